@@ -0,0 +1,798 @@
+// Benchmarks of the PTP layer against KRicohSimTransport, no camera needed.
+//
+//   KRicohBench [capture] [chunks] [tune] [enumerate] [alloc] [copy] [pool] [cabi] [short] [ptpip] [options]
+//
+// With no benchmark named all of them run. Options:
+//   --iterations N       cycles per measurement (default 50)
+//   --image-size BYTES   picture size (default 4 MB, a THETA S JPEG)
+//   --latency-us US      fixed cost of every operation (default 200)
+//   --throughput KBPS    data phase speed in KB/s, 0 is unlimited (default 30000, USB 2.0)
+//   --capture-us US      InitiateCapture until ObjectAdded (default 0)
+//   --fail-rate R        share of operations answered with DeviceBusy (default 0)
+//   --seed N             seed of the failure injection (default 1)
+//
+// Numbers go to stdout, one line per measurement, so runs before and after a change
+// can be diffed. tune, short and ptpip also check what they run and make the exit code 1 when a
+// check fails ("make ptpip").
+
+#include "KRicohPtpClient.h"
+#include "KRicohSimTransport.h"
+#include "KRicohMetrics.h"
+#include "KRicohChunkTuner.h"
+#include "KRicohCApi.h"
+#include "KRicohBufferPool.h"
+#include "KRicohPtpIpTransport.h"
+#include "KRicohPtpIpResponder.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <new>
+#include <algorithm>
+#include <string>
+
+// Every allocation of the process, the library is compiled into this executable
+static std::atomic<uint64_t> allocation_count(0);
+
+void* operator new(size_t size)
+{
+	allocation_count.fetch_add(1, std::memory_order_relaxed);
+
+	void* p = malloc(size > 0 ? size : 1);
+	if (p == NULL)
+		throw std::bad_alloc();
+
+	return p;
+}
+
+void operator delete(void* p) throw()
+{
+	free(p);
+}
+
+typedef std::chrono::steady_clock BenchClock;
+
+static uint64_t MicrosecondsSince(BenchClock::time_point start)
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(BenchClock::now() - start).count();
+}
+
+struct BenchOptions{
+	uint32_t iterations;
+	KRicohSimConfig sim;
+};
+
+// Exact percentile of a small sample
+static uint64_t Percentile(std::vector<uint64_t> samples, double fraction)
+{
+	if (samples.empty())
+		return 0;
+
+	std::sort(samples.begin(), samples.end());
+
+	size_t index = (size_t)(fraction * (double)(samples.size() - 1) + 0.5);
+	return samples[index];
+}
+
+static void PrintLatency(const char* name, const std::vector<uint64_t>& samples)
+{
+	uint64_t total = 0;
+
+	for (size_t i = 0; i < samples.size(); i++)
+		total += samples[i];
+
+	printf("%-28s n=%-6u mean=%-9llu p50=%-9llu p99=%-9llu max=%llu us\n", name, (unsigned int)samples.size(),
+		(unsigned long long)(samples.empty() ? 0 : total / samples.size()),
+		(unsigned long long)Percentile(samples, 0.50), (unsigned long long)Percentile(samples, 0.99),
+		(unsigned long long)Percentile(samples, 1.0));
+}
+
+// InitiateCapture until the picture is in memory, then delete it like the capture loop does
+static void BenchCapture(const BenchOptions& options)
+{
+	KRicohSimTransport sim(options.sim);
+	KRicohPtpClient client(sim);
+	std::vector<uint64_t> cycles;
+	std::vector<uint8_t> image;
+	uint32_t failures = 0;
+
+	client.OpenSession();
+
+	for (uint32_t i = 0; i < options.iterations; i++)
+	{
+		BenchClock::time_point start = BenchClock::now();
+		uint32_t handle = 0;
+
+		if (!client.InitiateCapture() || !client.WaitForObjectAdded(handle, 10000) || !client.GetObject(handle, image))
+		{
+			failures++;
+			continue;
+		}
+
+		cycles.push_back(MicrosecondsSince(start));
+		client.DeleteObject(handle);
+	}
+
+	client.CloseSession();
+
+	PrintLatency("capture-to-bytes", cycles);
+	if (failures > 0)
+		printf("%-28s %u of %u cycles failed\n", "capture-to-bytes", failures, options.iterations);
+}
+
+// GetPartialObject throughput for a range of chunk sizes
+static const uint32_t chunk_sizes[] = { 64 * 1024, 128 * 1024, 256 * 1024, 512 * 1024, 1024 * 1024, 2048 * 1024, 4096 * 1024 };
+
+// MB/s of GetPartialObject downloads in chunks of one size, requests is per image
+static double MeasureChunk(const KRicohSimConfig& config, uint32_t chunk_size, uint32_t iterations, double* requests)
+{
+	KRicohSimTransport sim(config);
+	KRicohPtpClient client(sim);
+	std::vector<uint32_t> handles;
+	std::vector<uint8_t> chunk;
+	std::vector<uint8_t> image;
+	uint64_t bytes = 0;
+	uint64_t request_count = 0;
+
+	*requests = 0.0;
+
+	client.OpenSession();
+	client.GetObjectHandles(handles);
+	if (handles.empty())
+		return 0.0;
+
+	BenchClock::time_point start = BenchClock::now();
+	for (uint32_t i = 0; i < iterations; i++)
+	{
+		image.clear();
+		while (image.size() < config.image_size)
+		{
+			if (!client.GetPartialObject(handles[0], (uint32_t)image.size(), chunk_size, chunk) || chunk.empty())
+				break;
+
+			image.insert(image.end(), chunk.begin(), chunk.end());
+			request_count++;
+		}
+
+		bytes += image.size();
+	}
+	uint64_t elapsed_us = MicrosecondsSince(start);
+
+	if (iterations > 0)
+		*requests = (double)request_count / iterations;
+
+	return elapsed_us > 0 ? (double)bytes / (double)elapsed_us : 0.0;
+}
+
+static void BenchChunks(const BenchOptions& options)
+{
+	KRicohSimConfig config = options.sim;
+
+	config.object_count = 1;
+
+	for (size_t c = 0; c < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); c++)
+	{
+		double requests = 0.0;
+		double rate = MeasureChunk(config, chunk_sizes[c], options.iterations, &requests);
+
+		std::string name = "partial chunk=" + std::to_string(chunk_sizes[c] / 1024) + "K";
+		printf("%-28s %8.2f MB/s  %6.1f requests/image\n", name.c_str(), rate, requests);
+	}
+}
+
+// How many pictures KRicohChunkTuner needs to settle, and on what, starting from a 64 KB driver size
+// The tuner against the fixed chunk sizes of BenchChunks: the size it settles on must
+// be within tolerance of the best of them
+static bool BenchTune(const BenchOptions& options)
+{
+	const double tolerance = 0.03;
+	KRicohSimConfig config = options.sim;
+	config.object_count = 1;
+
+	KRicohSimTransport sim(config);
+	KRicohPtpClient client(sim);
+	KRicohChunkTuner tuner;
+	std::vector<uint32_t> handles;
+	std::vector<uint8_t> chunk;
+	std::vector<uint8_t> image;
+	uint32_t pictures = 0;
+
+	client.OpenSession();
+	client.GetObjectHandles(handles);
+	if (handles.empty())
+		return false;
+
+	while (!tuner.IsConverged() && pictures < options.iterations)
+	{
+		uint32_t chunk_size = tuner.NextChunkSize(64 * 1024);
+		BenchClock::time_point start = BenchClock::now();
+
+		image.clear();
+		while (image.size() < config.image_size)
+		{
+			if (!client.GetPartialObject(handles[0], (uint32_t)image.size(), chunk_size, chunk) || chunk.empty())
+				break;
+
+			image.insert(image.end(), chunk.begin(), chunk.end());
+		}
+
+		tuner.Record(chunk_size, image.size(), MicrosecondsSince(start));
+		pictures++;
+	}
+
+	printf("%-28s %s at %u KB after %u pictures\n", "tune", tuner.IsConverged() ? "settled" : "still searching",
+		tuner.GetBestSize() / 1024, pictures);
+
+	// Fewer pictures than BenchChunks, only the comparison matters here
+	uint32_t iterations = (std::min<uint32_t>)(options.iterations, 5);
+	uint32_t best_size = 0;
+	double best_rate = 0.0;
+	double requests = 0.0;
+
+	for (size_t c = 0; c < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); c++)
+	{
+		double rate = MeasureChunk(config, chunk_sizes[c], iterations, &requests);
+
+		if (rate > best_rate)
+		{
+			best_rate = rate;
+			best_size = chunk_sizes[c];
+		}
+	}
+
+	double tuned_rate = MeasureChunk(config, tuner.GetBestSize(), iterations, &requests);
+	bool passed = tuner.IsConverged() && tuned_rate >= best_rate * (1.0 - tolerance);
+
+	printf("%-28s %8.2f MB/s  best fixed %u KB %8.2f MB/s  %s\n", "tune result", tuned_rate, best_size / 1024, best_rate,
+		passed ? "within tolerance" : "too slow");
+	if (!passed)
+		printf("! tune: the tuned size is more than %.0f%% slower than the best fixed size\n", tolerance * 100.0);
+
+	return passed;
+}
+
+// GetObjectHandles as the card fills up
+static void BenchEnumerate(const BenchOptions& options)
+{
+	static const uint32_t object_counts[] = { 10, 100, 1000, 10000 };
+
+	for (size_t c = 0; c < sizeof(object_counts) / sizeof(object_counts[0]); c++)
+	{
+		KRicohSimConfig config = options.sim;
+		config.object_count = object_counts[c];
+
+		KRicohSimTransport sim(config);
+		KRicohPtpClient client(sim);
+		std::vector<uint32_t> handles;
+		std::vector<uint64_t> samples;
+
+		client.OpenSession();
+		for (uint32_t i = 0; i < options.iterations; i++)
+		{
+			BenchClock::time_point start = BenchClock::now();
+
+			if (client.GetObjectHandles(handles))
+				samples.push_back(MicrosecondsSince(start));
+		}
+
+		std::string name = "enumerate objects=" + std::to_string(object_counts[c]);
+		PrintLatency(name.c_str(), samples);
+	}
+}
+
+// Heap allocations to get one picture into memory, as one block and as the old std::list<BYTE>
+static void BenchAlloc(const BenchOptions& options)
+{
+	KRicohSimConfig config = options.sim;
+	config.object_count = 1;
+	config.op_latency_us = 0;
+	config.bytes_per_ms = 0;
+	config.fail_rate = 0.0;
+
+	KRicohSimTransport sim(config);
+	KRicohPtpClient client(sim);
+	std::vector<uint32_t> handles;
+	std::vector<uint8_t> image;
+
+	client.OpenSession();
+	client.GetObjectHandles(handles);
+	if (handles.empty())
+		return;
+
+	uint32_t iterations = (std::min<uint32_t>)(options.iterations, 10);
+
+	uint64_t before = allocation_count.load();
+	for (uint32_t i = 0; i < iterations; i++)
+		client.GetObject(handles[0], image);
+	uint64_t vector_allocations = (allocation_count.load() - before) / iterations;
+
+	before = allocation_count.load();
+	for (uint32_t i = 0; i < iterations; i++)
+	{
+		client.GetObject(handles[0], image);
+		std::list<uint8_t> list_image(image.begin(), image.end());
+	}
+	uint64_t list_allocations = (allocation_count.load() - before) / iterations;
+
+	printf("%-28s %llu\n", "allocations/image vector", (unsigned long long)vector_allocations);
+	printf("%-28s %llu\n", "allocations/image list", (unsigned long long)list_allocations);
+}
+
+// Stands in for the IStream of WPD: Read hands out the next bytes of a picture in memory,
+// the first length bytes of source
+struct BenchStream{
+	const std::vector<uint8_t>& source;
+	size_t length;
+	size_t position;
+
+	BenchStream(const std::vector<uint8_t>& source) : source(source), length(source.size()), position(0) {}
+	BenchStream(const std::vector<uint8_t>& source, size_t length) : source(source), length(length), position(0) {}
+
+	void Read(uint8_t* buffer, uint32_t size, uint32_t* read)
+	{
+		*read = (uint32_t)(std::min<size_t>)(size, this->length - this->position);
+		if (*read > 0)
+			memcpy(buffer, &this->source[this->position], *read);
+		this->position += *read;
+	}
+};
+
+// The copy loop of StreamCopy before and after contiguous buffers: the old one read each
+// transfer chunk into a temporary buffer and push_back'ed every byte into a std::list<BYTE>,
+// the new one is KRicohBufferPool::ReadStream, the loop of StreamCopy, reading straight into
+// a vector sized from WPD_OBJECT_SIZE; the pool is off so every image is a new allocation
+static void BenchCopy(const BenchOptions& options)
+{
+	const uint32_t transfer_size = 256 * 1024;
+	std::vector<uint8_t> source(options.sim.image_size);
+	uint32_t iterations = (std::min<uint32_t>)(options.iterations, 10);
+	KRicohBufferPool pool(0);
+	uint64_t list_us = 0;
+	uint64_t vector_us = 0;
+	uint64_t list_allocations = 0;
+	uint64_t vector_allocations = 0;
+
+	for (size_t i = 0; i < source.size(); i++)
+		source[i] = (uint8_t)i;
+
+	for (uint32_t i = 0; i < iterations; i++)
+	{
+		BenchStream list_stream(source);
+		uint64_t before = allocation_count.load();
+		BenchClock::time_point start = BenchClock::now();
+		{
+			std::list<uint8_t> out_image;
+			uint8_t* data = new uint8_t[transfer_size];
+			uint32_t read = 0;
+
+			do
+			{
+				list_stream.Read(data, transfer_size, &read);
+				for (uint32_t b = 0; b < read; b++)
+					out_image.push_back(data[b]);
+			} while (read > 0);
+
+			delete[] data;
+		}
+		list_us += MicrosecondsSince(start);
+		list_allocations += allocation_count.load() - before;
+
+		BenchStream vector_stream(source);
+		before = allocation_count.load();
+		start = BenchClock::now();
+		{
+			std::vector<uint8_t> out_image;
+			uint32_t total = 0;
+
+			pool.ReadStream([&vector_stream](uint8_t* data, uint32_t size, uint32_t* read) -> bool
+			{
+				vector_stream.Read(data, size, read);
+				return true;
+			}, transfer_size, source.size(), out_image, &total);
+		}
+		vector_us += MicrosecondsSince(start);
+		vector_allocations += allocation_count.load() - before;
+	}
+
+	uint64_t bytes = (uint64_t)source.size() * iterations;
+
+	printf("%-28s %8.2f MB/s  %llu allocations/image\n", "copy list push_back",
+		list_us > 0 ? (double)bytes / (double)list_us : 0.0, (unsigned long long)(list_allocations / iterations));
+	printf("%-28s %8.2f MB/s  %llu allocations/image\n", "copy contiguous",
+		vector_us > 0 ? (double)bytes / (double)vector_us : 0.0, (unsigned long long)(vector_allocations / iterations));
+}
+
+// Allocations per image of a download loop that hands every image back, with and without
+// KRicohBufferPool: each image goes through ReadStream like a streamed download, and picture
+// sizes differ a little from shot to shot like JPEGs do
+static void BenchPool(const BenchOptions& options)
+{
+	const uint32_t transfer_size = 256 * 1024;
+	const uint32_t images = (std::max<uint32_t>)(options.iterations, 8);
+	std::vector<uint8_t> source(options.sim.image_size);
+	KRicohBufferPool pool;
+
+	for (size_t i = 0; i < source.size(); i++)
+		source[i] = (uint8_t)i;
+
+	for (int pooled = 0; pooled < 2; pooled++)
+	{
+		std::vector<uint8_t> image;
+		uint64_t before = allocation_count.load();
+		BenchClock::time_point start = BenchClock::now();
+
+		pool.SetLimit(pooled ? DEFAULT_POOL_BYTES : 0);
+		pool.ResetStats();
+
+		for (uint32_t i = 0; i < images; i++)
+		{
+			BenchStream stream(source, source.size() - (i % 8) * 4096);
+			uint32_t written = 0;
+
+			pool.ReadStream([&stream](uint8_t* data, uint32_t size, uint32_t* read) -> bool
+			{
+				stream.Read(data, size, read);
+				return true;
+			}, transfer_size, stream.length, image, &written);
+			pool.Release(image);
+		}
+
+		uint64_t elapsed_us = MicrosecondsSince(start);
+		uint64_t allocations = allocation_count.load() - before;
+
+		printf("%-28s %8.2f allocations/image  %8.1f us/image\n", pooled ? "pool on" : "pool off",
+			(double)allocations / images, (double)elapsed_us / images);
+	}
+
+	KRicohPoolStats stats = pool.GetStats();
+	printf("%-28s %u hits, %u misses, %llu bytes allocated\n", "pool stats",
+		stats.hits, stats.misses, (unsigned long long)stats.allocated_bytes);
+}
+
+static void* KRICOH_CALL AllocateImage(void* context, uint32_t image_size)
+{
+	std::vector<uint8_t>* image = static_cast<std::vector<uint8_t>*>(context);
+
+	image->resize(image_size);
+	return image_size > 0 ? &(*image)[0] : NULL;
+}
+
+// What the C API costs on top of the C++ classes, on a camera without latency so only the
+// calls are measured: a call that stops before the camera, then a whole download
+static void BenchCApi(const BenchOptions& options)
+{
+	KRicohSimConfig config = options.sim;
+	config.object_count = 1;
+	config.op_latency_us = 0;
+	config.bytes_per_ms = 0;
+	config.fail_rate = 0.0;
+
+	KRicohSimTransport sim(config);
+	KRicohPtpClient client(sim);
+	KRicohCamera* camera = NULL;
+	std::vector<uint32_t> handles;
+	uint32_t handle = 0;
+
+	if (KRicoh_OpenSimulated(config.image_size, 1, &camera) != KRICOH_OK || KRicoh_GetLastImageHandle(camera, &handle) != KRICOH_OK)
+	{
+		printf("! Failed to open the simulated camera of the C API\n");
+		KRicoh_Close(camera);
+		return;
+	}
+
+	client.OpenSession();
+	client.GetObjectHandles(handles);
+	if (handles.empty())
+	{
+		KRicoh_Close(camera);
+		return;
+	}
+
+	const uint32_t calls = 1000000;
+	// Kept so the loops are not optimized away
+	volatile uint64_t sink = 0;
+
+	BenchClock::time_point start = BenchClock::now();
+	for (uint32_t i = 0; i < calls; i++)
+		sink += client.GetLastResponse();
+	double cpp_ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(BenchClock::now() - start).count() / calls;
+
+	start = BenchClock::now();
+	for (uint32_t i = 0; i < calls; i++)
+		sink += (uint64_t)KRicoh_GetLastError(camera);
+	double c_ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(BenchClock::now() - start).count() / calls;
+
+	printf("%-28s %6.1f ns/call  C++ %6.1f ns/call\n", "cabi call", c_ns, cpp_ns);
+
+	// The way the shims did it: into a vector, then copied into memory of the other runtime
+	std::vector<uint64_t> cpp_samples;
+	std::vector<uint64_t> buffer_samples;
+	std::vector<uint64_t> callback_samples;
+	std::vector<uint8_t> image;
+	std::vector<uint8_t> foreign(config.image_size);
+	uint32_t image_size = 0;
+	uint32_t failures = 0;
+
+	for (uint32_t i = 0; i < options.iterations; i++)
+	{
+		start = BenchClock::now();
+		if (client.GetObject(handles[0], image) && image.size() <= foreign.size())
+		{
+			memcpy(&foreign[0], &image[0], image.size());
+			cpp_samples.push_back(MicrosecondsSince(start));
+		}
+		else
+		{
+			failures++;
+		}
+
+		start = BenchClock::now();
+		if (KRicoh_DownloadImage(camera, handle, &foreign[0], (uint32_t)foreign.size(), &image_size) == KRICOH_OK)
+			buffer_samples.push_back(MicrosecondsSince(start));
+		else
+			failures++;
+
+		start = BenchClock::now();
+		if (KRicoh_DownloadImageTo(camera, handle, AllocateImage, &image, &image_size) == KRICOH_OK)
+			callback_samples.push_back(MicrosecondsSince(start));
+		else
+			failures++;
+	}
+
+	KRicoh_Close(camera);
+	client.CloseSession();
+
+	PrintLatency("cabi c++ get+copy", cpp_samples);
+	PrintLatency("cabi download buffer", buffer_samples);
+	PrintLatency("cabi download callback", callback_samples);
+	if (failures > 0)
+		printf("%-28s %u downloads failed\n", "cabi", failures);
+}
+
+static bool Check(bool passed, const char* what)
+{
+	if (!passed)
+		printf("! %s failed\n", what);
+
+	return passed;
+}
+
+// A camera whose GetObject stream ends before the size in ObjectInfo: the download into
+// memory of the reported size must fail instead of handing over the front of the picture,
+// and the picture must still be on the camera for the next try
+static bool BenchShort(const BenchOptions& options)
+{
+	KRicohSimConfig config;
+	config.object_count = 1;
+	config.image_size = options.sim.image_size;
+	config.short_by = 4096;
+
+	KRicohCamera* camera = NULL;
+	std::vector<uint8_t> image;
+	std::vector<uint8_t> buffer(config.image_size);
+	uint32_t handle = 0;
+	uint32_t image_size = 0;
+	bool passed = true;
+
+	if (!Check(KRicoh_OpenSimulated(config, &camera) == KRICOH_OK && KRicoh_GetLastImageHandle(camera, &handle) == KRICOH_OK,
+		"opening the simulated camera"))
+	{
+		KRicoh_Close(camera);
+		return false;
+	}
+
+	passed &= Check(KRicoh_DownloadImageTo(camera, handle, AllocateImage, &image, &image_size) == KRICOH_E_CAMERA &&
+		image.size() == config.image_size, "DownloadImageTo of a short stream");
+	passed &= Check(KRicoh_DownloadImage(camera, handle, &buffer[0], (uint32_t)buffer.size(), &image_size) == KRICOH_E_CAMERA,
+		"DownloadImage of a short stream");
+	passed &= Check(KRicoh_GetImageSize(camera, handle, &image_size) == KRICOH_OK && image_size == config.image_size,
+		"the picture on the camera after the failed downloads");
+
+	KRicoh_Close(camera);
+	printf("%-28s %s\n", "short checks", passed ? "passed" : "FAILED");
+
+	return passed;
+}
+
+// KRicohPtpClient over KRicohPtpIpTransport against a PTP/IP responder on the loopback
+// interface, answered by the simulated camera: the init handshake, data-in, data-out,
+// events and a pipelined batch, then what a round trip and a picture cost over TCP
+static bool BenchPtpIp(const BenchOptions& options)
+{
+	KRicohSimConfig config;
+	config.object_count = 4;
+	config.image_size = options.sim.image_size;
+
+	KRicohSimTransport sim(config);
+	KRicohSimTransport reference_sim(config);
+	KRicohPtpClient reference(reference_sim);
+	KRicohPtpIpResponder responder(sim);
+	KRicohPtpIpTransport transport;
+	KRicohPtpClient client(transport);
+	std::vector<uint32_t> handles;
+	std::vector<uint8_t> data;
+	std::vector<uint8_t> expected;
+	bool passed = true;
+
+	if (!Check(responder.Start(), "starting the responder") ||
+		!Check(transport.Connect("127.0.0.1", responder.GetPort()), "Init_Command and Init_Event handshake") ||
+		!Check(client.OpenSession(), "OpenSession"))
+	{
+		return false;
+	}
+
+	reference.OpenSession();
+
+	// Data-in: a small array, a whole picture in many DATA packets, part of one
+	passed &= Check(client.GetObjectHandles(handles) && handles.size() == config.object_count, "GetObjectHandles");
+	if (handles.empty())
+		return false;
+
+	reference.GetObject(handles[0], expected);
+	passed &= Check(client.GetObject(handles[0], data) && data == expected, "GetObject");
+	passed &= Check(client.GetPartialObject(handles[0], 1000, 5000, data) &&
+		data.size() == 5000 && memcmp(&data[0], &expected[1000], 5000) == 0, "GetPartialObject");
+
+	// Data-out: Start_Data and End_Data, read back through a data-in phase
+	uint32_t prop = PTP_DPC_TIMELAPSE_INTERVAL;
+	uint32_t interval = 5000;
+	KRicohPtpOperation set_op(*KRicohPtpFindOp(PTP_OC_SET_DEVICE_PROP_VALUE), &prop, 1);
+	set_op.data.assign((const uint8_t*)&interval, (const uint8_t*)&interval + sizeof(interval));
+	passed &= Check(client.Execute(set_op), "SetDevicePropValue");
+	passed &= Check(client.GetDevicePropValue(PTP_DPC_TIMELAPSE_INTERVAL, data) && data == set_op.data, "GetDevicePropValue after Set");
+
+	// Events: ObjectAdded on the event connection
+	uint32_t added = 0;
+	passed &= Check(client.InitiateCapture() && client.WaitForObjectAdded(added, 2000) && added != 0, "ObjectAdded event");
+	passed &= Check(client.GetObjectHandles(handles) && std::find(handles.begin(), handles.end(), added) != handles.end(),
+		"the new object in GetObjectHandles");
+
+	// Batch: every request in one write, answered in order
+	std::vector<uint32_t> failed;
+	passed &= Check(client.DeleteObjects(handles, failed) && failed.empty() && sim.GetObjectCount() == 0, "DeleteObjects batch");
+	passed &= Check(responder.GetMaxBatch() >= handles.size(), "pipelining of the batch");
+
+	// Round trips: one by one and as one batch
+	const uint32_t ops = 200;
+	std::vector<KRicohPtpOperation> batch(ops, KRicohPtpOperation(PTP_OC_GET_NUM_OBJECTS));
+	BenchClock::time_point start = BenchClock::now();
+	for (uint32_t i = 0; i < ops; i++)
+		transport.Execute(batch[i]);
+	uint64_t single_us = MicrosecondsSince(start);
+
+	start = BenchClock::now();
+	passed &= Check(transport.ExecuteBatch(batch) && batch.back().response == PTP_RESPONSE_OK, "GetNumObjects batch");
+	uint64_t batch_us = MicrosecondsSince(start);
+
+	printf("%-28s %8.1f us/op  batched %6.1f us/op\n", "ptpip round trip", (double)single_us / ops, (double)batch_us / ops);
+
+	// A picture over loopback TCP
+	uint32_t capture_handle = 0;
+	if (client.InitiateCapture() && client.WaitForObjectAdded(capture_handle, 2000))
+	{
+		uint32_t iterations = (std::min<uint32_t>)(options.iterations, 10);
+		uint64_t bytes = 0;
+
+		start = BenchClock::now();
+		for (uint32_t i = 0; i < iterations && client.GetObject(capture_handle, data); i++)
+			bytes += data.size();
+		uint64_t elapsed_us = MicrosecondsSince(start);
+
+		printf("%-28s %8.2f MB/s\n", "ptpip GetObject", elapsed_us > 0 ? (double)bytes / (double)elapsed_us : 0.0);
+	}
+
+	passed &= Check(client.CloseSession(), "CloseSession");
+	transport.Disconnect();
+	responder.Stop();
+
+	passed &= Check(responder.GetProtocolErrors() == 0, "PTP/IP framing");
+	printf("%-28s %s, %u requests\n", "ptpip checks", passed ? "passed" : "FAILED", responder.GetRequestCount());
+
+	return passed;
+}
+
+static bool ParseOptions(int argc, char* argv[], BenchOptions& options, std::vector<std::string>& benches)
+{
+	options.iterations = 50;
+	options.sim.image_size = 4 * 1024 * 1024;
+	options.sim.op_latency_us = 200;
+	options.sim.bytes_per_ms = 30000;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char* arg = argv[i];
+		const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+		if (arg[0] != '-')
+		{
+			benches.push_back(arg);
+			continue;
+		}
+
+		if (value == NULL)
+		{
+			printf("! %s needs a value\n", arg);
+			return false;
+		}
+
+		if (strcmp(arg, "--iterations") == 0)
+			options.iterations = (uint32_t)strtoul(value, NULL, 10);
+		else if (strcmp(arg, "--image-size") == 0)
+			options.sim.image_size = (uint32_t)strtoul(value, NULL, 10);
+		else if (strcmp(arg, "--latency-us") == 0)
+			options.sim.op_latency_us = (uint32_t)strtoul(value, NULL, 10);
+		else if (strcmp(arg, "--throughput") == 0)
+			options.sim.bytes_per_ms = (uint32_t)strtoul(value, NULL, 10);
+		else if (strcmp(arg, "--capture-us") == 0)
+			options.sim.capture_latency_us = (uint32_t)strtoul(value, NULL, 10);
+		else if (strcmp(arg, "--fail-rate") == 0)
+			options.sim.fail_rate = atof(value);
+		else if (strcmp(arg, "--seed") == 0)
+			options.sim.seed = (uint32_t)strtoul(value, NULL, 10);
+		else
+		{
+			printf("! Unknown option %s\n", arg);
+			return false;
+		}
+
+		i++;
+	}
+
+	if (options.iterations == 0)
+		options.iterations = 1;
+
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	BenchOptions options;
+	std::vector<std::string> benches;
+
+	if (!ParseOptions(argc, argv, options, benches))
+		return 1;
+
+	bool all = benches.empty();
+
+	printf("* image %u bytes, latency %u us, throughput %u KB/s, fail rate %.3f, seed %u, %u iterations\n",
+		options.sim.image_size, options.sim.op_latency_us, options.sim.bytes_per_ms, options.sim.fail_rate,
+		options.sim.seed, options.iterations);
+
+	if (all || std::find(benches.begin(), benches.end(), "capture") != benches.end())
+		BenchCapture(options);
+	if (all || std::find(benches.begin(), benches.end(), "chunks") != benches.end())
+		BenchChunks(options);
+	int status = 0;
+	if (all || std::find(benches.begin(), benches.end(), "tune") != benches.end())
+	{
+		if (!BenchTune(options))
+			status = 1;
+	}
+	if (all || std::find(benches.begin(), benches.end(), "enumerate") != benches.end())
+		BenchEnumerate(options);
+	if (all || std::find(benches.begin(), benches.end(), "alloc") != benches.end())
+		BenchAlloc(options);
+	if (all || std::find(benches.begin(), benches.end(), "copy") != benches.end())
+		BenchCopy(options);
+	if (all || std::find(benches.begin(), benches.end(), "pool") != benches.end())
+		BenchPool(options);
+
+	if (all || std::find(benches.begin(), benches.end(), "cabi") != benches.end())
+		BenchCApi(options);
+
+	if (all || std::find(benches.begin(), benches.end(), "short") != benches.end())
+	{
+		if (!BenchShort(options))
+			status = 1;
+	}
+
+	if (all || std::find(benches.begin(), benches.end(), "ptpip") != benches.end())
+	{
+		if (!BenchPtpIp(options))
+			status = 1;
+	}
+
+	return status;
+}
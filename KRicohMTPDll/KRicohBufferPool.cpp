@@ -0,0 +1,199 @@
+#include "KRicohBufferPool.h"
+#include <stdio.h>
+#include <string.h>
+#include <new>
+#include <algorithm>
+
+KRicohBufferPool::KRicohBufferPool(uint64_t max_pooled_bytes)
+	: max_pooled_bytes(max_pooled_bytes)
+{
+	memset(&this->stats, 0, sizeof(this->stats));
+}
+
+KRicohBufferPool::~KRicohBufferPool()
+{
+}
+
+bool KRicohBufferPool::Acquire(size_t size, std::vector<uint8_t>& buffer)
+{
+	buffer.clear();
+
+	{
+		std::lock_guard<std::mutex> guard(this->lock);
+
+		if (buffer.capacity() >= size)
+		{
+			this->stats.hits++;
+			return true;
+		}
+
+		// Smallest kept buffer that fits, so large ones stay available for large requests
+		size_t best = this->free_buffers.size();
+		for (size_t i = 0; i < this->free_buffers.size(); i++)
+		{
+			size_t capacity = this->free_buffers[i].capacity();
+
+			if (capacity >= size && (best == this->free_buffers.size() || capacity < this->free_buffers[best].capacity()))
+				best = i;
+		}
+
+		if (best < this->free_buffers.size())
+		{
+			// The caller's too small buffer takes the place of the one handed out
+			this->stats.pooled_bytes -= this->free_buffers[best].capacity();
+			buffer.swap(this->free_buffers[best]);
+
+			if (this->free_buffers[best].capacity() > 0)
+				this->stats.pooled_bytes += this->free_buffers[best].capacity();
+			else
+				this->free_buffers.erase(this->free_buffers.begin() + best);
+
+			this->stats.hits++;
+			Trim(this->max_pooled_bytes);
+			return true;
+		}
+
+		this->stats.misses++;
+	}
+
+	// Allocate outside the lock, other threads keep getting pooled buffers meanwhile
+	try
+	{
+		std::vector<uint8_t>().swap(buffer);
+		buffer.reserve(size);
+	}
+	catch (const std::bad_alloc&)
+	{
+		printf("! Failed to allocate a %llu bytes buffer\n", (unsigned long long)size);
+		return false;
+	}
+
+	std::lock_guard<std::mutex> guard(this->lock);
+	this->stats.allocated_bytes += buffer.capacity();
+
+	return true;
+}
+
+void KRicohBufferPool::Release(std::vector<uint8_t>& buffer)
+{
+	uint64_t capacity = buffer.capacity();
+
+	buffer.clear();
+
+	if (capacity == 0)
+		return;
+
+	{
+		std::lock_guard<std::mutex> guard(this->lock);
+
+		if (this->stats.pooled_bytes + capacity <= this->max_pooled_bytes)
+		{
+			this->free_buffers.push_back(std::vector<uint8_t>());
+			this->free_buffers.back().swap(buffer);
+			this->stats.releases++;
+			this->stats.pooled_bytes += capacity;
+			if (this->stats.pooled_bytes > this->stats.peak_pooled_bytes)
+				this->stats.peak_pooled_bytes = this->stats.pooled_bytes;
+			return;
+		}
+
+		this->stats.discards++;
+	}
+
+	// Freed outside the lock
+	std::vector<uint8_t>().swap(buffer);
+}
+
+bool KRicohBufferPool::ReadStream(const KRicohStreamReader& read, uint32_t transfer_size, uint64_t reported_size,
+								std::vector<uint8_t>& image, uint32_t* written)
+{
+	uint32_t total = 0;
+
+	*written = 0;
+
+	if (transfer_size == 0 || reported_size > (uint64_t)UINT32_MAX - transfer_size)
+	{
+		printf("! The object is too large to be read into memory (%llu bytes)\n", (unsigned long long)reported_size);
+		return false;
+	}
+
+	if (!Acquire((size_t)reported_size + transfer_size, image))
+		return false;
+
+	try
+	{
+		image.resize(reported_size > 0 ? (size_t)reported_size : transfer_size);
+
+		for (;;)
+		{
+			if (total == image.size())
+			{
+				// A full image of the reported size only has to find the end of the stream, which
+				// the reserved piece holds. Only data beyond that makes it grow for real.
+				size_t grow = (reported_size > 0 && total == reported_size) ? transfer_size :
+								(std::max)((size_t)transfer_size, image.size() / 2);
+
+				if (image.size() + grow > UINT32_MAX)
+				{
+					printf("! The stream is longer than %u bytes\n", total);
+					return false;
+				}
+				image.resize(image.size() + grow);
+			}
+
+			uint32_t count = 0;
+			if (!read(&image[total], (std::min)(transfer_size, (uint32_t)(image.size() - total)), &count))
+				return false;
+			if (count == 0)
+				break;
+
+			total += count;
+		}
+	}
+	catch (const std::bad_alloc&)
+	{
+		printf("! Failed to grow the image beyond %u bytes\n", total);
+		return false;
+	}
+
+	image.resize(total);
+	*written = total;
+
+	return true;
+}
+
+void KRicohBufferPool::SetLimit(uint64_t max_pooled_bytes)
+{
+	std::lock_guard<std::mutex> guard(this->lock);
+
+	this->max_pooled_bytes = max_pooled_bytes;
+	Trim(max_pooled_bytes);
+}
+
+KRicohPoolStats KRicohBufferPool::GetStats()
+{
+	std::lock_guard<std::mutex> guard(this->lock);
+
+	return this->stats;
+}
+
+void KRicohBufferPool::ResetStats()
+{
+	std::lock_guard<std::mutex> guard(this->lock);
+
+	uint64_t pooled_bytes = this->stats.pooled_bytes;
+	memset(&this->stats, 0, sizeof(this->stats));
+	this->stats.pooled_bytes = pooled_bytes;
+	this->stats.peak_pooled_bytes = pooled_bytes;
+}
+
+void KRicohBufferPool::Trim(uint64_t limit)
+{
+	// Oldest buffers go first, called with lock held
+	while (this->stats.pooled_bytes > limit && !this->free_buffers.empty())
+	{
+		this->stats.pooled_bytes -= this->free_buffers.front().capacity();
+		this->stats.discards++;
+		this->free_buffers.erase(this->free_buffers.begin());
+	}
+}
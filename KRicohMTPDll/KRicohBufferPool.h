@@ -0,0 +1,66 @@
+#ifndef _K_RICOH_BUFFER_POOL_H_
+#define _K_RICOH_BUFFER_POOL_H_
+
+// Nothing here depends on Windows, so the benchmarks measure the pool on Linux too.
+
+#include "KRicohPtp.h"
+#include <vector>
+#include <mutex>
+#include <functional>
+
+// Upper bound for the memory kept for reuse, about eight THETA S pictures
+#define DEFAULT_POOL_BYTES      (64 * 1024 * 1024)
+
+struct KRicohPoolStats{
+	uint32_t hits;				// Acquire served from the pool or from the caller's own buffer
+	uint32_t misses;			// Acquire that had to allocate
+	uint32_t releases;			// buffers given back and kept
+	uint32_t discards;			// buffers given back but freed, the pool was full
+	uint64_t pooled_bytes;		// capacity waiting in the pool now
+	uint64_t peak_pooled_bytes;
+	uint64_t allocated_bytes;	// capacity allocated by misses since the last reset
+};
+
+// Reads up to size bytes into data and sets read, 0 at the end of the stream; false when the read failed
+typedef std::function<bool(uint8_t* data, uint32_t size, uint32_t* read)> KRicohStreamReader;
+
+// Image and transfer buffers recycled between downloads. A buffer taken with Acquire
+// belongs to the caller until it is handed back with Release, or simply dropped.
+class K_RICOH_API KRicohBufferPool
+{
+public:
+	KRicohBufferPool(uint64_t max_pooled_bytes = DEFAULT_POOL_BYTES);
+	virtual ~KRicohBufferPool();
+
+private:
+	std::vector<std::vector<uint8_t> > free_buffers;
+	uint64_t max_pooled_bytes;
+	KRicohPoolStats stats;
+	std::mutex lock;
+
+	KRicohBufferPool(const KRicohBufferPool&);
+	KRicohBufferPool& operator=(const KRicohBufferPool&);
+
+	void Trim(uint64_t limit);
+
+public:
+	// buffer comes back empty with room for at least size bytes; a buffer that is already
+	// large enough is kept, a smaller one goes to the pool in exchange
+	bool Acquire(size_t size, std::vector<uint8_t>& buffer);
+	// buffer is left empty, its memory is kept for the next Acquire
+	void Release(std::vector<uint8_t>& buffer);
+
+	// Reads a whole stream into image in transfer_size pieces. With the size the device reported
+	// the image is taken with room for one more piece, so the read that sees the end of the
+	// stream fits without another allocation; it grows further only once the stream really is
+	// longer. written is the number of bytes read. False when a read failed or memory ran out.
+	bool ReadStream(const KRicohStreamReader& read, uint32_t transfer_size, uint64_t reported_size,
+					std::vector<uint8_t>& image, uint32_t* written);
+
+	// 0 turns pooling off and frees what is kept
+	void SetLimit(uint64_t max_pooled_bytes);
+	KRicohPoolStats GetStats();
+	void ResetStats();
+};
+
+#endif
@@ -0,0 +1,430 @@
+#include "KRicohCApi.h"
+#include "KRicohPtpClient.h"
+#include "KRicohSimTransport.h"
+// KRICOH_NO_WPD leaves the USB backend out, for builds without WPD like the benchmarks
+#if defined(_WIN32) && !defined(KRICOH_NO_WPD)
+#include "KRicohMTP.h"
+#endif
+#include <string.h>
+#include <new>
+
+// Set while a handle is alive, a pointer that was never a camera fails the check
+#define KRICOH_CAMERA_MAGIC     0x4B524348	// "KRCH"
+
+// What a handle points to. The exported functions check it and hand over to one of the backends.
+struct KRicohCamera
+{
+	uint32_t magic;
+
+	KRicohCamera()
+		: magic(KRICOH_CAMERA_MAGIC)
+	{
+	}
+
+	virtual ~KRicohCamera()
+	{
+		this->magic = 0;
+	}
+
+	virtual KRicohStatus TakePicture(uint32_t timeout_ms, uint32_t& handle) = 0;
+	virtual KRicohStatus GetLastImageHandle(uint32_t& handle) = 0;
+	virtual KRicohStatus GetImageSize(uint32_t handle, uint32_t& image_size) = 0;
+	// KRICOH_E_CANCELLED when allocate returned NULL, image_size is set either way
+	virtual KRicohStatus Download(uint32_t handle, KRicohAllocCallback allocate, void* context, uint32_t& image_size) = 0;
+	virtual KRicohStatus DeleteImage(uint32_t handle) = 0;
+	virtual int32_t GetLastError() = 0;
+};
+
+// KRicohPtpClient on KRicohSimTransport, builds everywhere
+class KRicohSimCamera : public KRicohCamera
+{
+private:
+	KRicohSimTransport sim;
+	KRicohPtpClient client;
+	std::vector<uint8_t> image;		// kept so its capacity is reused
+
+public:
+	KRicohSimCamera(const KRicohSimConfig& config)
+		: sim(config), client(sim)
+	{
+	}
+
+	virtual ~KRicohSimCamera()
+	{
+		this->client.CloseSession();
+	}
+
+	bool Open()
+	{
+		return this->client.OpenSession();
+	}
+
+	virtual KRicohStatus TakePicture(uint32_t timeout_ms, uint32_t& handle)
+	{
+		if (!this->client.InitiateCapture() || !this->client.WaitForObjectAdded(handle, timeout_ms))
+			return KRICOH_E_CAMERA;
+
+		return KRICOH_OK;
+	}
+
+	virtual KRicohStatus GetLastImageHandle(uint32_t& handle)
+	{
+		std::vector<uint32_t> handles;
+
+		handle = 0;
+		if (!this->client.GetObjectHandles(handles, PTP_STORAGE_ALL, PTP_FORMAT_EXIF_JPEG))
+			return KRICOH_E_CAMERA;
+
+		for (size_t i = 0; i < handles.size(); i++)
+		{
+			if (handles[i] > handle)
+				handle = handles[i];
+		}
+
+		return handle != 0 ? KRICOH_OK : KRICOH_E_CAMERA;
+	}
+
+	virtual KRicohStatus GetImageSize(uint32_t handle, uint32_t& image_size)
+	{
+		return this->client.GetObjectSize(handle, image_size) ? KRICOH_OK : KRICOH_E_CAMERA;
+	}
+
+	virtual KRicohStatus Download(uint32_t handle, KRicohAllocCallback allocate, void* context, uint32_t& image_size)
+	{
+		// The size comes first, like the stream of a USB camera, so nothing moves when there is no
+		// memory; an empty object is never a picture
+		if (!this->client.GetObjectSize(handle, image_size) || image_size == 0)
+			return KRICOH_E_CAMERA;
+
+		void* buffer = allocate(context, image_size);
+		if (buffer == NULL)
+			return KRICOH_E_CANCELLED;
+
+		if (!this->client.GetObject(handle, this->image) || this->image.size() != image_size)
+			return KRICOH_E_CAMERA;
+
+		memcpy(buffer, &this->image[0], image_size);
+		return KRICOH_OK;
+	}
+
+	virtual KRicohStatus DeleteImage(uint32_t handle)
+	{
+		return this->client.DeleteObject(handle) ? KRICOH_OK : KRICOH_E_CAMERA;
+	}
+
+	virtual int32_t GetLastError()
+	{
+		return this->client.GetLastResponse();
+	}
+};
+
+#if defined(_WIN32) && !defined(KRICOH_NO_WPD)
+// KRicohMTP, a THETA S on USB through WPD
+class KRicohUsbCamera : public KRicohCamera
+{
+private:
+	KRicohMTP camera;
+	bool session_open;
+
+public:
+	KRicohUsbCamera()
+		: session_open(false)
+	{
+	}
+
+	virtual ~KRicohUsbCamera()
+	{
+		if (this->session_open)
+			this->camera.CloseSession();
+	}
+
+	KRicohStatus Open(const wchar_t* pnp_device_id)
+	{
+		bool found = (pnp_device_id == NULL) ? this->camera.InitRicohDevice() : this->camera.InitRicohDevice(std::wstring(pnp_device_id));
+		if (!found)
+			return KRICOH_E_NO_CAMERA;
+
+		DWORD response = this->camera.OpenSession();
+		if (response != PTP_RESPONSE_OK && response != PTP_RESPONSE_SESSION_ALREADY_OPEN)
+			return KRICOH_E_CAMERA;
+
+		// The session of an earlier Open is as good as a new one
+		this->camera.ClearLastError();
+		this->session_open = true;
+		return KRICOH_OK;
+	}
+
+	virtual KRicohStatus TakePicture(uint32_t timeout_ms, uint32_t& handle)
+	{
+		std::wstring obj_id;
+
+		if (this->camera.TakePicture(obj_id, timeout_ms) != PTP_RESPONSE_OK || obj_id.empty())
+			return KRICOH_E_CAMERA;
+
+		handle = KRicohMTP::ObjectIDToHandle(obj_id.c_str());
+		return KRICOH_OK;
+	}
+
+	virtual KRicohStatus GetLastImageHandle(uint32_t& handle)
+	{
+		DWORD last_handle = 0;
+
+		if (!this->camera.GetLastImageHandle(last_handle))
+			return KRICOH_E_CAMERA;
+
+		handle = last_handle;
+		return KRICOH_OK;
+	}
+
+	virtual KRicohStatus GetImageSize(uint32_t handle, uint32_t& image_size)
+	{
+		DWORD size = 0;
+
+		if (!this->camera.GetImageSize(KRicohMTP::HandleToObjectID(handle), &size))
+			return KRICOH_E_CAMERA;
+
+		image_size = size;
+		return KRICOH_OK;
+	}
+
+	virtual KRicohStatus Download(uint32_t handle, KRicohAllocCallback allocate, void* context, uint32_t& image_size)
+	{
+		bool declined = false;
+		DWORD size = 0;
+
+		bool downloaded = this->camera.DownloadImage(KRicohMTP::HandleToObjectID(handle), [allocate, context, &declined](DWORD needed) -> BYTE*
+		{
+			BYTE* buffer = static_cast<BYTE*>(allocate(context, needed));
+
+			declined = (buffer == NULL);
+			return buffer;
+		}, &size);
+
+		image_size = size;
+		if (downloaded)
+			return KRICOH_OK;
+
+		return declined ? KRICOH_E_CANCELLED : KRICOH_E_CAMERA;
+	}
+
+	virtual KRicohStatus DeleteImage(uint32_t handle)
+	{
+		return this->camera.DeleteImage(KRicohMTP::HandleToObjectID(handle)) ? KRICOH_OK : KRICOH_E_CAMERA;
+	}
+
+	virtual int32_t GetLastError()
+	{
+		return this->camera.GetLastError();
+	}
+};
+#endif
+
+// Buffer of KRicoh_DownloadImage, handed to the backends as an allocation callback
+struct KRicohFixedBuffer{
+	void* buffer;
+	uint32_t size;
+};
+
+static void* KRICOH_CALL UseFixedBuffer(void* context, uint32_t image_size)
+{
+	KRicohFixedBuffer* fixed = static_cast<KRicohFixedBuffer*>(context);
+
+	return (image_size <= fixed->size) ? fixed->buffer : NULL;
+}
+
+// No C++ exception may cross into the caller's runtime
+template <typename Call>
+static KRicohStatus Guard(KRicohCamera* camera, Call call)
+{
+	if (camera == NULL || camera->magic != KRICOH_CAMERA_MAGIC)
+		return KRICOH_E_INVALID_ARGUMENT;
+
+	try
+	{
+		return call(*camera);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return KRICOH_E_OUT_OF_MEMORY;
+	}
+	catch (...)
+	{
+		return KRICOH_E_CAMERA;
+	}
+}
+
+uint32_t KRICOH_CALL KRicoh_GetApiVersion(void)
+{
+	return KRICOH_C_API_VERSION;
+}
+
+KRicohStatus KRICOH_CALL KRicoh_Open(const wchar_t* pnp_device_id, KRicohCamera** camera)
+{
+	if (camera == NULL)
+		return KRICOH_E_INVALID_ARGUMENT;
+
+	*camera = NULL;
+
+#if defined(_WIN32) && !defined(KRICOH_NO_WPD)
+	try
+	{
+		KRicohUsbCamera* usb_camera = new KRicohUsbCamera();
+		KRicohStatus status = usb_camera->Open(pnp_device_id);
+
+		if (status != KRICOH_OK)
+		{
+			delete usb_camera;
+			return status;
+		}
+
+		*camera = usb_camera;
+		return KRICOH_OK;
+	}
+	catch (...)
+	{
+		return KRICOH_E_OUT_OF_MEMORY;
+	}
+#else
+	(void)pnp_device_id;
+	return KRICOH_E_NOT_SUPPORTED;
+#endif
+}
+
+KRicohStatus KRICOH_CALL KRicoh_OpenSimulated(uint32_t image_size, uint32_t object_count, KRicohCamera** camera)
+{
+	KRicohSimConfig config;
+
+	config.image_size = image_size;
+	config.object_count = object_count;
+
+	return KRicoh_OpenSimulated(config, camera);
+}
+
+KRicohStatus KRICOH_CALL KRicoh_OpenSimulated(const KRicohSimConfig& config, KRicohCamera** camera)
+{
+	if (camera == NULL)
+		return KRICOH_E_INVALID_ARGUMENT;
+
+	*camera = NULL;
+
+	try
+	{
+		KRicohSimCamera* sim_camera = new KRicohSimCamera(config);
+		if (!sim_camera->Open())
+		{
+			delete sim_camera;
+			return KRICOH_E_CAMERA;
+		}
+
+		*camera = sim_camera;
+		return KRICOH_OK;
+	}
+	catch (...)
+	{
+		return KRICOH_E_OUT_OF_MEMORY;
+	}
+}
+
+void KRICOH_CALL KRicoh_Close(KRicohCamera* camera)
+{
+	if (camera == NULL || camera->magic != KRICOH_CAMERA_MAGIC)
+		return;
+
+	try
+	{
+		delete camera;
+	}
+	catch (...)
+	{
+	}
+}
+
+KRicohStatus KRICOH_CALL KRicoh_TakePicture(KRicohCamera* camera, uint32_t timeout_ms, uint32_t* handle)
+{
+	if (handle == NULL)
+		return KRICOH_E_INVALID_ARGUMENT;
+
+	*handle = 0;
+
+	return Guard(camera, [timeout_ms, handle](KRicohCamera& target)
+	{
+		return target.TakePicture(timeout_ms, *handle);
+	});
+}
+
+KRicohStatus KRICOH_CALL KRicoh_GetLastImageHandle(KRicohCamera* camera, uint32_t* handle)
+{
+	if (handle == NULL)
+		return KRICOH_E_INVALID_ARGUMENT;
+
+	*handle = 0;
+
+	return Guard(camera, [handle](KRicohCamera& target)
+	{
+		return target.GetLastImageHandle(*handle);
+	});
+}
+
+KRicohStatus KRICOH_CALL KRicoh_GetImageSize(KRicohCamera* camera, uint32_t handle, uint32_t* image_size)
+{
+	if (image_size == NULL)
+		return KRICOH_E_INVALID_ARGUMENT;
+
+	*image_size = 0;
+
+	return Guard(camera, [handle, image_size](KRicohCamera& target)
+	{
+		return target.GetImageSize(handle, *image_size);
+	});
+}
+
+KRicohStatus KRICOH_CALL KRicoh_DownloadImage(KRicohCamera* camera, uint32_t handle, void* buffer,
+											uint32_t buffer_size, uint32_t* image_size)
+{
+	if (image_size == NULL || (buffer == NULL && buffer_size > 0))
+		return KRICOH_E_INVALID_ARGUMENT;
+
+	*image_size = 0;
+
+	KRicohFixedBuffer fixed;
+	fixed.buffer = buffer;
+	fixed.size = buffer_size;
+
+	KRicohStatus status = Guard(camera, [handle, &fixed, image_size](KRicohCamera& target)
+	{
+		return target.Download(handle, UseFixedBuffer, &fixed, *image_size);
+	});
+
+	// Declined by UseFixedBuffer, i.e. the image does not fit
+	return (status == KRICOH_E_CANCELLED) ? KRICOH_E_BUFFER_TOO_SMALL : status;
+}
+
+KRicohStatus KRICOH_CALL KRicoh_DownloadImageTo(KRicohCamera* camera, uint32_t handle, KRicohAllocCallback allocate,
+												void* context, uint32_t* image_size)
+{
+	if (image_size == NULL || allocate == NULL)
+		return KRICOH_E_INVALID_ARGUMENT;
+
+	*image_size = 0;
+
+	return Guard(camera, [handle, allocate, context, image_size](KRicohCamera& target)
+	{
+		return target.Download(handle, allocate, context, *image_size);
+	});
+}
+
+KRicohStatus KRICOH_CALL KRicoh_DeleteImage(KRicohCamera* camera, uint32_t handle)
+{
+	return Guard(camera, [handle](KRicohCamera& target)
+	{
+		return target.DeleteImage(handle);
+	});
+}
+
+int32_t KRICOH_CALL KRicoh_GetLastError(KRicohCamera* camera)
+{
+	if (camera == NULL || camera->magic != KRICOH_CAMERA_MAGIC)
+		return 0;
+
+	return camera->GetLastError();
+}
@@ -0,0 +1,96 @@
+#ifndef _K_RICOH_C_API_H_
+#define _K_RICOH_C_API_H_
+
+/*
+ * Flat C interface of the DLL: plain C types only, so any compiler, C runtime or FFI
+ * (P/Invoke, ctypes, cffi) can use it. Images are written straight into memory of the
+ * caller, a byte[] pinned by the marshaller or the data of a NumPy array, without a
+ * copy in between.
+ *
+ * A camera handle may be used by one thread at a time. Every call returns KRICOH_OK or
+ * one of the KRICOH_E_ codes; KRicoh_GetLastError tells more about KRICOH_E_CAMERA.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef KRICOH_C_API
+#if defined(_WIN32) && defined(KRICOHMTPDLL_EXPORTS)
+#define KRICOH_C_API __declspec(dllexport)
+#elif defined(_WIN32)
+#define KRICOH_C_API __declspec(dllimport)
+#else
+#define KRICOH_C_API
+#endif
+#endif
+
+/* cdecl keeps the exported names undecorated on x86 as well */
+#ifdef _WIN32
+#define KRICOH_CALL __cdecl
+#else
+#define KRICOH_CALL
+#endif
+
+/* Raised when a function is added; existing signatures never change */
+#define KRICOH_C_API_VERSION        1
+
+typedef int32_t KRicohStatus;
+
+#define KRICOH_OK                   0
+#define KRICOH_E_INVALID_ARGUMENT   1	/* null or stale handle, null out parameter */
+#define KRICOH_E_NO_CAMERA          2
+#define KRICOH_E_BUFFER_TOO_SMALL   3	/* the image size is in *image_size */
+#define KRICOH_E_CANCELLED          4	/* the allocation callback returned NULL */
+#define KRICOH_E_OUT_OF_MEMORY      5
+#define KRICOH_E_CAMERA             6	/* the camera failed the call, see KRicoh_GetLastError */
+#define KRICOH_E_NOT_SUPPORTED      7	/* e.g. a USB camera outside Windows */
+
+typedef struct KRicohCamera KRicohCamera;
+
+/* Returns memory for image_size bytes that stays valid until the download returns, or
+ * NULL to skip the image. Called once per download, before any data is copied. */
+typedef void* (KRICOH_CALL *KRicohAllocCallback)(void* context, uint32_t image_size);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+KRICOH_C_API uint32_t KRICOH_CALL KRicoh_GetApiVersion(void);
+
+/* Opens a RICOH THETA S on USB and its session. pnp_device_id NULL takes the camera
+ * used last, or any one attached. Windows only, and not with KRICOH_NO_WPD. */
+KRICOH_C_API KRicohStatus KRICOH_CALL KRicoh_Open(const wchar_t* pnp_device_id, KRicohCamera** camera);
+/* A camera in memory with object_count pictures of image_size bytes, for tests of a
+ * binding and for benchmarks; it captures and deletes like the real one. */
+KRICOH_C_API KRicohStatus KRICOH_CALL KRicoh_OpenSimulated(uint32_t image_size, uint32_t object_count, KRicohCamera** camera);
+/* Closes the session and frees the handle, NULL is ignored */
+KRICOH_C_API void KRICOH_CALL KRicoh_Close(KRicohCamera* camera);
+
+/* Pictures are named by their PTP object handle */
+KRICOH_C_API KRicohStatus KRICOH_CALL KRicoh_TakePicture(KRicohCamera* camera, uint32_t timeout_ms, uint32_t* handle);
+KRICOH_C_API KRicohStatus KRICOH_CALL KRicoh_GetLastImageHandle(KRicohCamera* camera, uint32_t* handle);
+KRICOH_C_API KRicohStatus KRICOH_CALL KRicoh_GetImageSize(KRicohCamera* camera, uint32_t handle, uint32_t* image_size);
+/* Into a buffer of the caller; KRICOH_E_BUFFER_TOO_SMALL leaves the camera untouched */
+KRICOH_C_API KRicohStatus KRICOH_CALL KRicoh_DownloadImage(KRicohCamera* camera, uint32_t handle, void* buffer,
+														uint32_t buffer_size, uint32_t* image_size);
+/* Into memory allocate returns once the size is known, one round trip less than
+ * KRicoh_GetImageSize followed by KRicoh_DownloadImage */
+KRICOH_C_API KRicohStatus KRICOH_CALL KRicoh_DownloadImageTo(KRicohCamera* camera, uint32_t handle, KRicohAllocCallback allocate,
+															void* context, uint32_t* image_size);
+KRICOH_C_API KRicohStatus KRICOH_CALL KRicoh_DeleteImage(KRicohCamera* camera, uint32_t handle);
+
+/* USB cameras: the KRicohMTPError of the last failure. Simulated cameras: the PTP
+ * response code of the last operation. */
+KRICOH_C_API int32_t KRICOH_CALL KRicoh_GetLastError(KRicohCamera* camera);
+
+#ifdef __cplusplus
+}
+
+struct KRicohSimConfig;
+
+/* C++ only: a simulated camera with the whole KRicohSimConfig, e.g. latency, failures
+ * or a stream that ends early */
+KRICOH_C_API KRicohStatus KRICOH_CALL KRicoh_OpenSimulated(const KRicohSimConfig& config, KRicohCamera** camera);
+#endif
+
+#endif
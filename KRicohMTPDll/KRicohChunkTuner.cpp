@@ -0,0 +1,140 @@
+#include "KRicohChunkTuner.h"
+
+KRicohChunkTuner::KRicohChunkTuner()
+{
+	Reset();
+}
+
+KRicohChunkTuner::~KRicohChunkTuner()
+{
+}
+
+void KRicohChunkTuner::Reset(uint32_t remembered_size)
+{
+	std::lock_guard<std::mutex> guard(this->lock);
+
+	this->start_size = 0;
+	this->probe_size = 0;
+	this->best_size = remembered_size;
+	this->best_rate = 0.0;
+	this->direction = 1;
+	this->stale = 0;
+	this->converged = (remembered_size != 0);
+	this->samples = 0;
+	this->sample_bytes = 0;
+	this->sample_us = 0;
+	this->transfers = 0;
+}
+
+uint32_t KRicohChunkTuner::NextChunkSize(uint32_t driver_size)
+{
+	std::lock_guard<std::mutex> guard(this->lock);
+
+	if (this->converged)
+		return this->best_size;
+
+	if (this->start_size == 0)
+	{
+		uint32_t size = driver_size;
+
+		if (size < TUNE_MIN_CHUNK)
+			size = TUNE_MIN_CHUNK;
+		if (size > TUNE_MAX_CHUNK)
+			size = TUNE_MAX_CHUNK;
+
+		this->start_size = size;
+		this->probe_size = size;
+	}
+
+	return this->probe_size;
+}
+
+bool KRicohChunkTuner::Record(uint32_t chunk_size, uint64_t bytes, uint64_t elapsed_us)
+{
+	std::lock_guard<std::mutex> guard(this->lock);
+
+	// Transfers of an earlier candidate may still finish on another thread
+	if (this->converged || chunk_size != this->probe_size || bytes == 0 || elapsed_us == 0)
+		return false;
+
+	this->transfers++;
+	this->samples++;
+	this->sample_bytes += bytes;
+	this->sample_us += elapsed_us;
+
+	if (this->samples < TUNE_SAMPLES)
+		return false;
+
+	double rate = (double)this->sample_bytes / (double)this->sample_us;
+
+	this->samples = 0;
+	this->sample_bytes = 0;
+	this->sample_us = 0;
+
+	if (this->best_size == 0 || rate > this->best_rate * (1.0 + TUNE_NOISE))
+	{
+		this->best_size = this->probe_size;
+		this->best_rate = rate;
+		this->stale = 0;
+	}
+	else
+	{
+		this->stale++;
+	}
+
+	// A flat step may still lead to a better size further on
+	if (this->stale < TUNE_PATIENCE)
+	{
+		if (this->direction > 0 && this->probe_size <= TUNE_MAX_CHUNK / 2)
+		{
+			this->probe_size *= 2;
+			return false;
+		}
+
+		if (this->direction < 0 && this->probe_size >= TUNE_MIN_CHUNK * 2)
+		{
+			this->probe_size /= 2;
+			return false;
+		}
+	}
+
+	// Larger chunks never helped, so try smaller ones before giving up
+	if (this->direction > 0 && this->best_size == this->start_size && this->start_size >= TUNE_MIN_CHUNK * 2)
+	{
+		this->direction = -1;
+		this->stale = 0;
+		this->probe_size = this->start_size / 2;
+		return false;
+	}
+
+	Settle();
+	return true;
+}
+
+bool KRicohChunkTuner::IsConverged()
+{
+	std::lock_guard<std::mutex> guard(this->lock);
+
+	return this->converged;
+}
+
+uint32_t KRicohChunkTuner::GetBestSize()
+{
+	std::lock_guard<std::mutex> guard(this->lock);
+
+	return this->best_size;
+}
+
+uint32_t KRicohChunkTuner::GetTransferCount()
+{
+	std::lock_guard<std::mutex> guard(this->lock);
+
+	return this->transfers;
+}
+
+void KRicohChunkTuner::Settle()
+{
+	// Called with lock held
+	this->converged = true;
+	this->probe_size = this->best_size;
+}
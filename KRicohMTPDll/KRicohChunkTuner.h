@@ -0,0 +1,62 @@
+#ifndef _K_RICOH_CHUNK_TUNER_H_
+#define _K_RICOH_CHUNK_TUNER_H_
+
+// Finds the transfer chunk size with the best throughput on the current cable and hub.
+// Starting from the driver's size it doubles while that pays off, otherwise it halves,
+// and settles on the best size seen. Every candidate is held against the best rate so far,
+// not against the step before, and the search goes a few steps past a flat result, so
+// gains too small to see in one step still add up. Nothing here depends on Windows.
+
+#include "KRicohPtp.h"
+#include <mutex>
+
+// Range the tuner may move in (bytes)
+#define TUNE_MIN_CHUNK      (16 * 1024)
+#define TUNE_MAX_CHUNK      (8 * 1024 * 1024)
+// Transfers measured per candidate
+#define TUNE_SAMPLES        2
+// A candidate becomes the best only when it beats the best rate so far by more than the noise
+#define TUNE_NOISE          0.01
+// Candidates in a row that are no better before the search turns or settles
+#define TUNE_PATIENCE       2
+
+class K_RICOH_API KRicohChunkTuner
+{
+public:
+	KRicohChunkTuner();
+	virtual ~KRicohChunkTuner();
+
+private:
+	uint32_t start_size;
+	uint32_t probe_size;
+	uint32_t best_size;
+	double best_rate;			// bytes per microsecond
+	int direction;				// 1 while doubling, -1 while halving
+	uint32_t stale;				// candidates since the best one was found
+	bool converged;
+	uint32_t samples;
+	uint64_t sample_bytes;
+	uint64_t sample_us;
+	uint32_t transfers;			// measured transfers until convergence
+	std::mutex lock;
+
+	KRicohChunkTuner(const KRicohChunkTuner&);
+	KRicohChunkTuner& operator=(const KRicohChunkTuner&);
+
+	void Settle();
+
+public:
+	// a new session; a size remembered from an earlier one is used without tuning again
+	void Reset(uint32_t remembered_size = 0);
+	// size for the next transfer, driver_size is where the search starts
+	uint32_t NextChunkSize(uint32_t driver_size);
+	// one finished transfer, true when it completed the search
+	bool Record(uint32_t chunk_size, uint64_t bytes, uint64_t elapsed_us);
+
+	bool IsConverged();
+	// 0 until a size has been measured or remembered
+	uint32_t GetBestSize();
+	uint32_t GetTransferCount();
+};
+
+#endif
@@ -0,0 +1,324 @@
+#include "KRicohExecutor.h"
+
+using namespace std;
+
+KRicohDeviceExecutor::KRicohDeviceExecutor(__in DWORD status_interval_ms)
+	: thread(nullptr), waiting(0), stopping(0), pending(0), status_interval_ms(status_interval_ms), camera(nullptr)
+{
+	this->status.opened = false;
+	this->status.connected = false;
+	this->status.battery_level = -1;
+	this->status.last_handle = 0;
+	this->status.last_error = KRicohMTPError::NO_RICOH_ERROR;
+	this->status.completed = 0;
+	this->status.updated_tick = 0;
+	InitializeSRWLock(&this->status_lock);
+
+	this->wake_event = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+	if (this->wake_event != nullptr)
+		this->thread = CreateThread(nullptr, 0, ExecutorThread, this, 0, nullptr);
+	if (this->thread == nullptr)
+		printf("! Failed to start the device executor, error = %lu\n", ::GetLastError());
+}
+
+KRicohDeviceExecutor::~KRicohDeviceExecutor()
+{
+	InterlockedExchange(&this->stopping, 1);
+
+	if (this->thread != nullptr)
+	{
+		SetEvent(this->wake_event);
+		WaitForSingleObject(this->thread, INFINITE);
+		CloseHandle(this->thread);
+		this->thread = nullptr;
+	}
+
+	// Requests that came in while the executor was ending still complete
+	std::function<void(bool)> task;
+	while (this->requests.Pop(task))
+		task(false);
+
+	if (this->wake_event != nullptr)
+		CloseHandle(this->wake_event);
+}
+
+std::future<KRicohAsyncResult> KRicohDeviceExecutor::Open(__in const std::wstring& pnp_device_id, __in ULONG storage,
+														__in KRicohAsyncCallback on_done)
+{
+	KRicohAsyncResult request;
+
+	return Post(request, [this, pnp_device_id, storage](KRicohMTP& camera, KRicohAsyncResult& result)
+	{
+		bool found = pnp_device_id.empty() ? camera.InitRicohDevice() : camera.InitRicohDevice(pnp_device_id);
+		if (!found)
+			return false;
+
+		result.response = camera.OpenSession(storage);
+		if (result.response != PTP_RESPONSE_OK && result.response != PTP_RESPONSE_SESSION_ALREADY_OPEN)
+			return false;
+
+		// The session of an earlier Open is as good as a new one
+		camera.ClearLastError();
+
+		AcquireSRWLockExclusive(&this->status_lock);
+		this->status.opened = true;
+		this->status.device_id = camera.GetDeviceID();
+		ReleaseSRWLockExclusive(&this->status_lock);
+
+		// The first GetStatus after Open already knows the battery
+		ReadStatus();
+		return true;
+	}, on_done);
+}
+
+std::future<KRicohAsyncResult> KRicohDeviceExecutor::Close(__in KRicohAsyncCallback on_done)
+{
+	KRicohAsyncResult request;
+
+	return Post(request, [this](KRicohMTP& camera, KRicohAsyncResult& result)
+	{
+		AcquireSRWLockExclusive(&this->status_lock);
+		this->status.opened = false;
+		ReleaseSRWLockExclusive(&this->status_lock);
+
+		result.response = camera.CloseSession();
+		return result.response == PTP_RESPONSE_OK;
+	}, on_done);
+}
+
+std::future<KRicohAsyncResult> KRicohDeviceExecutor::TakePicture(__in KRicohAsyncCallback on_done, __in DWORD timeout_ms)
+{
+	KRicohAsyncResult request;
+
+	return Post(request, [this, timeout_ms](KRicohMTP& camera, KRicohAsyncResult& result)
+	{
+		result.response = camera.TakePicture(result.obj_id, timeout_ms);
+		if (result.response != PTP_RESPONSE_OK || result.obj_id.empty())
+			return false;
+
+		AcquireSRWLockExclusive(&this->status_lock);
+		this->status.last_object_id = result.obj_id;
+		ReleaseSRWLockExclusive(&this->status_lock);
+
+		return true;
+	}, on_done);
+}
+
+std::future<KRicohAsyncResult> KRicohDeviceExecutor::DownloadImage(__in const std::wstring& obj_id, __in KRicohAsyncCallback on_done)
+{
+	KRicohAsyncResult request;
+
+	request.obj_id = obj_id;
+
+	return Post(request, [](KRicohMTP& camera, KRicohAsyncResult& result)
+	{
+		return camera.DownloadImage(result.obj_id, result.image);
+	}, on_done);
+}
+
+std::future<KRicohAsyncResult> KRicohDeviceExecutor::DeleteImage(__in const std::wstring& obj_id, __in KRicohAsyncCallback on_done)
+{
+	KRicohAsyncResult request;
+
+	request.obj_id = obj_id;
+
+	return Post(request, [](KRicohMTP& camera, KRicohAsyncResult& result)
+	{
+		return camera.DeleteImage(result.obj_id);
+	}, on_done);
+}
+
+std::future<KRicohAsyncResult> KRicohDeviceExecutor::GetOneImageAndDelete(__in KRicohAsyncCallback on_done)
+{
+	KRicohAsyncResult request;
+
+	return Post(request, [](KRicohMTP& camera, KRicohAsyncResult& result)
+	{
+		return camera.GetOneImageAndDelete(result.image);
+	}, on_done);
+}
+
+std::future<KRicohAsyncResult> KRicohDeviceExecutor::Submit(__in KRicohExecutorWork work, __in KRicohAsyncCallback on_done)
+{
+	KRicohAsyncResult request;
+
+	return Post(request, work, on_done);
+}
+
+KRicohDeviceStatus KRicohDeviceExecutor::GetStatus()
+{
+	AcquireSRWLockShared(&this->status_lock);
+	KRicohDeviceStatus snapshot = this->status;
+	ReleaseSRWLockShared(&this->status_lock);
+
+	return snapshot;
+}
+
+void KRicohDeviceExecutor::RefreshStatus()
+{
+	// Not a request of the caller, so it does not touch last_error or completed
+	Enqueue([this](bool run)
+	{
+		if (run)
+			ReadStatus();
+		InterlockedDecrement(&this->pending);
+	});
+}
+
+DWORD KRicohDeviceExecutor::GetPendingCount()
+{
+	return (DWORD)this->pending;
+}
+
+std::future<KRicohAsyncResult> KRicohDeviceExecutor::Post(__in const KRicohAsyncResult& request, __in KRicohExecutorWork work,
+														__in KRicohAsyncCallback on_done)
+{
+	std::shared_ptr<std::promise<KRicohAsyncResult> > promise = std::make_shared<std::promise<KRicohAsyncResult> >();
+	std::future<KRicohAsyncResult> future = promise->get_future();
+	KRicohAsyncResult initial = request;
+
+	initial.succeeded = false;
+	initial.error = KRicohMTPError::NO_RICOH_ERROR;
+	initial.response = 0;
+
+	// run is false when the request is dropped at shutdown, it still completes
+	std::function<void(bool)> task = [this, initial, work, on_done, promise](bool run)
+	{
+		KRicohAsyncResult result = initial;
+
+		if (run)
+		{
+			// A request that succeeds without a word must not report the error of the one before
+			this->camera->ClearLastError();
+			result.succeeded = work(*this->camera, result);
+			if (!result.succeeded)
+				result.error = (enum KRicohMTPError)this->camera->GetLastError();
+
+			AcquireSRWLockExclusive(&this->status_lock);
+			this->status.last_error = result.error;
+			this->status.connected = this->camera->IsConnected();
+			this->status.completed++;
+			ReleaseSRWLockExclusive(&this->status_lock);
+		}
+		else
+		{
+			result.error = KRicohMTPError::CALL_CANCELLED;
+		}
+
+		InterlockedDecrement(&this->pending);
+		if (on_done)
+			on_done(result);
+		promise->set_value(result);
+	};
+
+	Enqueue(task);
+
+	return future;
+}
+
+void KRicohDeviceExecutor::Enqueue(__in const std::function<void(bool)>& task)
+{
+	InterlockedIncrement(&this->pending);
+
+	if (this->thread == nullptr || this->stopping != 0)
+	{
+		task(false);
+		return;
+	}
+
+	this->requests.Push(task);
+
+	// Only a sleeping executor needs the event, a busy one finds the request on its next Pop
+	if (InterlockedExchange(&this->waiting, 0) == 1)
+		SetEvent(this->wake_event);
+}
+
+DWORD WINAPI KRicohDeviceExecutor::ExecutorThread(__in LPVOID param)
+{
+	// KRicohMTP initializes COM for this thread
+	static_cast<KRicohDeviceExecutor*>(param)->RunExecutor();
+
+	return 0;
+}
+
+void KRicohDeviceExecutor::RunExecutor()
+{
+	this->camera = new (std::nothrow) KRicohMTP();
+	bool com_initialized = this->camera != nullptr && this->camera->GetLastError() != KRicohMTPError::COINITIALIZE_FAIL;
+	ULONGLONG last_read = GetTickCount64();
+
+	for (;;)
+	{
+		std::function<void(bool)> task;
+
+		if (this->requests.Pop(task))
+		{
+			// Unfinished requests are cancelled at shutdown instead of keeping the destructor waiting
+			task(this->stopping == 0 && com_initialized);
+			continue;
+		}
+
+		if (this->stopping != 0)
+			break;
+
+		// Idle: keep the status fresh, a request that comes in meanwhile waits for one property read
+		DWORD timeout_ms = INFINITE;
+		if (this->status_interval_ms > 0 && com_initialized)
+		{
+			ULONGLONG elapsed = GetTickCount64() - last_read;
+
+			if (elapsed >= this->status_interval_ms)
+			{
+				ReadStatus();
+				last_read = GetTickCount64();
+				continue;
+			}
+
+			timeout_ms = this->status_interval_ms - (DWORD)elapsed;
+		}
+
+		// A request pushed after this exchange sees waiting and sets the event
+		InterlockedExchange(&this->waiting, 1);
+		if (this->requests.Size() == 0 && this->stopping == 0)
+			WaitForSingleObject(this->wake_event, timeout_ms);
+		InterlockedExchange(&this->waiting, 0);
+	}
+
+	// The camera goes on the thread that made it, before its COM apartment
+	delete this->camera;
+	this->camera = nullptr;
+	if (com_initialized)
+		CoUninitialize();
+}
+
+void KRicohDeviceExecutor::ReadStatus()
+{
+	bool opened;
+	int battery_level = -1;
+	DWORD last_handle = 0;
+
+	AcquireSRWLockShared(&this->status_lock);
+	opened = this->status.opened;
+	ReleaseSRWLockShared(&this->status_lock);
+
+	bool connected = this->camera->IsConnected();
+
+	// Without a session the camera answers nothing but OpenSession
+	if (opened && connected)
+	{
+		std::vector<BYTE> value;
+
+		if (this->camera->GetDevicePropValue(PTP_DPC_BATTERY_LEVEL, value) && !value.empty())
+			battery_level = value[0];
+		this->camera->GetLastImageHandle(last_handle);
+	}
+
+	AcquireSRWLockExclusive(&this->status_lock);
+	this->status.connected = connected;
+	if (battery_level >= 0)
+		this->status.battery_level = battery_level;
+	if (last_handle != 0)
+		this->status.last_handle = last_handle;
+	this->status.updated_tick = GetTickCount64();
+	ReleaseSRWLockExclusive(&this->status_lock);
+}
@@ -0,0 +1,84 @@
+#ifndef _K_RICOH_EXECUTOR_H_
+#define _K_RICOH_EXECUTOR_H_
+
+#include "KRicohMTP.h"
+#include "KRicohMpscQueue.h"
+
+// Status read while the executor has nothing to do (ms), 0 only reads it on RefreshStatus
+#define DEFAULT_STATUS_INTERVAL 10000
+
+// Last known state of the camera, kept by the executor thread
+struct KRicohDeviceStatus{
+	bool opened;					// Open succeeded and Close was not called since
+	bool connected;					// false while the camera is off USB
+	std::wstring device_id;
+	int battery_level;				// percent, -1 until it was read
+	DWORD last_handle;				// newest object on the camera, 0 until it was read
+	std::wstring last_object_id;	// picture of the last TakePicture through the executor
+	enum KRicohMTPError last_error;	// of the last request
+	DWORD completed;				// requests run since the executor started
+	ULONGLONG updated_tick;			// GetTickCount64 when battery_level and last_handle were read
+};
+
+typedef std::function<bool(KRicohMTP& camera, KRicohAsyncResult& result)> KRicohExecutorWork;
+
+// One thread owns the KRicohMTP of a camera: it creates it (and so its COM apartment),
+// runs every request on it and destroys it. Any number of threads may queue requests,
+// they go through a lock-free queue and run in the order they were queued.
+// GetStatus answers from the state the executor keeps, it never waits for a transfer.
+class K_RICOH_API KRicohDeviceExecutor
+{
+public:
+	KRicohDeviceExecutor(__in DWORD status_interval_ms = DEFAULT_STATUS_INTERVAL);
+	virtual ~KRicohDeviceExecutor();
+
+private:
+	KRicohMpscQueue<std::function<void(bool)> > requests;
+	HANDLE thread;
+	HANDLE wake_event;
+	volatile LONG waiting;			// the executor is about to sleep on wake_event
+	volatile LONG stopping;
+	volatile LONG pending;
+	DWORD status_interval_ms;
+
+	// Created, used and destroyed on the executor thread only
+	KRicohMTP* camera;
+
+	KRicohDeviceStatus status;
+	SRWLOCK status_lock;
+
+	KRicohDeviceExecutor(const KRicohDeviceExecutor&);
+	KRicohDeviceExecutor& operator=(const KRicohDeviceExecutor&);
+
+	static DWORD WINAPI ExecutorThread(__in LPVOID param);
+	void RunExecutor();
+	// on the executor thread: connection, battery and the last handle
+	void ReadStatus();
+	void Enqueue(__in const std::function<void(bool)>& task);
+	std::future<KRicohAsyncResult> Post(__in const KRicohAsyncResult& request, __in KRicohExecutorWork work,
+										__in KRicohAsyncCallback on_done);
+
+public:
+	// InitRicohDevice and OpenSession; an empty pnp_device_id opens the camera InitRicohDevice() picks
+	std::future<KRicohAsyncResult> Open(__in const std::wstring& pnp_device_id = std::wstring(), __in ULONG storage = 0x10001,
+										__in KRicohAsyncCallback on_done = KRicohAsyncCallback());
+	std::future<KRicohAsyncResult> Close(__in KRicohAsyncCallback on_done = KRicohAsyncCallback());
+	std::future<KRicohAsyncResult> TakePicture(__in KRicohAsyncCallback on_done = KRicohAsyncCallback(),
+												__in DWORD timeout_ms = DEFAULT_CAPTURE_TIMEOUT);
+	std::future<KRicohAsyncResult> DownloadImage(__in const std::wstring& obj_id,
+												__in KRicohAsyncCallback on_done = KRicohAsyncCallback());
+	std::future<KRicohAsyncResult> DeleteImage(__in const std::wstring& obj_id,
+												__in KRicohAsyncCallback on_done = KRicohAsyncCallback());
+	std::future<KRicohAsyncResult> GetOneImageAndDelete(__in KRicohAsyncCallback on_done = KRicohAsyncCallback());
+	// anything else KRicohMTP does, work runs on the executor thread and returns result.succeeded;
+	// the camera must not be kept beyond the call
+	std::future<KRicohAsyncResult> Submit(__in KRicohExecutorWork work, __in KRicohAsyncCallback on_done = KRicohAsyncCallback());
+
+	KRicohDeviceStatus GetStatus();
+	// queues a read of the battery and the last handle, GetStatus has them once it ran
+	void RefreshStatus();
+	// requests queued or running
+	DWORD GetPendingCount();
+};
+
+#endif
@@ -1,134 +1,1688 @@
 #include "KRicohMTP.h"
+#include "KRicohWpdTransport.h"
 
 using namespace std;
 using namespace Microsoft::WRL;
 
+static ULONGLONG MicrosecondsSince(__in const LARGE_INTEGER& start)
+{
+	LARGE_INTEGER frequency, now;
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&now);
+
+	return (ULONGLONG)(now.QuadPart - start.QuadPart) * 1000000 / frequency.QuadPart;
+}
+
+// Reads of the driver's transfer size a stream copy needed
+static DWORD TransferChunks(__in DWORD bytes, __in DWORD transfer_size)
+{
+	if (transfer_size == 0)
+		return 0;
+
+	return bytes / transfer_size + ((bytes % transfer_size) != 0 ? 1 : 0);
+}
+
+// Holds a critical section until the end of the scope, for calls with many ways out
+class KRicohScopedLock
+{
+public:
+	explicit KRicohScopedLock(__in CRITICAL_SECTION* lock)
+		: lock(lock)
+	{
+		EnterCriticalSection(this->lock);
+	}
+
+	~KRicohScopedLock()
+	{
+		LeaveCriticalSection(this->lock);
+	}
+
+private:
+	CRITICAL_SECTION* lock;
+
+	KRicohScopedLock(const KRicohScopedLock&);
+	KRicohScopedLock& operator=(const KRicohScopedLock&);
+};
+
+// What a call past its deadline or cancelled needs to stop: the attempt is told through
+// abort_event and whatever is pending on the device is cancelled, so a stuck transfer returns
+struct KRicohCallAbort{
+	ComPtr<IPortableDevice> device;
+	HANDLE abort_event;
+};
+
+static VOID CALLBACK OnCallAborted(__in PVOID param, __in BOOLEAN timed_out)
+{
+	KRicohCallAbort* abort = static_cast<KRicohCallAbort*>(param);
+
+	SetEvent(abort->abort_event);
+
+	// A thread pool thread, it shares the process MTA the device was opened in
+	if (abort->device != nullptr)
+		abort->device->Cancel();
+}
+
+// Failure of one attempt, a missing camera is reported as such whatever step it was in
+static bool FailAttempt(__inout KRicohCallResult& result, __in HRESULT hr, __in DWORD response,
+						__in KRicohCallPhase phase, __in KRicohMTPError error)
+{
+	bool no_device = (hr == HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED) && response == 0);
+
+	result.hr = hr;
+	result.response = response;
+	result.phase = no_device ? CALL_PHASE_CONNECT : phase;
+	result.error = no_device ? KRicohMTPError::THERE_IS_NO_RICOH : error;
+
+	return false;
+}
+
+// Forwards WPD events (ObjectAdded, ...) to the owning KRicohMTP
+class KRicohEventCallback : public IPortableDeviceEventCallback
+{
+private:
+	LONG ref_count;
+	KRicohMTP* owner;
+
+public:
+	KRicohEventCallback(__in KRicohMTP* owner)
+		: ref_count(1), owner(owner)
+	{
+	}
+
+	virtual ~KRicohEventCallback()
+	{
+	}
+
+	IFACEMETHODIMP QueryInterface(__in REFIID riid, __out void** ppvObject)
+	{
+		if (ppvObject == nullptr)
+			return E_POINTER;
+
+		if ((riid == __uuidof(IUnknown)) ||
+			(riid == __uuidof(IPortableDeviceEventCallback)))
+		{
+			AddRef();
+			*ppvObject = static_cast<IPortableDeviceEventCallback*>(this);
+			return S_OK;
+		}
+
+		*ppvObject = nullptr;
+		return E_NOINTERFACE;
+	}
+
+	IFACEMETHODIMP_(ULONG) AddRef()
+	{
+		return InterlockedIncrement(&this->ref_count);
+	}
+
+	IFACEMETHODIMP_(ULONG) Release()
+	{
+		ULONG ref = InterlockedDecrement(&this->ref_count);
+		if (ref == 0)
+			delete this;
+
+		return ref;
+	}
+
+	IFACEMETHODIMP OnEvent(__in IPortableDeviceValues* pEventParameters)
+	{
+		if (pEventParameters != nullptr && this->owner != nullptr)
+			this->owner->OnDeviceEvent(pEventParameters);
+
+		return S_OK;
+	}
+};
+
 KRicohMTP::KRicohMTP()
-	: last_error(KRicohMTPError::NO_RICOH_ERROR), device(nullptr)
+	: last_error(KRicohMTPError::NO_RICOH_ERROR), last_error_slot(TlsAlloc()), device(nullptr),
+	event_callback(nullptr), event_cookie(nullptr), object_added_event(nullptr),
+	object_index_state(INDEX_INVALID), ready_budget_ms(DEFAULT_READY_BUDGET), deferred_delete_batch(0), partial_chunk_size(0),
+	transfer_chunk_size(TRANSFER_CHUNK_DRIVER), last_transfer_chunk(0),
+	connected(0), connected_event(nullptr), reconnect_event(nullptr), reconnect_thread(nullptr), reconnect_stop(0),
+	reconnect_timeout_ms(DEFAULT_RECONNECT_TIMEOUT), reconnect_count(0), session_storage(0), session_open(false),
+	async_event(nullptr), async_thread(nullptr), async_stop(0)
+{
+	HRESULT hr = S_OK;
+
+	// Enable the heap manager to terminate the process on heap error.
+	HeapSetInformation(nullptr, HeapEnableTerminationOnCorruption, nullptr, 0);
+
+	// Initialize COM for COINIT_MULTITHREADED
+	hr = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+	if (hr != S_OK)
+		SetError(KRicohMTPError::COINITIALIZE_FAIL);
+
+	ZeroMemory(this->wait_stats, sizeof(this->wait_stats));
+
+	InitializeCriticalSection(&this->call_lock);
+	InitializeCriticalSection(&this->connection_lock);
+	InitializeCriticalSection(&this->event_lock);
+	this->object_added_event = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+
+	InitializeSRWLock(&this->device_lock);
+	this->connected_event = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+	this->reconnect_event = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+
+	InitializeCriticalSection(&this->async_lock);
+	this->async_event = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+}
+
+KRicohMTP::~KRicohMTP()
+{
+	// Queued calls still need the reconnect thread, so the worker goes first
+	StopAsyncThread();
+	// Nothing may swap the device while it is torn down
+	StopReconnectThread();
+
+	if (this->device != nullptr)
+	{
+		FlushDeletes();
+		UnregisterForEvents();
+		device->Close();
+		//device->Release();
+	}
+
+	if (this->object_added_event != nullptr)
+		CloseHandle(this->object_added_event);
+	if (this->connected_event != nullptr)
+		CloseHandle(this->connected_event);
+	if (this->reconnect_event != nullptr)
+		CloseHandle(this->reconnect_event);
+	if (this->async_event != nullptr)
+		CloseHandle(this->async_event);
+	DeleteCriticalSection(&this->async_lock);
+	DeleteCriticalSection(&this->event_lock);
+	DeleteCriticalSection(&this->connection_lock);
+	DeleteCriticalSection(&this->call_lock);
+
+	if (this->last_error_slot != TLS_OUT_OF_INDEXES)
+		TlsFree(this->last_error_slot);
+}
+
+bool KRicohMTP::InitRicohDevice()
+{
+	std::vector<std::wstring> ricoh_ids;
+	std::wstring cached_id;
+
+	// Skip the enumeration when the camera from the last run is still attached
+	if (LoadCachedDeviceID(cached_id) && InitRicohDevice(cached_id))
+		return true;
+
+	FindRicoh(ricoh_ids);
+	if (ricoh_ids.empty())
+	{
+		SetError(KRicohMTPError::THERE_IS_NO_RICOH);
+		return false;
+	}
+
+	// Keep the old behaviour of picking the last camera found
+	return InitRicohDevice(ricoh_ids.back());
+}
+
+bool KRicohMTP::InitRicohDevice(__in const std::wstring& pnp_device_id)
+{
+	KRicohScopedLock call(&this->call_lock);
+	ComPtr<IPortableDevice> new_device;
+
+	GetRicohDevice(&new_device, pnp_device_id.c_str());
+
+	if (new_device == nullptr)
+	{
+		SetError(KRicohMTPError::THERE_IS_NO_RICOH);
+		return false;
+	}
+
+	std::shared_ptr<KRicohWpdTransport> transport = std::make_shared<KRicohWpdTransport>(new_device.Get());
+
+	// The reconnect thread may be reopening the camera opened before
+	EnterCriticalSection(&this->connection_lock);
+
+	// Events of a camera opened before go with it
+	UnregisterForEvents();
+
+	AcquireSRWLockExclusive(&this->device_lock);
+	ComPtr<IPortableDevice> old_device = this->device;
+	this->device = new_device;
+	this->wpd_transport = transport;
+	ReleaseSRWLockExclusive(&this->device_lock);
+
+	if (old_device != nullptr)
+		old_device->Close();
+
+	this->device_id = pnp_device_id;
+	SaveCachedDeviceID(pnp_device_id);
+	// A camera measured before starts on its best chunk size
+	this->chunk_tuner.Reset(LoadTunedChunkSize(pnp_device_id));
+	// Without events TakePicture falls back to waiting out the timeout
+	if (FAILED(RegisterForEvents()))
+		printf("! Failed to register for device events, captures will wait for the full timeout\n");
+
+	InterlockedExchange(&this->connected, 1);
+	SetEvent(this->connected_event);
+
+	LeaveCriticalSection(&this->connection_lock);
+
+	// Watches for the camera to drop off and brings it back
+	if (this->reconnect_thread == nullptr)
+	{
+		this->reconnect_stop = 0;
+		this->reconnect_thread = CreateThread(nullptr, 0, ReconnectThread, this, 0, nullptr);
+		if (this->reconnect_thread == nullptr)
+			printf("! Failed to start the reconnect thread, a lost camera will not be reopened\n");
+	}
+
+	return true;
+}
+
+DWORD KRicohMTP::OpenSession(__in ULONG storage)
+{
+	KRicohScopedLock call(&this->call_lock);
+	ComPtr<IPortableDevice> device = GetDevice();
+	DWORD result = 0x2002;
+	if (device == nullptr)
+	{
+		SetError(KRicohMTPError::THERE_IS_NO_RICOH);
+		return result;
+	}
+
+	// A new session gets a fresh object index
+	RefreshObjectIndex();
+
+	ULONG params[1] = { storage };
+	if (SendCommand(device.Get(), 0x1002, &result, params, 1) != S_OK)
+	{
+		// ERROR
+		SetError(KRicohMTPError::CANNOT_OPEN_SESSION);
+	}
+	else
+	{
+		// Remembered so a reconnect can open the same session again
+		EnterCriticalSection(&this->connection_lock);
+		this->session_storage = storage;
+		this->session_open = true;
+		LeaveCriticalSection(&this->connection_lock);
+	}
+
+	WaitUntilReady(WAIT_AFTER_OPEN_SESSION);
+
+	return result;
+}
+
+DWORD KRicohMTP::CloseSession()
+{
+	KRicohScopedLock call(&this->call_lock);
+	ComPtr<IPortableDevice> device = GetDevice();
+	DWORD result = 0x2002;
+	if (device == nullptr)
+	{
+		SetError(KRicohMTPError::THERE_IS_NO_RICOH);
+		return result;
+	}
+
+	// Queued deletes go out while the session is still open
+	FlushDeletes();
+	EnterCriticalSection(&this->connection_lock);
+	this->session_open = false;
+	LeaveCriticalSection(&this->connection_lock);
+
+	if (SendCommand(device.Get(), 0x1003, &result) != S_OK)
+	{
+		// ERROR
+		SetError(KRicohMTPError::CANNOT_CLOSE_SESSION);
+	}
+
+	WaitUntilReady(WAIT_AFTER_CLOSE_SESSION);
+
+	return result;
+}
+
+DWORD KRicohMTP::TakePicture()
+{
+	std::wstring new_object_id;
+
+	return TakePicture(new_object_id);
+}
+
+DWORD KRicohMTP::TakePicture(__out std::wstring& new_object_id, __in DWORD timeout_ms)
+{
+	LARGE_INTEGER start;
+
+	new_object_id.clear();
+	QueryPerformanceCounter(&start);
+
+	DWORD result = TriggerCapture();
+	if (result == PTP_RESPONSE_OK)
+		WaitForCapture(new_object_id, timeout_ms);
+
+	this->metrics.Record(METRIC_CAPTURE, MicrosecondsSince(start), result == PTP_RESPONSE_OK && !new_object_id.empty());
+
+	return result;
+}
+
+DWORD KRicohMTP::TriggerCapture()
+{
+	DWORD result = 0x2002;
+
+	TriggerCapture(&result);
+
+	return result;
+}
+
+HRESULT KRicohMTP::TriggerCapture(__out DWORD* result)
+{
+	KRicohScopedLock call(&this->call_lock);
+	ComPtr<IPortableDevice> device = GetDevice();
+
+	if (device == nullptr)
+	{
+		SetError(KRicohMTPError::THERE_IS_NO_RICOH);
+		return HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED);
+	}
+
+	// Forget objects reported before this capture
+	EnterCriticalSection(&this->event_lock);
+	this->last_added_object.clear();
+	ResetEvent(this->object_added_event);
+	LeaveCriticalSection(&this->event_lock);
+
+	HRESULT hr = SendCommand(device.Get(), 0x100E, result);
+	if (hr != S_OK)
+	{
+		// ERROR
+		SetError(KRicohMTPError::CANNOT_TAKE_PICTURE);
+	}
+
+	return hr;
+}
+
+bool KRicohMTP::WaitForCapture(__out std::wstring& new_object_id, __in DWORD timeout_ms, __in HANDLE cancel_event)
+{
+	ComPtr<IPortableDevice> device = GetDevice();
+
+	new_object_id.clear();
+
+	if (device == nullptr)
+	{
+		SetError(KRicohMTPError::THERE_IS_NO_RICOH);
+		return false;
+	}
+
+	// Only the lookup below takes call_lock, other calls go on while the camera shoots
+	EnterCriticalSection(&this->event_lock);
+	bool events = this->event_cookie != nullptr;
+	LeaveCriticalSection(&this->event_lock);
+
+	if (!events)
+	{
+		// No ObjectAdded notification will come, wait and look the picture up
+		if (cancel_event == nullptr)
+		{
+			Sleep(min(timeout_ms, CAPTURE_FALLBACK_WAIT));
+		}
+		else if (WaitForSingleObject(cancel_event, min(timeout_ms, CAPTURE_FALLBACK_WAIT)) == WAIT_OBJECT_0)
+		{
+			SetError(KRicohMTPError::CALL_CANCELLED);
+			return false;
+		}
+
+		KRicohScopedLock call(&this->call_lock);
+		return GetLastImageObjName(device.Get(), new_object_id);
+	}
+
+	// Wait for ObjectAdded instead of a fixed delay
+	HANDLE handles[2] = { this->object_added_event, cancel_event };
+	DWORD wait = WaitForMultipleObjects((cancel_event != nullptr) ? 2 : 1, handles, FALSE, timeout_ms);
+
+	if (wait == WAIT_OBJECT_0)
+	{
+		EnterCriticalSection(&this->event_lock);
+		new_object_id = this->last_added_object;
+		LeaveCriticalSection(&this->event_lock);
+	}
+	else if (wait == WAIT_OBJECT_0 + 1)
+	{
+		SetError(KRicohMTPError::CALL_CANCELLED);
+	}
+	else
+	{
+		printf("! The camera did not report a new object within %u ms\n", timeout_ms);
+		SetError(KRicohMTPError::CAPTURE_TIMEOUT);
+	}
+
+	return !new_object_id.empty();
+}
+
+DWORD KRicohMTP::InitiateOpenCapture()
+{
+	KRicohScopedLock call(&this->call_lock);
+	ComPtr<IPortableDevice> device = GetDevice();
+	DWORD result = 0x2002;
+	ULONG params[2] = { 0, PTP_FORMAT_ANY };
+
+	if (device == nullptr)
+	{
+		SetError(KRicohMTPError::THERE_IS_NO_RICOH);
+		return result;
+	}
+
+	EnterCriticalSection(&this->event_lock);
+	this->last_added_object.clear();
+	ResetEvent(this->object_added_event);
+	LeaveCriticalSection(&this->event_lock);
+
+	if (SendCommand(device.Get(), PTP_OC_INITIATE_OPEN_CAPTURE, &result, params, 2) != S_OK)
+	{
+		SetError(KRicohMTPError::CANNOT_TAKE_PICTURE);
+	}
+
+	return result;
+}
+
+DWORD KRicohMTP::TerminateOpenCapture()
+{
+	KRicohScopedLock call(&this->call_lock);
+	ComPtr<IPortableDevice> device = GetDevice();
+	DWORD result = 0x2002;
+	ULONG params[1] = { PTP_TRANSACTION_ANY };
+
+	if (device == nullptr)
+	{
+		SetError(KRicohMTPError::THERE_IS_NO_RICOH);
+		return result;
+	}
+
+	if (SendCommand(device.Get(), PTP_OC_TERMINATE_OPEN_CAPTURE, &result, params, 1) != S_OK)
+	{
+		SetError(KRicohMTPError::CANNOT_TAKE_PICTURE);
+	}
+
+	return result;
+}
+
+bool KRicohMTP::GetOneImageAndDelete(__out std::list<BYTE>& out_image)
+{
+	std::vector<BYTE> image;
+
+	if (!GetOneImageAndDelete(image))
+		return false;
+
+	out_image.assign(image.begin(), image.end());
+
+	return true;
+}
+
+bool KRicohMTP::GetOneImageAndDelete(__out std::vector<BYTE>& out_image)
+{
+	KRicohScopedLock call(&this->call_lock);
+	ComPtr<IPortableDevice> device = GetDevice();
+	std::wstring last_picture_id;
+
+	if (device == nullptr)
+	{
+		SetError(KRicohMTPError::THERE_IS_NO_RICOH);
+		return false;
+	}
+
+	// Get Image
+	if (!GetLastImageObjName(device.Get(), last_picture_id))
+	{
+		return false;
+	}
+
+	return GetImageAndDelete(last_picture_id, out_image);
+}
+
+bool KRicohMTP::GetImageAndDelete(__in const std::wstring& obj_id, __out std::vector<BYTE>& out_image)
+{
+	DeliverPreview(obj_id);
+
+	// Keep the picture on the device when the copy fails so it can be fetched again
+	if (!DownloadImage(obj_id, out_image))
+		return false;
+
+	DeleteImage(obj_id);
+
+	return true;
+}
+
+bool KRicohMTP::DownloadImage(__in const std::wstring& obj_id, __out std::vector<BYTE>& out_image)
+{
+	// Chunked downloads take call_lock per chunk, so a capture can go out between two chunks
+	if ((DWORD)this->partial_chunk_size > 0)
+		return DownloadImagePartial(obj_id, out_image);
+
+	KRicohScopedLock call(&this->call_lock);
+	ComPtr<IPortableDevice> device = GetDevice();
+
+	if (device == nullptr)
+	{
+		SetError(KRicohMTPError::THERE_IS_NO_RICOH);
+		return false;
+	}
+
+	if (obj_id.empty())
+	{
+		SetError(KRicohMTPError::CANNOT_GET_IMAGE);
+		return false;
+	}
+
+	WaitUntilReady(WAIT_BEFORE_TRANSFER);
+
+	// Image Copy
+	HRESULT hr = GetImage(device.Get(), out_image, obj_id.c_str());
+
+	// The picture stays on the camera, copy it again once the connection is back
+	if (FAILED(hr) && !IsConnected() && (device = GetDevice()) != nullptr)
+	{
+		printf("* Replaying the download of '%ws' after reconnect\n", obj_id.c_str());
+		WaitUntilReady(WAIT_BEFORE_TRANSFER);
+		hr = GetImage(device.Get(), out_image, obj_id.c_str());
+	}
+
+	if (FAILED(hr))
+	{
+		if (hr == HRESULT_FROM_WIN32(ERROR_NO_DATA))
+			SetError(KRicohMTPError::EMPTY_IMAGE);
+		else if (hr == HRESULT_FROM_WIN32(ERROR_HANDLE_EOF))
+			SetError(KRicohMTPError::SHORT_IMAGE);
+		else
+			SetError(KRicohMTPError::CANNOT_GET_IMAGE);
+		return false;
+	}
+
+	return true;
+}
+
+bool KRicohMTP::DownloadImage(__in const std::wstring& obj_id, __in KRicohBufferProvider get_buffer, __out DWORD* image_size)
+{
+	KRicohScopedLock call(&this->call_lock);
+	ComPtr<IPortableDevice> device = GetDevice();
+
+	*image_size = 0;
+
+	if (device == nullptr)
+	{
+		SetError(KRicohMTPError::THERE_IS_NO_RICOH);
+		return false;
+	}
+
+	if (obj_id.empty() || !get_buffer)
+	{
+		SetError(KRicohMTPError::CANNOT_GET_IMAGE);
+		return false;
+	}
+
+	WaitUntilReady(WAIT_BEFORE_TRANSFER);
+
+	// Always streamed, GetPartialObject chunks would need a buffer of their own
+	HRESULT hr = GetImage(device.Get(), get_buffer, 0, image_size, obj_id.c_str());
+	if (FAILED(hr))
+	{
+		if (hr == HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER))
+			SetError(KRicohMTPError::IMAGE_BUFFER_TOO_SMALL);
+		else if (hr == HRESULT_FROM_WIN32(ERROR_NO_DATA))
+			SetError(KRicohMTPError::EMPTY_IMAGE);
+		else if (hr == HRESULT_FROM_WIN32(ERROR_HANDLE_EOF))
+			SetError(KRicohMTPError::SHORT_IMAGE);
+		else
+			SetError(KRicohMTPError::CANNOT_GET_IMAGE);
+		return false;
+	}
+
+	return true;
+}
+
+bool KRicohMTP::DownloadImagePartial(__in const std::wstring& obj_id, __inout std::vector<BYTE>& out_image, __in bool resume)
+{
+	DWORD response = 0;
+	HRESULT hr = PartialTransfer(obj_id, out_image, resume, nullptr, &response);
+
+	if (FAILED(hr))
+	{
+		SetError((hr == HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED)) ?
+			KRicohMTPError::THERE_IS_NO_RICOH : KRicohMTPError::CANNOT_GET_IMAGE);
+		return false;
+	}
+
+	return true;
+}
+
+HRESULT KRicohMTP::PartialTransfer(__in const std::wstring& obj_id, __inout std::vector<BYTE>& out_image, __in bool resume,
+									__in HANDLE abort_event, __out DWORD* response)
+{
+	ComPtr<IPortableDevice>				device = GetDevice();
+	ComPtr<IPortableDeviceContent>		pContent;
+	ComPtr<IPortableDeviceProperties>	pProperties;
+	ULONGLONG							cbObjectSize = 0;
+	DWORD								handle = ObjectIDToHandle(obj_id.c_str());
+	DWORD								chunk_size = (DWORD)this->partial_chunk_size;
+	HRESULT								hr = S_OK;
+
+	*response = 0;
+
+	if (chunk_size == 0)
+		chunk_size = DEFAULT_PARTIAL_CHUNK;
+
+	if (device == nullptr)
+		return HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED);
+
+	if (handle == 0)
+		return E_INVALIDARG;
+
+	if (!resume)
+		out_image.clear();
+
+	EnterCriticalSection(&this->call_lock);
+
+	WaitUntilReady(WAIT_BEFORE_TRANSFER);
+
+	// The size tells when to stop, GetPartialObject only takes 32 bit offsets
+	hr = device->Content(&pContent);
+	if (SUCCEEDED(hr))
+	{
+		hr = pContent->Properties(&pProperties);
+	}
+
+	if (SUCCEEDED(hr))
+	{
+		hr = GetObjectSize(pProperties.Get(), obj_id.c_str(), cbObjectSize);
+	}
+
+	LeaveCriticalSection(&this->call_lock);
+
+	if (FAILED(hr) || cbObjectSize > MAXDWORD)
+	{
+		printf("! Failed to get the size of '%ws' for a partial download, hr = 0x%lx\n", obj_id.c_str(), hr);
+		return FAILED(hr) ? hr : HRESULT_FROM_WIN32(ERROR_FILE_TOO_LARGE);
+	}
+
+	// A prefix longer than the object cannot belong to it
+	if (out_image.size() > cbObjectSize)
+		out_image.clear();
+
+	// A resumed prefix is kept in place, a fresh download starts from a pooled buffer
+	bool allocated = true;
+	if (out_image.empty())
+	{
+		allocated = this->buffer_pool.Acquire((size_t)cbObjectSize, out_image);
+	}
+	else
+	{
+		try
+		{
+			out_image.reserve((size_t)cbObjectSize);
+		}
+		catch (const std::bad_alloc&)
+		{
+			allocated = false;
+		}
+	}
+
+	std::vector<BYTE> chunk;
+	if (!allocated || !this->buffer_pool.Acquire(min(chunk_size, (DWORD)cbObjectSize), chunk))
+		return E_OUTOFMEMORY;
+
+	DWORD retries = 0;
+	DWORD chunks = 0;
+	size_t resumed_at = out_image.size();
+	LARGE_INTEGER start;
+
+	QueryPerformanceCounter(&start);
+
+	while (out_image.size() < cbObjectSize)
+	{
+		DWORD offset = (DWORD)out_image.size();
+		DWORD result = 0;
+		ULONG params[3] = { handle, offset, min(chunk_size, (DWORD)cbObjectSize - offset) };
+
+		// The bytes so far stay in out_image for a resumed download
+		if (abort_event != nullptr && WaitForSingleObject(abort_event, 0) == WAIT_OBJECT_0)
+		{
+			printf("! GetPartialObject stopped at offset %u of %llu\n", offset, cbObjectSize);
+			this->metrics.Record(METRIC_TRANSFER, MicrosecondsSince(start), false, out_image.size() - resumed_at, chunks);
+			this->buffer_pool.Release(chunk);
+			return HRESULT_FROM_WIN32(ERROR_CANCELLED);
+		}
+
+		// Each chunk is one exchange, calls of other threads can go between two
+		EnterCriticalSection(&this->call_lock);
+		hr = SendCommandReadData(device.Get(), 0x101B, &result, chunk, params, 3);
+		LeaveCriticalSection(&this->call_lock);
+		*response = result;
+		chunks++;
+		if (hr == S_OK && !chunk.empty())
+		{
+			out_image.insert(out_image.end(), chunk.begin(), chunk.end());
+			retries = 0;
+			continue;
+		}
+
+		// Everything before offset is good, only this chunk is asked for again
+		if (++retries > PARTIAL_RETRY_LIMIT)
+		{
+			printf("! GetPartialObject gave up at offset %u of %llu, response code 0x%X, hr = 0x%lx\n",
+				offset, cbObjectSize, result, hr);
+			this->metrics.Record(METRIC_TRANSFER, MicrosecondsSince(start), false, out_image.size() - resumed_at, chunks);
+			this->buffer_pool.Release(chunk);
+			return FAILED(hr) ? hr : E_FAIL;
+		}
+
+		printf("! GetPartialObject failed at offset %u, retry %u of %u\n", offset, retries, PARTIAL_RETRY_LIMIT);
+
+		// After a reconnect the transfer continues on the new device
+		device = GetDevice();
+		if (device == nullptr)
+		{
+			this->metrics.Record(METRIC_TRANSFER, MicrosecondsSince(start), false, out_image.size() - resumed_at, chunks);
+			this->buffer_pool.Release(chunk);
+			return HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED);
+		}
+
+		EnterCriticalSection(&this->call_lock);
+		WaitUntilReady(WAIT_BEFORE_TRANSFER);
+		LeaveCriticalSection(&this->call_lock);
+	}
+
+	this->metrics.Record(METRIC_TRANSFER, MicrosecondsSince(start), true, out_image.size() - resumed_at, chunks);
+	this->buffer_pool.Release(chunk);
+	*response = PTP_RESPONSE_OK;
+
+	return S_OK;
+}
+
+void KRicohMTP::SetPartialTransfer(__in DWORD chunk_size)
+{
+	InterlockedExchange(&this->partial_chunk_size, (LONG)chunk_size);
+}
+
+void KRicohMTP::SetTransferChunkSize(__in DWORD chunk_size)
+{
+	InterlockedExchange(&this->transfer_chunk_size, (LONG)chunk_size);
+}
+
+DWORD KRicohMTP::GetTransferChunkSize()
+{
+	return (DWORD)this->last_transfer_chunk;
+}
+
+DWORD KRicohMTP::TransferChunkSize(__in DWORD cbOptimalTransferSize)
+{
+	DWORD chunk_size = (DWORD)this->transfer_chunk_size;
+
+	if (chunk_size == TRANSFER_CHUNK_DRIVER)
+		chunk_size = cbOptimalTransferSize;
+	else if (chunk_size == TRANSFER_CHUNK_AUTO)
+		chunk_size = this->chunk_tuner.NextChunkSize(cbOptimalTransferSize);
+
+	InterlockedExchange(&this->last_transfer_chunk, (LONG)chunk_size);
+
+	return chunk_size;
+}
+
+void KRicohMTP::RecordTransferChunk(__in DWORD chunk_size, __in DWORD bytes, __in ULONGLONG elapsed_us)
+{
+	if ((DWORD)this->transfer_chunk_size != TRANSFER_CHUNK_AUTO)
+		return;
+
+	if (this->chunk_tuner.Record(chunk_size, bytes, elapsed_us))
+	{
+		DWORD best_size = this->chunk_tuner.GetBestSize();
+
+		printf("* Transfer chunk size settled at %u bytes after %u transfers\n", best_size, this->chunk_tuner.GetTransferCount());
+		SaveTunedChunkSize(this->device_id, best_size);
+	}
+}
+
+bool KRicohMTP::GetThumbnail(__in const std::wstring& obj_id, __out std::vector<BYTE>& thumbnail)
+{
+	KRicohScopedLock call(&this->call_lock);
+	ComPtr<IPortableDevice> device = GetDevice();
+	DWORD handle = ObjectIDToHandle(obj_id.c_str());
+	DWORD result = 0;
+
+	thumbnail.clear();
+
+	if (device == nullptr)
+	{
+		SetError(KRicohMTPError::THERE_IS_NO_RICOH);
+		return false;
+	}
+
+	if (handle == 0)
+	{
+		SetError(KRicohMTPError::CANNOT_GET_THUMBNAIL);
+		return false;
+	}
+
+	WaitUntilReady(WAIT_BEFORE_TRANSFER);
+
+	ULONG params[1] = { handle };
+	if (SendCommandReadData(device.Get(), 0x100A, &result, thumbnail, params, 1) != S_OK || thumbnail.empty())
+	{
+		printf("! Failed to get the thumbnail of '%ws', response code 0x%lx\n", obj_id.c_str(), result);
+		SetError(KRicohMTPError::CANNOT_GET_THUMBNAIL);
+		return false;
+	}
+
+	return true;
+}
+
+void KRicohMTP::SetPreviewCallback(__in KRicohPreviewCallback on_preview)
+{
+	EnterCriticalSection(&this->event_lock);
+	this->on_preview = on_preview;
+	LeaveCriticalSection(&this->event_lock);
+}
+
+void KRicohMTP::DeliverPreview(__in const std::wstring& obj_id)
+{
+	KRicohPreviewCallback callback;
+	std::vector<BYTE> thumbnail;
+
+	EnterCriticalSection(&this->event_lock);
+	callback = this->on_preview;
+	LeaveCriticalSection(&this->event_lock);
+
+	// A missing thumbnail never holds back the picture itself
+	if (!callback || !GetThumbnail(obj_id, thumbnail))
+		return;
+
+	callback(obj_id, thumbnail);
+}
+
+bool KRicohMTP::DeleteImage(__in const std::wstring& obj_id)
+{
+	KRicohScopedLock call(&this->call_lock);
+	ComPtr<IPortableDevice> device = GetDevice();
+
+	if (device == nullptr)
+	{
+		SetError(KRicohMTPError::THERE_IS_NO_RICOH);
+		return false;
+	}
+
+	// Coalesce with other deletes and keep the camera free for the next capture
+	if (this->deferred_delete_batch > 0)
+	{
+		bool flush;
+
+		EnterCriticalSection(&this->event_lock);
+		this->pending_deletes.push_back(obj_id);
+		flush = (this->pending_deletes.size() >= this->deferred_delete_batch);
+		LeaveCriticalSection(&this->event_lock);
+
+		return flush ? FlushDeletes() : true;
+	}
+
+	WaitUntilReady(WAIT_BEFORE_DELETE);
+
+	// Delete Pictures
+	HRESULT hr = DeleteImage(device.Get(), obj_id.c_str());
+	if (FAILED(hr) && !IsConnected() && (device = GetDevice()) != nullptr)
+	{
+		WaitUntilReady(WAIT_BEFORE_DELETE);
+		hr = DeleteImage(device.Get(), obj_id.c_str());
+	}
+
+	if (hr != S_OK)
+	{
+		SetError(KRicohMTPError::CANNOT_DELETE_IMAGE);
+		return false;
+	}
+
+	return true;
+}
+
+bool KRicohMTP::GetOneImageAndDelete(__out BYTE* buffer, __in DWORD buffer_size, __out DWORD* image_size)
+{
+	KRicohScopedLock call(&this->call_lock);
+	ComPtr<IPortableDevice> device = GetDevice();
+	std::wstring last_picture_id;
+
+	if (device == nullptr)
+	{
+		SetError(KRicohMTPError::THERE_IS_NO_RICOH);
+		return false;
+	}
+
+	// Get Image
+	if (!GetLastImageObjName(device.Get(), last_picture_id))
+	{
+		return false;
+	}
+
+	DeliverPreview(last_picture_id);
+
+	WaitUntilReady(WAIT_BEFORE_TRANSFER);
+
+	// Image Copy
+	HRESULT hr = GetImage(device.Get(), buffer, buffer_size, image_size, last_picture_id.c_str());
+	if (FAILED(hr))
+	{
+		if (hr == HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER))
+			SetError(KRicohMTPError::IMAGE_BUFFER_TOO_SMALL);
+		else if (hr == HRESULT_FROM_WIN32(ERROR_NO_DATA))
+			SetError(KRicohMTPError::EMPTY_IMAGE);
+		else if (hr == HRESULT_FROM_WIN32(ERROR_HANDLE_EOF))
+			SetError(KRicohMTPError::SHORT_IMAGE);
+		else
+			SetError(KRicohMTPError::CANNOT_GET_IMAGE);
+		return false;
+	}
+
+	DeleteImage(last_picture_id);
+
+	return true;
+}
+
+bool KRicohMTP::GetLastImageSize(__out DWORD* image_size)
+{
+	KRicohScopedLock call(&this->call_lock);
+	ComPtr<IPortableDevice> device = GetDevice();
+	std::wstring last_picture_id;
+
+	if (device == nullptr)
+	{
+		SetError(KRicohMTPError::THERE_IS_NO_RICOH);
+		return false;
+	}
+
+	if (!GetLastImageObjName(device.Get(), last_picture_id))
+	{
+		return false;
+	}
+
+	return GetImageSize(last_picture_id, image_size);
+}
+
+bool KRicohMTP::GetImageSize(__in const std::wstring& obj_id, __out DWORD* image_size)
+{
+	KRicohScopedLock call(&this->call_lock);
+	ComPtr<IPortableDevice> device = GetDevice();
+	HRESULT								hr = S_OK;
+	ComPtr<IPortableDeviceContent>		pContent;
+	ComPtr<IPortableDeviceProperties>	pProperties;
+	ULONGLONG							cbObjectSize = 0;
+
+	if (device == nullptr)
+	{
+		SetError(KRicohMTPError::THERE_IS_NO_RICOH);
+		return false;
+	}
+
+	hr = device->Content(&pContent);
+	if (SUCCEEDED(hr))
+	{
+		hr = pContent->Properties(&pProperties);
+	}
+
+	if (SUCCEEDED(hr))
+	{
+		hr = GetObjectSize(pProperties.Get(), obj_id.c_str(), cbObjectSize);
+	}
+
+	if (FAILED(hr) || cbObjectSize > MAXDWORD)
+	{
+		SetError(KRicohMTPError::CANNOT_GET_IMAGE);
+		return false;
+	}
+
+	*image_size = (DWORD)cbObjectSize;
+
+	return true;
+}
+
+bool KRicohMTP::GetImageInfo(__in const std::wstring& obj_id, __out DWORD* image_size, __out std::wstring& file_name)
+{
+	KRicohScopedLock call(&this->call_lock);
+	ComPtr<IPortableDevice> device = GetDevice();
+	HRESULT								hr = S_OK;
+	ComPtr<IPortableDeviceContent>		pContent;
+	ComPtr<IPortableDeviceProperties>	pProperties;
+	ULONGLONG							cbObjectSize = 0;
+	CAtlStringW							name;
+
+	if (device == nullptr)
+	{
+		SetError(KRicohMTPError::THERE_IS_NO_RICOH);
+		return false;
+	}
+
+	hr = device->Content(&pContent);
+	if (SUCCEEDED(hr))
+	{
+		hr = pContent->Properties(&pProperties);
+	}
+
+	if (SUCCEEDED(hr))
+	{
+		hr = GetObjectSize(pProperties.Get(), obj_id.c_str(), cbObjectSize);
+	}
+
+	if (SUCCEEDED(hr))
+	{
+		hr = GetStringValue(pProperties.Get(), obj_id.c_str(), WPD_OBJECT_ORIGINAL_FILE_NAME, name);
+	}
+
+	if (FAILED(hr) || cbObjectSize > MAXDWORD)
+	{
+		SetError(KRicohMTPError::CANNOT_GET_IMAGE);
+		return false;
+	}
+
+	*image_size = (DWORD)cbObjectSize;
+	file_name = name.GetString();
+
+	return true;
+}
+
+DWORD KRicohMTP::EnumerateRicohDevices(__out std::vector<std::wstring>& pnp_device_ids)
+{
+	FindRicoh(pnp_device_ids);
+
+	return (DWORD)pnp_device_ids.size();
+}
+
+std::wstring KRicohMTP::GetDeviceID()
+{
+	KRicohScopedLock connection(&this->connection_lock);
+
+	return this->device_id;
+}
+
+int KRicohMTP::GetLastError()
+{
+	if (this->last_error_slot == TLS_OUT_OF_INDEXES)
+		return this->last_error;
+
+	// 0 is a thread that has not failed a call yet
+	ULONG_PTR value = (ULONG_PTR)TlsGetValue(this->last_error_slot);
+
+	return value == 0 ? KRicohMTPError::NO_RICOH_ERROR : (int)(value - 1);
+}
+
+void KRicohMTP::ClearLastError()
+{
+	SetError(KRicohMTPError::NO_RICOH_ERROR);
+}
+
+void KRicohMTP::SetError(__in enum KRicohMTPError error)
+{
+	if (this->last_error_slot == TLS_OUT_OF_INDEXES)
+		this->last_error = error;
+	else
+		TlsSetValue(this->last_error_slot, (LPVOID)(ULONG_PTR)(error + 1));
+}
+
+KRicohCallResult KRicohMTP::TakePicture(__out std::wstring& new_object_id, __in const KRicohCallOptions& options)
+{
+	LARGE_INTEGER start;
+
+	new_object_id.clear();
+	QueryPerformanceCounter(&start);
+
+	KRicohCallResult result = RunCall(options, CALL_PHASE_CAPTURE,
+		[&](HANDLE abort_event, DWORD timeout_ms, KRicohCallResult& attempt) -> bool
+	{
+		DWORD response = 0;
+		HRESULT hr = TriggerCapture(&response);
+
+		if (hr != S_OK)
+			return FailAttempt(attempt, hr, response, CALL_PHASE_CAPTURE, KRicohMTPError::CANNOT_TAKE_PICTURE);
+
+		attempt.response = response;
+		return true;
+	});
+
+	// Not retried, the camera may have taken the picture without reporting it. Outside
+	// RunCall, so other threads keep the camera while it shoots.
+	if (result.succeeded)
+	{
+		DWORD remaining_ms = INFINITE;
+
+		if (options.timeout_ms != INFINITE)
+			remaining_ms = (result.elapsed_ms < options.timeout_ms) ? options.timeout_ms - result.elapsed_ms : 0;
+
+		DWORD wait_ms = min(remaining_ms, (DWORD)DEFAULT_CAPTURE_TIMEOUT);
+		if (!WaitForCapture(new_object_id, wait_ms, options.cancel_event))
+		{
+			FailAttempt(result, HRESULT_FROM_WIN32(WAIT_TIMEOUT), result.response, CALL_PHASE_WAIT_OBJECT, KRicohMTPError::CAPTURE_TIMEOUT);
+			if (GetLastError() == KRicohMTPError::CALL_CANCELLED)
+				result.error = KRicohMTPError::CALL_CANCELLED;
+			else if (wait_ms == remaining_ms)
+				result.error = KRicohMTPError::DEADLINE_EXCEEDED;
+
+			result.succeeded = false;
+			result.transient = false;
+			SetError(result.error);
+		}
+
+		result.elapsed_ms = (DWORD)(MicrosecondsSince(start) / 1000);
+	}
+
+	this->metrics.Record(METRIC_CAPTURE, MicrosecondsSince(start), result.succeeded);
+
+	return result;
+}
+
+KRicohCallResult KRicohMTP::DownloadImage(__in const std::wstring& obj_id, __out std::vector<BYTE>& out_image,
+										__in const KRicohCallOptions& options)
 {
-	HRESULT hr = S_OK;
+	// Chunked downloads take call_lock per chunk, so other calls, and a cancel or a deadline,
+	// get in between two chunks instead of after the whole picture
+	bool partial = (DWORD)this->partial_chunk_size > 0;
 
-	// Enable the heap manager to terminate the process on heap error.
-	HeapSetInformation(nullptr, HeapEnableTerminationOnCorruption, nullptr, 0);
+	return RunCall(options, CALL_PHASE_TRANSFER, [&](HANDLE abort_event, DWORD timeout_ms, KRicohCallResult& attempt) -> bool
+	{
+		DWORD response = 0;
+		HRESULT hr = S_OK;
 
-	// Initialize COM for COINIT_MULTITHREADED
-	hr = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
-	if (hr != S_OK)
-		this->last_error = KRicohMTPError::COINITIALIZE_FAIL;
+		if (obj_id.empty())
+			return FailAttempt(attempt, E_INVALIDARG, 0, CALL_PHASE_TRANSFER, KRicohMTPError::CANNOT_GET_IMAGE);
+
+		if (partial)
+		{
+			// A retry continues where the last attempt stopped
+			hr = PartialTransfer(obj_id, out_image, attempt.attempts > 1, abort_event, &response);
+		}
+		else
+		{
+			ComPtr<IPortableDevice> device = GetDevice();
+
+			if (device == nullptr)
+				return FailAttempt(attempt, HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED), 0, CALL_PHASE_CONNECT, KRicohMTPError::THERE_IS_NO_RICOH);
+
+			WaitUntilReady(WAIT_BEFORE_TRANSFER);
+			hr = GetImage(device.Get(), out_image, obj_id.c_str(), abort_event);
+		}
+
+		if (FAILED(hr))
+			return FailAttempt(attempt, hr, response, CALL_PHASE_TRANSFER, KRicohMTPError::CANNOT_GET_IMAGE);
+
+		return true;
+	}, partial);
 }
 
-KRicohMTP::~KRicohMTP()
+KRicohCallResult KRicohMTP::DeleteImage(__in const std::wstring& obj_id, __in const KRicohCallOptions& options)
 {
-	if (this->device != nullptr)
+	return RunCall(options, CALL_PHASE_DELETE, [&](HANDLE abort_event, DWORD timeout_ms, KRicohCallResult& attempt) -> bool
 	{
-		device->Close();
-		//device->Release();
-	}
+		ComPtr<IPortableDevice> device = GetDevice();
+
+		if (device == nullptr)
+			return FailAttempt(attempt, HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED), 0, CALL_PHASE_CONNECT, KRicohMTPError::THERE_IS_NO_RICOH);
+
+		WaitUntilReady(WAIT_BEFORE_DELETE);
+
+		HRESULT hr = DeleteImage(device.Get(), obj_id.c_str());
+		if (hr != S_OK)
+			return FailAttempt(attempt, FAILED(hr) ? hr : E_FAIL, 0, CALL_PHASE_DELETE, KRicohMTPError::CANNOT_DELETE_IMAGE);
+
+		return true;
+	});
 }
 
-bool KRicohMTP::InitRicohDevice()
+KRicohCallResult KRicohMTP::ExecutePtpOperation(__inout KRicohPtpOperation& op, __in const KRicohCallOptions& options)
 {
-	GetRicohDevice(&this->device);
+	return RunCall(options, CALL_PHASE_OPERATION, [&](HANDLE abort_event, DWORD timeout_ms, KRicohCallResult& attempt) -> bool
+	{
+		ComPtr<IPortableDevice> device = GetDevice();
 
-	if (this->device == nullptr)
-		return false;
-	else
+		if (device == nullptr)
+			return FailAttempt(attempt, HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED), 0, CALL_PHASE_CONNECT, KRicohMTPError::THERE_IS_NO_RICOH);
+
+		HRESULT hr = ExecuteOperation(*GetTransport(device.Get()), op, NULL);
+		if (hr != S_OK)
+			return FailAttempt(attempt, hr, op.response, CALL_PHASE_OPERATION, KRicohMTPError::CANNOT_EXECUTE_OPERATION);
+
+		attempt.response = op.response;
 		return true;
+	});
 }
 
-DWORD KRicohMTP::OpenSession(__in ULONG storage)
+bool KRicohMTP::IsTransientFailure(__in HRESULT hr, __in DWORD response)
 {
-	DWORD result = 0x2002;
-	if (this->device == nullptr)
+	// The camera answered: busy and interrupted transactions pass, anything else is about the request
+	if (response != 0 && response != PTP_RESPONSE_OK)
 	{
-		this->last_error = KRicohMTPError::THERE_IS_NO_RICOH;
-		return result;
+		return response == PTP_RESPONSE_DEVICE_BUSY ||
+			response == PTP_RESPONSE_INCOMPLETE_TRANSFER ||
+			response == PTP_RESPONSE_TRANSACTION_CANCELLED;
 	}
 
-	ULONG params[1] = { storage };
-	if (SendCommand(this->device.Get(), 0x1002, &result, params, 1) != S_OK)
+	// No answer: USB timeouts and a camera being reopened by the reconnect thread
+	return IsDisconnectError(hr) ||
+		hr == HRESULT_FROM_WIN32(ERROR_SEM_TIMEOUT) ||
+		hr == HRESULT_FROM_WIN32(ERROR_TIMEOUT) ||
+		hr == HRESULT_FROM_WIN32(ERROR_BUSY) ||
+		hr == HRESULT_FROM_WIN32(ERROR_NOT_READY) ||
+		hr == HRESULT_FROM_WIN32(ERROR_IO_DEVICE);
+}
+
+KRicohCallResult KRicohMTP::RunCall(__in const KRicohCallOptions& options, __in KRicohCallPhase phase,
+									__in std::function<bool(HANDLE abort_event, DWORD timeout_ms, KRicohCallResult& result)> attempt,
+									__in bool locks_per_exchange)
+{
+	KRicohCallResult result;
+	KRicohCallAbort abort;
+	ULONGLONG start = GetTickCount64();
+	DWORD backoff_ms = CALL_BACKOFF_INITIAL;
+
+	result.succeeded = false;
+	result.error = KRicohMTPError::NO_RICOH_ERROR;
+	result.hr = S_OK;
+	result.response = 0;
+	result.phase = phase;
+	result.transient = false;
+	result.attempts = 0;
+
+	abort.abort_event = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+
+	for (;;)
 	{
-		// ERROR
-		this->last_error = KRicohMTPError::CANNOT_OPEN_SESSION;
+		// One attempt at a time on the camera. The watchdog only cancels the device with the
+		// lock held, so it never cancels a transfer of another thread; the wait for the lock
+		// counts against the deadline. An attempt that locks per exchange is stopped through
+		// abort_event between two exchanges instead, without the lock.
+		if (!locks_per_exchange)
+			EnterCriticalSection(&this->call_lock);
+
+		ULONGLONG elapsed_ms = GetTickCount64() - start;
+		DWORD remaining_ms = INFINITE;
+
+		if (options.timeout_ms != INFINITE)
+			remaining_ms = (elapsed_ms < options.timeout_ms) ? options.timeout_ms - (DWORD)elapsed_ms : 0;
+
+		if (remaining_ms == 0)
+		{
+			if (!locks_per_exchange)
+				LeaveCriticalSection(&this->call_lock);
+			result.error = KRicohMTPError::DEADLINE_EXCEEDED;
+			break;
+		}
+
+		// Fires once, at the deadline or when the caller cancels, whichever comes first
+		HANDLE watchdog = nullptr;
+		abort.device = nullptr;
+		if (!locks_per_exchange)
+			abort.device = GetDevice();
+		if (abort.abort_event != nullptr && (remaining_ms != INFINITE || options.cancel_event != nullptr))
+		{
+			HANDLE trigger = (options.cancel_event != nullptr) ? options.cancel_event : abort.abort_event;
+
+			if (!RegisterWaitForSingleObject(&watchdog, trigger, OnCallAborted, &abort, remaining_ms, WT_EXECUTEONLYONCE))
+				watchdog = nullptr;
+		}
+
+		result.attempts++;
+		result.hr = S_OK;
+		result.response = 0;
+		result.phase = phase;
+		result.error = KRicohMTPError::NO_RICOH_ERROR;
+
+		bool succeeded = attempt(abort.abort_event, remaining_ms, result);
+
+		// Waits for a callback that is already running
+		if (watchdog != nullptr)
+			UnregisterWaitEx(watchdog, INVALID_HANDLE_VALUE);
+
+		if (!locks_per_exchange)
+			LeaveCriticalSection(&this->call_lock);
+
+		if (succeeded)
+		{
+			result.succeeded = true;
+			break;
+		}
+
+		result.transient = IsTransientFailure(result.hr, result.response);
+
+		if (options.cancel_event != nullptr && WaitForSingleObject(options.cancel_event, 0) == WAIT_OBJECT_0)
+		{
+			result.error = KRicohMTPError::CALL_CANCELLED;
+			break;
+		}
+
+		if (abort.abort_event != nullptr && WaitForSingleObject(abort.abort_event, 0) == WAIT_OBJECT_0)
+		{
+			result.error = KRicohMTPError::DEADLINE_EXCEEDED;
+			break;
+		}
+
+		if (!result.transient || result.attempts >= options.max_attempts)
+			break;
+
+		// Back off, unless the deadline would pass while waiting
+		elapsed_ms = GetTickCount64() - start;
+		if (options.timeout_ms != INFINITE && elapsed_ms + backoff_ms >= options.timeout_ms)
+		{
+			result.error = KRicohMTPError::DEADLINE_EXCEEDED;
+			break;
+		}
+
+		printf("! Attempt %u of %u failed in phase %d, hr = 0x%lx, response code 0x%X, retrying in %u ms\n",
+			result.attempts, options.max_attempts, result.phase, result.hr, result.response, backoff_ms);
+
+		if (options.cancel_event != nullptr)
+		{
+			if (WaitForSingleObject(options.cancel_event, backoff_ms) == WAIT_OBJECT_0)
+			{
+				result.error = KRicohMTPError::CALL_CANCELLED;
+				break;
+			}
+		}
+		else
+		{
+			Sleep(backoff_ms);
+		}
+
+		backoff_ms = min(backoff_ms * 2, (DWORD)CALL_BACKOFF_MAX);
 	}
 
-	Sleep(500);
+	if (abort.abort_event != nullptr)
+		CloseHandle(abort.abort_event);
+
+	result.elapsed_ms = (DWORD)(GetTickCount64() - start);
+	if (!result.succeeded)
+		SetError(result.error);
 
 	return result;
 }
 
-DWORD KRicohMTP::CloseSession()
+bool KRicohMTP::DeleteImages(__in const std::vector<std::wstring>& obj_ids, __out std::vector<std::wstring>& failed_ids)
 {
-	DWORD result = 0x2002;
-	if (this->device == nullptr)
+	KRicohScopedLock call(&this->call_lock);
+	ComPtr<IPortableDevice> device = GetDevice();
+	failed_ids.clear();
+
+	if (device == nullptr)
 	{
-		this->last_error = KRicohMTPError::THERE_IS_NO_RICOH;
-		return result;
+		SetError(KRicohMTPError::THERE_IS_NO_RICOH);
+		failed_ids = obj_ids;
+		return false;
 	}
 
-	if (SendCommand(this->device.Get(), 0x1003, &result) != S_OK)
+	if (obj_ids.empty())
+		return true;
+
+	WaitUntilReady(WAIT_BEFORE_DELETE);
+
+	HRESULT hr = DeleteImages(device.Get(), obj_ids, &failed_ids);
+	if (FAILED(hr) && !IsConnected() && (device = GetDevice()) != nullptr)
 	{
-		// ERROR
-		this->last_error = KRicohMTPError::CANNOT_CLOSE_SESSION;
+		WaitUntilReady(WAIT_BEFORE_DELETE);
+		hr = DeleteImages(device.Get(), obj_ids, &failed_ids);
+	}
+
+	if (hr != S_OK)
+	{
+		SetError(KRicohMTPError::CANNOT_DELETE_IMAGE);
+		return false;
 	}
 
-	Sleep(500);
+	return true;
+}
 
-	return result;
+void KRicohMTP::SetDeferredDelete(__in DWORD batch_size)
+{
+	EnterCriticalSection(&this->event_lock);
+	this->deferred_delete_batch = batch_size;
+	LeaveCriticalSection(&this->event_lock);
+
+	// Turning the mode off must not strand queued deletes
+	if (batch_size == 0)
+		FlushDeletes();
 }
 
-DWORD KRicohMTP::TakePicture()
+bool KRicohMTP::FlushDeletes()
 {
-	DWORD result = 0x2002;
-	if (this->device == nullptr)
+	std::vector<std::wstring> obj_ids;
+	std::vector<std::wstring> failed_ids;
+
+	EnterCriticalSection(&this->event_lock);
+	obj_ids.swap(this->pending_deletes);
+	LeaveCriticalSection(&this->event_lock);
+
+	if (obj_ids.empty())
+		return true;
+
+	bool deleted = DeleteImages(obj_ids, failed_ids);
+
+	EnterCriticalSection(&this->event_lock);
+	this->failed_deletes.insert(this->failed_deletes.end(), failed_ids.begin(), failed_ids.end());
+	LeaveCriticalSection(&this->event_lock);
+
+	return deleted;
+}
+
+void KRicohMTP::GetFailedDeletes(__out std::vector<std::wstring>& failed_ids)
+{
+	failed_ids.clear();
+
+	EnterCriticalSection(&this->event_lock);
+	failed_ids.swap(this->failed_deletes);
+	LeaveCriticalSection(&this->event_lock);
+}
+
+bool KRicohMTP::GetImageList(__out std::vector<std::wstring>& obj_ids, __in DWORD newer_than)
+{
+	KRicohScopedLock call(&this->call_lock);
+	ComPtr<IPortableDevice> device = GetDevice();
+	obj_ids.clear();
+
+	if (device == nullptr)
 	{
-		this->last_error = KRicohMTPError::THERE_IS_NO_RICOH;
-		return result;
+		SetError(KRicohMTPError::THERE_IS_NO_RICOH);
+		return false;
 	}
 
-	if (SendCommand(this->device.Get(), 0x100E, &result) != S_OK)
+	if (!EnsureObjectIndex(device.Get()))
+		return false;
+
+	EnterCriticalSection(&this->event_lock);
+	for (std::map<DWORD, std::wstring>::const_iterator it = this->object_index.upper_bound(newer_than);
+		it != this->object_index.end(); it++)
 	{
-		// ERROR
-		this->last_error = KRicohMTPError::CANNOT_TAKE_PICTURE;
+		obj_ids.push_back(it->second);
 	}
-	
-	Sleep(10000);
+	LeaveCriticalSection(&this->event_lock);
 
-	return result;
+	return true;
 }
 
-bool KRicohMTP::GetOneImageAndDelete(__out std::list<BYTE>& out_image)
+bool KRicohMTP::GetDevicePropValue(__in WORD prop_code, __out std::vector<BYTE>& value)
 {
-	std::wstring last_picture_id;
+	uint32_t param = prop_code;
+	KRicohPtpOperation op(*KRicohPtpFindOp(PTP_OC_GET_DEVICE_PROP_VALUE), &param, 1);
+
+	value.clear();
+
+	if (!ExecutePtpOperation(op))
+		return false;
+
+	value.swap(op.data);
+	return true;
+}
+
+bool KRicohMTP::SetDevicePropValue(__in WORD prop_code, __in const std::vector<BYTE>& value)
+{
+	uint32_t param = prop_code;
+	KRicohPtpOperation op(*KRicohPtpFindOp(PTP_OC_SET_DEVICE_PROP_VALUE), &param, 1);
+
+	op.data = value;
 
-	if (this->device == nullptr)
+	return ExecutePtpOperation(op);
+}
+
+bool KRicohMTP::ExecutePtpOperation(__inout KRicohPtpOperation& op)
+{
+	KRicohScopedLock call(&this->call_lock);
+	ComPtr<IPortableDevice> device = GetDevice();
+
+	if (device == nullptr)
 	{
-		this->last_error = KRicohMTPError::THERE_IS_NO_RICOH;
+		SetError(KRicohMTPError::THERE_IS_NO_RICOH);
 		return false;
 	}
 
-	// Get Image
-	if (!GetLastImageObjName(this->device.Get(), last_picture_id))
+	if (ExecuteOperation(*GetTransport(device.Get()), op, NULL) != S_OK)
 	{
+		printf("! %s failed, response code 0x%X\n", KRicohPtpOpName(op.code), op.response);
+		SetError(KRicohMTPError::CANNOT_EXECUTE_OPERATION);
 		return false;
 	}
 
-	Sleep(500);
+	return true;
+}
 
-	// Image Copy
-	GetImage(this->device.Get(), out_image, last_picture_id.c_str());
+bool KRicohMTP::GetObjectHandles(__out std::vector<DWORD>& handles, __in ULONG storage, __in WORD format, __in ULONG parent)
+{
+	KRicohScopedLock call(&this->call_lock);
+	ComPtr<IPortableDevice> device = GetDevice();
+	DWORD result = 0x2002;
+	std::vector<BYTE> data;
+	ULONG params[3] = { storage, format, parent };
 
-	Sleep(500);
+	handles.clear();
 
-	// Delete Pictures
-	DeleteImage(this->device.Get(), last_picture_id.c_str());
+	if (device == nullptr)
+	{
+		SetError(KRicohMTPError::THERE_IS_NO_RICOH);
+		return false;
+	}
+
+	if (SendCommandReadData(device.Get(), 0x1007, &result, data, params, 3) != S_OK)
+	{
+		printf("! GetObjectHandles failed, response code 0x%X\n", result);
+		SetError(KRicohMTPError::CANNOT_GET_OBJECT_HANDLES);
+		return false;
+	}
+
+	// The data phase is a PTP array: UINT32 element count followed by the UINT32 handles
+	DWORD count = 0;
+	if (data.size() >= sizeof(DWORD))
+		CopyMemory(&count, &data[0], sizeof(DWORD));
+
+	if (data.size() < sizeof(DWORD) || (data.size() - sizeof(DWORD)) / sizeof(DWORD) < count)
+	{
+		printf("! GetObjectHandles returned a malformed array (%u bytes)\n", (DWORD)data.size());
+		SetError(KRicohMTPError::CANNOT_GET_OBJECT_HANDLES);
+		return false;
+	}
+
+	handles.resize(count);
+	if (count > 0)
+		CopyMemory(&handles[0], &data[sizeof(DWORD)], count * sizeof(DWORD));
 
 	return true;
 }
 
-int KRicohMTP::GetLastError()
+bool KRicohMTP::GetLastImageHandle(__out DWORD& handle, __in ULONG storage)
+{
+	std::vector<DWORD> handles;
+
+	handle = 0;
+
+	if (!GetObjectHandles(handles, storage, PTP_FORMAT_EXIF_JPEG))
+		return false;
+
+	// The newest picture has the highest handle
+	for (size_t i = 0; i < handles.size(); i++)
+	{
+		if (handles[i] > handle)
+			handle = handles[i];
+	}
+
+	return handle != 0;
+}
+
+std::wstring KRicohMTP::HandleToObjectID(__in DWORD handle)
+{
+	WCHAR obj_id[16] = { 0 };
+
+	// MTP object ids are "o" followed by the object handle in hex
+	StringCchPrintfW(obj_id, ARRAYSIZE(obj_id), L"o%X", handle);
+
+	return std::wstring(obj_id);
+}
+
+void KRicohMTP::RefreshObjectIndex()
+{
+	EnterCriticalSection(&this->event_lock);
+	this->object_index_state = INDEX_INVALID;
+	this->object_index.clear();
+	LeaveCriticalSection(&this->event_lock);
+}
+
+void KRicohMTP::SetReadyBudget(__in DWORD budget_ms)
+{
+	KRicohScopedLock call(&this->call_lock);
+	this->ready_budget_ms = budget_ms;
+}
+
+KRicohWaitStats KRicohMTP::GetWaitStats(__in KRicohWaitStep step)
+{
+	KRicohWaitStats stats = { 0 };
+
+	EnterCriticalSection(&this->event_lock);
+	if (step >= 0 && step < WAIT_STEP_COUNT)
+		stats = this->wait_stats[step];
+	LeaveCriticalSection(&this->event_lock);
+
+	return stats;
+}
+
+bool KRicohMTP::IsConnected()
+{
+	return this->connected != 0;
+}
+
+void KRicohMTP::SetReconnectTimeout(__in DWORD timeout_ms)
+{
+	KRicohScopedLock call(&this->call_lock);
+	this->reconnect_timeout_ms = timeout_ms;
+}
+
+DWORD KRicohMTP::GetReconnectCount()
+{
+	return (DWORD)this->reconnect_count;
+}
+
+KRicohMetricsSnapshot KRicohMTP::GetMetrics()
+{
+	KRicohMetricsSnapshot snapshot;
+
+	this->metrics.Snapshot(snapshot);
+
+	return snapshot;
+}
+
+void KRicohMTP::ResetMetrics()
+{
+	this->metrics.Reset();
+}
+
+void KRicohMTP::ReleaseImage(__inout std::vector<BYTE>& image)
+{
+	this->buffer_pool.Release(image);
+}
+
+KRicohPoolStats KRicohMTP::GetBufferPoolStats()
+{
+	return this->buffer_pool.GetStats();
+}
+
+void KRicohMTP::SetBufferPoolLimit(__in ULONGLONG max_bytes)
+{
+	this->buffer_pool.SetLimit(max_bytes);
+}
+
+void KRicohMTP::ResetWaitStats()
 {
-	return this->last_error;
+	EnterCriticalSection(&this->event_lock);
+	ZeroMemory(this->wait_stats, sizeof(this->wait_stats));
+	LeaveCriticalSection(&this->event_lock);
 }
 
 // Private Methods
@@ -138,6 +1692,17 @@ bool KRicohMTP::IsRicoh(_In_ IPortableDeviceManager* deviceManager,
 	DWORD descriptionLength = 0;
 	bool is_ricoh = false;
 
+	// The USB ids are part of the PnP ID, so most devices are settled without
+	// asking the driver for the description
+	std::wstring pnp_id(pnpDeviceID);
+	for (size_t i = 0; i < pnp_id.size(); i++)
+		pnp_id[i] = towlower(pnp_id[i]);
+
+	if (pnp_id.find(RICOH_USB_VID_PID) != std::wstring::npos)
+		return true;
+	if (pnp_id.find(L"vid_") != std::wstring::npos && pnp_id.find(RICOH_USB_VID) == std::wstring::npos)
+		return false;
+
 	// 1) Pass nullptr as the PWSTR return string parameter to get the total number
 	// of characters to allocate for the string value.
 	HRESULT hr = deviceManager->GetDeviceDescription(pnpDeviceID, nullptr, &descriptionLength);
@@ -195,11 +1760,11 @@ bool KRicohMTP::IsRicoh(_In_ IPortableDeviceManager* deviceManager,
 	}
 }
 
-DWORD KRicohMTP::FindRicoh(__out int& ricoh_index)
+DWORD KRicohMTP::FindRicoh(__out std::vector<std::wstring>& ricoh_ids)
 {
 	DWORD                           pnpDeviceIDCount = 0;
 	ComPtr<IPortableDeviceManager>  deviceManager;
-	ricoh_index = -1;
+	ricoh_ids.clear();
 
 	// CoCreate the IPortableDeviceManager interface to enumerate
 	// portable devices and to get information about them.
@@ -245,12 +1810,11 @@ DWORD KRicohMTP::FindRicoh(__out int& ricoh_index)
 			if (SUCCEEDED(hr))
 			{
 				_Analysis_assume_(retrievedDeviceIDCount <= pnpDeviceIDCount);
-				// For each device found, display the devices friendly name,
-				// manufacturer, and description strings.
+				// Keep the PnP ID of every RICOH THETA S found
 				for (DWORD index = 0; index < retrievedDeviceIDCount; index++)
 				{
 					if (IsRicoh(deviceManager.Get(), pnpDeviceIDs[index]) == true)
-						ricoh_index = index;
+						ricoh_ids.push_back(std::wstring(pnpDeviceIDs[index]));
 				}
 			}
 			else
@@ -278,7 +1842,75 @@ DWORD KRicohMTP::FindRicoh(__out int& ricoh_index)
 		}
 	}
 
-	return pnpDeviceIDCount;
+	return pnpDeviceIDCount;
+}
+
+bool KRicohMTP::LoadCachedDeviceID(__out std::wstring& pnp_device_id)
+{
+	WCHAR buffer[MAX_PATH] = { 0 };
+	DWORD size = sizeof(buffer);
+
+	pnp_device_id.clear();
+
+	LSTATUS status = RegGetValueW(HKEY_CURRENT_USER, RICOH_REGISTRY_KEY, RICOH_REGISTRY_LAST_DEVICE,
+		RRF_RT_REG_SZ, nullptr, buffer, &size);
+	if (status != ERROR_SUCCESS)
+		return false;
+
+	pnp_device_id = buffer;
+	return !pnp_device_id.empty();
+}
+
+void KRicohMTP::SaveCachedDeviceID(__in const std::wstring& pnp_device_id)
+{
+	HKEY key = nullptr;
+
+	LSTATUS status = RegCreateKeyExW(HKEY_CURRENT_USER, RICOH_REGISTRY_KEY, 0, nullptr,
+		REG_OPTION_NON_VOLATILE, KEY_WRITE, nullptr, &key, nullptr);
+	if (status != ERROR_SUCCESS)
+	{
+		wprintf(L"! Failed to open the registry key to cache the device ID, status = %ld\n", status);
+		return;
+	}
+
+	status = RegSetValueExW(key, RICOH_REGISTRY_LAST_DEVICE, 0, REG_SZ,
+		(const BYTE*)pnp_device_id.c_str(), (DWORD)((pnp_device_id.size() + 1) * sizeof(WCHAR)));
+	if (status != ERROR_SUCCESS)
+		wprintf(L"! Failed to cache the device ID, status = %ld\n", status);
+
+	RegCloseKey(key);
+}
+
+DWORD KRicohMTP::LoadTunedChunkSize(__in const std::wstring& pnp_device_id)
+{
+	DWORD chunk_size = 0;
+	DWORD size = sizeof(chunk_size);
+
+	LSTATUS status = RegGetValueW(HKEY_CURRENT_USER, RICOH_REGISTRY_CHUNK_SIZES, pnp_device_id.c_str(),
+		RRF_RT_REG_DWORD, nullptr, &chunk_size, &size);
+	if (status != ERROR_SUCCESS)
+		return 0;
+
+	return chunk_size;
+}
+
+void KRicohMTP::SaveTunedChunkSize(__in const std::wstring& pnp_device_id, __in DWORD chunk_size)
+{
+	HKEY key = nullptr;
+
+	LSTATUS status = RegCreateKeyExW(HKEY_CURRENT_USER, RICOH_REGISTRY_CHUNK_SIZES, 0, nullptr,
+		REG_OPTION_NON_VOLATILE, KEY_WRITE, nullptr, &key, nullptr);
+	if (status != ERROR_SUCCESS)
+	{
+		wprintf(L"! Failed to open the registry key to remember the chunk size, status = %ld\n", status);
+		return;
+	}
+
+	status = RegSetValueExW(key, pnp_device_id.c_str(), 0, REG_DWORD, (const BYTE*)&chunk_size, sizeof(chunk_size));
+	if (status != ERROR_SUCCESS)
+		wprintf(L"! Failed to remember the chunk size, status = %ld\n", status);
+
+	RegCloseKey(key);
 }
 
 void KRicohMTP::GetClientInformation(_Outptr_result_maybenull_ IPortableDeviceValues** clientInformation)
@@ -335,18 +1967,11 @@ void KRicohMTP::GetClientInformation(_Outptr_result_maybenull_ IPortableDeviceVa
 	}
 }
 
-void KRicohMTP::GetRicohDevice(_Outptr_result_maybenull_ IPortableDevice** device)
+void KRicohMTP::GetRicohDevice(_Outptr_result_maybenull_ IPortableDevice** device, __in PCWSTR pnpDeviceID)
 {
 	*device = nullptr;
 
 	HRESULT							hr = S_OK;
-	//UINT   	                        currentDeviceIndex = 0;
-	DWORD  	                        pnpDeviceIDCount = 0;
-	PWSTR* 	                        pnpDeviceIDs = nullptr;
-	WCHAR  	                        selection[SELECTION_BUFFER_SIZE] = { 0 };
-	int	   							ricoh_index = -1;
-
-	ComPtr<IPortableDeviceManager>	deviceManager;
 	ComPtr<IPortableDeviceValues> 	clientInformation;
 
 	// Fill out information about your application, so the device knows
@@ -354,103 +1979,41 @@ void KRicohMTP::GetRicohDevice(_Outptr_result_maybenull_ IPortableDevice** devic
 
 	GetClientInformation(&clientInformation);
 
-	// Enumerate and display all devices.
-	pnpDeviceIDCount = FindRicoh(ricoh_index);
-
-	if (ricoh_index < 0)
-	{
-		return;
-	}
-
-	// CoCreate the IPortableDeviceManager interface to enumerate
-	// portable devices and to get information about them.
-	hr = CoCreateInstance(CLSID_PortableDeviceManager,
+	// CoCreate the IPortableDevice interface and call Open() with
+	// the chosen PnPDeviceID string.
+	hr = CoCreateInstance(CLSID_PortableDeviceFTM,
 		nullptr,
 		CLSCTX_INPROC_SERVER,
-		IID_PPV_ARGS(&deviceManager));
-	if (FAILED(hr))
+		IID_PPV_ARGS(device));
+	if (SUCCEEDED(hr))
 	{
-		wprintf(L"! Failed to CoCreateInstance CLSID_PortableDeviceManager, hr = 0x%lx\n", hr);
-	}
+		hr = (*device)->Open(pnpDeviceID, clientInformation.Get());
 
-	// Allocate an array to hold the PnPDeviceID strings returned from
-	// the IPortableDeviceManager::GetDevices method
-	if (SUCCEEDED(hr) && (pnpDeviceIDCount > 0))
-	{
-		pnpDeviceIDs = new (std::nothrow)PWSTR[pnpDeviceIDCount];
-		if (pnpDeviceIDs != nullptr)
+		if (hr == E_ACCESSDENIED)
 		{
-			ZeroMemory(pnpDeviceIDs, pnpDeviceIDCount * sizeof(PWSTR));
-			DWORD retrievedDeviceIDCount = pnpDeviceIDCount;
-			hr = deviceManager->GetDevices(pnpDeviceIDs, &retrievedDeviceIDCount);
-			if (SUCCEEDED(hr))
-			{
-				_Analysis_assume_(retrievedDeviceIDCount <= pnpDeviceIDCount);
-				// CoCreate the IPortableDevice interface and call Open() with
-				// the chosen PnPDeviceID string.
-				hr = CoCreateInstance(CLSID_PortableDeviceFTM,
-					nullptr,
-					CLSCTX_INPROC_SERVER,
-					IID_PPV_ARGS(device));
-				if (SUCCEEDED(hr))
-				{
-					hr = (*device)->Open(pnpDeviceIDs[ricoh_index], clientInformation.Get());
-
-					if (hr == E_ACCESSDENIED)
-					{
-						wprintf(L"Failed to Open the device for Read Write access, will open it for Read-only access instead\n");
-						clientInformation->SetUnsignedIntegerValue(WPD_CLIENT_DESIRED_ACCESS, GENERIC_READ);
-						hr = (*device)->Open(pnpDeviceIDs[ricoh_index], clientInformation.Get());
-					}
-
-					if (FAILED(hr))
-					{
-						wprintf(L"! Failed to Open the device, hr = 0x%lx\n", hr);
-						// Release the IPortableDevice interface, because we cannot proceed
-						// with an unopen device.
-						(*device)->Release();
-						*device = nullptr;
-					}
-				}
-				else
-				{
-					wprintf(L"! Failed to CoCreateInstance CLSID_PortableDeviceFTM, hr = 0x%lx\n", hr);
-				}
-			}
-			else
-			{
-				wprintf(L"! Failed to get the device list from the system, hr = 0x%lx\n", hr);
-			}
-
-			// Free all returned PnPDeviceID strings by using CoTaskMemFree.
-			// NOTE: CoTaskMemFree can handle nullptr pointers, so no nullptr
-			//       check is needed.
-			for (DWORD index = 0; index < pnpDeviceIDCount; index++)
-			{
-				CoTaskMemFree(pnpDeviceIDs[index]);
-				pnpDeviceIDs[index] = nullptr;
-			}
-
-			// Delete the array of PWSTR pointers
-			delete[] pnpDeviceIDs;
-			pnpDeviceIDs = nullptr;
+			wprintf(L"Failed to Open the device for Read Write access, will open it for Read-only access instead\n");
+			clientInformation->SetUnsignedIntegerValue(WPD_CLIENT_DESIRED_ACCESS, GENERIC_READ);
+			hr = (*device)->Open(pnpDeviceID, clientInformation.Get());
 		}
-		else
+
+		if (FAILED(hr))
 		{
-			wprintf(L"! Failed to allocate memory for PWSTR array\n");
+			wprintf(L"! Failed to Open the device, hr = 0x%lx\n", hr);
+			// Release the IPortableDevice interface, because we cannot proceed
+			// with an unopen device.
+			(*device)->Release();
+			*device = nullptr;
 		}
 	}
-
-	// If no devices were found on the system, just exit this function.
+	else
+	{
+		wprintf(L"! Failed to CoCreateInstance CLSID_PortableDeviceFTM, hr = 0x%lx\n", hr);
+	}
 }
 
 bool KRicohMTP::GetLastImageObjName(__in IPortableDevice* device, __out std::wstring& obj_name)
 {
-	HRESULT                         hr = S_OK;
-	ComPtr<IPortableDeviceContent> pContent;
-	std::list<std::wstring> contentIDs;
-	std::list<std::string> pictureIDs;
-	PCWSTR picture_pre = L"o64";
+	obj_name.clear();
 
 	if (device == NULL)
 	{
@@ -458,57 +2021,116 @@ bool KRicohMTP::GetLastImageObjName(__in IPortableDevice* device, __out std::wst
 		return false;
 	}
 
+	if (!EnsureObjectIndex(device))
+		return false;
+
+	// The newest picture has the highest handle
+	EnterCriticalSection(&this->event_lock);
+	if (!this->object_index.empty())
+		obj_name = this->object_index.rbegin()->second;
+	LeaveCriticalSection(&this->event_lock);
+
+	return !obj_name.empty();
+}
+
+DWORD KRicohMTP::ObjectIDToHandle(__in PCWSTR obj_id)
+{
+	// MTP object ids are "o" followed by the object handle in hex
+	if (obj_id == nullptr || obj_id[0] != L'o')
+		return 0;
+
+	return wcstoul(obj_id + 1, nullptr, 16);
+}
+
+bool KRicohMTP::EnsureObjectIndex(__in IPortableDevice* device)
+{
+	bool valid;
+
+	// Without device events the index cannot follow the camera, so walk it every time
+	EnterCriticalSection(&this->event_lock);
+	valid = (this->object_index_state == INDEX_VALID && this->event_cookie != nullptr);
+	LeaveCriticalSection(&this->event_lock);
+
+	if (valid)
+		return true;
+
+	return BuildObjectIndex(device);
+}
+
+bool KRicohMTP::BuildObjectIndex(__in IPortableDevice* device)
+{
+	HRESULT                         hr = S_OK;
+	ComPtr<IPortableDeviceContent>	pContent;
+	std::list<std::wstring>			contentIDs;
+	LARGE_INTEGER					start;
+
+	QueryPerformanceCounter(&start);
+
 	// Get an IPortableDeviceContent interface from the IPortableDevice interface to
 	// access the content-specific methods.
 	hr = device->Content(&pContent);
 	if (FAILED(hr))
 	{
 		printf("! Failed to get IPortableDeviceContent from IPortableDevice, hr = 0x%lx\n", hr);
+		this->metrics.Record(METRIC_ENUMERATE, MicrosecondsSince(start), false);
 		return false;
 	}
 
+	// Events arriving during the walk are applied to the index as it is filled
+	EnterCriticalSection(&this->event_lock);
+	this->object_index_state = INDEX_BUILDING;
+	this->object_index.clear();
+	this->object_index_removed.clear();
+	LeaveCriticalSection(&this->event_lock);
+
 	// Enumerate content starting from the "DEVICE" object.
-	if (SUCCEEDED(hr))
-	{
-		printf("\n");
-		RecursiveEnumerate(WPD_DEVICE_OBJECT_ID, pContent.Get(), contentIDs);
-	}
+	RecursiveEnumerate(WPD_DEVICE_OBJECT_ID, pContent.Get(), contentIDs);
 
-	wstring pre_wstr(picture_pre);
-	std::string pre_str(pre_wstr.begin(), pre_wstr.end());
+	EnterCriticalSection(&this->event_lock);
 	for (std::list<std::wstring>::iterator it = contentIDs.begin(); it != contentIDs.end(); it++)
 	{
-		std::string content_str(it->begin(), it->end());
 		// if the content is an image
-		if (content_str.find(pre_str) != std::string::npos)
-			pictureIDs.push_back(content_str);
+		if (it->find(PICTURE_ID_PREFIX) == std::wstring::npos)
+			continue;
+
+		DWORD handle = ObjectIDToHandle(it->c_str());
+		if (handle != 0 && this->object_index_removed.count(handle) == 0)
+			this->object_index.insert(std::make_pair(handle, *it));
 	}
+	this->object_index_removed.clear();
+	this->object_index_state = INDEX_VALID;
+	LeaveCriticalSection(&this->event_lock);
 
-	// Get Last Picture
-	int index = -1;
-	std::string last_picture_id;
-	for (std::list<std::string>::iterator it = pictureIDs.begin(); it != pictureIDs.end(); it++)
-	{
-		char buffer[4];
-		std::string id_str = "0x";
-		int id;
-		it->copy(buffer, 4, 3);
-		id_str += buffer;
-		id = std::stol(id_str, nullptr, 16);
+	this->metrics.Record(METRIC_ENUMERATE, MicrosecondsSince(start), true, 0, contentIDs.size());
 
-		if (index < id && id != 0)
-		{
-			index = id;
-			last_picture_id = *it;
-		}
-	}
+	return true;
+}
 
-	obj_name = std::wstring(last_picture_id.begin(), last_picture_id.end());
+void KRicohMTP::IndexObjectAdded(__in PCWSTR obj_id)
+{
+	DWORD handle = ObjectIDToHandle(obj_id);
 
-	if (index > 0)
-		return true;
-	else
-		return false;
+	if (handle == 0 || wcsstr(obj_id, PICTURE_ID_PREFIX) == nullptr)
+		return;
+
+	EnterCriticalSection(&this->event_lock);
+	if (this->object_index_state != INDEX_INVALID)
+		this->object_index[handle] = obj_id;
+	LeaveCriticalSection(&this->event_lock);
+}
+
+void KRicohMTP::IndexObjectRemoved(__in PCWSTR obj_id)
+{
+	DWORD handle = ObjectIDToHandle(obj_id);
+
+	if (handle == 0)
+		return;
+
+	EnterCriticalSection(&this->event_lock);
+	if (this->object_index_state == INDEX_BUILDING)
+		this->object_index_removed.insert(handle);
+	this->object_index.erase(handle);
+	LeaveCriticalSection(&this->event_lock);
 }
 
 HRESULT KRicohMTP::GetStringValue(__in IPortableDeviceProperties* pProperties,
@@ -575,96 +2197,65 @@ HRESULT KRicohMTP::GetStringValue(__in IPortableDeviceProperties* pProperties,
 	return hr;
 }
 
-HRESULT KRicohMTP::StreamCopy(__out std::list<BYTE>& out_image, __in IStream* pSourceStream, __in DWORD cbTransferSize, __in DWORD* pcbWritten)
+HRESULT KRicohMTP::GetObjectSize(__in IPortableDeviceProperties* pProperties,
+								__in PCWSTR                     pszObjectID,
+								__out ULONGLONG&                ullObjectSize)
 {
-	HRESULT hr = S_OK;
-
-	// Allocate a temporary buffer (of Optimal transfer size) for the read results to
-	// be written to.
-	BYTE*   pObjectData = new (std::nothrow) BYTE[cbTransferSize];
-	if (pObjectData != NULL)
-	{
-		DWORD cbTotalBytesRead = 0;
-		DWORD cbTotalBytesWritten = 0;
-
-		DWORD cbBytesRead = 0;
-		DWORD cbBytesWritten = 0;
-
-		// Read until the number of bytes returned from the source stream is 0, or
-		// an error occured during transfer.
-		do
-		{
-			// Read object data from the source stream
-			hr = pSourceStream->Read(pObjectData, cbTransferSize, &cbBytesRead);
-			
-			if (FAILED(hr))
-			{
-				printf("! Failed to read %d bytes from the source stream, hr = 0x%lx\n", cbTransferSize, hr);
-			}
-
-			// Write object data to the destination stream
-			if (SUCCEEDED(hr))
-			{
-				cbTotalBytesRead += cbBytesRead; // Calculating total bytes read from device for debugging purposes only
-
-				cbBytesWritten = cbBytesRead;
-				for (int i = 0; i < cbBytesRead; i++)
-					out_image.push_back(pObjectData[i]);
-				//hr = pDestStream->Write(pObjectData, cbBytesRead, &cbBytesWritten);
-				//if (FAILED(hr))
-				//{
-				//	printf("! Failed to write %d bytes of object data to the destination stream, hr = 0x%lx\n", cbBytesRead, hr);
-				//}
-				//
-				//if (SUCCEEDED(hr))
-				//{
-				//	cbTotalBytesWritten += cbBytesWritten; // Calculating total bytes written to the file for debugging purposes only
-				//}
-			}
+	CComPtr<IPortableDeviceValues>        pObjectProperties;
+	CComPtr<IPortableDeviceKeyCollection> pPropertiesToRead;
 
-			// Output Read/Write operation information only if we have received data and if no error has occured so far.
-			if (SUCCEEDED(hr) && (cbBytesRead > 0))
-			{
-				printf("Read %d bytes from the source stream...Wrote %d bytes to the destination stream...\n", cbBytesRead, cbBytesWritten);
-			}
+	ullObjectSize = 0;
 
-		} while (SUCCEEDED(hr) && (cbBytesRead > 0));
+	// 1) CoCreate an IPortableDeviceKeyCollection interface to hold WPD_OBJECT_SIZE.
+	HRESULT hr = CoCreateInstance(CLSID_PortableDeviceKeyCollection,
+		NULL,
+		CLSCTX_INPROC_SERVER,
+		IID_PPV_ARGS(&pPropertiesToRead));
 
-		// If the caller supplied a pcbWritten parameter and we
-		// and we are successful, set it to cbTotalBytesWritten
-		// before exiting.
-		if ((SUCCEEDED(hr)) && (pcbWritten != NULL))
+	if (SUCCEEDED(hr))
+	{
+		hr = pPropertiesToRead->Add(WPD_OBJECT_SIZE);
+		if (FAILED(hr))
 		{
-			*pcbWritten = cbTotalBytesWritten;
+			printf("! Failed to add WPD_OBJECT_SIZE to IPortableDeviceKeyCollection, hr= 0x%lx\n", hr);
 		}
+	}
 
-		// Remember to delete the temporary transfer buffer
-		delete[] pObjectData;
-		pObjectData = NULL;
+	// 2) Read the size of the object before the transfer so the destination can be
+	// allocated once.
+	if (SUCCEEDED(hr))
+	{
+		hr = pProperties->GetValues(pszObjectID, pPropertiesToRead, &pObjectProperties);
 	}
-	else
+
+	if (SUCCEEDED(hr))
 	{
-		printf("! Failed to allocate %d bytes for the temporary transfer buffer.\n", cbTransferSize);
+		hr = pObjectProperties->GetUnsignedLargeIntegerValue(WPD_OBJECT_SIZE, &ullObjectSize);
+		if (FAILED(hr))
+		{
+			printf("! Failed to read WPD_OBJECT_SIZE on object '%ws', hr = 0x%lx\n", pszObjectID, hr);
+		}
 	}
 
 	return hr;
 }
 
-void KRicohMTP::GetImage(__in IPortableDevice* device, __out std::list<BYTE>& out_image, __in const WCHAR* obj_name)
+HRESULT KRicohMTP::OpenImageStream(__in IPortableDevice* device, __in const WCHAR* obj_name, __out IStream** ppObjectDataStream,
+									__out DWORD* pcbOptimalTransferSize, __out ULONGLONG* pcbObjectSize)
 {
 	HRESULT								hr = S_OK;
 	ComPtr<IPortableDeviceContent>		pContent;
 	ComPtr<IPortableDeviceResources>	pResources;
 	ComPtr<IPortableDeviceProperties>	pProperties;
-	ComPtr<IStream>						pObjectDataStream;
-	ComPtr<IStream>						pFinalFileStream;
-	DWORD								cbOptimalTransferSize = 0;
-	CAtlStringW							strOriginalFileName;
+
+	*ppObjectDataStream = nullptr;
+	*pcbOptimalTransferSize = 0;
+	*pcbObjectSize = 0;
 
 	if (device == NULL)
 	{
 		printf("! A NULL IPortableDevice interface pointer was received\n");
-		return;
+		return E_POINTER;
 	}
 
 	//</SnippetTransferFrom1>
@@ -700,8 +2291,8 @@ void KRicohMTP::GetImage(__in IPortableDevice* device, __out std::list<BYTE>& ou
 		hr = pResources->GetStream(obj_name,             // Identifier of the object we want to transfer
 								WPD_RESOURCE_DEFAULT,    // We are transferring the default resource (which is the entire object's data)
 								STGM_READ,               // Opening a stream in READ mode, because we are reading data from the device.
-								&cbOptimalTransferSize,  // Driver supplied optimal transfer size
-								&pObjectDataStream);
+								pcbOptimalTransferSize,  // Driver supplied optimal transfer size
+								ppObjectDataStream);
 		if (FAILED(hr))
 		{
 			printf("! Failed to get IStream (representing object data on the device) from IPortableDeviceResources, hr = 0x%lx\n", hr);
@@ -709,73 +2300,332 @@ void KRicohMTP::GetImage(__in IPortableDevice* device, __out std::list<BYTE>& ou
 	}
 	//</SnippetTransferFrom4>
 
-	// 4) Read the WPD_OBJECT_ORIGINAL_FILE_NAME property so we can properly name the
-	// transferred object.  Some content objects may not have this property, so a
-	// fall-back case has been provided below. (i.e. Creating a file named <objectID>.data )
-	//<SnippetTransferFrom5>
+	// 4) Read the WPD_OBJECT_SIZE property so the destination can be sized before
+	// the first read. Some content objects may not report a size, in that case the
+	// copy falls back to growing the destination as data arrives.
 	if (SUCCEEDED(hr))
 	{
 		hr = pContent->Properties(&pProperties);
 		if (SUCCEEDED(hr))
 		{
-			hr = GetStringValue(pProperties.Get(),
-								obj_name,
-								WPD_OBJECT_ORIGINAL_FILE_NAME,
-								strOriginalFileName);
-			if (FAILED(hr))
+			if (FAILED(GetObjectSize(pProperties.Get(), obj_name, *pcbObjectSize)))
+			{
+				*pcbObjectSize = 0;
+			}
+		}
+		else
+		{
+			printf("! Failed to get IPortableDeviceProperties from IPortableDeviceContent, hr = 0x%lx\n", hr);
+		}
+	}
+
+	if (FAILED(hr) && *ppObjectDataStream != nullptr)
+	{
+		(*ppObjectDataStream)->Release();
+		*ppObjectDataStream = nullptr;
+	}
+
+	return hr;
+}
+
+HRESULT KRicohMTP::StreamCopy(__out BYTE* out_buffer, __in DWORD buffer_size, __in IStream* pSourceStream, __in DWORD cbTransferSize,
+							__out DWORD* pcbWritten, __in HANDLE abort_event)
+{
+	HRESULT hr = S_OK;
+	DWORD cbTotalBytesRead = 0;
+	DWORD cbBytesRead = 0;
+
+	*pcbWritten = 0;
+
+	// Read straight into the destination until the source stream returns 0 bytes,
+	// the destination is full, or an error occured during transfer.
+	do
+	{
+		DWORD cbToRead = min(cbTransferSize, buffer_size - cbTotalBytesRead);
+
+		if (abort_event != nullptr && WaitForSingleObject(abort_event, 0) == WAIT_OBJECT_0)
+		{
+			printf("! The transfer was stopped after %u bytes\n", cbTotalBytesRead);
+			hr = HRESULT_FROM_WIN32(ERROR_CANCELLED);
+			break;
+		}
+
+		hr = pSourceStream->Read(out_buffer + cbTotalBytesRead, cbToRead, &cbBytesRead);
+		if (FAILED(hr))
+		{
+			printf("! Failed to read %d bytes from the source stream, hr = 0x%lx\n", cbToRead, hr);
+		}
+		else
+		{
+			cbTotalBytesRead += cbBytesRead;
+		}
+	} while (SUCCEEDED(hr) && (cbBytesRead > 0) && (cbTotalBytesRead < buffer_size));
+
+	if (SUCCEEDED(hr))
+	{
+		*pcbWritten = cbTotalBytesRead;
+
+		// S_FALSE tells the caller the destination was filled before the end of
+		// the stream was seen, so there may be more data to read.
+		if (cbBytesRead > 0)
+			hr = S_FALSE;
+		else
+			hr = S_OK;
+	}
+
+	return hr;
+}
+
+HRESULT KRicohMTP::StreamCopy(__out std::vector<BYTE>& out_image, __in IStream* pSourceStream, __in DWORD cbTransferSize,
+							__in ULONGLONG cbObjectSize, __out DWORD* pcbWritten, __in HANDLE abort_event)
+{
+	HRESULT hr = S_OK;
+	uint32_t cbTotalBytesWritten = 0;
+
+	*pcbWritten = 0;
+
+	// The pool sizes the image from cbObjectSize plus one transfer chunk, so probing for the
+	// end of the stream never reallocates it. A released image of the last shot usually fits.
+	bool copied = this->buffer_pool.ReadStream([&hr, pSourceStream, abort_event](uint8_t* data, uint32_t size, uint32_t* read) -> bool
+	{
+		ULONG cbBytesRead = 0;
+
+		if (abort_event != nullptr && WaitForSingleObject(abort_event, 0) == WAIT_OBJECT_0)
+		{
+			printf("! The transfer was stopped\n");
+			hr = HRESULT_FROM_WIN32(ERROR_CANCELLED);
+			return false;
+		}
+
+		hr = pSourceStream->Read(data, size, &cbBytesRead);
+		if (FAILED(hr))
+		{
+			printf("! Failed to read %u bytes from the source stream, hr = 0x%lx\n", size, hr);
+			return false;
+		}
+
+		*read = cbBytesRead;
+		return true;
+	}, cbTransferSize, cbObjectSize, out_image, &cbTotalBytesWritten);
+
+	if (!copied)
+		return FAILED(hr) ? hr : E_OUTOFMEMORY;
+
+	*pcbWritten = cbTotalBytesWritten;
+	return S_OK;
+}
+
+HRESULT KRicohMTP::GetImage(__in IPortableDevice* device, __out std::vector<BYTE>& out_image, __in const WCHAR* obj_name,
+							__in HANDLE abort_event)
+{
+	ComPtr<IStream>	pObjectDataStream;
+	DWORD			cbOptimalTransferSize = 0;
+	ULONGLONG		cbObjectSize = 0;
+	DWORD			cbTotalBytesWritten = 0;
+	LARGE_INTEGER	start;
+
+	QueryPerformanceCounter(&start);
+
+	HRESULT hr = OpenImageStream(device, obj_name, &pObjectDataStream, &cbOptimalTransferSize, &cbObjectSize);
+	DWORD cbTransferSize = SUCCEEDED(hr) ? TransferChunkSize(cbOptimalTransferSize) : cbOptimalTransferSize;
+
+	// Read on the object's data stream straight into the image, by default
+	// using the driver supplied optimal transfer buffer size.
+	if (SUCCEEDED(hr))
+	{
+		LARGE_INTEGER copy_start;
+
+		QueryPerformanceCounter(&copy_start);
+		hr = StreamCopy(out_image, pObjectDataStream.Get(), cbTransferSize, cbObjectSize, &cbTotalBytesWritten, abort_event);
+
+		// No picture is empty, a stream that ended at once is a failed transfer
+		if (SUCCEEDED(hr) && cbTotalBytesWritten == 0)
+		{
+			printf("! The device sent no data for '%ws'\n", obj_name);
+			hr = HRESULT_FROM_WIN32(ERROR_NO_DATA);
+		}
+
+		// A stream that ends early would hand over the front of a picture as the whole one
+		if (SUCCEEDED(hr) && cbObjectSize > 0 && cbTotalBytesWritten < cbObjectSize)
+		{
+			printf("! The device sent %u of %llu bytes for '%ws'\n", cbTotalBytesWritten, cbObjectSize, obj_name);
+			hr = HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+		}
+
+		if (FAILED(hr))
+		{
+			printf("! Failed to transfer object from device, hr = 0x%lx\n", hr);
+		}
+		else
+		{
+			RecordTransferChunk(cbTransferSize, cbTotalBytesWritten, MicrosecondsSince(copy_start));
+			printf("* Transferred object '%ws' (%u bytes) to '%s'.\n", obj_name, cbTotalBytesWritten, "std::vector<BYTE> out_image");
+		}
+	}
+
+	this->metrics.Record(METRIC_TRANSFER, MicrosecondsSince(start), SUCCEEDED(hr), cbTotalBytesWritten,
+						TransferChunks(cbTotalBytesWritten, cbTransferSize));
+
+	return hr;
+}
+
+HRESULT KRicohMTP::GetImage(__in IPortableDevice* device, __out BYTE* buffer, __in DWORD buffer_size,
+							__out DWORD* image_size, __in const WCHAR* obj_name)
+{
+	return GetImage(device, [buffer, buffer_size, obj_name](DWORD needed) -> BYTE*
+	{
+		if (needed > buffer_size)
+		{
+			printf("! The object '%ws' needs %u bytes but the buffer has %u bytes\n", obj_name, needed, buffer_size);
+			return nullptr;
+		}
+
+		return buffer;
+	}, buffer_size, image_size, obj_name);
+}
+
+HRESULT KRicohMTP::GetImage(__in IPortableDevice* device, __in const KRicohBufferProvider& get_buffer, __in DWORD buffer_size,
+							__out DWORD* image_size, __in const WCHAR* obj_name)
+{
+	ComPtr<IStream>	pObjectDataStream;
+	DWORD			cbOptimalTransferSize = 0;
+	ULONGLONG		cbObjectSize = 0;
+	DWORD			cbTotalBytesWritten = 0;
+	BYTE*			buffer = nullptr;
+	std::vector<BYTE> unsized_image;
+	LARGE_INTEGER	start;
+
+	*image_size = 0;
+	QueryPerformanceCounter(&start);
+
+	HRESULT hr = OpenImageStream(device, obj_name, &pObjectDataStream, &cbOptimalTransferSize, &cbObjectSize);
+
+	// Report the needed size without touching the device stream when there is no
+	// memory for the whole image. Without a size from WPD there is nothing to ask for
+	// yet, the image goes into a pooled buffer and is handed over once its size is known.
+	if (SUCCEEDED(hr) && cbObjectSize > 0)
+	{
+		if (cbObjectSize <= MAXDWORD)
+			buffer = get_buffer((DWORD)cbObjectSize);
+
+		if (buffer == nullptr)
+		{
+			*image_size = (cbObjectSize > MAXDWORD) ? MAXDWORD : (DWORD)cbObjectSize;
+			return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+		}
+
+		if (buffer_size < (DWORD)cbObjectSize)
+			buffer_size = (DWORD)cbObjectSize;
+	}
+
+	DWORD cbTransferSize = SUCCEEDED(hr) ? TransferChunkSize(cbOptimalTransferSize) : cbOptimalTransferSize;
+	LARGE_INTEGER copy_start;
+
+	if (SUCCEEDED(hr))
+	{
+		QueryPerformanceCounter(&copy_start);
+
+		if (buffer == nullptr)
+		{
+			hr = StreamCopy(unsized_image, pObjectDataStream.Get(), cbTransferSize, 0, &cbTotalBytesWritten);
+		}
+		else
+		{
+			hr = StreamCopy(buffer, buffer_size, pObjectDataStream.Get(), cbTransferSize, &cbTotalBytesWritten);
+
+			// The buffer is full, make sure the device has nothing more to send
+			if (hr == S_FALSE)
+			{
+				BYTE	probe = 0;
+				ULONG	cbProbe = 0;
+
+				hr = pObjectDataStream->Read(&probe, 1, &cbProbe);
+				if (SUCCEEDED(hr) && cbProbe > 0)
+				{
+					printf("! The object '%ws' is larger than the reported %llu bytes\n", obj_name, cbObjectSize);
+					hr = HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+				}
+			}
+		}
+
+		// No picture is empty, a stream that ended at once is a failed transfer
+		if (SUCCEEDED(hr) && cbTotalBytesWritten == 0)
+		{
+			printf("! The device sent no data for '%ws'\n", obj_name);
+			hr = HRESULT_FROM_WIN32(ERROR_NO_DATA);
+		}
+
+		// The caller's buffer may be larger, only the reported size tells a whole picture
+		if (SUCCEEDED(hr) && cbObjectSize > 0 && cbTotalBytesWritten < cbObjectSize)
+		{
+			printf("! The device sent %u of %llu bytes for '%ws'\n", cbTotalBytesWritten, cbObjectSize, obj_name);
+			hr = HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+		}
+
+		if (SUCCEEDED(hr) && buffer == nullptr)
+		{
+			buffer = get_buffer(cbTotalBytesWritten);
+			if (buffer == nullptr)
 			{
-				printf("! Failed to read WPD_OBJECT_ORIGINAL_FILE_NAME on object '%ws', hr = 0x%lx\n", obj_name, hr);
-				strOriginalFileName.Format(L"%ws.data", obj_name);
-				printf("* Creating a filename '%ws' as a default.\n", (PWSTR)strOriginalFileName.GetString());
-				// Set the HRESULT to S_OK, so we can continue with our newly generated
-				// temporary file name.
-				hr = S_OK;
+				*image_size = cbTotalBytesWritten;
+				hr = HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+			}
+			else
+			{
+				CopyMemory(buffer, &unsized_image[0], cbTotalBytesWritten);
 			}
 		}
-		else
-		{
-			printf("! Failed to get IPortableDeviceProperties from IPortableDeviceContent, hr = 0x%lx\n", hr);
-		}
-	}
 
-	//</SnippetTransferFrom5>
-	// 5) Read on the object's data stream and write to the final file's data stream using the
-    // driver supplied optimal transfer buffer size.
-	//<SnippetTransferFrom6>
-	if (SUCCEEDED(hr))
-	{
-		DWORD cbTotalBytesWritten = 0;
+		this->buffer_pool.Release(unsized_image);
 
-		// Since we have IStream-compatible interfaces, call our helper function
-		// that copies the contents of a source stream into a destination stream.
-		hr = StreamCopy(out_image,      // Destination (The Final File to transfer to)
-			pObjectDataStream.Get(),    // Source (The Object's data to transfer from)
-			cbOptimalTransferSize,		// The driver specified optimal transfer buffer size
-			&cbTotalBytesWritten);		// The total number of bytes transferred from device to the finished file
 		if (FAILED(hr))
 		{
 			printf("! Failed to transfer object from device, hr = 0x%lx\n", hr);
 		}
 		else
 		{
-			printf("* Transferred object '%ws' to '%s'.\n", obj_name, "std::list<BYTE> out_image");
+			*image_size = cbTotalBytesWritten;
+			RecordTransferChunk(cbTransferSize, cbTotalBytesWritten, MicrosecondsSince(copy_start));
+			printf("* Transferred object '%ws' (%u bytes) to '%s'.\n", obj_name, cbTotalBytesWritten, "BYTE* buffer");
 		}
 	}
+
+	this->metrics.Record(METRIC_TRANSFER, MicrosecondsSince(start), SUCCEEDED(hr), cbTotalBytesWritten,
+						TransferChunks(cbTotalBytesWritten, cbTransferSize));
+
+	return hr;
+}
+
+HRESULT KRicohMTP::DeleteImage(__in IPortableDevice* device, __in const WCHAR* obj_name)
+{
+	std::vector<std::wstring> obj_ids(1, std::wstring(obj_name));
+
+	return DeleteImages(device, obj_ids, nullptr);
 }
 
-void KRicohMTP::DeleteImage(__in IPortableDevice* device, __in const WCHAR* obj_name)
+HRESULT KRicohMTP::DeleteImages(__in IPortableDevice* device, __in const std::vector<std::wstring>& obj_ids,
+								__out std::vector<std::wstring>* failed_ids)
 {
 	HRESULT                                       hr = S_OK;
 	CComPtr<IPortableDeviceContent>               pContent;
 	CComPtr<IPortableDevicePropVariantCollection> pObjectsToDelete;
-	CComPtr<IPortableDevicePropVariantCollection> pObjectsFailedToDelete;
+	CComPtr<IPortableDevicePropVariantCollection> pDeleteResults;
+
+	if (failed_ids != nullptr)
+		failed_ids->clear();
 
 	if (device == NULL)
 	{
 		printf("! A NULL IPortableDevice interface pointer was received\n");
-		return;
+		return E_POINTER;
 	}
 
+	if (obj_ids.empty())
+		return S_OK;
+
+	LARGE_INTEGER start;
+	QueryPerformanceCounter(&start);
+
 	// 1) get an IPortableDeviceContent interface from the IPortableDevice interface to
 	// access the content-specific methods.
 	if (SUCCEEDED(hr))
@@ -788,85 +2638,112 @@ void KRicohMTP::DeleteImage(__in IPortableDevice* device, __in const WCHAR* obj_
 	}
 
 	// 2) CoCreate an IPortableDevicePropVariantCollection interface to hold the the object identifiers
-	// to delete.
-	//
-	// NOTE: This is a collection interface so more than 1 object can be deleted at a time.
-	//       This sample only deletes a single object.
+	// to delete. Every object goes into the same collection so the driver deletes them in one call.
 	if (SUCCEEDED(hr))
 	{
 		hr = CoCreateInstance(CLSID_PortableDevicePropVariantCollection,
 			NULL,
 			CLSCTX_INPROC_SERVER,
 			IID_PPV_ARGS(&pObjectsToDelete));
-		if (SUCCEEDED(hr))
+		if (FAILED(hr))
+		{
+			printf("! Failed to CoCreateInstance CLSID_PortableDevicePropVariantCollection, hr = 0x%lx\n", hr);
+		}
+		else if (pObjectsToDelete == NULL)
+		{
+			hr = E_POINTER;
+			printf("! Failed to delete objects from the device because we were returned a NULL IPortableDevicePropVariantCollection interface pointer, hr = 0x%lx\n", hr);
+		}
+	}
+
+	for (size_t i = 0; i < obj_ids.size() && SUCCEEDED(hr); i++)
+	{
+		PROPVARIANT pv = { 0 };
+		PropVariantInit(&pv);
+
+		// Initialize a PROPVARIANT structure with the object identifier string.
+		// This memory will be freed when PropVariantClear() is called below.
+		pv.vt = VT_LPWSTR;
+		pv.pwszVal = AtlAllocTaskWideString(obj_ids[i].c_str());
+		if (pv.pwszVal != NULL)
+		{
+			hr = pObjectsToDelete->Add(&pv);
+			if (FAILED(hr))
+			{
+				printf("! Failed to delete objects from the device because we could no add the object identifier string to the IPortableDevicePropVariantCollection, hr = 0x%lx\n", hr);
+			}
+		}
+		else
+		{
+			hr = E_OUTOFMEMORY;
+			printf("! Failed to delete objects from the device because we could no allocate memory for the object identifier string, hr = 0x%lx\n", hr);
+		}
+
+		// Free any allocated values in the PROPVARIANT before exiting
+		PropVariantClear(&pv);
+	}
+
+	// 3) Attempt to delete the objects from the device
+	if (SUCCEEDED(hr))
+	{
+		hr = pContent->Delete(PORTABLE_DEVICE_DELETE_NO_RECURSION,  // Deleting with no recursion
+			pObjectsToDelete,                     // Object(s) to delete
+			&pDeleteResults);                     // One VT_ERROR per object, in the same order
+		if (FAILED(hr))
+		{
+			printf("! Failed to delete %u object(s) from the device, hr = 0x%lx\n", (DWORD)obj_ids.size(), hr);
+		}
+	}
+
+	// 4) An S_OK return lets the caller know that every object was deleted. On S_FALSE
+	// the results collection tells which of them failed.
+	if (SUCCEEDED(hr))
+	{
+		DWORD cResults = 0;
+
+		if (hr == S_FALSE && pDeleteResults != NULL)
+			pDeleteResults->GetCount(&cResults);
+
+		for (size_t i = 0; i < obj_ids.size(); i++)
 		{
-			if (pObjectsToDelete != NULL)
+			HRESULT hrObject = (hr == S_OK) ? S_OK : E_FAIL;
+
+			if (i < cResults)
 			{
 				PROPVARIANT pv = { 0 };
 				PropVariantInit(&pv);
 
-				// Initialize a PROPVARIANT structure with the object identifier string
-				// that the user selected above. Notice we are allocating memory for the
-				// PWSTR value.  This memory will be freed when PropVariantClear() is
-				// called below.
-				pv.vt = VT_LPWSTR;
-				pv.pwszVal = AtlAllocTaskWideString(obj_name);
-				if (pv.pwszVal != NULL)
-				{
-					// Add the object identifier to the objects-to-delete list
-					// (We are only deleting 1 in this example)
-					hr = pObjectsToDelete->Add(&pv);
-					if (SUCCEEDED(hr))
-					{
-						// Attempt to delete the object from the device
-						hr = pContent->Delete(PORTABLE_DEVICE_DELETE_NO_RECURSION,  // Deleting with no recursion
-							pObjectsToDelete,                     // Object(s) to delete
-							NULL);                                // Object(s) that failed to delete (we are only deleting 1, so we can pass NULL here)
-						if (SUCCEEDED(hr))
-						{
-							// An S_OK return lets the caller know that the deletion was successful
-							if (hr == S_OK)
-							{
-								printf("The object '%ws' was deleted from the device.\n", obj_name);
-							}
-
-							// An S_FALSE return lets the caller know that the deletion failed.
-							// The caller should check the returned IPortableDevicePropVariantCollection
-							// for a list of object identifiers that failed to be deleted.
-							else
-							{
-								printf("The object '%ws' failed to be deleted from the device.\n", obj_name);
-							}
-						}
-						else
-						{
-							printf("! Failed to delete an object from the device, hr = 0x%lx\n", hr);
-						}
-					}
-					else
-					{
-						printf("! Failed to delete an object from the device because we could no add the object identifier string to the IPortableDevicePropVariantCollection, hr = 0x%lx\n", hr);
-					}
-				}
-				else
-				{
-					hr = E_OUTOFMEMORY;
-					printf("! Failed to delete an object from the device because we could no allocate memory for the object identifier string, hr = 0x%lx\n", hr);
-				}
+				if (SUCCEEDED(pDeleteResults->GetAt((DWORD)i, &pv)) && pv.vt == VT_ERROR)
+					hrObject = pv.scode;
 
-				// Free any allocated values in the PROPVARIANT before exiting
 				PropVariantClear(&pv);
 			}
+
+			if (SUCCEEDED(hrObject))
+			{
+				IndexObjectRemoved(obj_ids[i].c_str());
+			}
 			else
 			{
-				printf("! Failed to delete an object from the device because we were returned a NULL IPortableDevicePropVariantCollection interface pointer, hr = 0x%lx\n", hr);
+				printf("The object '%ws' failed to be deleted from the device, hr = 0x%lx\n", obj_ids[i].c_str(), hrObject);
+				if (failed_ids != nullptr)
+					failed_ids->push_back(obj_ids[i]);
 			}
 		}
-		else
+
+		if (hr == S_OK)
 		{
-			printf("! Failed to CoCreateInstance CLSID_PortableDevicePropVariantCollection, hr = 0x%lx\n", hr);
+			printf("%u object(s) were deleted from the device.\n", (DWORD)obj_ids.size());
 		}
 	}
+	else if (failed_ids != nullptr)
+	{
+		*failed_ids = obj_ids;
+	}
+
+	this->metrics.Record(METRIC_DELETE, MicrosecondsSince(start), hr == S_OK, 0, obj_ids.size());
+
+	return hr;
 }
 
 void KRicohMTP::RecursiveEnumerate(__in PCWSTR pszObjectID, __in IPortableDeviceContent* pContent, __out std::list<std::wstring>& deviceIDs)
@@ -912,121 +2789,534 @@ void KRicohMTP::RecursiveEnumerate(__in PCWSTR pszObjectID, __in IPortableDevice
 	}
 }
 
-HRESULT KRicohMTP::SendCommand(__in IPortableDevice* pDevice, __in WORD command, __out DWORD* result,
-							__in const ULONG* params, __in const int param_count)
+bool KRicohMTP::WaitUntilReady(__in KRicohWaitStep step)
 {
-	HRESULT hr = S_OK;
-	const WORD PTP_OPCODE_GETNUMOBJECT = command; // GetNumObject opcode is 0x1006
-	const WORD PTP_RESPONSECODE_OK = 0x2001;     // 0x2001 indicates command success
+	LARGE_INTEGER	start;
+	ULONGLONG		waited_us = 0;
+	DWORD			backoff_ms = READY_POLL_INITIAL;
+	DWORD			probes = 0;
+	bool			ready = false;
+
+	// GetNumObjects on the root of all storages is the cheapest operation without a
+	// data phase. Any response other than DeviceBusy means the camera is ready.
+	const ULONG params[3] = { 0xFFFFFFFF, 0x00000000, 0xFFFFFFFF };
+
+	// Also called by the reconnect thread before the camera is marked connected
+	ComPtr<IPortableDevice> device;
+	AcquireSRWLockShared(&this->device_lock);
+	device = this->device;
+	ReleaseSRWLockShared(&this->device_lock);
+
+	if (device == nullptr)
+		return false;
+
+	QueryPerformanceCounter(&start);
 
-	// Build basic WPD parameters for the command
-	ComPtr<IPortableDeviceValues> spParameters;
-	if (hr == S_OK)
+	while (true)
 	{
-		hr = CoCreateInstance(CLSID_PortableDeviceValues,
-			NULL,
-			CLSCTX_INPROC_SERVER,
-			IID_IPortableDeviceValues,
-			(VOID**)&spParameters);
+		DWORD result = 0;
+
+		SendCommand(device.Get(), 0x1006, &result, params, 3);
+		probes++;
+
+		waited_us = MicrosecondsSince(start);
+		if (result != 0 && result != PTP_RESPONSE_DEVICE_BUSY)
+		{
+			ready = true;
+			break;
+		}
+
+		ULONGLONG waited_ms = waited_us / 1000;
+		if (waited_ms >= this->ready_budget_ms)
+			break;
+
+		// Exponential backoff, never sleeping past the budget
+		Sleep((DWORD)min((ULONGLONG)backoff_ms, this->ready_budget_ms - waited_ms));
+		backoff_ms = min(backoff_ms * 2, (DWORD)READY_POLL_MAX);
 	}
 
-	// Use the WPD_COMMAND_MTP_EXT_EXECUTE_COMMAND_WITHOUT_DATA_PHASE command
-	// Similar commands exist for reading and writing data phases
-	if (hr == S_OK)
+	EnterCriticalSection(&this->event_lock);
+	KRicohWaitStats& stats = this->wait_stats[step];
+	stats.waits++;
+	stats.probes += probes;
+	stats.total_us += waited_us;
+	stats.last_us = waited_us;
+	if (waited_us > stats.max_us)
+		stats.max_us = waited_us;
+	if (!ready)
+		stats.timeouts++;
+	LeaveCriticalSection(&this->event_lock);
+
+	if (!ready)
 	{
-		hr = spParameters->SetGuidValue(WPD_PROPERTY_COMMON_COMMAND_CATEGORY,
-			WPD_COMMAND_MTP_EXT_EXECUTE_COMMAND_WITHOUT_DATA_PHASE.fmtid);
+		printf("! The camera was not ready after %u ms (%u probes)\n", this->ready_budget_ms, probes);
 	}
 
-	if (hr == S_OK)
+	return ready;
+}
+
+ComPtr<IPortableDevice> KRicohMTP::GetDevice()
+{
+	ComPtr<IPortableDevice> device;
+
+	// While the camera is being reopened, give it a chance to come back
+	if (this->connected == 0 && this->reconnect_thread != nullptr)
+		WaitForSingleObject(this->connected_event, this->reconnect_timeout_ms);
+
+	AcquireSRWLockShared(&this->device_lock);
+	if (this->connected != 0)
+		device = this->device;
+	ReleaseSRWLockShared(&this->device_lock);
+
+	return device;
+}
+
+bool KRicohMTP::IsDisconnectError(__in HRESULT hr)
+{
+	return hr == HRESULT_FROM_WIN32(ERROR_GEN_FAILURE) ||
+		hr == HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED) ||
+		hr == HRESULT_FROM_WIN32(ERROR_DEVICE_REMOVED) ||
+		hr == E_WPD_DEVICE_IS_HUNG;
+}
+
+void KRicohMTP::OnDeviceLost()
+{
+	if (InterlockedCompareExchange(&this->connected, 0, 1) != 1)
+		return;
+
+	printf("! The camera was disconnected, trying to reopen it\n");
+	ResetEvent(this->connected_event);
+	SetEvent(this->reconnect_event);
+}
+
+DWORD WINAPI KRicohMTP::ReconnectThread(__in LPVOID param)
+{
+	CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+	static_cast<KRicohMTP*>(param)->RunReconnect();
+	CoUninitialize();
+
+	return 0;
+}
+
+void KRicohMTP::RunReconnect()
+{
+	while (this->reconnect_stop == 0)
 	{
-		hr = spParameters->SetUnsignedIntegerValue(WPD_PROPERTY_COMMON_COMMAND_ID,
-			WPD_COMMAND_MTP_EXT_EXECUTE_COMMAND_WITHOUT_DATA_PHASE.pid);
+		// Sleep until a removal is reported, then retry on a short interval
+		WaitForSingleObject(this->reconnect_event, this->connected != 0 ? INFINITE : RECONNECT_POLL_INTERVAL);
+
+		if (this->reconnect_stop != 0)
+			break;
+
+		if (this->connected == 0)
+			TryReconnect();
 	}
+}
+
+bool KRicohMTP::TryReconnect()
+{
+	// Never call_lock: a call holding it may be waiting in GetDevice for this reconnect
+	KRicohScopedLock connection(&this->connection_lock);
+	ComPtr<IPortableDevice> new_device;
+	LARGE_INTEGER start;
+
+	QueryPerformanceCounter(&start);
+
+	// The PnP ID stays the same while the camera is on the same port
+	GetRicohDevice(&new_device, this->device_id.c_str());
+	if (new_device == nullptr)
+		return false;
+
+	// The old device and its event registration are dead, replace both
+	UnregisterForEvents();
+
+	std::shared_ptr<KRicohWpdTransport> new_transport = std::make_shared<KRicohWpdTransport>(new_device.Get());
+
+	AcquireSRWLockExclusive(&this->device_lock);
+	ComPtr<IPortableDevice> old_device = this->device;
+	this->device = new_device;
+	this->wpd_transport = new_transport;
+	ReleaseSRWLockExclusive(&this->device_lock);
 
-	// Specify the actual MTP opcode that we want to execute here
-	if (hr == S_OK)
+	if (old_device != nullptr)
+		old_device->Close();
+
+	if (FAILED(RegisterForEvents()))
+		printf("! Failed to register for device events after reconnect\n");
+
+	// Resume the session the caller had open, the camera dropped it with the connection
+	if (this->session_open)
 	{
-		hr = spParameters->SetUnsignedIntegerValue(WPD_PROPERTY_MTP_EXT_OPERATION_CODE,
-			(ULONG)PTP_OPCODE_GETNUMOBJECT);
+		DWORD result = 0;
+		ULONG params[1] = { this->session_storage };
+
+		SendCommand(new_device.Get(), 0x1002, &result, params, 1);
+		if (result != PTP_RESPONSE_OK && result != PTP_RESPONSE_SESSION_ALREADY_OPEN)
+		{
+			printf("! Failed to reopen the session after reconnect, response code 0x%X\n", result);
+			return false;
+		}
+
+		RefreshObjectIndex();
+		WaitUntilReady(WAIT_AFTER_OPEN_SESSION);
 	}
 
-	// GetNumObject requires three params - storage ID, object format, and parent object handle   
-	// Parameters need to be first put into a PropVariantCollection
-	ComPtr<IPortableDevicePropVariantCollection> spMtpParams;
-	if (hr == S_OK)
+	InterlockedIncrement(&this->reconnect_count);
+	InterlockedExchange(&this->connected, 1);
+	SetEvent(this->connected_event);
+
+	printf("* The camera was reconnected in %llu ms\n", MicrosecondsSince(start) / 1000);
+
+	return true;
+}
+
+void KRicohMTP::StopReconnectThread()
+{
+	if (this->reconnect_thread == nullptr)
+		return;
+
+	InterlockedExchange(&this->reconnect_stop, 1);
+	SetEvent(this->reconnect_event);
+	WaitForSingleObject(this->reconnect_thread, INFINITE);
+
+	CloseHandle(this->reconnect_thread);
+	this->reconnect_thread = nullptr;
+}
+
+std::future<KRicohAsyncResult> KRicohMTP::TakePictureAsync(__in KRicohAsyncCallback on_done, __in DWORD timeout_ms)
+{
+	KRicohAsyncResult request;
+
+	return PostAsync(request, [this, timeout_ms](KRicohAsyncResult& result)
 	{
-		hr = CoCreateInstance(CLSID_PortableDevicePropVariantCollection,
-			NULL,
-			CLSCTX_INPROC_SERVER,
-			IID_IPortableDevicePropVariantCollection,
-			(VOID**)&spMtpParams);
-	}
+		result.response = TakePicture(result.obj_id, timeout_ms);
+		result.succeeded = result.response == PTP_RESPONSE_OK && !result.obj_id.empty();
+	}, on_done);
+}
+
+std::future<KRicohAsyncResult> KRicohMTP::DownloadAsync(__in const std::wstring& obj_id, __in KRicohAsyncCallback on_done)
+{
+	KRicohAsyncResult request;
+
+	request.obj_id = obj_id;
+
+	return PostAsync(request, [this](KRicohAsyncResult& result)
+	{
+		result.succeeded = DownloadImage(result.obj_id, result.image);
+	}, on_done);
+}
+
+std::future<KRicohAsyncResult> KRicohMTP::DeleteAsync(__in const std::wstring& obj_id, __in KRicohAsyncCallback on_done)
+{
+	KRicohAsyncResult request;
+
+	request.obj_id = obj_id;
+
+	return PostAsync(request, [this](KRicohAsyncResult& result)
+	{
+		result.succeeded = DeleteImage(result.obj_id);
+	}, on_done);
+}
 
-	PROPVARIANT pvParam = { 0 };
-	pvParam.vt = VT_UI4;
+DWORD KRicohMTP::GetPendingAsyncCount()
+{
+	EnterCriticalSection(&this->async_lock);
+	DWORD count = (DWORD)this->async_queue.size();
+	LeaveCriticalSection(&this->async_lock);
+
+	return count;
+}
+
+std::future<KRicohAsyncResult> KRicohMTP::PostAsync(__in const KRicohAsyncResult& request,
+													__in std::function<void(KRicohAsyncResult&)> work, __in KRicohAsyncCallback on_done)
+{
+	std::shared_ptr<std::promise<KRicohAsyncResult> > promise = std::make_shared<std::promise<KRicohAsyncResult> >();
+	std::future<KRicohAsyncResult> future = promise->get_future();
+	KRicohAsyncResult initial = request;
+
+	initial.succeeded = false;
+	initial.error = KRicohMTPError::NO_RICOH_ERROR;
+	initial.response = 0;
 
-	// Specify storage ID parameter. Most devices that have 0x10001 have the storage ID. This
-	// should be changed to use the device's real storage ID (which can be obtained by
-	// removing the prefix for the WPD object ID for the storage)
-	if (params != NULL && param_count > 0)
+	// run is false when the call is dropped at shutdown, it still completes
+	std::function<void(bool)> task = [this, initial, work, on_done, promise](bool run)
 	{
-		for (int i = 0; i < param_count; i++)
+		KRicohAsyncResult result = initial;
+
+		if (run)
+		{
+			// The error is the worker's own, sync calls of other threads keep theirs
+			SetError(KRicohMTPError::NO_RICOH_ERROR);
+			work(result);
+			if (!result.succeeded)
+				result.error = (enum KRicohMTPError)GetLastError();
+		}
+		else
 		{
-			pvParam.ulVal = params[i];
-			hr = spMtpParams->Add(&pvParam);
+			result.error = KRicohMTPError::CALL_CANCELLED;
 		}
+
+		if (on_done)
+			on_done(result);
+		promise->set_value(result);
+	};
+
+	EnterCriticalSection(&this->async_lock);
+
+	// The worker starts with the first call, objects used synchronously never pay for it
+	if (this->async_thread == nullptr && this->async_stop == 0)
+	{
+		this->async_thread = CreateThread(nullptr, 0, AsyncThread, this, 0, nullptr);
+		if (this->async_thread == nullptr)
+			printf("! Failed to start the async worker, error = %lu\n", ::GetLastError());
+	}
+
+	if (this->async_thread == nullptr || this->async_stop != 0)
+	{
+		LeaveCriticalSection(&this->async_lock);
+		task(false);
+		return future;
 	}
 
-	// Add MTP parameters collection to our main parameter list
-	if (hr == S_OK)
+	this->async_queue.push_back(task);
+	LeaveCriticalSection(&this->async_lock);
+
+	SetEvent(this->async_event);
+
+	return future;
+}
+
+DWORD WINAPI KRicohMTP::AsyncThread(__in LPVOID param)
+{
+	CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+	static_cast<KRicohMTP*>(param)->RunAsync();
+	CoUninitialize();
+
+	return 0;
+}
+
+void KRicohMTP::RunAsync()
+{
+	for (;;)
 	{
-		hr = spParameters->SetIPortableDevicePropVariantCollectionValue(
-			WPD_PROPERTY_MTP_EXT_OPERATION_PARAMS, spMtpParams.Get());
+		std::function<void(bool)> task;
+
+		EnterCriticalSection(&this->async_lock);
+		if (!this->async_queue.empty())
+			task = this->async_queue.front();
+		bool stop = this->async_stop != 0;
+		LeaveCriticalSection(&this->async_lock);
+
+		if (!task)
+		{
+			if (stop)
+				break;
+
+			WaitForSingleObject(this->async_event, INFINITE);
+			continue;
+		}
+
+		// Unfinished calls are cancelled at shutdown instead of keeping the destructor waiting
+		task(!stop);
+
+		// Popped after it ran so GetPendingAsyncCount includes the running call
+		EnterCriticalSection(&this->async_lock);
+		this->async_queue.pop_front();
+		LeaveCriticalSection(&this->async_lock);
 	}
+}
+
+void KRicohMTP::StopAsyncThread()
+{
+	EnterCriticalSection(&this->async_lock);
+	InterlockedExchange(&this->async_stop, 1);
+	HANDLE thread = this->async_thread;
+	LeaveCriticalSection(&this->async_lock);
+
+	if (thread == nullptr)
+		return;
+
+	SetEvent(this->async_event);
+	WaitForSingleObject(thread, INFINITE);
+
+	CloseHandle(thread);
+	this->async_thread = nullptr;
+}
+
+HRESULT KRicohMTP::RegisterForEvents()
+{
+	HRESULT hr = S_OK;
 
-	// Send the command to the MTP device
-	ComPtr<IPortableDeviceValues> spResults;
-	if (hr == S_OK)
+	EnterCriticalSection(&this->event_lock);
+	bool registered = (this->event_cookie != nullptr);
+	LeaveCriticalSection(&this->event_lock);
+
+	if (registered)
+		return S_OK;
+
+	if (this->event_callback == nullptr)
 	{
-		hr = pDevice->SendCommand(0, spParameters.Get(), &spResults);
+		this->event_callback = new (std::nothrow) KRicohEventCallback(this);
+		if (this->event_callback == nullptr)
+		{
+			printf("! Failed to allocate the device event callback\n");
+			return E_OUTOFMEMORY;
+		}
 	}
 
-	// Check if the driver was able to send the command by interrogating WPD_PROPERTY_COMMON_HRESULT
-	HRESULT hrCmd = S_OK;
-	if (hr == S_OK)
+	PWSTR cookie = nullptr;
+	hr = this->device->Advise(0, this->event_callback, nullptr, &cookie);
+	if (FAILED(hr))
 	{
-		hr = spResults->GetErrorValue(WPD_PROPERTY_COMMON_HRESULT, &hrCmd);
+		printf("! Failed to register for device events, hr = 0x%lx\n", hr);
+		return hr;
 	}
 
-	if (hr == S_OK)
+	EnterCriticalSection(&this->event_lock);
+	this->event_cookie = cookie;
+	LeaveCriticalSection(&this->event_lock);
+
+	return hr;
+}
+
+void KRicohMTP::UnregisterForEvents()
+{
+	EnterCriticalSection(&this->event_lock);
+	PWSTR cookie = this->event_cookie;
+	this->event_cookie = nullptr;
+	LeaveCriticalSection(&this->event_lock);
+
+	if (cookie != nullptr)
 	{
-		//printf("Driver return code: 0x%08X\n", hrCmd);
-		hr = hrCmd;
+		HRESULT hr = this->device->Unadvise(cookie);
+		if (FAILED(hr))
+		{
+			printf("! Failed to unregister for device events, hr = 0x%lx\n", hr);
+		}
+
+		CoTaskMemFree(cookie);
 	}
 
-	// If the command was executed successfully, check the MTP response code to see if the
-	// device can handle the command. Be aware that there is a distinction between the command
-	// being successfully sent to the device and the command being handled successfully by the device.
-	if (hr == S_OK)
+	if (this->event_callback != nullptr)
 	{
-		hr = spResults->GetUnsignedIntegerValue(WPD_PROPERTY_MTP_EXT_RESPONSE_CODE, result);
+		this->event_callback->Release();
+		this->event_callback = nullptr;
 	}
+}
+
+void KRicohMTP::OnDeviceEvent(__in IPortableDeviceValues* pEventParameters)
+{
+	GUID event_id = { 0 };
+
+	if (FAILED(pEventParameters->GetGuidValue(WPD_EVENT_PARAMETER_EVENT_ID, &event_id)))
+		return;
 
-	if (hr == S_OK)
+	if (IsEqualGUID(event_id, WPD_EVENT_OBJECT_ADDED))
 	{
-		//printf("MTP Response code: 0x%X\n", *result);
-		hr = (*result == (DWORD)PTP_RESPONSECODE_OK) ? S_OK : E_FAIL;
+		PWSTR object_id = nullptr;
+
+		// Only pictures complete a capture, folders may be created along with them
+		if (SUCCEEDED(pEventParameters->GetStringValue(WPD_OBJECT_ID, &object_id)) &&
+			wcsstr(object_id, PICTURE_ID_PREFIX) != nullptr)
+		{
+			IndexObjectAdded(object_id);
+
+			EnterCriticalSection(&this->event_lock);
+			this->last_added_object = object_id;
+			SetEvent(this->object_added_event);
+			LeaveCriticalSection(&this->event_lock);
+		}
+
+		CoTaskMemFree(object_id);
 	}
+	else if (IsEqualGUID(event_id, WPD_EVENT_OBJECT_REMOVED))
+	{
+		PWSTR object_id = nullptr;
 
-	// If the command was executed successfully, the MTP response parameters are returned in 
-	// the WPD_PROPERTY_MTP_EXT_RESPONSE_PARAMS property, which is a PropVariantCollection
-	ComPtr<IPortableDevicePropVariantCollection> spRespParams;
-	if (hr == S_OK)
+		if (SUCCEEDED(pEventParameters->GetStringValue(WPD_OBJECT_ID, &object_id)))
+			IndexObjectRemoved(object_id);
+
+		CoTaskMemFree(object_id);
+	}
+	else if (IsEqualGUID(event_id, WPD_EVENT_DEVICE_REMOVED))
 	{
-		hr = spResults->GetIPortableDevicePropVariantCollectionValue(WPD_PROPERTY_MTP_EXT_RESPONSE_PARAMS,
-			&spRespParams);
+		OnDeviceLost();
 	}
+}
+
+HRESULT KRicohMTP::SendCommand(__in IPortableDevice* pDevice, __in WORD command, __out DWORD* result,
+							__in const ULONG* params, __in const int param_count)
+{
+	std::shared_ptr<KRicohWpdTransport> transport = GetTransport(pDevice);
+	KRicohPtpOperation op(command);
+
+	for (int i = 0; params != NULL && i < param_count && i < PTP_MAX_PARAMS; i++)
+		op.params[op.param_count++] = params[i];
+
+	return ExecuteOperation(*transport, op, result);
+}
+
+HRESULT KRicohMTP::SendCommandReadData(__in IPortableDevice* pDevice, __in WORD command, __out DWORD* result,
+									__out std::vector<BYTE>& data, __in const ULONG* params, __in const int param_count)
+{
+	std::shared_ptr<KRicohWpdTransport> transport = GetTransport(pDevice);
+	KRicohPtpOperation op(command, NULL, 0, PTP_DATA_READ);
+
+	for (int i = 0; params != NULL && i < param_count && i < PTP_MAX_PARAMS; i++)
+		op.params[op.param_count++] = params[i];
+
+	// The data phase is read into the caller's buffer, so a reused one does not reallocate
+	op.data.swap(data);
+
+	HRESULT hr = ExecuteOperation(*transport, op, result);
+	data.swap(op.data);
 
 	return hr;
-}
\ No newline at end of file
+}
+
+HRESULT KRicohMTP::SendCommandWriteData(__in IPortableDevice* pDevice, __in WORD command, __out DWORD* result,
+										__in const std::vector<BYTE>& data, __in const ULONG* params, __in const int param_count)
+{
+	std::shared_ptr<KRicohWpdTransport> transport = GetTransport(pDevice);
+	KRicohPtpOperation op(command, NULL, 0, PTP_DATA_WRITE);
+
+	for (int i = 0; params != NULL && i < param_count && i < PTP_MAX_PARAMS; i++)
+		op.params[op.param_count++] = params[i];
+	op.data = data;
+
+	return ExecuteOperation(*transport, op, result);
+}
+
+std::shared_ptr<KRicohWpdTransport> KRicohMTP::GetTransport(__in IPortableDevice* pDevice)
+{
+	std::shared_ptr<KRicohWpdTransport> transport;
+
+	AcquireSRWLockShared(&this->device_lock);
+	if (this->wpd_transport != nullptr && this->wpd_transport->GetDevice() == pDevice)
+		transport = this->wpd_transport;
+	ReleaseSRWLockShared(&this->device_lock);
+
+	// A caller still holding the device from before a reconnect gets a transport of its own
+	if (transport == nullptr)
+		transport = std::make_shared<KRicohWpdTransport>(pDevice);
+
+	return transport;
+}
+
+HRESULT KRicohMTP::ExecuteOperation(__in KRicohPtpTransport& transport, __inout KRicohPtpOperation& op, __out DWORD* result)
+{
+	bool sent = transport.Execute(op);
+	HRESULT hr = (HRESULT)transport.GetLastStatus();
+
+	if (IsDisconnectError(hr))
+		OnDeviceLost();
+
+	if (result != NULL && op.response != 0)
+		*result = op.response;
+
+	if (!sent)
+		return FAILED(hr) ? hr : E_FAIL;
+
+	// The command reached the device, now it depends on whether the device could handle it
+	return (op.response == PTP_RESPONSE_OK) ? S_OK : E_FAIL;
+}
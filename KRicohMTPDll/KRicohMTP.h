@@ -21,15 +21,62 @@
 #include <strsafe.h>
 #include <wrl/client.h>
 #include <list>
+#include <vector>
+#include <map>
+#include <set>
+#include <functional>
+#include <future>
+#include <deque>
+#include <memory>
+#include "KRicohPtp.h"
+#include "KRicohMetrics.h"
+#include "KRicohBufferPool.h"
+#include "KRicohChunkTuner.h"
 
 #define SELECTION_BUFFER_SIZE 81
 #define RICOH_NAME "RICOH THETA S"
+// USB ids of the THETA S as they appear in the PnP device ID (lower case)
+#define RICOH_USB_VID       L"vid_05ca"
+#define RICOH_USB_VID_PID   L"vid_05ca&pid_0366"
+// The last camera opened is kept here so the next start can open it directly
+#define RICOH_REGISTRY_KEY  L"Software\\K_RICOH"
+#define RICOH_REGISTRY_LAST_DEVICE L"LastDeviceID"
+// Tuned transfer chunk sizes, one DWORD per device ID
+#define RICOH_REGISTRY_CHUNK_SIZES L"Software\\K_RICOH\\ChunkSizes"
 #define CLIENT_NAME         L"K_RICOH"
 #define CLIENT_MAJOR_VER    1
 #define CLIENT_MINOR_VER    0
 #define CLIENT_REVISION     0
 
 #define NUM_OBJECTS_TO_REQUEST  10
+#define PICTURE_ID_PREFIX       L"o64"
+
+// Upper bound for InitiateCapture to report the new object (ms)
+#define DEFAULT_CAPTURE_TIMEOUT 15000
+// Fixed wait used when the driver does not deliver device events (ms)
+#define CAPTURE_FALLBACK_WAIT   10000
+
+// Readiness polling instead of fixed pauses (ms)
+#define DEFAULT_READY_BUDGET    500
+#define READY_POLL_INITIAL      10
+#define READY_POLL_MAX          160
+
+// GetPartialObject downloads: bytes per request and retries at the same offset
+#define DEFAULT_PARTIAL_CHUNK       (1024 * 1024)
+#define PARTIAL_RETRY_LIMIT         3
+
+// Streamed downloads: chunk size of the driver, measured per device, or anything else as given
+#define TRANSFER_CHUNK_DRIVER       0
+#define TRANSFER_CHUNK_AUTO         MAXDWORD
+
+// Reopening a camera that dropped off USB (ms)
+#define RECONNECT_POLL_INTERVAL     100
+#define DEFAULT_RECONNECT_TIMEOUT   3000
+
+// Calls with KRicohCallOptions: tries of a transient failure and the pause between them (ms)
+#define DEFAULT_CALL_ATTEMPTS       3
+#define CALL_BACKOFF_INITIAL        50
+#define CALL_BACKOFF_MAX            1000
 
 // MTP Library
 #pragma comment(lib, "ws2_32.lib")
@@ -42,43 +89,403 @@ enum KRicohMTPError{
 	CANNOT_OPEN_SESSION = 10,
 	CANNOT_CLOSE_SESSION = 11,
 	CANNOT_TAKE_PICTURE = 12,
+	CANNOT_GET_IMAGE = 13,
+	IMAGE_BUFFER_TOO_SMALL = 14,
+	CAPTURE_TIMEOUT = 15,
+	CANNOT_GET_OBJECT_HANDLES = 16,
+	CANNOT_DELETE_IMAGE = 17,
+	CANNOT_GET_THUMBNAIL = 18,
+	CALL_CANCELLED = 19,
+	CANNOT_EXECUTE_OPERATION = 20,
+	DEADLINE_EXCEEDED = 21,
+	EMPTY_IMAGE = 22,			// the camera sent no bytes for the picture
+	SHORT_IMAGE = 23,			// the stream ended before the size the camera reported
 	NO_RICOH_ERROR = 100
 };
 
+// Points where the library waits for the camera to become ready
+enum KRicohWaitStep{
+	WAIT_AFTER_OPEN_SESSION = 0,
+	WAIT_AFTER_CLOSE_SESSION = 1,
+	WAIT_BEFORE_TRANSFER = 2,
+	WAIT_BEFORE_DELETE = 3,
+	WAIT_STEP_COUNT = 4
+};
+
+struct KRicohWaitStats{
+	DWORD waits;			// number of times the step waited
+	DWORD timeouts;			// waits that ran out of budget before the camera was ready
+	DWORD probes;			// readiness probes sent to the camera
+	ULONGLONG total_us;
+	ULONGLONG max_us;
+	ULONGLONG last_us;
+};
+
+// Gets the thumbnail of a picture before its full transfer starts. Return quickly
+// (e.g. post it to the UI thread), the full transfer waits for the callback.
+typedef std::function<void(const std::wstring& obj_id, const std::vector<BYTE>& thumbnail)> KRicohPreviewCallback;
+
+// Outcome of an asynchronous call, handed to the completion callback and then to the future
+struct KRicohAsyncResult{
+	bool succeeded;
+	enum KRicohMTPError error;		// NO_RICOH_ERROR on success
+	DWORD response;					// PTP response code of TakePictureAsync
+	std::wstring obj_id;			// the new object for TakePictureAsync, the requested one otherwise
+	std::vector<BYTE> image;		// DownloadAsync only
+};
+
+typedef std::function<void(const KRicohAsyncResult& result)> KRicohAsyncCallback;
+
+// Asked for the memory of an image once its size is known, the image is copied straight
+// into it; nullptr gives up the download
+typedef std::function<BYTE*(DWORD image_size)> KRicohBufferProvider;
+
+// Deadline, cancellation and retries of one call
+struct KRicohCallOptions{
+	DWORD timeout_ms;		// the whole call including retries, INFINITE waits as long as it takes
+	HANDLE cancel_event;	// manual reset event the caller sets to give up, nullptr for none
+	DWORD max_attempts;		// tries of a transient failure, 1 never retries
+
+	explicit KRicohCallOptions(__in DWORD timeout_ms = INFINITE, __in HANDLE cancel_event = nullptr)
+		: timeout_ms(timeout_ms), cancel_event(cancel_event), max_attempts(DEFAULT_CALL_ATTEMPTS)
+	{
+	}
+};
+
+// Step of a call that failed
+enum KRicohCallPhase{
+	CALL_PHASE_NONE = 0,
+	CALL_PHASE_CONNECT = 1,		// no camera, or it did not come back in time
+	CALL_PHASE_CAPTURE = 2,		// InitiateCapture
+	CALL_PHASE_WAIT_OBJECT = 3,	// the camera did not report the picture
+	CALL_PHASE_TRANSFER = 4,
+	CALL_PHASE_DELETE = 5,
+	CALL_PHASE_OPERATION = 6	// ExecutePtpOperation
+};
+
+// Outcome of a call with KRicohCallOptions, everything about the last attempt
+struct KRicohCallResult{
+	bool succeeded;
+	enum KRicohMTPError error;	// CALL_CANCELLED and DEADLINE_EXCEEDED win over the error of the attempt
+	HRESULT hr;
+	DWORD response;				// PTP response code, 0 when the camera did not answer
+	KRicohCallPhase phase;
+	bool transient;				// the failure would likely pass on a retry
+	DWORD attempts;
+	DWORD elapsed_ms;
+};
+
+class KRicohEventCallback;
+class KRicohWpdTransport;
+
+// Safe to call from any number of threads. Calls take turns on the camera one exchange at
+// a time: waiting for a capture to be reported does not hold it, and chunked downloads let
+// other calls go between two chunks, so one thread can trigger the next shot while another
+// downloads and deletes. KRicohDeviceExecutor (KRicohExecutor.h) adds a queue with
+// priorities and deadlines on top.
 class K_RICOH_API KRicohMTP
 {
+	friend class KRicohEventCallback;
+
 public:
 	KRicohMTP();
 	virtual ~KRicohMTP();
 
 private:
 	Microsoft::WRL::ComPtr<IPortableDevice> device;
+	std::wstring device_id;
+	// Error of the last failed call, per thread like ::GetLastError, so a call on another
+	// thread (e.g. the async worker) cannot overwrite it; last_error only when TlsAlloc failed
 	enum KRicohMTPError last_error;
+	DWORD last_error_slot;
+
+	// One exchange with the camera at a time; recursive, so calls built on other calls take
+	// it again. The reconnect thread never takes it.
+	CRITICAL_SECTION call_lock;
+	// InitRicohDevice and the reconnect thread: the device swap, the event registration,
+	// device_id and the session to resume
+	CRITICAL_SECTION connection_lock;
+
+	// Device events; event_cookie changes under connection_lock and is read under event_lock
+	KRicohEventCallback* event_callback;
+	PWSTR event_cookie;
+	CRITICAL_SECTION event_lock;
+	HANDLE object_added_event;
+	std::wstring last_added_object;
+
+	// Picture index keyed by object handle, built once per session and kept
+	// current from ObjectAdded/ObjectRemoved events
+	enum ObjectIndexState{
+		INDEX_INVALID,
+		INDEX_BUILDING,
+		INDEX_VALID
+	};
+	std::map<DWORD, std::wstring> object_index;
+	std::set<DWORD> object_index_removed;
+	ObjectIndexState object_index_state;
+
+	// Deferred deletes, flushed in one batch
+	DWORD deferred_delete_batch;
+	std::vector<std::wstring> pending_deletes;
+	std::vector<std::wstring> failed_deletes;
+
+	// 0 streams objects through WPD, otherwise DownloadImage uses GetPartialObject chunks of this size.
+	// Set with InterlockedExchange, read once per download without call_lock
+	volatile LONG partial_chunk_size;
+	KRicohPreviewCallback on_preview;
+
+	// Chunk size of streamed downloads, TRANSFER_CHUNK_AUTO lets chunk_tuner find it; like
+	// partial_chunk_size
+	volatile LONG transfer_chunk_size;
+	volatile LONG last_transfer_chunk;
+	KRicohChunkTuner chunk_tuner;
+
+	// Readiness
+	DWORD ready_budget_ms;
+	KRicohWaitStats wait_stats[WAIT_STEP_COUNT];
+
+	// Capture, enumeration, transfer and delete timings
+	KRicohMetrics metrics;
+
+	// Images and GetPartialObject chunks are taken from here and given back by ReleaseImage
+	KRicohBufferPool buffer_pool;
+
+	// Connection, the reconnect thread swaps device and its transport under device_lock
+	SRWLOCK device_lock;
+	std::shared_ptr<KRicohWpdTransport> wpd_transport;
+	volatile LONG connected;
+	HANDLE connected_event;
+	HANDLE reconnect_event;
+	HANDLE reconnect_thread;
+	volatile LONG reconnect_stop;
+	DWORD reconnect_timeout_ms;
+	volatile LONG reconnect_count;
+	ULONG session_storage;
+	bool session_open;
+
+	// Asynchronous calls run in order on one worker thread with its own COM apartment
+	std::deque<std::function<void(bool)> > async_queue;
+	CRITICAL_SECTION async_lock;
+	HANDLE async_event;
+	HANDLE async_thread;
+	volatile LONG async_stop;
 
 	// Private Methods
-	bool IsRicoh(_In_ IPortableDeviceManager* deviceManager,
+	static bool IsRicoh(_In_ IPortableDeviceManager* deviceManager,
 				_In_ PCWSTR pnpDeviceID);
-	DWORD FindRicoh(__out int& ricoh_index);
+	static DWORD FindRicoh(__out std::vector<std::wstring>& ricoh_ids);
+	static bool LoadCachedDeviceID(__out std::wstring& pnp_device_id);
+	static void SaveCachedDeviceID(__in const std::wstring& pnp_device_id);
+	static DWORD LoadTunedChunkSize(__in const std::wstring& pnp_device_id);
+	static void SaveTunedChunkSize(__in const std::wstring& pnp_device_id, __in DWORD chunk_size);
+	DWORD TransferChunkSize(__in DWORD cbOptimalTransferSize);
+	void RecordTransferChunk(__in DWORD chunk_size, __in DWORD bytes, __in ULONGLONG elapsed_us);
 	void GetClientInformation(_Outptr_result_maybenull_ IPortableDeviceValues** clientInformation);
-	void GetRicohDevice(_Outptr_result_maybenull_ IPortableDevice** device);
+	void GetRicohDevice(_Outptr_result_maybenull_ IPortableDevice** device, __in PCWSTR pnpDeviceID);
 	void RecursiveEnumerate(__in PCWSTR pszObjectID, __in IPortableDeviceContent* pContent, __out std::list<std::wstring>& deviceIDs);
 	bool GetLastImageObjName(__in IPortableDevice* device, __out std::wstring& obj_name);
+	bool EnsureObjectIndex(__in IPortableDevice* device);
+	bool BuildObjectIndex(__in IPortableDevice* device);
+	void IndexObjectAdded(__in PCWSTR obj_id);
+	void IndexObjectRemoved(__in PCWSTR obj_id);
 	HRESULT GetStringValue(__in IPortableDeviceProperties* pProperties, __in PCWSTR pszObjectID, __in REFPROPERTYKEY key, __out CAtlStringW& strStringValue);
-	HRESULT StreamCopy(__out std::list<BYTE>& out_image, __in IStream* pSourceStream, __in DWORD cbTransferSize, __in DWORD* pcbWritten);
-	void GetImage(__in IPortableDevice* device, __out std::list<BYTE>& out_image,
-				__in const WCHAR* obj_name);
-	void DeleteImage(__in IPortableDevice* device, __in const WCHAR* obj_name);
+	HRESULT GetObjectSize(__in IPortableDeviceProperties* pProperties, __in PCWSTR pszObjectID, __out ULONGLONG& ullObjectSize);
+	HRESULT OpenImageStream(__in IPortableDevice* device, __in const WCHAR* obj_name, __out IStream** ppObjectDataStream,
+							__out DWORD* pcbOptimalTransferSize, __out ULONGLONG* pcbObjectSize);
+	// abort_event, when given, stops the copy between two chunks with ERROR_CANCELLED
+	HRESULT StreamCopy(__out BYTE* out_buffer, __in DWORD buffer_size, __in IStream* pSourceStream, __in DWORD cbTransferSize,
+						__out DWORD* pcbWritten, __in HANDLE abort_event = nullptr);
+	HRESULT StreamCopy(__out std::vector<BYTE>& out_image, __in IStream* pSourceStream, __in DWORD cbTransferSize,
+						__in ULONGLONG cbObjectSize, __out DWORD* pcbWritten, __in HANDLE abort_event = nullptr);
+	HRESULT GetImage(__in IPortableDevice* device, __out std::vector<BYTE>& out_image,
+					__in const WCHAR* obj_name, __in HANDLE abort_event = nullptr);
+	HRESULT PartialTransfer(__in const std::wstring& obj_id, __inout std::vector<BYTE>& out_image, __in bool resume,
+							__in HANDLE abort_event, __out DWORD* response);
+	HRESULT TriggerCapture(__out DWORD* result);
+	// runs attempt until it succeeds, fails for good, or the deadline or cancel_event ends the call.
+	// Each attempt holds call_lock, unless it takes the lock per exchange itself (locks_per_exchange)
+	// and checks abort_event in between, like PartialTransfer
+	KRicohCallResult RunCall(__in const KRicohCallOptions& options, __in KRicohCallPhase phase,
+							__in std::function<bool(HANDLE abort_event, DWORD timeout_ms, KRicohCallResult& result)> attempt,
+							__in bool locks_per_exchange = false);
+	HRESULT GetImage(__in IPortableDevice* device, __out BYTE* buffer, __in DWORD buffer_size,
+					__out DWORD* image_size, __in const WCHAR* obj_name);
+	// buffer_size is what the provided memory holds, 0 when it is exactly the image
+	HRESULT GetImage(__in IPortableDevice* device, __in const KRicohBufferProvider& get_buffer, __in DWORD buffer_size,
+					__out DWORD* image_size, __in const WCHAR* obj_name);
+	HRESULT DeleteImage(__in IPortableDevice* device, __in const WCHAR* obj_name);
+	HRESULT DeleteImages(__in IPortableDevice* device, __in const std::vector<std::wstring>& obj_ids,
+						__out std::vector<std::wstring>* failed_ids);
 
+	void SetError(__in enum KRicohMTPError error);
+	bool WaitUntilReady(__in KRicohWaitStep step);
+	void DeliverPreview(__in const std::wstring& obj_id);
+
+	Microsoft::WRL::ComPtr<IPortableDevice> GetDevice();
+	static bool IsDisconnectError(__in HRESULT hr);
+	void OnDeviceLost();
+	static DWORD WINAPI ReconnectThread(__in LPVOID param);
+	void RunReconnect();
+	bool TryReconnect();
+	void StopReconnectThread();
+	static DWORD WINAPI AsyncThread(__in LPVOID param);
+	void RunAsync();
+	void StopAsyncThread();
+	std::future<KRicohAsyncResult> PostAsync(__in const KRicohAsyncResult& request,
+											__in std::function<void(KRicohAsyncResult&)> work, __in KRicohAsyncCallback on_done);
+	HRESULT RegisterForEvents();
+	void UnregisterForEvents();
+	void OnDeviceEvent(__in IPortableDeviceValues* pEventParameters);
+
+	// PTP operations go through the KRicohWpdTransport of the current device, which keeps its
+	// WPD parameter objects between calls
+	std::shared_ptr<KRicohWpdTransport> GetTransport(__in IPortableDevice* pDevice);
 	HRESULT SendCommand(__in IPortableDevice* pDevice, __in WORD command, __out DWORD* result = NULL, 
 						__in const ULONG* params = NULL, __in const int param_count = 0);
+	HRESULT SendCommandReadData(__in IPortableDevice* pDevice, __in WORD command, __out DWORD* result,
+								__out std::vector<BYTE>& data, __in const ULONG* params = NULL, __in const int param_count = 0);
+	HRESULT SendCommandWriteData(__in IPortableDevice* pDevice, __in WORD command, __out DWORD* result,
+								__in const std::vector<BYTE>& data, __in const ULONG* params = NULL, __in const int param_count = 0);
+	HRESULT ExecuteOperation(__in KRicohPtpTransport& transport, __inout KRicohPtpOperation& op, __out DWORD* result);
 public:
 	// if there is ricoh theta s, return true and set member, else return false
+	// the camera opened last time is tried first, without enumerating
 	bool InitRicohDevice();
+	// opens one camera from EnumerateRicohDevices, one KRicohMTP per camera
+	bool InitRicohDevice(__in const std::wstring& pnp_device_id);
+	// PnP IDs of every RICOH THETA S attached, COM must be initialized on the calling thread
+	static DWORD EnumerateRicohDevices(__out std::vector<std::wstring>& pnp_device_ids);
+	std::wstring GetDeviceID();
 	DWORD OpenSession(__in ULONG storage = 0x10001);
 	DWORD CloseSession();
 	DWORD TakePicture();
+	// returns as soon as the camera reports the new object, new_object_id is empty on timeout
+	DWORD TakePicture(__out std::wstring& new_object_id, __in DWORD timeout_ms = DEFAULT_CAPTURE_TIMEOUT);
+	// the two halves of TakePicture: send InitiateCapture, then wait for the new object
+	DWORD TriggerCapture();
+	// cancel_event, when given, ends the wait early with CALL_CANCELLED
+	bool WaitForCapture(__out std::wstring& new_object_id, __in DWORD timeout_ms = DEFAULT_CAPTURE_TIMEOUT,
+						__in HANDLE cancel_event = nullptr);
+	// InitiateOpenCapture (0x101C): the camera shoots on its own, TimelapseInterval apart, until
+	// TimelapseNumber pictures are taken or TerminateOpenCapture (0x1018); WaitForCapture returns each one
+	DWORD InitiateOpenCapture();
+	DWORD TerminateOpenCapture();
+	// These delete the picture as soon as it is in memory; KRicohSpool deletes it only once
+	// its file is on disk
 	bool GetOneImageAndDelete(__out std::list<BYTE>& out_image);
+	// the image is read into one contiguous block sized from WPD_OBJECT_SIZE
+	bool GetOneImageAndDelete(__out std::vector<BYTE>& out_image);
+	// caller owned buffer, image_size is set to the needed size even if the buffer is too small
+	bool GetOneImageAndDelete(__out BYTE* buffer, __in DWORD buffer_size, __out DWORD* image_size);
+	bool GetLastImageSize(__out DWORD* image_size);
+	// skips the object enumeration when the object id is already known (e.g. from TakePicture)
+	bool GetImageAndDelete(__in const std::wstring& obj_id, __out std::vector<BYTE>& out_image);
+
+	// single steps of GetImageAndDelete, each waits for the camera to be ready first
+	bool DownloadImage(__in const std::wstring& obj_id, __out std::vector<BYTE>& out_image);
+	// GetPartialObject (0x101B) in chunks, a failed chunk is asked for again from the last good offset.
+	// With resume the bytes already in out_image are kept, so an interrupted download can be continued.
+	bool DownloadImagePartial(__in const std::wstring& obj_id, __inout std::vector<BYTE>& out_image, __in bool resume = false);
+	// streams the object into memory from get_buffer, e.g. a buffer of another runtime or a mapped
+	// file; image_size is set even when get_buffer gives up (IMAGE_BUFFER_TOO_SMALL)
+	bool DownloadImage(__in const std::wstring& obj_id, __in KRicohBufferProvider get_buffer, __out DWORD* image_size);
+	bool GetImageSize(__in const std::wstring& obj_id, __out DWORD* image_size);
+	// size and file name on the camera (e.g. R0010042.JPG), which tell a picture from a later one
+	// the camera gave the same handle
+	bool GetImageInfo(__in const std::wstring& obj_id, __out DWORD* image_size, __out std::wstring& file_name);
+	// chunk_size > 0 makes DownloadImage use DownloadImagePartial, 0 streams the whole object
+	void SetPartialTransfer(__in DWORD chunk_size);
+	// Chunk size of streamed downloads: TRANSFER_CHUNK_DRIVER (default) uses the driver's optimal size,
+	// TRANSFER_CHUNK_AUTO measures the first transfers of a session and keeps the fastest size for
+	// this camera, any other value is used as is
+	void SetTransferChunkSize(__in DWORD chunk_size);
+	// chunk size of the last streamed download, 0 before the first one
+	DWORD GetTransferChunkSize();
+	// PTP GetThumb (0x100A): a few KB instead of the whole equirectangular picture
+	bool GetThumbnail(__in const std::wstring& obj_id, __out std::vector<BYTE>& thumbnail);
+	// When set, GetOneImageAndDelete and GetImageAndDelete hand over the thumbnail first and
+	// transfer the picture after; an empty callback turns this off
+	void SetPreviewCallback(__in KRicohPreviewCallback on_preview);
+	bool DeleteImage(__in const std::wstring& obj_id);
+
+	// deletes every object in one IPortableDeviceContent::Delete call, failed_ids lists the ones left on the camera
+	bool DeleteImages(__in const std::vector<std::wstring>& obj_ids, __out std::vector<std::wstring>& failed_ids);
+	// batch_size > 0 queues DeleteImage calls and deletes them together once batch_size are queued,
+	// at FlushDeletes or when the camera is closed; 0 deletes immediately
+	void SetDeferredDelete(__in DWORD batch_size);
+	bool FlushDeletes();
+	// objects that a deferred flush could not delete since the last call
+	void GetFailedDeletes(__out std::vector<std::wstring>& failed_ids);
+
+	// pictures on the camera from the object index, oldest first; only handles above newer_than are returned
+	bool GetImageList(__out std::vector<std::wstring>& obj_ids, __in DWORD newer_than = 0);
+	// forces the object index to be rebuilt from the device on next use
+	void RefreshObjectIndex();
+
+	// PTP GetObjectHandles (0x1007) in a single transaction, parent 0 means every object of the storage
+	bool GetObjectHandles(__out std::vector<DWORD>& handles, __in ULONG storage = PTP_STORAGE_ALL,
+						__in WORD format = PTP_FORMAT_ANY, __in ULONG parent = 0);
+	bool GetLastImageHandle(__out DWORD& handle, __in ULONG storage = PTP_STORAGE_ALL);
+	static std::wstring HandleToObjectID(__in DWORD handle);
+	// 0 for anything that is not an MTP object id
+	static DWORD ObjectIDToHandle(__in PCWSTR obj_id);
+	// PTP GetDevicePropValue (0x1015), e.g. 0x5001 BatteryLevel; cheap enough to poll
+	bool GetDevicePropValue(__in WORD prop_code, __out std::vector<BYTE>& value);
+	// PTP SetDevicePropValue (0x1016), value in the property's own little endian type
+	bool SetDevicePropValue(__in WORD prop_code, __in const std::vector<BYTE>& value);
+	// any PTP operation, op.response and op.response_params hold what the camera answered;
+	// true only for PTP_RESPONSE_OK
+	bool ExecutePtpOperation(__inout KRicohPtpOperation& op);
+	// error of the last failed call made by the calling thread
 	int GetLastError();
+	// NO_RICOH_ERROR for the calling thread again, e.g. before a call that sets nothing when it succeeds
+	void ClearLastError();
+
+	// The same calls with a deadline and a cancel event. Transient failures (camera busy, USB
+	// timeouts, a reconnect) are retried with backoff inside the deadline, and whatever is still
+	// pending on the device when it passes is cancelled, so a stuck transfer cannot hold the call.
+	// A retried partial download continues at the last good offset; DeleteImage ignores
+	// SetDeferredDelete and deletes at once.
+	KRicohCallResult TakePicture(__out std::wstring& new_object_id, __in const KRicohCallOptions& options);
+	KRicohCallResult DownloadImage(__in const std::wstring& obj_id, __out std::vector<BYTE>& out_image,
+									__in const KRicohCallOptions& options);
+	KRicohCallResult DeleteImage(__in const std::wstring& obj_id, __in const KRicohCallOptions& options);
+	KRicohCallResult ExecutePtpOperation(__inout KRicohPtpOperation& op, __in const KRicohCallOptions& options);
+	// busy and interrupted answers, timeouts and a camera that dropped off USB
+	static bool IsTransientFailure(__in HRESULT hr, __in DWORD response);
+
+	// upper bound for each readiness wait, the call returns as soon as the camera answers
+	void SetReadyBudget(__in DWORD budget_ms);
+	KRicohWaitStats GetWaitStats(__in KRicohWaitStep step);
+	void ResetWaitStats();
+	// counts, errors, bytes/s and p50/p90/p99 per phase since the last reset
+	KRicohMetricsSnapshot GetMetrics();
+	void ResetMetrics();
+
+	// hands a downloaded image back once it is consumed, the next download reuses its memory
+	void ReleaseImage(__inout std::vector<BYTE>& image);
+	KRicohPoolStats GetBufferPoolStats();
+	// upper bound of the memory kept for reuse, 0 frees it and turns pooling off
+	void SetBufferPoolLimit(__in ULONGLONG max_bytes);
+
+	// false while the camera is off USB, it is reopened and its session resumed in the background
+	bool IsConnected();
+	// how long a call waits for a lost camera to come back before it fails
+	void SetReconnectTimeout(__in DWORD timeout_ms);
+	DWORD GetReconnectCount();
+
+	// Non-blocking variants, queued in order on an internal worker thread. on_done runs on that
+	// worker right before the future becomes ready, so it may queue the next call (e.g. DownloadAsync
+	// of the new object) but should not block. Calls still queued when the object is destroyed
+	// complete with CALL_CANCELLED.
+	std::future<KRicohAsyncResult> TakePictureAsync(__in KRicohAsyncCallback on_done = KRicohAsyncCallback(),
+													__in DWORD timeout_ms = DEFAULT_CAPTURE_TIMEOUT);
+	std::future<KRicohAsyncResult> DownloadAsync(__in const std::wstring& obj_id,
+												__in KRicohAsyncCallback on_done = KRicohAsyncCallback());
+	std::future<KRicohAsyncResult> DeleteAsync(__in const std::wstring& obj_id,
+												__in KRicohAsyncCallback on_done = KRicohAsyncCallback());
+	// calls queued or running on the worker
+	DWORD GetPendingAsyncCount();
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,158 @@
+#include "KRicohMetrics.h"
+#include <string.h>
+
+KRicohMetrics::KRicohMetrics()
+{
+	Reset();
+}
+
+KRicohMetrics::~KRicohMetrics()
+{
+}
+
+void KRicohMetrics::Record(KRicohMetricPhase phase, uint64_t elapsed_us, bool succeeded, uint64_t bytes, uint64_t chunks)
+{
+	if (phase < 0 || phase >= METRIC_PHASE_COUNT)
+		return;
+
+	PhaseCounters& counters = this->phases[phase];
+
+	// Each counter is updated on its own, a snapshot may see a call half recorded
+	counters.calls.fetch_add(1, std::memory_order_relaxed);
+	if (!succeeded)
+		counters.errors.fetch_add(1, std::memory_order_relaxed);
+	counters.bytes.fetch_add(bytes, std::memory_order_relaxed);
+	counters.chunks.fetch_add(chunks, std::memory_order_relaxed);
+	counters.total_us.fetch_add(elapsed_us, std::memory_order_relaxed);
+	counters.buckets[BucketOf(elapsed_us)].fetch_add(1, std::memory_order_relaxed);
+
+	uint64_t max_us = counters.max_us.load(std::memory_order_relaxed);
+	while (elapsed_us > max_us && !counters.max_us.compare_exchange_weak(max_us, elapsed_us, std::memory_order_relaxed))
+	{
+	}
+}
+
+void KRicohMetrics::Snapshot(KRicohMetricsSnapshot& snapshot)
+{
+	memset(&snapshot, 0, sizeof(snapshot));
+
+	for (int phase = 0; phase < METRIC_PHASE_COUNT; phase++)
+	{
+		PhaseCounters& counters = this->phases[phase];
+		KRicohPhaseStats& stats = snapshot.phases[phase];
+		uint64_t buckets[METRIC_HISTOGRAM_BUCKETS];
+		uint64_t count = 0;
+
+		// Percentiles come from the bucket copy alone so they agree with each other
+		for (int i = 0; i < METRIC_HISTOGRAM_BUCKETS; i++)
+		{
+			buckets[i] = counters.buckets[i].load(std::memory_order_relaxed);
+			count += buckets[i];
+		}
+
+		stats.calls = counters.calls.load(std::memory_order_relaxed);
+		stats.errors = counters.errors.load(std::memory_order_relaxed);
+		stats.bytes = counters.bytes.load(std::memory_order_relaxed);
+		stats.chunks = counters.chunks.load(std::memory_order_relaxed);
+		stats.total_us = counters.total_us.load(std::memory_order_relaxed);
+		stats.max_us = counters.max_us.load(std::memory_order_relaxed);
+
+		stats.p50_us = Percentile(buckets, count, 0.50);
+		stats.p90_us = Percentile(buckets, count, 0.90);
+		stats.p99_us = Percentile(buckets, count, 0.99);
+
+		// A bucket bound past the slowest call says less than the call itself
+		if (stats.p50_us > stats.max_us)
+			stats.p50_us = stats.max_us;
+		if (stats.p90_us > stats.max_us)
+			stats.p90_us = stats.max_us;
+		if (stats.p99_us > stats.max_us)
+			stats.p99_us = stats.max_us;
+
+		if (stats.total_us > 0)
+			stats.bytes_per_second = (double)stats.bytes * 1000000.0 / (double)stats.total_us;
+	}
+}
+
+void KRicohMetrics::Reset()
+{
+	for (int phase = 0; phase < METRIC_PHASE_COUNT; phase++)
+	{
+		PhaseCounters& counters = this->phases[phase];
+
+		counters.calls.store(0, std::memory_order_relaxed);
+		counters.errors.store(0, std::memory_order_relaxed);
+		counters.bytes.store(0, std::memory_order_relaxed);
+		counters.chunks.store(0, std::memory_order_relaxed);
+		counters.total_us.store(0, std::memory_order_relaxed);
+		counters.max_us.store(0, std::memory_order_relaxed);
+		for (int i = 0; i < METRIC_HISTOGRAM_BUCKETS; i++)
+			counters.buckets[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+const char* KRicohMetrics::PhaseName(KRicohMetricPhase phase)
+{
+	switch (phase)
+	{
+	case METRIC_CAPTURE:
+		return "capture";
+	case METRIC_ENUMERATE:
+		return "enumerate";
+	case METRIC_TRANSFER:
+		return "transfer";
+	case METRIC_DELETE:
+		return "delete";
+	default:
+		return "unknown";
+	}
+}
+
+int KRicohMetrics::BucketOf(uint64_t us)
+{
+	if (us < 4)
+		return (int)us;
+
+	// Position of the highest bit, then the next two bits pick the quarter within it
+	int exponent = 2;
+	while ((us >> (exponent + 1)) != 0)
+		exponent++;
+
+	int bucket = 4 + (exponent - 2) * 4 + (int)((us >> (exponent - 2)) & 3);
+
+	return bucket < METRIC_HISTOGRAM_BUCKETS ? bucket : METRIC_HISTOGRAM_BUCKETS - 1;
+}
+
+uint64_t KRicohMetrics::BucketUpperBound(int bucket)
+{
+	if (bucket < 4)
+		return (uint64_t)bucket;
+
+	int exponent = (bucket - 4) / 4 + 2;
+	int quarter = (bucket - 4) % 4;
+
+	return ((uint64_t)(5 + quarter) << (exponent - 2)) - 1;
+}
+
+uint64_t KRicohMetrics::Percentile(const uint64_t* buckets, uint64_t count, double fraction)
+{
+	if (count == 0)
+		return 0;
+
+	// Smallest bucket that covers the requested share of the calls
+	uint64_t rank = (uint64_t)(fraction * (double)count);
+	if ((double)rank < fraction * (double)count)
+		rank++;
+	if (rank == 0)
+		rank = 1;
+
+	uint64_t seen = 0;
+	for (int i = 0; i < METRIC_HISTOGRAM_BUCKETS; i++)
+	{
+		seen += buckets[i];
+		if (seen >= rank)
+			return BucketUpperBound(i);
+	}
+
+	return BucketUpperBound(METRIC_HISTOGRAM_BUCKETS - 1);
+}
@@ -0,0 +1,76 @@
+#ifndef _K_RICOH_METRICS_H_
+#define _K_RICOH_METRICS_H_
+
+// Latency and throughput counters per phase of a capture cycle.
+// Recording is lock-free so it can stay on in production; nothing here depends on
+// Windows, so the simulated benchmarks use the same counters on Linux.
+
+#include "KRicohPtp.h"
+#include <atomic>
+
+// Latency buckets: exact below 4 us, then 4 buckets per power of two (<= 25% wide)
+#define METRIC_HISTOGRAM_BUCKETS    128
+
+enum KRicohMetricPhase{
+	METRIC_CAPTURE = 0,		// InitiateCapture until the camera reports the new object
+	METRIC_ENUMERATE = 1,	// walking the device for the picture index
+	METRIC_TRANSFER = 2,	// reading an image off the camera
+	METRIC_DELETE = 3,		// deleting one or a batch of pictures
+	METRIC_PHASE_COUNT = 4
+};
+
+// A copy of the counters of one phase, times in microseconds
+struct KRicohPhaseStats{
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t chunks;			// transfer requests for TRANSFER, objects seen for ENUMERATE and DELETE
+	uint64_t total_us;
+	uint64_t max_us;
+	uint64_t p50_us;			// upper bound of the bucket holding the percentile
+	uint64_t p90_us;
+	uint64_t p99_us;
+	double bytes_per_second;	// bytes over the time spent in the phase
+};
+
+struct KRicohMetricsSnapshot{
+	KRicohPhaseStats phases[METRIC_PHASE_COUNT];
+};
+
+class K_RICOH_API KRicohMetrics
+{
+public:
+	KRicohMetrics();
+	virtual ~KRicohMetrics();
+
+private:
+	struct PhaseCounters{
+		std::atomic<uint64_t> calls;
+		std::atomic<uint64_t> errors;
+		std::atomic<uint64_t> bytes;
+		std::atomic<uint64_t> chunks;
+		std::atomic<uint64_t> total_us;
+		std::atomic<uint64_t> max_us;
+		std::atomic<uint64_t> buckets[METRIC_HISTOGRAM_BUCKETS];
+	};
+
+	PhaseCounters phases[METRIC_PHASE_COUNT];
+
+	KRicohMetrics(const KRicohMetrics&);
+	KRicohMetrics& operator=(const KRicohMetrics&);
+
+	static int BucketOf(uint64_t us);
+	static uint64_t BucketUpperBound(int bucket);
+	static uint64_t Percentile(const uint64_t* buckets, uint64_t count, double fraction);
+
+public:
+	// safe from any thread, never blocks
+	void Record(KRicohMetricPhase phase, uint64_t elapsed_us, bool succeeded, uint64_t bytes = 0, uint64_t chunks = 0);
+	void Snapshot(KRicohMetricsSnapshot& snapshot);
+	// counters recorded while resetting may be lost
+	void Reset();
+
+	static const char* PhaseName(KRicohMetricPhase phase);
+};
+
+#endif
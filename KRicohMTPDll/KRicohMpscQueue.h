@@ -0,0 +1,86 @@
+#ifndef _K_RICOH_MPSC_QUEUE_H_
+#define _K_RICOH_MPSC_QUEUE_H_
+
+#include <Windows.h>
+
+// Unbounded FIFO for many producers and one consumer, without a lock.
+// Push is one interlocked exchange, so producers never wait for each other or for the
+// consumer; items come out in the order their exchanges happened. Only one thread may Pop.
+// Pop can miss an item whose Push is still between its two steps, that Push finishes by itself.
+template <typename T>
+class KRicohMpscQueue
+{
+private:
+	struct Node{
+		Node* volatile next;
+		T value;
+	};
+
+	// Producers swap themselves in at head, the consumer walks from the dummy node at tail
+	Node* volatile head;
+	Node* tail;
+	volatile LONG count;
+
+	KRicohMpscQueue(const KRicohMpscQueue&);
+	KRicohMpscQueue& operator=(const KRicohMpscQueue&);
+
+public:
+	KRicohMpscQueue()
+		: count(0)
+	{
+		Node* dummy = new Node();
+
+		dummy->next = nullptr;
+		this->head = dummy;
+		this->tail = dummy;
+	}
+
+	~KRicohMpscQueue()
+	{
+		while (this->tail != nullptr)
+		{
+			Node* next = this->tail->next;
+			delete this->tail;
+			this->tail = next;
+		}
+	}
+
+	void Push(__in const T& item)
+	{
+		Node* node = new Node();
+
+		node->next = nullptr;
+		node->value = item;
+		InterlockedIncrement(&this->count);
+
+		Node* prev = static_cast<Node*>(InterlockedExchangePointer((PVOID volatile*)&this->head, node));
+		// Full barrier, the consumer sees value before the link
+		InterlockedExchangePointer((PVOID volatile*)&prev->next, node);
+	}
+
+	bool Pop(__out T& item)
+	{
+		// volatile reads have acquire semantics with /volatile:ms, the default on x86 and x64
+		Node* next = this->tail->next;
+
+		if (next == nullptr)
+			return false;
+
+		// next becomes the dummy, its value is no longer needed there
+		item = next->value;
+		next->value = T();
+		delete this->tail;
+		this->tail = next;
+		InterlockedDecrement(&this->count);
+
+		return true;
+	}
+
+	// pushed and not popped yet, a snapshot while producers are busy
+	size_t Size()
+	{
+		return (size_t)this->count;
+	}
+};
+
+#endif
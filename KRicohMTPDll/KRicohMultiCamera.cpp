@@ -0,0 +1,293 @@
+#include "KRicohMultiCamera.h"
+
+using namespace std;
+
+// How long TriggerAll waits for every worker to be parked before releasing (ms)
+#define TRIGGER_ARM_TIMEOUT 1000
+
+KRicohMultiCamera::KRicohMultiCamera()
+	: session(0x10001), armed(0), released(0)
+{
+	QueryPerformanceFrequency(&this->frequency);
+}
+
+KRicohMultiCamera::~KRicohMultiCamera()
+{
+	CloseAll();
+}
+
+DWORD KRicohMultiCamera::OpenAll(__in ULONG session)
+{
+	std::vector<std::wstring> pnp_device_ids;
+
+	CloseAll();
+	this->session = session;
+
+	// The enumeration runs on the caller's thread, which may not have joined COM yet
+	HRESULT hrCom = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+	KRicohMTP::EnumerateRicohDevices(pnp_device_ids);
+	if (SUCCEEDED(hrCom))
+		CoUninitialize();
+
+	for (size_t i = 0; i < pnp_device_ids.size(); i++)
+	{
+		Worker* worker = new (std::nothrow) Worker();
+		if (worker == nullptr)
+			break;
+
+		worker->owner = this;
+		worker->device_id = pnp_device_ids[i];
+		worker->camera = nullptr;
+		worker->command = COMMAND_NONE;
+		worker->timeout_ms = DEFAULT_CAPTURE_TIMEOUT;
+		worker->pending = false;
+		worker->command_event = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+		worker->done_event = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+		worker->thread = nullptr;
+
+		if (worker->command_event != nullptr && worker->done_event != nullptr)
+			worker->thread = CreateThread(nullptr, 0, WorkerThread, worker, 0, nullptr);
+
+		if (worker->thread == nullptr)
+		{
+			printf("! Failed to start the worker for camera '%ws'\n", worker->device_id.c_str());
+			if (worker->command_event != nullptr)
+				CloseHandle(worker->command_event);
+			if (worker->done_event != nullptr)
+				CloseHandle(worker->done_event);
+			delete worker;
+			continue;
+		}
+
+		this->workers.push_back(worker);
+	}
+
+	// Every worker opens its camera and session on its own thread
+	for (size_t i = 0; i < this->workers.size(); )
+	{
+		Worker* worker = this->workers[i];
+
+		WaitForSingleObject(worker->done_event, INFINITE);
+		if (worker->camera != nullptr)
+		{
+			i++;
+			continue;
+		}
+
+		printf("! Failed to open camera '%ws'\n", worker->device_id.c_str());
+		WaitForSingleObject(worker->thread, INFINITE);
+		CloseHandle(worker->thread);
+		CloseHandle(worker->command_event);
+		CloseHandle(worker->done_event);
+		delete worker;
+		this->workers.erase(this->workers.begin() + i);
+	}
+
+	return (DWORD)this->workers.size();
+}
+
+void KRicohMultiCamera::CloseAll()
+{
+	for (size_t i = 0; i < this->workers.size(); i++)
+	{
+		Worker* worker = this->workers[i];
+
+		worker->command = COMMAND_QUIT;
+		SetEvent(worker->command_event);
+		WaitForSingleObject(worker->thread, INFINITE);
+
+		CloseHandle(worker->thread);
+		CloseHandle(worker->command_event);
+		CloseHandle(worker->done_event);
+		delete worker;
+	}
+
+	this->workers.clear();
+}
+
+DWORD KRicohMultiCamera::GetCameraCount()
+{
+	return (DWORD)this->workers.size();
+}
+
+KRicohMTP* KRicohMultiCamera::GetCamera(__in DWORD index)
+{
+	if (index >= this->workers.size())
+		return nullptr;
+
+	return this->workers[index]->camera;
+}
+
+bool KRicohMultiCamera::TriggerAll(__out std::vector<KRicohTriggerResult>& results, __in DWORD timeout_ms)
+{
+	std::vector<HANDLE> done_events;
+	LARGE_INTEGER arm_start, now, release_time;
+	bool all_captured = true;
+
+	results.clear();
+
+	if (this->workers.empty())
+		return false;
+
+	// A worker of a trigger that timed out writes its result until it signals done_event
+	for (size_t i = 0; i < this->workers.size(); i++)
+	{
+		Worker* worker = this->workers[i];
+
+		if (worker->pending && WaitForSingleObject(worker->done_event, 0) == WAIT_OBJECT_0)
+			worker->pending = false;
+
+		if (worker->pending)
+		{
+			printf("! Camera '%ws' is still busy with the last trigger\n", worker->device_id.c_str());
+			return false;
+		}
+	}
+
+	InterlockedExchange(&this->armed, 0);
+	InterlockedExchange(&this->released, 0);
+
+	// 1) Park every worker right in front of InitiateCapture
+	for (size_t i = 0; i < this->workers.size(); i++)
+	{
+		this->workers[i]->command = COMMAND_TRIGGER;
+		this->workers[i]->timeout_ms = timeout_ms;
+		SetEvent(this->workers[i]->command_event);
+		done_events.push_back(this->workers[i]->done_event);
+	}
+
+	QueryPerformanceCounter(&arm_start);
+	while (this->armed < (LONG)this->workers.size())
+	{
+		QueryPerformanceCounter(&now);
+		if (ElapsedMicroseconds(arm_start, now) > TRIGGER_ARM_TIMEOUT * 1000LL)
+		{
+			printf("! Only %d of %u cameras were ready for the trigger\n", this->armed, (DWORD)this->workers.size());
+			break;
+		}
+		Sleep(0);
+	}
+
+	// 2) Release them together, the workers are spinning on this flag
+	QueryPerformanceCounter(&release_time);
+	InterlockedExchange(&this->released, 1);
+
+	// 3) Each worker signals once its camera reported the picture or timed out. One wait takes
+	// MAXIMUM_WAIT_OBJECTS handles at most, so larger rigs are waited for in chunks.
+	ULONGLONG deadline = GetTickCount64() + timeout_ms + TRIGGER_ARM_TIMEOUT;
+	bool all_done = true;
+
+	for (size_t first = 0; first < done_events.size(); first += MAXIMUM_WAIT_OBJECTS)
+	{
+		DWORD count = (DWORD)min(done_events.size() - first, (size_t)MAXIMUM_WAIT_OBJECTS);
+		DWORD wait_ms = INFINITE;
+
+		if (timeout_ms != INFINITE)
+		{
+			ULONGLONG now_tick = GetTickCount64();
+			wait_ms = (now_tick < deadline) ? (DWORD)(deadline - now_tick) : 0;
+		}
+
+		DWORD wait = WaitForMultipleObjects(count, &done_events[first], TRUE, wait_ms);
+		if (wait >= WAIT_OBJECT_0 && wait < WAIT_OBJECT_0 + count)
+			continue;
+
+		if (wait == WAIT_FAILED)
+			printf("! Failed to wait for the cameras, error = %lu\n", GetLastError());
+		else
+			printf("! Cameras %u to %u did not finish the trigger in time\n", (DWORD)first, (DWORD)(first + count - 1));
+
+		for (size_t i = first; i < first + count; i++)
+			this->workers[i]->pending = true;
+		all_done = false;
+	}
+
+	// The workers of a failed wait may still be writing their results
+	if (!all_done)
+		return false;
+
+	LONGLONG first_issued = 0, last_issued = 0;
+	for (size_t i = 0; i < this->workers.size(); i++)
+	{
+		Worker* worker = this->workers[i];
+
+		worker->result.issued_us = ElapsedMicroseconds(release_time, worker->issued);
+		worker->result.completed_us = ElapsedMicroseconds(release_time, worker->completed);
+		results.push_back(worker->result);
+
+		if (i == 0 || worker->result.issued_us < first_issued)
+			first_issued = worker->result.issued_us;
+		if (i == 0 || worker->result.issued_us > last_issued)
+			last_issued = worker->result.issued_us;
+
+		if (worker->result.new_object_id.empty())
+			all_captured = false;
+	}
+
+	printf("* Triggered %u cameras, InitiateCapture skew %lld us\n", (DWORD)results.size(), last_issued - first_issued);
+
+	return all_captured;
+}
+
+DWORD WINAPI KRicohMultiCamera::WorkerThread(__in LPVOID param)
+{
+	Worker* worker = static_cast<Worker*>(param);
+
+	worker->owner->RunWorker(worker);
+
+	return 0;
+}
+
+void KRicohMultiCamera::RunWorker(__in Worker* worker)
+{
+	// The camera object joins COM on this thread and stays here
+	worker->camera = new (std::nothrow) KRicohMTP();
+	if (worker->camera != nullptr &&
+		(!worker->camera->InitRicohDevice(worker->device_id) ||
+		worker->camera->OpenSession(this->session) != PTP_RESPONSE_OK))
+	{
+		delete worker->camera;
+		worker->camera = nullptr;
+	}
+
+	SetEvent(worker->done_event);
+	if (worker->camera == nullptr)
+		return;
+
+	while (WaitForSingleObject(worker->command_event, INFINITE) == WAIT_OBJECT_0)
+	{
+		if (worker->command == COMMAND_QUIT)
+			break;
+
+		if (worker->command != COMMAND_TRIGGER)
+			continue;
+
+		worker->result.device_id = worker->device_id;
+		worker->result.new_object_id.clear();
+		worker->result.response = 0;
+
+		// Spin instead of waiting on a kernel object, waking up costs more than the skew we want
+		InterlockedIncrement(&this->armed);
+		while (this->released == 0)
+			YieldProcessor();
+
+		QueryPerformanceCounter(&worker->issued);
+		worker->result.response = worker->camera->TriggerCapture();
+		QueryPerformanceCounter(&worker->completed);
+
+		if (worker->result.response == PTP_RESPONSE_OK)
+			worker->camera->WaitForCapture(worker->result.new_object_id, worker->timeout_ms);
+
+		worker->command = COMMAND_NONE;
+		SetEvent(worker->done_event);
+	}
+
+	worker->camera->CloseSession();
+	delete worker->camera;
+	worker->camera = nullptr;
+}
+
+LONGLONG KRicohMultiCamera::ElapsedMicroseconds(__in const LARGE_INTEGER& from, __in const LARGE_INTEGER& to)
+{
+	return (to.QuadPart - from.QuadPart) * 1000000 / this->frequency.QuadPart;
+}
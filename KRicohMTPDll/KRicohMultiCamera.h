@@ -0,0 +1,71 @@
+#ifndef _K_RICOH_MULTI_CAMERA_H_
+#define _K_RICOH_MULTI_CAMERA_H_
+
+#include "KRicohMTP.h"
+
+struct KRicohTriggerResult{
+	std::wstring device_id;
+	DWORD response;				// PTP response code of InitiateCapture
+	LONGLONG issued_us;			// InitiateCapture sent, relative to the trigger release
+	LONGLONG completed_us;		// InitiateCapture answered, relative to the trigger release
+	std::wstring new_object_id;	// empty when the camera did not report the picture in time
+};
+
+// Every attached THETA gets its own KRicohMTP, session and worker thread.
+// TriggerAll releases InitiateCapture on all of them at once.
+class K_RICOH_API KRicohMultiCamera
+{
+public:
+	KRicohMultiCamera();
+	virtual ~KRicohMultiCamera();
+
+private:
+	enum WorkerCommand{
+		COMMAND_NONE,
+		COMMAND_TRIGGER,
+		COMMAND_QUIT
+	};
+
+	struct Worker{
+		KRicohMultiCamera* owner;
+		std::wstring device_id;
+		KRicohMTP* camera;
+		HANDLE thread;
+		HANDLE command_event;
+		HANDLE done_event;
+		WorkerCommand command;
+		DWORD timeout_ms;
+		LARGE_INTEGER issued;
+		LARGE_INTEGER completed;
+		KRicohTriggerResult result;
+		bool pending;			// a trigger timed out before done_event, only TriggerAll uses it
+	};
+
+	std::vector<Worker*> workers;
+	ULONG session;
+	volatile LONG armed;
+	volatile LONG released;
+	LARGE_INTEGER frequency;
+
+	KRicohMultiCamera(const KRicohMultiCamera&);
+	KRicohMultiCamera& operator=(const KRicohMultiCamera&);
+
+	static DWORD WINAPI WorkerThread(__in LPVOID param);
+	void RunWorker(__in Worker* worker);
+	LONGLONG ElapsedMicroseconds(__in const LARGE_INTEGER& from, __in const LARGE_INTEGER& to);
+
+public:
+	// opens every attached RICOH THETA S, returns the number of cameras ready
+	DWORD OpenAll(__in ULONG session = 0x10001);
+	void CloseAll();
+	DWORD GetCameraCount();
+	// the camera stays owned by this object, use it only while no trigger is running
+	KRicohMTP* GetCamera(__in DWORD index);
+
+	// fires InitiateCapture on every camera with minimal skew and waits for the new pictures,
+	// results are in the camera order of GetCamera. Gives up after timeout_ms plus the time to
+	// arm the cameras; a camera still busy from that fails the next TriggerAll until it is done.
+	bool TriggerAll(__out std::vector<KRicohTriggerResult>& results, __in DWORD timeout_ms = DEFAULT_CAPTURE_TIMEOUT);
+};
+
+#endif
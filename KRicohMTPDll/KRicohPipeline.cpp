@@ -0,0 +1,239 @@
+#include "KRicohPipeline.h"
+
+using namespace std;
+
+KRicohPipeline::KRicohPipeline(__in KRicohMTP& camera, __in DWORD queue_depth)
+	: camera(camera), queue_depth(queue_depth), shot_count(0),
+	download_queue(nullptr), delete_queue(nullptr), stop_requested(0)
+{
+	ZeroMemory(this->threads, sizeof(this->threads));
+	ZeroMemory(&this->stats, sizeof(this->stats));
+}
+
+KRicohPipeline::~KRicohPipeline()
+{
+	Stop();
+}
+
+bool KRicohPipeline::Start(__in KRicohImageCallback on_image, __in DWORD shot_count)
+{
+	if (IsRunning())
+	{
+		printf("! The pipeline is already running\n");
+		return false;
+	}
+
+	Release();
+
+	this->on_image = on_image;
+	this->shot_count = shot_count;
+	this->stop_requested = 0;
+	ZeroMemory(&this->stats, sizeof(this->stats));
+
+	this->download_queue = new (std::nothrow) KRicohBoundedQueue<std::wstring>(this->queue_depth);
+	this->delete_queue = new (std::nothrow) KRicohBoundedQueue<std::wstring>(this->queue_depth);
+	if (this->download_queue == nullptr || this->delete_queue == nullptr)
+	{
+		printf("! Failed to allocate the pipeline queues\n");
+		Release();
+		return false;
+	}
+
+	// Start from the end so every stage has its consumer running
+	this->threads[2] = CreateThread(nullptr, 0, DeleteThread, this, 0, nullptr);
+	this->threads[1] = CreateThread(nullptr, 0, DownloadThread, this, 0, nullptr);
+	this->threads[0] = CreateThread(nullptr, 0, CaptureThread, this, 0, nullptr);
+
+	if (this->threads[0] == nullptr || this->threads[1] == nullptr || this->threads[2] == nullptr)
+	{
+		printf("! Failed to create the pipeline threads\n");
+		Stop();
+		return false;
+	}
+
+	return true;
+}
+
+void KRicohPipeline::Stop()
+{
+	InterlockedExchange(&this->stop_requested, 1);
+	Wait();
+	Release();
+}
+
+void KRicohPipeline::Wait()
+{
+	// A stage closes the queue to the next one when it finishes, so waiting on
+	// the threads in order drains every queue.
+	for (int i = 0; i < 3; i++)
+	{
+		if (this->threads[i] != nullptr)
+		{
+			WaitForSingleObject(this->threads[i], INFINITE);
+			CloseHandle(this->threads[i]);
+			this->threads[i] = nullptr;
+		}
+		else if (i == 0 && this->download_queue != nullptr)
+		{
+			this->download_queue->Close();
+		}
+		else if (i == 1 && this->delete_queue != nullptr)
+		{
+			this->delete_queue->Close();
+		}
+	}
+
+	if (this->download_queue != nullptr)
+		this->stats.peak_download_queue = (DWORD)this->download_queue->Peak();
+	if (this->delete_queue != nullptr)
+		this->stats.peak_delete_queue = (DWORD)this->delete_queue->Peak();
+}
+
+bool KRicohPipeline::IsRunning()
+{
+	for (int i = 0; i < 3; i++)
+	{
+		if (this->threads[i] != nullptr && WaitForSingleObject(this->threads[i], 0) == WAIT_TIMEOUT)
+			return true;
+	}
+
+	return false;
+}
+
+KRicohPipelineStats KRicohPipeline::GetStats()
+{
+	KRicohPipelineStats snapshot = this->stats;
+
+	if (this->download_queue != nullptr)
+		snapshot.peak_download_queue = (DWORD)this->download_queue->Peak();
+	if (this->delete_queue != nullptr)
+		snapshot.peak_delete_queue = (DWORD)this->delete_queue->Peak();
+
+	return snapshot;
+}
+
+void KRicohPipeline::Release()
+{
+	for (int i = 0; i < 3; i++)
+	{
+		if (this->threads[i] != nullptr)
+		{
+			CloseHandle(this->threads[i]);
+			this->threads[i] = nullptr;
+		}
+	}
+
+	delete this->download_queue;
+	this->download_queue = nullptr;
+	delete this->delete_queue;
+	this->delete_queue = nullptr;
+}
+
+DWORD WINAPI KRicohPipeline::CaptureThread(__in LPVOID param)
+{
+	CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+	static_cast<KRicohPipeline*>(param)->CaptureStage();
+	CoUninitialize();
+
+	return 0;
+}
+
+DWORD WINAPI KRicohPipeline::DownloadThread(__in LPVOID param)
+{
+	CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+	static_cast<KRicohPipeline*>(param)->DownloadStage();
+	CoUninitialize();
+
+	return 0;
+}
+
+DWORD WINAPI KRicohPipeline::DeleteThread(__in LPVOID param)
+{
+	CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+	static_cast<KRicohPipeline*>(param)->DeleteStage();
+	CoUninitialize();
+
+	return 0;
+}
+
+void KRicohPipeline::CaptureStage()
+{
+	DWORD shots = 0;
+	DWORD failures = 0;
+	DWORD retry_delay = PIPELINE_RETRY_DELAY;
+
+	while (this->stop_requested == 0 && (this->shot_count == 0 || shots < this->shot_count))
+	{
+		std::wstring obj_id;
+
+		shots++;
+		this->camera.TakePicture(obj_id);
+		if (obj_id.empty())
+		{
+			InterlockedIncrement(&this->stats.capture_errors);
+
+			if (++failures >= PIPELINE_MAX_CAPTURE_FAILURES)
+			{
+				printf("! %u captures failed in a row, the pipeline stops shooting\n", failures);
+				break;
+			}
+
+			// Give a busy or reconnecting camera time instead of asking again at once; Stop still ends the wait
+			for (DWORD waited = 0; waited < retry_delay && this->stop_requested == 0; waited += 50)
+				Sleep(50);
+			retry_delay = min(retry_delay * 2, (DWORD)PIPELINE_MAX_RETRY_DELAY);
+			continue;
+		}
+
+		failures = 0;
+		retry_delay = PIPELINE_RETRY_DELAY;
+		InterlockedIncrement(&this->stats.captured);
+
+		// Blocks while the download stage is behind
+		if (!this->download_queue->Push(obj_id))
+			break;
+	}
+
+	this->download_queue->Close();
+}
+
+void KRicohPipeline::DownloadStage()
+{
+	std::wstring obj_id;
+	std::vector<BYTE> image;
+
+	while (this->download_queue->Pop(obj_id))
+	{
+		if (!this->camera.DownloadImage(obj_id, image))
+		{
+			// Leave the picture on the camera
+			InterlockedIncrement(&this->stats.download_errors);
+			continue;
+		}
+
+		InterlockedIncrement(&this->stats.downloaded);
+
+		if (this->on_image)
+			this->on_image(obj_id, image);
+
+		if (!this->delete_queue->Push(obj_id))
+			break;
+	}
+
+	this->delete_queue->Close();
+}
+
+void KRicohPipeline::DeleteStage()
+{
+	std::vector<std::wstring> obj_ids;
+	std::vector<std::wstring> failed_ids;
+
+	// Everything that piled up while the last delete ran goes out in one call
+	while (this->delete_queue->PopBatch(obj_ids, this->queue_depth))
+	{
+		this->camera.DeleteImages(obj_ids, failed_ids);
+
+		InterlockedExchangeAdd(&this->stats.deleted, (LONG)(obj_ids.size() - failed_ids.size()));
+		InterlockedExchangeAdd(&this->stats.delete_errors, (LONG)failed_ids.size());
+	}
+}
@@ -0,0 +1,74 @@
+#ifndef _K_RICOH_PIPELINE_H_
+#define _K_RICOH_PIPELINE_H_
+
+#include "KRicohMTP.h"
+#include "KRicohQueue.h"
+#include <functional>
+
+// Pictures waiting between two stages
+#define DEFAULT_PIPELINE_DEPTH  4
+// After a failed capture the next one waits, twice as long after every further failure (ms)
+#define PIPELINE_RETRY_DELAY    100
+#define PIPELINE_MAX_RETRY_DELAY 5000
+// Captures failing in a row that end the run, e.g. the camera was unplugged for good
+#define PIPELINE_MAX_CAPTURE_FAILURES 20
+
+// Called on the download stage for every picture, the picture is deleted from
+// the camera after the callback returns
+typedef std::function<void(const std::wstring& obj_id, std::vector<BYTE>& image)> KRicohImageCallback;
+
+// The counters are updated by the stage threads with Interlocked calls
+struct KRicohPipelineStats{
+	volatile LONG captured;
+	volatile LONG downloaded;
+	volatile LONG deleted;
+	volatile LONG capture_errors;
+	volatile LONG download_errors;
+	volatile LONG delete_errors;
+	DWORD peak_download_queue;
+	DWORD peak_delete_queue;
+};
+
+// Capture -> download -> delete stages on their own threads, joined by bounded
+// queues, so picture N is transferred and removed while the camera takes N+1.
+class K_RICOH_API KRicohPipeline
+{
+public:
+	KRicohPipeline(__in KRicohMTP& camera, __in DWORD queue_depth = DEFAULT_PIPELINE_DEPTH);
+	virtual ~KRicohPipeline();
+
+private:
+	KRicohMTP& camera;
+	DWORD queue_depth;
+	KRicohImageCallback on_image;
+	DWORD shot_count;
+
+	KRicohBoundedQueue<std::wstring>* download_queue;
+	KRicohBoundedQueue<std::wstring>* delete_queue;
+	HANDLE threads[3];
+	volatile LONG stop_requested;
+	KRicohPipelineStats stats;
+
+	KRicohPipeline(const KRicohPipeline&);
+	KRicohPipeline& operator=(const KRicohPipeline&);
+
+	static DWORD WINAPI CaptureThread(__in LPVOID param);
+	static DWORD WINAPI DownloadThread(__in LPVOID param);
+	static DWORD WINAPI DeleteThread(__in LPVOID param);
+	void CaptureStage();
+	void DownloadStage();
+	void DeleteStage();
+	void Release();
+
+public:
+	// shot_count 0 keeps shooting until Stop, or until PIPELINE_MAX_CAPTURE_FAILURES captures fail in a row
+	bool Start(__in KRicohImageCallback on_image, __in DWORD shot_count = 0);
+	// stops capturing and waits until the queued pictures are downloaded and deleted
+	void Stop();
+	// waits until all shots of a bounded run are done
+	void Wait();
+	bool IsRunning();
+	KRicohPipelineStats GetStats();
+};
+
+#endif
@@ -0,0 +1,38 @@
+#include "KRicohPtp.h"
+
+// Every operation the library sends, looked up by code
+static const KRicohPtpOpDesc ptp_operations[] = {
+	{ PTP_OC_GET_DEVICE_INFO,       "GetDeviceInfo",        0, PTP_DATA_READ },
+	{ PTP_OC_OPEN_SESSION,          "OpenSession",          1, PTP_DATA_NONE },
+	{ PTP_OC_CLOSE_SESSION,         "CloseSession",         0, PTP_DATA_NONE },
+	{ PTP_OC_GET_NUM_OBJECTS,       "GetNumObjects",        3, PTP_DATA_NONE },
+	{ PTP_OC_GET_OBJECT_HANDLES,    "GetObjectHandles",     3, PTP_DATA_READ },
+	{ PTP_OC_GET_OBJECT_INFO,       "GetObjectInfo",        1, PTP_DATA_READ },
+	{ PTP_OC_GET_OBJECT,            "GetObject",            1, PTP_DATA_READ },
+	{ PTP_OC_GET_THUMB,             "GetThumb",             1, PTP_DATA_READ },
+	{ PTP_OC_DELETE_OBJECT,         "DeleteObject",         2, PTP_DATA_NONE },
+	{ PTP_OC_INITIATE_CAPTURE,      "InitiateCapture",      2, PTP_DATA_NONE },
+	{ PTP_OC_GET_DEVICE_PROP_VALUE, "GetDevicePropValue",   1, PTP_DATA_READ },
+	{ PTP_OC_SET_DEVICE_PROP_VALUE, "SetDevicePropValue",   1, PTP_DATA_WRITE },
+	{ PTP_OC_TERMINATE_OPEN_CAPTURE, "TerminateOpenCapture", 1, PTP_DATA_NONE },
+	{ PTP_OC_GET_PARTIAL_OBJECT,    "GetPartialObject",     3, PTP_DATA_READ },
+	{ PTP_OC_INITIATE_OPEN_CAPTURE, "InitiateOpenCapture",  2, PTP_DATA_NONE },
+};
+
+const KRicohPtpOpDesc* KRicohPtpFindOp(uint16_t code)
+{
+	for (size_t i = 0; i < sizeof(ptp_operations) / sizeof(ptp_operations[0]); i++)
+	{
+		if (ptp_operations[i].code == code)
+			return &ptp_operations[i];
+	}
+
+	return NULL;
+}
+
+const char* KRicohPtpOpName(uint16_t code)
+{
+	const KRicohPtpOpDesc* desc = KRicohPtpFindOp(code);
+
+	return desc != NULL ? desc->name : "Operation";
+}
@@ -0,0 +1,157 @@
+#ifndef _K_RICOH_PTP_H_
+#define _K_RICOH_PTP_H_
+
+// PTP operations independent of how they reach the camera.
+// Nothing here depends on Windows, so the PTP/IP backend builds on Linux too.
+
+#ifndef K_RICOH_API
+#if defined(_WIN32) && defined(KRICOHMTPDLL_EXPORTS)
+#define K_RICOH_API __declspec(dllexport)
+#elif defined(_WIN32)
+#define K_RICOH_API __declspec(dllimport)
+#else
+#define K_RICOH_API
+#endif
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+// Operation codes
+#define PTP_OC_GET_DEVICE_INFO      0x1001
+#define PTP_OC_OPEN_SESSION         0x1002
+#define PTP_OC_CLOSE_SESSION        0x1003
+#define PTP_OC_GET_NUM_OBJECTS      0x1006
+#define PTP_OC_GET_OBJECT_HANDLES   0x1007
+#define PTP_OC_GET_OBJECT_INFO      0x1008
+#define PTP_OC_GET_OBJECT           0x1009
+#define PTP_OC_GET_THUMB            0x100A
+#define PTP_OC_DELETE_OBJECT        0x100B
+#define PTP_OC_INITIATE_CAPTURE     0x100E
+#define PTP_OC_GET_DEVICE_PROP_VALUE 0x1015
+#define PTP_OC_SET_DEVICE_PROP_VALUE 0x1016
+#define PTP_OC_TERMINATE_OPEN_CAPTURE 0x1018
+#define PTP_OC_GET_PARTIAL_OBJECT   0x101B
+#define PTP_OC_INITIATE_OPEN_CAPTURE 0x101C
+
+// Response codes
+#define PTP_RESPONSE_OK             0x2001
+#define PTP_RESPONSE_INCOMPLETE_TRANSFER 0x2007
+#define PTP_RESPONSE_DEVICE_BUSY    0x2019
+#define PTP_RESPONSE_SESSION_ALREADY_OPEN 0x201E
+#define PTP_RESPONSE_TRANSACTION_CANCELLED 0x201F
+
+// Event codes
+#define PTP_EC_OBJECT_ADDED         0x4002
+#define PTP_EC_OBJECT_REMOVED       0x4003
+#define PTP_EC_CAPTURE_COMPLETE     0x400D
+
+// Object format codes for GetObjectHandles (0 matches every format)
+#define PTP_FORMAT_ANY          0x0000
+#define PTP_FORMAT_EXIF_JPEG    0x3801
+#define PTP_FORMAT_MPEG         0x300B	// THETA reports its MP4 movies as MPEG
+
+#define PTP_STORAGE_ALL         0xFFFFFFFF
+
+// ObjectInfo dataset: ObjectCompressedSize (UINT32) follows StorageID, ObjectFormat and
+// ProtectionStatus; the strings start after the fixed fields
+#define PTP_OBJECT_INFO_SIZE_OFFSET 8
+#define PTP_OBJECT_INFO_FIXED_SIZE  52
+
+// Device properties
+#define PTP_DPC_BATTERY_LEVEL       0x5001	// UINT8, percent
+#define PTP_DPC_TIMELAPSE_NUMBER    0x501A	// UINT16 on THETA, 0 shoots until TerminateOpenCapture
+#define PTP_DPC_TIMELAPSE_INTERVAL  0x501B	// UINT32, ms
+
+// TerminateOpenCapture takes the transaction of InitiateOpenCapture, THETA accepts this for any
+#define PTP_TRANSACTION_ANY     0xFFFFFFFF
+
+#define PTP_MAX_PARAMS          5
+
+enum KRicohPtpDataPhase{
+	PTP_DATA_NONE = 0,
+	PTP_DATA_READ = 1,		// responder -> initiator
+	PTP_DATA_WRITE = 2		// initiator -> responder
+};
+
+// What the library knows about an operation code, from the table in KRicohPtp.cpp
+struct KRicohPtpOpDesc{
+	uint16_t code;
+	const char* name;
+	int param_count;				// request parameters the operation takes at most
+	KRicohPtpDataPhase data_phase;
+};
+
+// NULL for codes the table does not list
+K_RICOH_API const KRicohPtpOpDesc* KRicohPtpFindOp(uint16_t code);
+// name for log messages, "Operation" for codes the table does not list
+K_RICOH_API const char* KRicohPtpOpName(uint16_t code);
+
+// One PTP transaction: request, optional data phase and response
+struct KRicohPtpOperation{
+	uint16_t code;
+	uint32_t params[PTP_MAX_PARAMS];
+	int param_count;
+	KRicohPtpDataPhase data_phase;
+	std::vector<uint8_t> data;		// sent for PTP_DATA_WRITE, received for PTP_DATA_READ
+
+	uint16_t response;				// 0 until the responder answered
+	uint32_t response_params[PTP_MAX_PARAMS];
+	int response_param_count;
+
+	KRicohPtpOperation(uint16_t code = 0, const uint32_t* params = NULL, int param_count = 0,
+						KRicohPtpDataPhase data_phase = PTP_DATA_NONE)
+		: code(code), param_count(0), data_phase(data_phase), response(0), response_param_count(0)
+	{
+		for (int i = 0; i < param_count && i < PTP_MAX_PARAMS; i++)
+			this->params[this->param_count++] = params[i];
+	}
+
+	// data phase from the descriptor, parameters beyond what the operation takes are dropped
+	KRicohPtpOperation(const KRicohPtpOpDesc& desc, const uint32_t* params = NULL, int param_count = 0)
+		: code(desc.code), param_count(0), data_phase(desc.data_phase), response(0), response_param_count(0)
+	{
+		for (int i = 0; i < param_count && i < desc.param_count && i < PTP_MAX_PARAMS; i++)
+			this->params[this->param_count++] = params[i];
+	}
+};
+
+struct KRicohPtpEvent{
+	uint16_t code;
+	uint32_t transaction_id;
+	uint32_t params[3];
+	int param_count;
+};
+
+// How PTP operations reach the camera: WPD on Windows, PTP/IP anywhere
+class K_RICOH_API KRicohPtpTransport
+{
+public:
+	virtual ~KRicohPtpTransport() {}
+
+	// false when the operation did not complete on the transport,
+	// otherwise op.response holds whatever the camera answered
+	virtual bool Execute(KRicohPtpOperation& op) = 0;
+
+	// runs the operations in order, transports that can overlap them override this;
+	// returns false at the first transport failure
+	virtual bool ExecuteBatch(std::vector<KRicohPtpOperation>& ops)
+	{
+		for (size_t i = 0; i < ops.size(); i++)
+		{
+			if (!Execute(ops[i]))
+				return false;
+		}
+
+		return true;
+	}
+
+	// false on timeout or when the transport does not deliver PTP events
+	virtual bool WaitForEvent(KRicohPtpEvent& event, uint32_t timeout_ms) = 0;
+
+	// error of the last failed call: HRESULT for WPD, errno / WSA error for sockets
+	virtual long GetLastStatus() = 0;
+};
+
+#endif
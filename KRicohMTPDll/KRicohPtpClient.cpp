@@ -0,0 +1,233 @@
+#include "KRicohPtpClient.h"
+#include <stdio.h>
+#include <string.h>
+
+KRicohPtpClient::KRicohPtpClient(KRicohPtpTransport& transport)
+	: transport(transport), last_response(0)
+{
+}
+
+KRicohPtpClient::~KRicohPtpClient()
+{
+}
+
+bool KRicohPtpClient::OpenSession(uint32_t session_id)
+{
+	KRicohPtpOperation op(PTP_OC_OPEN_SESSION, &session_id, 1);
+
+	// A session left open by an earlier run is as good as a new one
+	if (!this->transport.Execute(op))
+	{
+		this->last_response = 0;
+		printf("! OpenSession did not reach the camera, status = %ld\n", this->transport.GetLastStatus());
+		return false;
+	}
+
+	this->last_response = op.response;
+	return op.response == PTP_RESPONSE_OK || op.response == PTP_RESPONSE_SESSION_ALREADY_OPEN;
+}
+
+bool KRicohPtpClient::CloseSession()
+{
+	KRicohPtpOperation op(PTP_OC_CLOSE_SESSION);
+
+	return Run(op);
+}
+
+bool KRicohPtpClient::InitiateCapture(uint32_t storage, uint16_t format)
+{
+	uint32_t params[2] = { storage, format };
+	KRicohPtpOperation op(PTP_OC_INITIATE_CAPTURE, params, 2);
+
+	return Run(op);
+}
+
+bool KRicohPtpClient::WaitForObjectAdded(uint32_t& handle, uint32_t timeout_ms)
+{
+	KRicohPtpEvent event;
+
+	handle = 0;
+
+	// Other events may come first, each wait gets the full timeout
+	while (this->transport.WaitForEvent(event, timeout_ms))
+	{
+		if (event.code == PTP_EC_OBJECT_ADDED && event.param_count > 0)
+		{
+			handle = event.params[0];
+			return true;
+		}
+	}
+
+	printf("! The camera did not report a new object within %u ms\n", timeout_ms);
+	return false;
+}
+
+bool KRicohPtpClient::GetObjectHandles(std::vector<uint32_t>& handles, uint32_t storage, uint16_t format, uint32_t parent)
+{
+	uint32_t params[3] = { storage, format, parent };
+	KRicohPtpOperation op(PTP_OC_GET_OBJECT_HANDLES, params, 3, PTP_DATA_READ);
+
+	handles.clear();
+
+	if (!Run(op))
+		return false;
+
+	// The data phase is a PTP array: UINT32 element count followed by the UINT32 handles
+	uint32_t count = 0;
+	if (op.data.size() >= 4)
+		memcpy(&count, &op.data[0], 4);
+
+	if (op.data.size() < 4 || (op.data.size() - 4) / 4 < count)
+	{
+		printf("! GetObjectHandles returned a malformed array (%u bytes)\n", (unsigned int)op.data.size());
+		return false;
+	}
+
+	handles.resize(count);
+	if (count > 0)
+		memcpy(&handles[0], &op.data[4], count * 4);
+
+	return true;
+}
+
+bool KRicohPtpClient::GetObject(uint32_t handle, std::vector<uint8_t>& data)
+{
+	KRicohPtpOperation op(PTP_OC_GET_OBJECT, &handle, 1, PTP_DATA_READ);
+
+	data.clear();
+
+	if (!Run(op))
+		return false;
+
+	data.swap(op.data);
+	return true;
+}
+
+bool KRicohPtpClient::GetObjectSize(uint32_t handle, uint32_t& size)
+{
+	KRicohPtpOperation op(PTP_OC_GET_OBJECT_INFO, &handle, 1, PTP_DATA_READ);
+
+	size = 0;
+
+	if (!Run(op))
+		return false;
+
+	if (op.data.size() < PTP_OBJECT_INFO_SIZE_OFFSET + 4)
+	{
+		printf("! GetObjectInfo returned %u bytes, too short for the object size\n", (unsigned int)op.data.size());
+		return false;
+	}
+
+	memcpy(&size, &op.data[PTP_OBJECT_INFO_SIZE_OFFSET], 4);
+	return true;
+}
+
+bool KRicohPtpClient::GetThumb(uint32_t handle, std::vector<uint8_t>& thumbnail)
+{
+	KRicohPtpOperation op(PTP_OC_GET_THUMB, &handle, 1, PTP_DATA_READ);
+
+	thumbnail.clear();
+
+	if (!Run(op))
+		return false;
+
+	thumbnail.swap(op.data);
+	return true;
+}
+
+bool KRicohPtpClient::GetPartialObject(uint32_t handle, uint32_t offset, uint32_t max_bytes, std::vector<uint8_t>& data)
+{
+	uint32_t params[3] = { handle, offset, max_bytes };
+	KRicohPtpOperation op(PTP_OC_GET_PARTIAL_OBJECT, params, 3, PTP_DATA_READ);
+
+	data.clear();
+
+	if (!Run(op))
+		return false;
+
+	data.swap(op.data);
+	return true;
+}
+
+bool KRicohPtpClient::GetDevicePropValue(uint16_t prop_code, std::vector<uint8_t>& value)
+{
+	uint32_t param = prop_code;
+	KRicohPtpOperation op(PTP_OC_GET_DEVICE_PROP_VALUE, &param, 1, PTP_DATA_READ);
+
+	value.clear();
+
+	if (!Run(op))
+		return false;
+
+	value.swap(op.data);
+	return true;
+}
+
+bool KRicohPtpClient::Execute(KRicohPtpOperation& op)
+{
+	return Run(op);
+}
+
+bool KRicohPtpClient::DeleteObject(uint32_t handle)
+{
+	KRicohPtpOperation op(PTP_OC_DELETE_OBJECT, &handle, 1);
+
+	return Run(op);
+}
+
+bool KRicohPtpClient::DeleteObjects(const std::vector<uint32_t>& handles, std::vector<uint32_t>& failed)
+{
+	std::vector<KRicohPtpOperation> ops;
+
+	failed.clear();
+
+	for (size_t i = 0; i < handles.size(); i++)
+		ops.push_back(KRicohPtpOperation(PTP_OC_DELETE_OBJECT, &handles[i], 1));
+
+	bool sent = this->transport.ExecuteBatch(ops);
+
+	// Operations after a transport failure have no response and count as failed
+	for (size_t i = 0; i < ops.size(); i++)
+	{
+		if (ops[i].response != PTP_RESPONSE_OK)
+			failed.push_back(handles[i]);
+	}
+
+	this->last_response = ops.empty() ? PTP_RESPONSE_OK : ops.back().response;
+
+	if (!sent)
+		printf("! DeleteObject batch did not reach the camera, status = %ld\n", this->transport.GetLastStatus());
+
+	return sent && failed.empty();
+}
+
+uint16_t KRicohPtpClient::GetLastResponse()
+{
+	return this->last_response;
+}
+
+KRicohPtpTransport& KRicohPtpClient::GetTransport()
+{
+	return this->transport;
+}
+
+bool KRicohPtpClient::Run(KRicohPtpOperation& op)
+{
+	const char* name = KRicohPtpOpName(op.code);
+
+	if (!this->transport.Execute(op))
+	{
+		this->last_response = 0;
+		printf("! %s did not reach the camera, status = %ld\n", name, this->transport.GetLastStatus());
+		return false;
+	}
+
+	this->last_response = op.response;
+	if (op.response != PTP_RESPONSE_OK)
+	{
+		printf("! %s failed, response code 0x%X\n", name, op.response);
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,52 @@
+#ifndef _K_RICOH_PTP_CLIENT_H_
+#define _K_RICOH_PTP_CLIENT_H_
+
+#include "KRicohPtp.h"
+
+// The PTP operations the capture loop needs, on top of any KRicohPtpTransport.
+// Object handles are the raw PTP handles, not WPD object ids.
+class K_RICOH_API KRicohPtpClient
+{
+public:
+	KRicohPtpClient(KRicohPtpTransport& transport);
+	virtual ~KRicohPtpClient();
+
+private:
+	KRicohPtpTransport& transport;
+	uint16_t last_response;
+
+	KRicohPtpClient(const KRicohPtpClient&);
+	KRicohPtpClient& operator=(const KRicohPtpClient&);
+
+	bool Run(KRicohPtpOperation& op);
+
+public:
+	bool OpenSession(uint32_t session_id = 1);
+	bool CloseSession();
+	bool InitiateCapture(uint32_t storage = 0, uint16_t format = PTP_FORMAT_ANY);
+	// waits for the ObjectAdded event that follows InitiateCapture
+	bool WaitForObjectAdded(uint32_t& handle, uint32_t timeout_ms);
+	// parent 0 means every object of the storage
+	bool GetObjectHandles(std::vector<uint32_t>& handles, uint32_t storage = PTP_STORAGE_ALL,
+						uint16_t format = PTP_FORMAT_ANY, uint32_t parent = 0);
+	bool GetObject(uint32_t handle, std::vector<uint8_t>& data);
+	// ObjectCompressedSize from GetObjectInfo, without transferring the object
+	bool GetObjectSize(uint32_t handle, uint32_t& size);
+	// the small JPEG the camera keeps next to the picture
+	bool GetThumb(uint32_t handle, std::vector<uint8_t>& thumbnail);
+	// bytes [offset, offset + max_bytes) of the object, fewer at its end
+	bool GetPartialObject(uint32_t handle, uint32_t offset, uint32_t max_bytes, std::vector<uint8_t>& data);
+	bool DeleteObject(uint32_t handle);
+	// raw value of a device property, e.g. 0x5001 BatteryLevel
+	bool GetDevicePropValue(uint16_t prop_code, std::vector<uint8_t>& value);
+	// any other operation; true when the camera answered OK, op.response_params holds what it returned
+	bool Execute(KRicohPtpOperation& op);
+	// one batch on the transport, failed receives the handles left on the camera
+	bool DeleteObjects(const std::vector<uint32_t>& handles, std::vector<uint32_t>& failed);
+
+	// response code of the last operation, 0 when it did not reach the camera
+	uint16_t GetLastResponse();
+	KRicohPtpTransport& GetTransport();
+};
+
+#endif
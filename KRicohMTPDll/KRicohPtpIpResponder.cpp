@@ -0,0 +1,544 @@
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef int socklen_t;
+#define PTPIP_CLOSE(s)          closesocket(s)
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+typedef int SOCKET;
+#define INVALID_SOCKET          (-1)
+#define PTPIP_CLOSE(s)          close(s)
+#endif
+
+#include "KRicohPtpIpResponder.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+// Packet types, as in KRicohPtpIpTransport.cpp
+#define PTPIP_INIT_COMMAND_REQUEST  1
+#define PTPIP_INIT_COMMAND_ACK      2
+#define PTPIP_INIT_EVENT_REQUEST    3
+#define PTPIP_INIT_EVENT_ACK        4
+#define PTPIP_OPERATION_REQUEST     6
+#define PTPIP_OPERATION_RESPONSE    7
+#define PTPIP_EVENT                 8
+#define PTPIP_START_DATA            9
+#define PTPIP_DATA                  10
+#define PTPIP_END_DATA              12
+
+#define PTPIP_DATA_OUT              2
+#define PTPIP_PROTOCOL_VERSION      0x00010000
+#define PTPIP_HEADER_SIZE           8
+#define PTPIP_MAX_PACKET            (256 * 1024 * 1024)
+
+// The answer to an operation the backend could not run
+#define PTPIP_RESPONSE_GENERAL_ERROR 0x2002
+// How often the threads look at running while they wait (ms)
+#define PTPIP_RESPONDER_POLL        100
+// An initiator gets this long for the next part of a packet or connection (ms)
+#define PTPIP_RESPONDER_TIMEOUT     5000
+
+static const uint8_t RESPONDER_GUID[16] = {
+	0x54, 0x48, 0x45, 0x54, 0x41, 0x5F, 0x53, 0x49,
+	0x4D, 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66
+};
+
+static void Put16(std::vector<uint8_t>& out, uint16_t value)
+{
+	out.push_back((uint8_t)value);
+	out.push_back((uint8_t)(value >> 8));
+}
+
+static void Put32(std::vector<uint8_t>& out, uint32_t value)
+{
+	Put16(out, (uint16_t)value);
+	Put16(out, (uint16_t)(value >> 16));
+}
+
+static void Put64(std::vector<uint8_t>& out, uint64_t value)
+{
+	Put32(out, (uint32_t)value);
+	Put32(out, (uint32_t)(value >> 32));
+}
+
+static uint16_t Get16(const uint8_t* in)
+{
+	return (uint16_t)(in[0] | (in[1] << 8));
+}
+
+static uint32_t Get32(const uint8_t* in)
+{
+	return (uint32_t)Get16(in) | ((uint32_t)Get16(in + 2) << 16);
+}
+
+static uint64_t Get64(const uint8_t* in)
+{
+	return (uint64_t)Get32(in) | ((uint64_t)Get32(in + 4) << 32);
+}
+
+static size_t BeginPacket(std::vector<uint8_t>& out, uint32_t type)
+{
+	size_t start = out.size();
+
+	Put32(out, 0);
+	Put32(out, type);
+
+	return start;
+}
+
+static void EndPacket(std::vector<uint8_t>& out, size_t start)
+{
+	uint32_t length = (uint32_t)(out.size() - start);
+
+	out[start] = (uint8_t)length;
+	out[start + 1] = (uint8_t)(length >> 8);
+	out[start + 2] = (uint8_t)(length >> 16);
+	out[start + 3] = (uint8_t)(length >> 24);
+}
+
+KRicohPtpIpResponder::KRicohPtpIpResponder(KRicohPtpTransport& backend)
+	: backend(backend), listen_socket((intptr_t)INVALID_SOCKET), command_socket((intptr_t)INVALID_SOCKET),
+	event_socket((intptr_t)INVALID_SOCKET), port(0), connection_number(0), running(false), winsock_started(false),
+	requests(0), max_batch(0), protocol_errors(0)
+{
+}
+
+KRicohPtpIpResponder::~KRicohPtpIpResponder()
+{
+	Stop();
+}
+
+bool KRicohPtpIpResponder::Start(uint16_t port)
+{
+	Stop();
+
+#ifdef _WIN32
+	WSADATA wsa_data;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0)
+	{
+		printf("! Failed to start Winsock for the PTP/IP responder\n");
+		return false;
+	}
+	this->winsock_started = true;
+#endif
+
+	SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sock == INVALID_SOCKET)
+	{
+		printf("! Failed to create the PTP/IP responder socket\n");
+		Stop();
+		return false;
+	}
+	this->listen_socket = (intptr_t)sock;
+
+	int reuse = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+
+	socklen_t length = sizeof(address);
+	if (bind(sock, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(sock, 2) != 0 ||
+		getsockname(sock, (struct sockaddr*)&address, &length) != 0)
+	{
+		printf("! Failed to listen for PTP/IP on port %u\n", port);
+		Stop();
+		return false;
+	}
+
+	this->port = ntohs(address.sin_port);
+	this->requests = 0;
+	this->max_batch = 0;
+	this->protocol_errors = 0;
+	this->running = true;
+	this->command_thread = std::thread(&KRicohPtpIpResponder::RunCommands, this);
+	this->event_thread = std::thread(&KRicohPtpIpResponder::RunEvents, this);
+
+	return true;
+}
+
+void KRicohPtpIpResponder::Stop()
+{
+	// Both threads look at running at least every PTPIP_RESPONDER_POLL
+	this->running = false;
+	if (this->command_thread.joinable())
+		this->command_thread.join();
+	if (this->event_thread.joinable())
+		this->event_thread.join();
+
+	CloseSocket(this->listen_socket);
+
+#ifdef _WIN32
+	if (this->winsock_started)
+		WSACleanup();
+#endif
+	this->winsock_started = false;
+}
+
+uint16_t KRicohPtpIpResponder::GetPort()
+{
+	return this->port;
+}
+
+uint32_t KRicohPtpIpResponder::GetRequestCount()
+{
+	return this->requests;
+}
+
+uint32_t KRicohPtpIpResponder::GetMaxBatch()
+{
+	return this->max_batch;
+}
+
+uint32_t KRicohPtpIpResponder::GetProtocolErrors()
+{
+	return this->protocol_errors;
+}
+
+void KRicohPtpIpResponder::RunCommands()
+{
+	while (this->running)
+	{
+		intptr_t sock = Accept();
+		if (sock == (intptr_t)INVALID_SOCKET)
+			continue;
+
+		this->command_socket = sock;
+		ServeConnection();
+
+		std::lock_guard<std::mutex> guard(this->event_lock);
+		CloseSocket(this->event_socket);
+		CloseSocket(this->command_socket);
+	}
+}
+
+void KRicohPtpIpResponder::RunEvents()
+{
+	KRicohPtpEvent event;
+
+	while (this->running)
+	{
+		if (!this->backend.WaitForEvent(event, PTPIP_RESPONDER_POLL))
+			continue;
+
+		std::vector<uint8_t> packet;
+		size_t start = BeginPacket(packet, PTPIP_EVENT);
+		Put16(packet, event.code);
+		Put32(packet, event.transaction_id);
+		for (int i = 0; i < event.param_count && i < 3; i++)
+			Put32(packet, event.params[i]);
+		EndPacket(packet, start);
+
+		// Without an initiator the event is lost, as on the camera
+		std::lock_guard<std::mutex> guard(this->event_lock);
+		if (this->event_socket != (intptr_t)INVALID_SOCKET)
+			SendAll(this->event_socket, packet);
+	}
+}
+
+bool KRicohPtpIpResponder::ServeConnection()
+{
+	std::vector<uint8_t> payload;
+	std::vector<uint8_t> packet;
+	uint32_t type = 0;
+
+	// 1) Init_Command_Request: GUID, friendly name, protocol version
+	if (!RecvPacket(this->command_socket, type, payload))
+		return false;
+	if (type != PTPIP_INIT_COMMAND_REQUEST || payload.size() < sizeof(RESPONDER_GUID) + 2 + 4)
+		return ProtocolError("expected Init_Command_Request");
+
+	size_t start = BeginPacket(packet, PTPIP_INIT_COMMAND_ACK);
+	Put32(packet, ++this->connection_number);
+	packet.insert(packet.end(), RESPONDER_GUID, RESPONDER_GUID + sizeof(RESPONDER_GUID));
+	for (const char* c = "THETA SIM"; *c != '\0'; c++)
+		Put16(packet, (uint16_t)*c);
+	Put16(packet, 0);
+	Put32(packet, PTPIP_PROTOCOL_VERSION);
+	EndPacket(packet, start);
+	if (!SendAll(this->command_socket, packet))
+		return false;
+
+	// 2) The event connection with the number just handed out
+	intptr_t sock = (intptr_t)INVALID_SOCKET;
+	for (uint32_t waited = 0; sock == (intptr_t)INVALID_SOCKET && this->running && waited < PTPIP_RESPONDER_TIMEOUT;
+		waited += PTPIP_RESPONDER_POLL)
+	{
+		sock = Accept();
+	}
+	if (sock == (intptr_t)INVALID_SOCKET)
+		return ProtocolError("no event connection");
+
+	if (!RecvPacket(sock, type, payload) || type != PTPIP_INIT_EVENT_REQUEST || payload.size() < 4 ||
+		Get32(&payload[0]) != this->connection_number)
+	{
+		CloseSocket(sock);
+		return ProtocolError("expected Init_Event_Request of this connection");
+	}
+
+	packet.clear();
+	start = BeginPacket(packet, PTPIP_INIT_EVENT_ACK);
+	EndPacket(packet, start);
+	if (!SendAll(sock, packet))
+	{
+		CloseSocket(sock);
+		return false;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(this->event_lock);
+		this->event_socket = sock;
+	}
+
+	// 3) Transactions until the initiator goes away
+	uint32_t batch = 0;
+	while (this->running)
+	{
+		if (!RecvPacket(this->command_socket, type, payload))
+			return false;
+
+		if (type != PTPIP_OPERATION_REQUEST || payload.size() < 10)
+			return ProtocolError("expected Operation_Request");
+
+		packet.clear();
+		if (!ServeOperation(payload, packet))
+			return false;
+
+		// The next request is here before this response went out: the initiator pipelines
+		batch++;
+		this->max_batch = (std::max<uint32_t>)(this->max_batch, batch);
+		if (!WaitReadable(this->command_socket, 0))
+			batch = 0;
+
+		if (!SendAll(this->command_socket, packet))
+			return false;
+	}
+
+	return true;
+}
+
+bool KRicohPtpIpResponder::ServeOperation(const std::vector<uint8_t>& request, std::vector<uint8_t>& out)
+{
+	uint32_t data_phase = Get32(&request[0]);
+	uint16_t code = Get16(&request[4]);
+	uint32_t transaction_id = Get32(&request[6]);
+	const KRicohPtpOpDesc* desc = KRicohPtpFindOp(code);
+	KRicohPtpOperation op(code);
+
+	this->requests++;
+
+	for (size_t offset = 10; offset + 4 <= request.size() && op.param_count < PTP_MAX_PARAMS; offset += 4)
+		op.params[op.param_count++] = Get32(&request[offset]);
+
+	if (data_phase == PTPIP_DATA_OUT)
+	{
+		op.data_phase = PTP_DATA_WRITE;
+		if (!ReceiveDataOut(transaction_id, op.data))
+			return false;
+	}
+	else if (desc != NULL && desc->data_phase == PTP_DATA_WRITE)
+	{
+		return ProtocolError("data-out operation sent without its data phase");
+	}
+	else
+	{
+		op.data_phase = (desc != NULL) ? desc->data_phase : PTP_DATA_NONE;
+	}
+
+	if (!this->backend.Execute(op))
+	{
+		op.response = PTPIP_RESPONSE_GENERAL_ERROR;
+		op.response_param_count = 0;
+		op.data.clear();
+	}
+
+	// Data-in: Start_Data with the total, the bytes in DATA packets, the last piece in End_Data
+	if (op.data_phase == PTP_DATA_READ && op.response == PTP_RESPONSE_OK)
+	{
+		size_t start = BeginPacket(out, PTPIP_START_DATA);
+		Put32(out, transaction_id);
+		Put64(out, op.data.size());
+		EndPacket(out, start);
+
+		size_t offset = 0;
+		do
+		{
+			size_t count = (std::min<size_t>)(PTPIP_RESPONDER_CHUNK, op.data.size() - offset);
+			bool last = (offset + count == op.data.size());
+
+			start = BeginPacket(out, last ? PTPIP_END_DATA : PTPIP_DATA);
+			Put32(out, transaction_id);
+			out.insert(out.end(), op.data.begin() + offset, op.data.begin() + offset + count);
+			EndPacket(out, start);
+			offset += count;
+		} while (offset < op.data.size());
+	}
+
+	size_t start = BeginPacket(out, PTPIP_OPERATION_RESPONSE);
+	Put16(out, op.response);
+	Put32(out, transaction_id);
+	for (int i = 0; i < op.response_param_count; i++)
+		Put32(out, op.response_params[i]);
+	EndPacket(out, start);
+
+	return true;
+}
+
+bool KRicohPtpIpResponder::ReceiveDataOut(uint32_t transaction_id, std::vector<uint8_t>& data)
+{
+	std::vector<uint8_t> payload;
+	uint32_t type = 0;
+
+	if (!RecvPacket(this->command_socket, type, payload))
+		return false;
+	if (type != PTPIP_START_DATA || payload.size() < 12 || Get32(&payload[0]) != transaction_id)
+		return ProtocolError("expected Start_Data of the transaction");
+
+	uint64_t total = Get64(&payload[4]);
+	data.clear();
+
+	for (;;)
+	{
+		if (!RecvPacket(this->command_socket, type, payload))
+			return false;
+		if ((type != PTPIP_DATA && type != PTPIP_END_DATA) || payload.size() < 4 || Get32(&payload[0]) != transaction_id)
+			return ProtocolError("expected Data or End_Data of the transaction");
+
+		data.insert(data.end(), payload.begin() + 4, payload.end());
+		if (data.size() > total)
+			return ProtocolError("more data than Start_Data announced");
+
+		if (type == PTPIP_END_DATA)
+			break;
+	}
+
+	if (data.size() != total)
+		return ProtocolError("less data than Start_Data announced");
+
+	return true;
+}
+
+intptr_t KRicohPtpIpResponder::Accept()
+{
+	if (!WaitReadable(this->listen_socket, PTPIP_RESPONDER_POLL))
+		return (intptr_t)INVALID_SOCKET;
+
+	SOCKET sock = accept((SOCKET)this->listen_socket, NULL, NULL);
+	if (sock == INVALID_SOCKET)
+		return (intptr_t)INVALID_SOCKET;
+
+	int no_delay = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&no_delay, sizeof(no_delay));
+
+#ifdef _WIN32
+	DWORD timeout = PTPIP_RESPONDER_TIMEOUT;
+#else
+	struct timeval timeout;
+	timeout.tv_sec = PTPIP_RESPONDER_TIMEOUT / 1000;
+	timeout.tv_usec = 0;
+#endif
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+
+	return (intptr_t)sock;
+}
+
+bool KRicohPtpIpResponder::WaitReadable(intptr_t sock, uint32_t timeout_ms)
+{
+	fd_set readable;
+	FD_ZERO(&readable);
+	FD_SET((SOCKET)sock, &readable);
+
+	struct timeval timeout;
+	timeout.tv_sec = (long)(timeout_ms / 1000);
+	timeout.tv_usec = (long)(timeout_ms % 1000) * 1000;
+
+	return select((int)sock + 1, &readable, NULL, NULL, &timeout) > 0;
+}
+
+bool KRicohPtpIpResponder::SendAll(intptr_t sock, const std::vector<uint8_t>& data)
+{
+	size_t sent_total = 0;
+
+	while (sent_total < data.size())
+	{
+		int sent = send((SOCKET)sock, (const char*)&data[sent_total], (int)(std::min<size_t>)(data.size() - sent_total, 0x40000000), 0);
+		if (sent <= 0)
+			return false;
+
+		sent_total += sent;
+	}
+
+	return true;
+}
+
+bool KRicohPtpIpResponder::RecvAll(intptr_t sock, uint8_t* data, size_t size)
+{
+	while (size > 0)
+	{
+		int received = recv((SOCKET)sock, (char*)data, (int)(std::min<size_t>)(size, 0x40000000), 0);
+		if (received <= 0)
+			return false;
+
+		data += received;
+		size -= received;
+	}
+
+	return true;
+}
+
+bool KRicohPtpIpResponder::RecvPacket(intptr_t sock, uint32_t& type, std::vector<uint8_t>& payload)
+{
+	uint8_t header[PTPIP_HEADER_SIZE];
+
+	// Between packets the initiator may take its time, Stop must not wait for it
+	while (!WaitReadable(sock, PTPIP_RESPONDER_POLL))
+	{
+		if (!this->running)
+			return false;
+	}
+
+	if (!RecvAll(sock, header, sizeof(header)))
+		return false;
+
+	uint32_t length = Get32(header);
+	type = Get32(header + 4);
+
+	if (length < PTPIP_HEADER_SIZE || length > PTPIP_MAX_PACKET)
+		return ProtocolError("malformed packet length");
+
+	payload.resize(length - PTPIP_HEADER_SIZE);
+	if (payload.empty())
+		return true;
+
+	return RecvAll(sock, &payload[0], payload.size());
+}
+
+void KRicohPtpIpResponder::CloseSocket(intptr_t& sock)
+{
+	if (sock != (intptr_t)INVALID_SOCKET)
+	{
+		PTPIP_CLOSE((SOCKET)sock);
+		sock = (intptr_t)INVALID_SOCKET;
+	}
+}
+
+bool KRicohPtpIpResponder::ProtocolError(const char* what)
+{
+	this->protocol_errors++;
+	printf("! PTP/IP responder: %s\n", what);
+
+	return false;
+}
@@ -0,0 +1,70 @@
+#ifndef _K_RICOH_PTP_IP_RESPONDER_H_
+#define _K_RICOH_PTP_IP_RESPONDER_H_
+
+#include "KRicohPtp.h"
+#include <thread>
+#include <atomic>
+#include <mutex>
+
+// Data phases are sent in DATA packets of this size, the last piece in END_DATA
+#define PTPIP_RESPONDER_CHUNK   (64 * 1024)
+
+// The camera side of PTP/IP on a local port, for running KRicohPtpIpTransport without a
+// THETA. Every operation is answered by a backend transport, e.g. KRicohSimTransport,
+// and its events go out on the event connection. One initiator at a time.
+class K_RICOH_API KRicohPtpIpResponder
+{
+public:
+	KRicohPtpIpResponder(KRicohPtpTransport& backend);
+	virtual ~KRicohPtpIpResponder();
+
+private:
+	KRicohPtpTransport& backend;
+	intptr_t listen_socket;
+	intptr_t command_socket;
+	intptr_t event_socket;
+	uint16_t port;
+	uint32_t connection_number;
+	std::atomic<bool> running;
+	std::thread command_thread;
+	std::thread event_thread;
+	// the event thread writes to event_socket only while the command thread keeps it open
+	std::mutex event_lock;
+	bool winsock_started;
+
+	// what the responder saw, for checks of the initiator
+	std::atomic<uint32_t> requests;
+	std::atomic<uint32_t> max_batch;
+	std::atomic<uint32_t> protocol_errors;
+
+	KRicohPtpIpResponder(const KRicohPtpIpResponder&);
+	KRicohPtpIpResponder& operator=(const KRicohPtpIpResponder&);
+
+	void RunCommands();
+	void RunEvents();
+	intptr_t Accept();
+	bool WaitReadable(intptr_t sock, uint32_t timeout_ms);
+	bool SendAll(intptr_t sock, const std::vector<uint8_t>& data);
+	bool RecvAll(intptr_t sock, uint8_t* data, size_t size);
+	bool RecvPacket(intptr_t sock, uint32_t& type, std::vector<uint8_t>& payload);
+	bool ServeConnection();
+	bool ServeOperation(const std::vector<uint8_t>& request, std::vector<uint8_t>& out);
+	bool ReceiveDataOut(uint32_t transaction_id, std::vector<uint8_t>& data);
+	void CloseSocket(intptr_t& sock);
+	bool ProtocolError(const char* what);
+
+public:
+	// listens on the loopback interface, port 0 picks a free one (see GetPort)
+	bool Start(uint16_t port = 0);
+	void Stop();
+	uint16_t GetPort();
+
+	// operation requests received since Start
+	uint32_t GetRequestCount();
+	// most requests that were waiting on the socket at once, > 1 when a batch was pipelined
+	uint32_t GetMaxBatch();
+	// packets that broke the protocol, 0 for a correct initiator
+	uint32_t GetProtocolErrors();
+};
+
+#endif
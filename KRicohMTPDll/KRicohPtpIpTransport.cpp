@@ -0,0 +1,567 @@
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef int socklen_t;
+#define PTPIP_SOCKET_ERROR()    ((long)WSAGetLastError())
+#define PTPIP_CLOSE(s)          closesocket(s)
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+typedef int SOCKET;
+#define INVALID_SOCKET          (-1)
+#define PTPIP_SOCKET_ERROR()    ((long)errno)
+#define PTPIP_CLOSE(s)          close(s)
+#endif
+
+#include "KRicohPtpIpTransport.h"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+// Packet types
+#define PTPIP_INIT_COMMAND_REQUEST  1
+#define PTPIP_INIT_COMMAND_ACK      2
+#define PTPIP_INIT_EVENT_REQUEST    3
+#define PTPIP_INIT_EVENT_ACK        4
+#define PTPIP_INIT_FAIL             5
+#define PTPIP_OPERATION_REQUEST     6
+#define PTPIP_OPERATION_RESPONSE    7
+#define PTPIP_EVENT                 8
+#define PTPIP_START_DATA            9
+#define PTPIP_DATA                  10
+#define PTPIP_CANCEL                11
+#define PTPIP_END_DATA              12
+
+// Data phase info of an operation request
+#define PTPIP_DATA_NONE_OR_IN       1
+#define PTPIP_DATA_OUT              2
+
+#define PTPIP_PROTOCOL_VERSION      0x00010000
+#define PTPIP_HEADER_SIZE           8
+// Anything larger is a broken stream, not a picture
+#define PTPIP_MAX_PACKET            (256 * 1024 * 1024)
+
+// Identifies this initiator to the camera
+static const uint8_t PTPIP_GUID[16] = {
+	0x4B, 0x5F, 0x52, 0x49, 0x43, 0x4F, 0x48, 0x00,
+	0x9A, 0x61, 0x2E, 0x33, 0xC1, 0x07, 0x54, 0x3D
+};
+
+// PTP/IP is little endian on the wire
+static void Put16(std::vector<uint8_t>& out, uint16_t value)
+{
+	out.push_back((uint8_t)value);
+	out.push_back((uint8_t)(value >> 8));
+}
+
+static void Put32(std::vector<uint8_t>& out, uint32_t value)
+{
+	Put16(out, (uint16_t)value);
+	Put16(out, (uint16_t)(value >> 16));
+}
+
+static void Put64(std::vector<uint8_t>& out, uint64_t value)
+{
+	Put32(out, (uint32_t)value);
+	Put32(out, (uint32_t)(value >> 32));
+}
+
+static uint16_t Get16(const uint8_t* in)
+{
+	return (uint16_t)(in[0] | (in[1] << 8));
+}
+
+static uint32_t Get32(const uint8_t* in)
+{
+	return (uint32_t)Get16(in) | ((uint32_t)Get16(in + 2) << 16);
+}
+
+// Header first, the length is patched once the payload is known
+static size_t BeginPacket(std::vector<uint8_t>& out, uint32_t type)
+{
+	size_t start = out.size();
+
+	Put32(out, 0);
+	Put32(out, type);
+
+	return start;
+}
+
+static void EndPacket(std::vector<uint8_t>& out, size_t start)
+{
+	uint32_t length = (uint32_t)(out.size() - start);
+
+	out[start] = (uint8_t)length;
+	out[start + 1] = (uint8_t)(length >> 8);
+	out[start + 2] = (uint8_t)(length >> 16);
+	out[start + 3] = (uint8_t)(length >> 24);
+}
+
+KRicohPtpIpTransport::KRicohPtpIpTransport()
+	: command_socket((intptr_t)INVALID_SOCKET), event_socket((intptr_t)INVALID_SOCKET),
+	connection_number(0), next_transaction_id(1), io_timeout_ms(PTPIP_DEFAULT_TIMEOUT),
+	last_status(0), winsock_started(false)
+{
+}
+
+KRicohPtpIpTransport::~KRicohPtpIpTransport()
+{
+	Disconnect();
+}
+
+bool KRicohPtpIpTransport::Connect(const char* host, uint16_t port, const char* friendly_name)
+{
+	std::vector<uint8_t> packet;
+	std::vector<uint8_t> payload;
+	uint32_t type = 0;
+
+	Disconnect();
+
+#ifdef _WIN32
+	WSADATA wsa_data;
+	int error = WSAStartup(MAKEWORD(2, 2), &wsa_data);
+	if (error != 0)
+	{
+		this->last_status = error;
+		printf("! Failed to start Winsock, error = %d\n", error);
+		return false;
+	}
+	this->winsock_started = true;
+#endif
+
+	// 1) Command connection: Init_Command_Request -> Init_Command_Ack
+	this->command_socket = OpenSocket(host, port);
+	if (this->command_socket == (intptr_t)INVALID_SOCKET)
+	{
+		Disconnect();
+		return false;
+	}
+
+	size_t start = BeginPacket(packet, PTPIP_INIT_COMMAND_REQUEST);
+	packet.insert(packet.end(), PTPIP_GUID, PTPIP_GUID + sizeof(PTPIP_GUID));
+	for (const char* c = friendly_name; c != NULL && *c != '\0'; c++)
+		Put16(packet, (uint16_t)(uint8_t)*c);
+	Put16(packet, 0);
+	Put32(packet, PTPIP_PROTOCOL_VERSION);
+	EndPacket(packet, start);
+
+	if (!SendAll(this->command_socket, &packet[0], packet.size()) ||
+		!RecvPacket(this->command_socket, type, payload))
+	{
+		Disconnect();
+		return false;
+	}
+
+	if (type != PTPIP_INIT_COMMAND_ACK || payload.size() < 4)
+	{
+		this->last_status = (type == PTPIP_INIT_FAIL && payload.size() >= 4) ? (long)Get32(&payload[0]) : -1;
+		printf("! The camera refused the PTP/IP connection, packet type %u, reason 0x%lx\n", type, this->last_status);
+		Disconnect();
+		return false;
+	}
+
+	this->connection_number = Get32(&payload[0]);
+
+	// 2) Event connection bound to the same connection number
+	this->event_socket = OpenSocket(host, port);
+	if (this->event_socket == (intptr_t)INVALID_SOCKET)
+	{
+		Disconnect();
+		return false;
+	}
+
+	packet.clear();
+	start = BeginPacket(packet, PTPIP_INIT_EVENT_REQUEST);
+	Put32(packet, this->connection_number);
+	EndPacket(packet, start);
+
+	if (!SendAll(this->event_socket, &packet[0], packet.size()) ||
+		!RecvPacket(this->event_socket, type, payload))
+	{
+		Disconnect();
+		return false;
+	}
+
+	if (type != PTPIP_INIT_EVENT_ACK)
+	{
+		this->last_status = -1;
+		printf("! The camera refused the PTP/IP event connection, packet type %u\n", type);
+		Disconnect();
+		return false;
+	}
+
+	this->next_transaction_id = 1;
+	this->last_status = 0;
+
+	return true;
+}
+
+void KRicohPtpIpTransport::Disconnect()
+{
+	CloseSocket(this->event_socket);
+	CloseSocket(this->command_socket);
+
+#ifdef _WIN32
+	if (this->winsock_started)
+		WSACleanup();
+#endif
+	this->winsock_started = false;
+}
+
+bool KRicohPtpIpTransport::IsConnected()
+{
+	return this->command_socket != (intptr_t)INVALID_SOCKET && this->event_socket != (intptr_t)INVALID_SOCKET;
+}
+
+void KRicohPtpIpTransport::SetTimeout(uint32_t timeout_ms)
+{
+	this->io_timeout_ms = timeout_ms;
+}
+
+bool KRicohPtpIpTransport::Execute(KRicohPtpOperation& op)
+{
+	return ExecuteOperations(&op, 1);
+}
+
+bool KRicohPtpIpTransport::ExecuteBatch(std::vector<KRicohPtpOperation>& ops)
+{
+	if (ops.empty())
+		return true;
+
+	return ExecuteOperations(&ops[0], ops.size());
+}
+
+bool KRicohPtpIpTransport::ExecuteOperations(KRicohPtpOperation* ops, size_t count)
+{
+	std::vector<uint8_t> stream;
+
+	std::lock_guard<std::mutex> guard(this->command_lock);
+
+	if (this->command_socket == (intptr_t)INVALID_SOCKET)
+	{
+		this->last_status = -1;
+		return false;
+	}
+
+	uint32_t first_transaction_id = this->next_transaction_id;
+	for (size_t i = 0; i < count; i++)
+	{
+		ops[i].response = 0;
+		ops[i].response_param_count = 0;
+		AppendRequest(ops[i], this->next_transaction_id++, stream);
+	}
+
+	// The camera handles the requests one by one, they just do not wait on our side
+	if (!SendAll(this->command_socket, &stream[0], stream.size()))
+	{
+		CloseSocket(this->command_socket);
+		return false;
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (!ReadResult(ops[i], first_transaction_id + (uint32_t)i))
+		{
+			// The stream is out of step now, only a new connection recovers it
+			CloseSocket(this->command_socket);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool KRicohPtpIpTransport::WaitForEvent(KRicohPtpEvent& event, uint32_t timeout_ms)
+{
+	std::vector<uint8_t> payload;
+	uint32_t type = 0;
+
+	if (this->event_socket == (intptr_t)INVALID_SOCKET)
+	{
+		this->last_status = -1;
+		return false;
+	}
+
+	fd_set readable;
+	FD_ZERO(&readable);
+	FD_SET((SOCKET)this->event_socket, &readable);
+
+	struct timeval timeout;
+	timeout.tv_sec = (long)(timeout_ms / 1000);
+	timeout.tv_usec = (long)(timeout_ms % 1000) * 1000;
+
+	int ready = select((int)this->event_socket + 1, &readable, NULL, NULL, &timeout);
+	if (ready <= 0)
+	{
+		if (ready < 0)
+			return Fail("wait for a PTP/IP event");
+		return false;
+	}
+
+	if (!RecvPacket(this->event_socket, type, payload))
+	{
+		CloseSocket(this->event_socket);
+		return false;
+	}
+
+	if (type != PTPIP_EVENT || payload.size() < 6)
+	{
+		printf("! Unexpected packet type %u on the PTP/IP event connection\n", type);
+		return false;
+	}
+
+	event.code = Get16(&payload[0]);
+	event.transaction_id = Get32(&payload[2]);
+	event.param_count = 0;
+	for (size_t offset = 6; offset + 4 <= payload.size() && event.param_count < 3; offset += 4)
+		event.params[event.param_count++] = Get32(&payload[offset]);
+
+	return true;
+}
+
+long KRicohPtpIpTransport::GetLastStatus()
+{
+	return this->last_status;
+}
+
+intptr_t KRicohPtpIpTransport::OpenSocket(const char* host, uint16_t port)
+{
+	struct addrinfo hints;
+	struct addrinfo* addresses = NULL;
+	std::string service = std::to_string((unsigned int)port);
+	SOCKET sock = INVALID_SOCKET;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	int error = getaddrinfo(host, service.c_str(), &hints, &addresses);
+	if (error != 0)
+	{
+		this->last_status = error;
+		printf("! Failed to resolve the camera address %s, error = %d\n", host, error);
+		return (intptr_t)INVALID_SOCKET;
+	}
+
+	for (struct addrinfo* address = addresses; address != NULL; address = address->ai_next)
+	{
+		sock = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+		if (sock == INVALID_SOCKET)
+			continue;
+
+		if (connect(sock, address->ai_addr, (socklen_t)address->ai_addrlen) == 0)
+			break;
+
+		this->last_status = PTPIP_SOCKET_ERROR();
+		PTPIP_CLOSE(sock);
+		sock = INVALID_SOCKET;
+	}
+	freeaddrinfo(addresses);
+
+	if (sock == INVALID_SOCKET)
+	{
+		printf("! Failed to connect to the camera at %s:%u, error = %ld\n", host, port, this->last_status);
+		return (intptr_t)INVALID_SOCKET;
+	}
+
+	// Requests are small and a batch is written at once, do not let Nagle hold them back
+	int no_delay = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&no_delay, sizeof(no_delay));
+
+#ifdef _WIN32
+	DWORD timeout = this->io_timeout_ms;
+#else
+	struct timeval timeout;
+	timeout.tv_sec = this->io_timeout_ms / 1000;
+	timeout.tv_usec = (this->io_timeout_ms % 1000) * 1000;
+#endif
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+
+	return (intptr_t)sock;
+}
+
+void KRicohPtpIpTransport::CloseSocket(intptr_t& sock)
+{
+	if (sock != (intptr_t)INVALID_SOCKET)
+	{
+		PTPIP_CLOSE((SOCKET)sock);
+		sock = (intptr_t)INVALID_SOCKET;
+	}
+}
+
+bool KRicohPtpIpTransport::SendAll(intptr_t sock, const uint8_t* data, size_t size)
+{
+	while (size > 0)
+	{
+		int chunk = (int)(size > 0x40000000 ? 0x40000000 : size);
+		int sent = send((SOCKET)sock, (const char*)data, chunk, 0);
+		if (sent <= 0)
+			return Fail("send to the camera");
+
+		data += sent;
+		size -= sent;
+	}
+
+	return true;
+}
+
+bool KRicohPtpIpTransport::RecvAll(intptr_t sock, uint8_t* data, size_t size)
+{
+	while (size > 0)
+	{
+		int chunk = (int)(size > 0x40000000 ? 0x40000000 : size);
+		int received = recv((SOCKET)sock, (char*)data, chunk, 0);
+		if (received == 0)
+		{
+			this->last_status = -1;
+			printf("! The camera closed the PTP/IP connection\n");
+			return false;
+		}
+		if (received < 0)
+			return Fail("receive from the camera");
+
+		data += received;
+		size -= received;
+	}
+
+	return true;
+}
+
+bool KRicohPtpIpTransport::RecvPacket(intptr_t sock, uint32_t& type, std::vector<uint8_t>& payload)
+{
+	uint8_t header[PTPIP_HEADER_SIZE];
+
+	if (!RecvAll(sock, header, sizeof(header)))
+		return false;
+
+	uint32_t length = Get32(header);
+	type = Get32(header + 4);
+
+	if (length < PTPIP_HEADER_SIZE || length > PTPIP_MAX_PACKET)
+	{
+		this->last_status = -1;
+		printf("! Malformed PTP/IP packet, length %u\n", length);
+		return false;
+	}
+
+	payload.resize(length - PTPIP_HEADER_SIZE);
+	if (payload.empty())
+		return true;
+
+	return RecvAll(sock, &payload[0], payload.size());
+}
+
+void KRicohPtpIpTransport::AppendRequest(const KRicohPtpOperation& op, uint32_t transaction_id, std::vector<uint8_t>& stream)
+{
+	size_t start = BeginPacket(stream, PTPIP_OPERATION_REQUEST);
+	Put32(stream, op.data_phase == PTP_DATA_WRITE ? PTPIP_DATA_OUT : PTPIP_DATA_NONE_OR_IN);
+	Put16(stream, op.code);
+	Put32(stream, transaction_id);
+	for (int i = 0; i < op.param_count; i++)
+		Put32(stream, op.params[i]);
+	EndPacket(stream, start);
+
+	if (op.data_phase != PTP_DATA_WRITE)
+		return;
+
+	// Data-out follows its request right away: Start_Data, then the payload in End_Data
+	start = BeginPacket(stream, PTPIP_START_DATA);
+	Put32(stream, transaction_id);
+	Put64(stream, op.data.size());
+	EndPacket(stream, start);
+
+	start = BeginPacket(stream, PTPIP_END_DATA);
+	Put32(stream, transaction_id);
+	stream.insert(stream.end(), op.data.begin(), op.data.end());
+	EndPacket(stream, start);
+}
+
+bool KRicohPtpIpTransport::ReadResult(KRicohPtpOperation& op, uint32_t transaction_id)
+{
+	std::vector<uint8_t> payload;
+	uint32_t type = 0;
+
+	if (op.data_phase == PTP_DATA_READ)
+		op.data.clear();
+
+	while (true)
+	{
+		if (!RecvPacket(this->command_socket, type, payload))
+			return false;
+
+		if (payload.size() < 4)
+		{
+			this->last_status = -1;
+			printf("! Truncated PTP/IP packet of type %u\n", type);
+			return false;
+		}
+
+		// Data of another transaction means the stream is out of step
+		if ((type == PTPIP_START_DATA || type == PTPIP_DATA || type == PTPIP_END_DATA) && Get32(&payload[0]) != transaction_id)
+		{
+			this->last_status = -1;
+			printf("! PTP/IP data for transaction %u while waiting for %u\n", Get32(&payload[0]), transaction_id);
+			return false;
+		}
+
+		switch (type)
+		{
+		case PTPIP_START_DATA:
+			if (payload.size() >= 12)
+			{
+				uint32_t total = Get32(&payload[4]);
+				if (total <= PTPIP_MAX_PACKET)
+					op.data.reserve(total);
+			}
+			break;
+
+		case PTPIP_DATA:
+		case PTPIP_END_DATA:
+			op.data.insert(op.data.end(), payload.begin() + 4, payload.end());
+			break;
+
+		case PTPIP_OPERATION_RESPONSE:
+			if (payload.size() < 6)
+			{
+				this->last_status = -1;
+				printf("! Truncated PTP/IP response\n");
+				return false;
+			}
+
+			if (Get32(&payload[2]) != transaction_id)
+			{
+				this->last_status = -1;
+				printf("! PTP/IP response for transaction %u while waiting for %u\n", Get32(&payload[2]), transaction_id);
+				return false;
+			}
+
+			op.response = Get16(&payload[0]);
+			op.response_param_count = 0;
+			for (size_t offset = 6; offset + 4 <= payload.size() && op.response_param_count < PTP_MAX_PARAMS; offset += 4)
+				op.response_params[op.response_param_count++] = Get32(&payload[offset]);
+			return true;
+
+		default:
+			printf("! Unexpected packet type %u on the PTP/IP command connection\n", type);
+			break;
+		}
+	}
+}
+
+bool KRicohPtpIpTransport::Fail(const char* what)
+{
+	this->last_status = PTPIP_SOCKET_ERROR();
+	printf("! Failed to %s, error = %ld\n", what, this->last_status);
+
+	return false;
+}
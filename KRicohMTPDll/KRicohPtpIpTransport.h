@@ -0,0 +1,58 @@
+#ifndef _K_RICOH_PTP_IP_TRANSPORT_H_
+#define _K_RICOH_PTP_IP_TRANSPORT_H_
+
+#include "KRicohPtp.h"
+#include <mutex>
+
+#define PTPIP_DEFAULT_PORT      15740
+// Upper bound for a single socket read or write (ms)
+#define PTPIP_DEFAULT_TIMEOUT   5000
+
+// PTP/IP (CIPA DC-005) over TCP: a command connection for the transactions and an
+// event connection for ObjectAdded and friends. Builds with Winsock or BSD sockets.
+class K_RICOH_API KRicohPtpIpTransport : public KRicohPtpTransport
+{
+public:
+	KRicohPtpIpTransport();
+	virtual ~KRicohPtpIpTransport();
+
+private:
+	intptr_t command_socket;
+	intptr_t event_socket;
+	uint32_t connection_number;
+	uint32_t next_transaction_id;
+	uint32_t io_timeout_ms;
+	long last_status;
+	bool winsock_started;
+	// one transaction at a time on the command connection
+	std::mutex command_lock;
+
+	KRicohPtpIpTransport(const KRicohPtpIpTransport&);
+	KRicohPtpIpTransport& operator=(const KRicohPtpIpTransport&);
+
+	intptr_t OpenSocket(const char* host, uint16_t port);
+	void CloseSocket(intptr_t& sock);
+	bool SendAll(intptr_t sock, const uint8_t* data, size_t size);
+	bool RecvAll(intptr_t sock, uint8_t* data, size_t size);
+	bool RecvPacket(intptr_t sock, uint32_t& type, std::vector<uint8_t>& payload);
+	void AppendRequest(const KRicohPtpOperation& op, uint32_t transaction_id, std::vector<uint8_t>& stream);
+	bool ExecuteOperations(KRicohPtpOperation* ops, size_t count);
+	bool ReadResult(KRicohPtpOperation& op, uint32_t transaction_id);
+	bool Fail(const char* what);
+
+public:
+	// opens both connections and runs the PTP/IP init handshake
+	bool Connect(const char* host, uint16_t port = PTPIP_DEFAULT_PORT, const char* friendly_name = "K_RICOH");
+	void Disconnect();
+	bool IsConnected();
+	void SetTimeout(uint32_t timeout_ms);
+
+	virtual bool Execute(KRicohPtpOperation& op);
+	// all requests go out in one write before the first response is read, so a batch
+	// costs one round trip instead of one per operation
+	virtual bool ExecuteBatch(std::vector<KRicohPtpOperation>& ops);
+	virtual bool WaitForEvent(KRicohPtpEvent& event, uint32_t timeout_ms);
+	virtual long GetLastStatus();
+};
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef _K_RICOH_QUEUE_H_
+#define _K_RICOH_QUEUE_H_
+
+#include <Windows.h>
+#include <deque>
+#include <vector>
+
+// Bounded FIFO shared between pipeline stages.
+// Push blocks while the queue is full (backpressure), Pop blocks while it is empty.
+// After Close, Push fails and Pop drains what is left before failing.
+template <typename T>
+class KRicohBoundedQueue
+{
+private:
+	std::deque<T> items;
+	size_t capacity;
+	size_t peak;
+	bool closed;
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE not_full;
+	CONDITION_VARIABLE not_empty;
+
+	KRicohBoundedQueue(const KRicohBoundedQueue&);
+	KRicohBoundedQueue& operator=(const KRicohBoundedQueue&);
+
+public:
+	KRicohBoundedQueue(__in size_t capacity)
+		: capacity(capacity > 0 ? capacity : 1), peak(0), closed(false)
+	{
+		InitializeCriticalSection(&this->lock);
+		InitializeConditionVariable(&this->not_full);
+		InitializeConditionVariable(&this->not_empty);
+	}
+
+	~KRicohBoundedQueue()
+	{
+		DeleteCriticalSection(&this->lock);
+	}
+
+	bool Push(__in const T& item)
+	{
+		EnterCriticalSection(&this->lock);
+		while (!this->closed && this->items.size() >= this->capacity)
+			SleepConditionVariableCS(&this->not_full, &this->lock, INFINITE);
+
+		if (this->closed)
+		{
+			LeaveCriticalSection(&this->lock);
+			return false;
+		}
+
+		this->items.push_back(item);
+		if (this->items.size() > this->peak)
+			this->peak = this->items.size();
+		LeaveCriticalSection(&this->lock);
+
+		WakeConditionVariable(&this->not_empty);
+		return true;
+	}
+
+	bool Pop(__out T& item)
+	{
+		EnterCriticalSection(&this->lock);
+		while (!this->closed && this->items.empty())
+			SleepConditionVariableCS(&this->not_empty, &this->lock, INFINITE);
+
+		if (this->items.empty())
+		{
+			LeaveCriticalSection(&this->lock);
+			return false;
+		}
+
+		item = this->items.front();
+		this->items.pop_front();
+		LeaveCriticalSection(&this->lock);
+
+		WakeConditionVariable(&this->not_full);
+		return true;
+	}
+
+	// waits for the first item, then takes whatever else is queued up to max_items
+	bool PopBatch(__out std::vector<T>& batch, __in size_t max_items)
+	{
+		batch.clear();
+
+		EnterCriticalSection(&this->lock);
+		while (!this->closed && this->items.empty())
+			SleepConditionVariableCS(&this->not_empty, &this->lock, INFINITE);
+
+		while (!this->items.empty() && batch.size() < max_items)
+		{
+			batch.push_back(this->items.front());
+			this->items.pop_front();
+		}
+		LeaveCriticalSection(&this->lock);
+
+		if (batch.empty())
+			return false;
+
+		WakeAllConditionVariable(&this->not_full);
+		return true;
+	}
+
+	void Close()
+	{
+		EnterCriticalSection(&this->lock);
+		this->closed = true;
+		LeaveCriticalSection(&this->lock);
+
+		WakeAllConditionVariable(&this->not_full);
+		WakeAllConditionVariable(&this->not_empty);
+	}
+
+	size_t Size()
+	{
+		EnterCriticalSection(&this->lock);
+		size_t size = this->items.size();
+		LeaveCriticalSection(&this->lock);
+
+		return size;
+	}
+
+	size_t Peak()
+	{
+		EnterCriticalSection(&this->lock);
+		size_t peak = this->peak;
+		LeaveCriticalSection(&this->lock);
+
+		return peak;
+	}
+};
+
+#endif
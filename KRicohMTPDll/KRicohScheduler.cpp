@@ -0,0 +1,372 @@
+#include "KRicohScheduler.h"
+#include <math.h>
+
+using namespace std;
+
+KRicohCaptureScheduler::KRicohCaptureScheduler(__in KRicohMTP& camera, __in DWORD queue_depth)
+	: camera(camera), queue_depth(queue_depth), shot_queue(nullptr), lag_sum(0.0), lag_square_sum(0.0)
+{
+	ZeroMemory(&this->schedule, sizeof(this->schedule));
+	ZeroMemory(this->threads, sizeof(this->threads));
+	ZeroMemory(&this->stats, sizeof(this->stats));
+	this->start.QuadPart = 0;
+	QueryPerformanceFrequency(&this->frequency);
+
+	InitializeCriticalSection(&this->stats_lock);
+	this->stop_event = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+}
+
+KRicohCaptureScheduler::~KRicohCaptureScheduler()
+{
+	Stop();
+
+	if (this->stop_event != nullptr)
+		CloseHandle(this->stop_event);
+	DeleteCriticalSection(&this->stats_lock);
+}
+
+bool KRicohCaptureScheduler::Start(__in const KRicohSchedule& schedule, __in KRicohShotCallback on_shot)
+{
+	if (IsRunning())
+	{
+		printf("! The scheduler is already running\n");
+		return false;
+	}
+
+	if (schedule.mode == SCHEDULE_OPEN_CAPTURE && schedule.interval_ms == 0)
+	{
+		printf("! Open capture needs an interval\n");
+		return false;
+	}
+
+	Release();
+
+	this->schedule = schedule;
+	this->on_shot = on_shot;
+	ResetEvent(this->stop_event);
+
+	EnterCriticalSection(&this->stats_lock);
+	ZeroMemory(&this->stats, sizeof(this->stats));
+	this->lag_sum = 0.0;
+	this->lag_square_sum = 0.0;
+	LeaveCriticalSection(&this->stats_lock);
+
+	this->shot_queue = new (std::nothrow) KRicohBoundedQueue<KRicohShot>(this->queue_depth);
+	if (this->shot_queue == nullptr)
+	{
+		printf("! Failed to allocate the shot queue\n");
+		return false;
+	}
+
+	QueryPerformanceCounter(&this->start);
+
+	this->threads[1] = CreateThread(nullptr, 0, DeliverThread, this, 0, nullptr);
+	this->threads[0] = CreateThread(nullptr, 0, ShootThread, this, 0, nullptr);
+
+	if (this->threads[0] == nullptr || this->threads[1] == nullptr)
+	{
+		printf("! Failed to create the scheduler threads\n");
+		Stop();
+		return false;
+	}
+
+	return true;
+}
+
+void KRicohCaptureScheduler::Stop()
+{
+	SetEvent(this->stop_event);
+	Wait();
+	Release();
+}
+
+void KRicohCaptureScheduler::Wait()
+{
+	// The shoot thread closes the queue when it ends, so the deliver thread drains it and follows
+	for (int i = 0; i < 2; i++)
+	{
+		if (this->threads[i] != nullptr)
+		{
+			WaitForSingleObject(this->threads[i], INFINITE);
+			CloseHandle(this->threads[i]);
+			this->threads[i] = nullptr;
+		}
+		else if (i == 0 && this->shot_queue != nullptr)
+		{
+			this->shot_queue->Close();
+		}
+	}
+}
+
+bool KRicohCaptureScheduler::IsRunning()
+{
+	for (int i = 0; i < 2; i++)
+	{
+		if (this->threads[i] != nullptr && WaitForSingleObject(this->threads[i], 0) == WAIT_TIMEOUT)
+			return true;
+	}
+
+	return false;
+}
+
+KRicohScheduleStats KRicohCaptureScheduler::GetStats()
+{
+	KRicohScheduleStats snapshot;
+
+	EnterCriticalSection(&this->stats_lock);
+	snapshot = this->stats;
+
+	DWORD timed = this->stats.shots;
+	if (timed > 0)
+	{
+		double mean = this->lag_sum / timed;
+		double variance = this->lag_square_sum / timed - mean * mean;
+
+		snapshot.mean_lag_us = (LONGLONG)mean;
+		snapshot.jitter_us = (LONGLONG)sqrt(variance > 0.0 ? variance : 0.0);
+	}
+	LeaveCriticalSection(&this->stats_lock);
+
+	return snapshot;
+}
+
+void KRicohCaptureScheduler::Release()
+{
+	for (int i = 0; i < 2; i++)
+	{
+		if (this->threads[i] != nullptr)
+		{
+			CloseHandle(this->threads[i]);
+			this->threads[i] = nullptr;
+		}
+	}
+
+	delete this->shot_queue;
+	this->shot_queue = nullptr;
+}
+
+DWORD WINAPI KRicohCaptureScheduler::ShootThread(__in LPVOID param)
+{
+	KRicohCaptureScheduler* scheduler = static_cast<KRicohCaptureScheduler*>(param);
+
+	CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+	if (scheduler->schedule.mode == SCHEDULE_OPEN_CAPTURE)
+		scheduler->ShootOpenCapture();
+	else
+		scheduler->ShootOnGrid();
+	scheduler->shot_queue->Close();
+	CoUninitialize();
+
+	return 0;
+}
+
+DWORD WINAPI KRicohCaptureScheduler::DeliverThread(__in LPVOID param)
+{
+	CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+	static_cast<KRicohCaptureScheduler*>(param)->Deliver();
+	CoUninitialize();
+
+	return 0;
+}
+
+void KRicohCaptureScheduler::ShootOnGrid()
+{
+	LONGLONG interval_us = (LONGLONG)this->schedule.interval_ms * 1000;
+	DWORD per_interval = (this->schedule.mode == SCHEDULE_BURST && this->schedule.burst_count > 1) ? this->schedule.burst_count : 1;
+	DWORD shot_count = this->schedule.shot_count;
+	ULONGLONG slot = 0;
+	DWORD index = 0;
+
+	while (shot_count == 0 || index < shot_count)
+	{
+		LONGLONG target_us = (LONGLONG)slot * interval_us;
+
+		if (!WaitUntil(target_us))
+			break;
+
+		for (DWORD i = 0; i < per_interval && (shot_count == 0 || index < shot_count) && !IsStopping(); i++)
+		{
+			KRicohShot shot;
+
+			shot.index = index++;
+			shot.target_us = target_us;
+			shot.achieved_us = Now();
+			shot.response = this->camera.TriggerCapture();
+			if (shot.response == PTP_RESPONSE_OK)
+				this->camera.WaitForCapture(shot.obj_id, this->schedule.capture_timeout_ms, this->stop_event);
+			shot.captured_us = Now();
+
+			Report(shot);
+		}
+
+		if (IsStopping())
+			break;
+
+		// Grid points that went by while shooting are skipped rather than shot late,
+		// unless the next one is less than half an interval behind
+		slot++;
+		if (interval_us > 0)
+		{
+			LONGLONG now = Now();
+
+			if (now - (LONGLONG)slot * interval_us > interval_us / 2)
+			{
+				// First grid point at most half an interval behind
+				ULONGLONG next = (ULONGLONG)((now - interval_us / 2 + interval_us - 1) / interval_us);
+				next = max(next, slot);
+
+				EnterCriticalSection(&this->stats_lock);
+				this->stats.missed += (DWORD)(next - slot);
+				LeaveCriticalSection(&this->stats_lock);
+
+				slot = next;
+			}
+		}
+	}
+}
+
+void KRicohCaptureScheduler::ShootOpenCapture()
+{
+	LONGLONG interval_us = (LONGLONG)this->schedule.interval_ms * 1000;
+	DWORD shot_count = this->schedule.shot_count;
+	WORD number = (WORD)min(shot_count, (DWORD)MAXWORD);
+	DWORD interval = this->schedule.interval_ms;
+	std::vector<BYTE> value;
+
+	// Both properties are little endian like everything on the wire
+	value.assign((const BYTE*)&interval, (const BYTE*)&interval + sizeof(interval));
+	if (!this->camera.SetDevicePropValue(PTP_DPC_TIMELAPSE_INTERVAL, value))
+		printf("! Failed to set the interval to %u ms, the camera keeps its own\n", interval);
+
+	value.assign((const BYTE*)&number, (const BYTE*)&number + sizeof(number));
+	if (!this->camera.SetDevicePropValue(PTP_DPC_TIMELAPSE_NUMBER, value))
+		printf("! Failed to set the number of shots to %u, the camera keeps its own\n", number);
+
+	KRicohShot shot;
+	shot.index = 0;
+	shot.target_us = 0;
+	shot.achieved_us = Now();
+	shot.response = this->camera.InitiateOpenCapture();
+	if (shot.response != PTP_RESPONSE_OK)
+	{
+		printf("! InitiateOpenCapture failed, response code 0x%X\n", shot.response);
+		shot.captured_us = shot.achieved_us;
+		Report(shot);
+		return;
+	}
+
+	// The camera takes its time for the first picture, the grid starts there
+	LONGLONG anchor_us = -1;
+	DWORD index = 0;
+
+	while (shot_count == 0 || index < shot_count)
+	{
+		shot.obj_id.clear();
+		shot.index = index;
+		shot.response = PTP_RESPONSE_OK;
+
+		DWORD timeout_ms = this->schedule.interval_ms + this->schedule.capture_timeout_ms;
+		bool captured = this->camera.WaitForCapture(shot.obj_id, timeout_ms, this->stop_event);
+
+		if (IsStopping())
+			break;
+
+		LONGLONG now = Now();
+		if (anchor_us < 0)
+			anchor_us = now;
+
+		shot.target_us = anchor_us + (LONGLONG)index * interval_us;
+		shot.achieved_us = now;
+		shot.captured_us = now;
+		index++;
+
+		Report(shot);
+
+		// Without a picture for a whole interval the camera has stopped shooting
+		if (!captured)
+			break;
+	}
+
+	// A bounded run ends on the camera by itself
+	if (shot_count == 0 || index < shot_count)
+	{
+		DWORD response = this->camera.TerminateOpenCapture();
+		if (response != PTP_RESPONSE_OK)
+			printf("! TerminateOpenCapture failed, response code 0x%X\n", response);
+	}
+}
+
+void KRicohCaptureScheduler::Deliver()
+{
+	KRicohShot shot;
+
+	while (this->shot_queue->Pop(shot))
+	{
+		if (this->on_shot)
+			this->on_shot(shot);
+	}
+}
+
+LONGLONG KRicohCaptureScheduler::Now()
+{
+	LARGE_INTEGER now;
+
+	QueryPerformanceCounter(&now);
+
+	// Split so a run of weeks does not overflow
+	LONGLONG ticks = now.QuadPart - this->start.QuadPart;
+	LONGLONG frequency = this->frequency.QuadPart;
+
+	return (ticks / frequency) * 1000000 + (ticks % frequency) * 1000000 / frequency;
+}
+
+bool KRicohCaptureScheduler::WaitUntil(__in LONGLONG target_us)
+{
+	for (;;)
+	{
+		LONGLONG remaining_us = target_us - Now();
+
+		if (remaining_us <= 0)
+			return !IsStopping();
+
+		if (remaining_us > SCHEDULE_SPIN_US)
+		{
+			if (WaitForSingleObject(this->stop_event, (DWORD)((remaining_us - SCHEDULE_SPIN_US) / 1000)) == WAIT_OBJECT_0)
+				return false;
+			continue;
+		}
+
+		if (IsStopping())
+			return false;
+
+		YieldProcessor();
+	}
+}
+
+bool KRicohCaptureScheduler::IsStopping()
+{
+	return WaitForSingleObject(this->stop_event, 0) == WAIT_OBJECT_0;
+}
+
+void KRicohCaptureScheduler::Report(__in const KRicohShot& shot)
+{
+	double lag = (double)(shot.achieved_us - shot.target_us);
+
+	EnterCriticalSection(&this->stats_lock);
+	if (shot.obj_id.empty())
+	{
+		this->stats.failed++;
+	}
+	else
+	{
+		this->stats.shots++;
+		this->lag_sum += lag;
+		this->lag_square_sum += lag * lag;
+		if (shot.achieved_us - shot.target_us > this->stats.max_lag_us)
+			this->stats.max_lag_us = shot.achieved_us - shot.target_us;
+	}
+	LeaveCriticalSection(&this->stats_lock);
+
+	// Blocks while the callback is behind, which shows up as lag on the next shots
+	this->shot_queue->Push(shot);
+}
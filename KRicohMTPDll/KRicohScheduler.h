@@ -0,0 +1,101 @@
+#ifndef _K_RICOH_SCHEDULER_H_
+#define _K_RICOH_SCHEDULER_H_
+
+#include "KRicohMTP.h"
+#include "KRicohQueue.h"
+#include <functional>
+
+// Shots waiting for the callback
+#define DEFAULT_SCHEDULE_DEPTH  16
+// The end of a wait is spun instead of slept, Sleep is only good to a timer tick (us)
+#define SCHEDULE_SPIN_US        2000
+
+enum KRicohScheduleMode{
+	SCHEDULE_FIXED_RATE = 0,	// one InitiateCapture every interval_ms
+	SCHEDULE_OPEN_CAPTURE = 1,	// InitiateOpenCapture, the camera keeps the interval itself
+	SCHEDULE_BURST = 2			// burst_count InitiateCapture back to back every interval_ms
+};
+
+struct KRicohSchedule{
+	KRicohScheduleMode mode;
+	DWORD interval_ms;			// 0 shoots as fast as the camera allows (not for open capture)
+	DWORD shot_count;			// 0 shoots until Stop
+	DWORD burst_count;			// shots per interval in SCHEDULE_BURST
+	DWORD capture_timeout_ms;	// InitiateCapture until ObjectAdded
+};
+
+// Times in microseconds from the start of the schedule
+struct KRicohShot{
+	DWORD index;
+	std::wstring obj_id;		// empty when the shot failed
+	DWORD response;				// of InitiateCapture, PTP_RESPONSE_OK in open capture
+	LONGLONG target_us;			// when the shot was due
+	LONGLONG achieved_us;		// when it was triggered, or reported by the camera in open capture
+	LONGLONG captured_us;		// when the camera reported the picture
+};
+
+struct KRicohScheduleStats{
+	DWORD shots;
+	DWORD failed;
+	DWORD missed;				// intervals skipped because a shot ran over them
+	LONGLONG mean_lag_us;		// achieved - target
+	LONGLONG max_lag_us;
+	LONGLONG jitter_us;			// standard deviation of the lag
+};
+
+// Called on a thread of its own for every shot, so downloading there does not
+// delay the next one
+typedef std::function<void(const KRicohShot& shot)> KRicohShotCallback;
+
+// Time-lapse and burst shooting on the monotonic clock. The schedule is a grid fixed at
+// Start, a late shot does not move the ones after it; a shot more than half an interval
+// late is skipped and counted as missed.
+class K_RICOH_API KRicohCaptureScheduler
+{
+public:
+	KRicohCaptureScheduler(__in KRicohMTP& camera, __in DWORD queue_depth = DEFAULT_SCHEDULE_DEPTH);
+	virtual ~KRicohCaptureScheduler();
+
+private:
+	KRicohMTP& camera;
+	DWORD queue_depth;
+	KRicohSchedule schedule;
+	KRicohShotCallback on_shot;
+
+	KRicohBoundedQueue<KRicohShot>* shot_queue;
+	HANDLE threads[2];
+	HANDLE stop_event;
+	LARGE_INTEGER start;
+	LARGE_INTEGER frequency;
+
+	KRicohScheduleStats stats;
+	double lag_sum;
+	double lag_square_sum;
+	CRITICAL_SECTION stats_lock;
+
+	KRicohCaptureScheduler(const KRicohCaptureScheduler&);
+	KRicohCaptureScheduler& operator=(const KRicohCaptureScheduler&);
+
+	static DWORD WINAPI ShootThread(__in LPVOID param);
+	static DWORD WINAPI DeliverThread(__in LPVOID param);
+	void ShootOnGrid();
+	void ShootOpenCapture();
+	void Deliver();
+	LONGLONG Now();
+	// false when Stop came first
+	bool WaitUntil(__in LONGLONG target_us);
+	bool IsStopping();
+	void Report(__in const KRicohShot& shot);
+	void Release();
+
+public:
+	bool Start(__in const KRicohSchedule& schedule, __in KRicohShotCallback on_shot);
+	// stops shooting, ends an open capture and waits until every shot is delivered
+	void Stop();
+	// waits until all shots of a bounded schedule are delivered
+	void Wait();
+	bool IsRunning();
+	KRicohScheduleStats GetStats();
+};
+
+#endif
@@ -0,0 +1,454 @@
+#include "KRicohSharedRing.h"
+
+using namespace std;
+
+// Both processes must agree on these, whatever their bitness
+static_assert(sizeof(KRicohRingHeader) == 256, "KRicohRingHeader is part of the shared layout");
+static_assert(sizeof(KRicohRingSlot) == 64, "KRicohRingSlot is part of the shared layout");
+
+static ULONGLONG RoundUp(__in ULONGLONG value, __in ULONGLONG alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+// A plain read of 64 bits is not atomic in a 32 bit process
+static LONGLONG Load(__in volatile LONGLONG* value)
+{
+	return InterlockedCompareExchange64(value, 0, 0);
+}
+
+static LONGLONG Now()
+{
+	LARGE_INTEGER now;
+
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+KRicohSharedRing::KRicohSharedRing()
+	: mapping(nullptr), ready_semaphore(nullptr), view(nullptr), header(nullptr), slots(nullptr), producer(false),
+	write_slot(MAXDWORD)
+{
+}
+
+KRicohSharedRing::~KRicohSharedRing()
+{
+	Close();
+}
+
+bool KRicohSharedRing::Create(__in const std::wstring& name, __in DWORD slot_count, __in DWORD slot_size)
+{
+	Close();
+
+	if (name.empty() || slot_count == 0 || slot_size == 0)
+	{
+		printf("! A ring needs a name, slots and a slot size\n");
+		return false;
+	}
+
+	ULONGLONG slot_stride = RoundUp(slot_size, RING_DATA_ALIGNMENT);
+	ULONGLONG data_offset = RoundUp(sizeof(KRicohRingHeader) + (ULONGLONG)slot_count * sizeof(KRicohRingSlot), RING_DATA_ALIGNMENT);
+	ULONGLONG total_size = data_offset + slot_stride * slot_count;
+
+	this->mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, (DWORD)(total_size >> 32),
+										(DWORD)(total_size & 0xFFFFFFFF), name.c_str());
+	if (this->mapping == nullptr)
+	{
+		printf("! Failed to create the shared memory '%ws', error = %lu\n", name.c_str(), ::GetLastError());
+		return false;
+	}
+
+	bool existed = (::GetLastError() == ERROR_ALREADY_EXISTS);
+
+	this->view = static_cast<BYTE*>(MapViewOfFile(this->mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+	if (this->view == nullptr)
+	{
+		printf("! Failed to map %llu bytes of shared memory, error = %lu\n", total_size, ::GetLastError());
+		Close();
+		return false;
+	}
+
+	this->header = reinterpret_cast<KRicohRingHeader*>(this->view);
+	this->slots = reinterpret_cast<KRicohRingSlot*>(this->view + sizeof(KRicohRingHeader));
+
+	if (existed)
+	{
+		// The consumers kept the ring of a producer that went away, take it over when it is the same ring
+		if (this->header->magic != RING_MAGIC || this->header->version != RING_VERSION ||
+			this->header->slot_count != slot_count || this->header->slot_size != slot_size)
+		{
+			printf("! The shared memory '%ws' exists with another layout\n", name.c_str());
+			Close();
+			return false;
+		}
+
+		if (this->header->producer_pid != GetCurrentProcessId() && IsProcessAlive(this->header->producer_pid))
+		{
+			printf("! The ring '%ws' already has a producer, process %lu\n", name.c_str(), this->header->producer_pid);
+			Close();
+			return false;
+		}
+
+		// A write it did not finish never became visible
+		for (DWORD i = 0; i < slot_count; i++)
+			InterlockedCompareExchange(&this->slots[i].state, RING_SLOT_FREE, RING_SLOT_WRITING);
+	}
+	else
+	{
+		LARGE_INTEGER frequency;
+
+		// The pages of a new mapping are zero, only the layout has to be filled in
+		QueryPerformanceFrequency(&frequency);
+		this->header->version = RING_VERSION;
+		this->header->slot_count = slot_count;
+		this->header->slot_size = slot_size;
+		this->header->data_offset = data_offset;
+		this->header->slot_stride = slot_stride;
+		this->header->tick_frequency = frequency.QuadPart;
+
+		// Last, a consumer that attaches meanwhile must not see half a header
+		InterlockedExchange(reinterpret_cast<volatile LONG*>(&this->header->magic), RING_MAGIC);
+	}
+
+	this->header->producer_pid = GetCurrentProcessId();
+
+	this->ready_semaphore = CreateSemaphoreW(nullptr, 0, MAXLONG, SemaphoreName(name).c_str());
+	if (this->ready_semaphore == nullptr)
+	{
+		printf("! Failed to create the semaphore of the ring '%ws', error = %lu\n", name.c_str(), ::GetLastError());
+		Close();
+		return false;
+	}
+
+	this->producer = true;
+	return true;
+}
+
+bool KRicohSharedRing::Attach(__in const std::wstring& name)
+{
+	Close();
+
+	this->mapping = OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+	if (this->mapping == nullptr)
+	{
+		printf("! Failed to open the shared memory '%ws', error = %lu\n", name.c_str(), ::GetLastError());
+		return false;
+	}
+
+	this->view = static_cast<BYTE*>(MapViewOfFile(this->mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+	if (this->view == nullptr)
+	{
+		printf("! Failed to map the shared memory '%ws', error = %lu\n", name.c_str(), ::GetLastError());
+		Close();
+		return false;
+	}
+
+	this->header = reinterpret_cast<KRicohRingHeader*>(this->view);
+	this->slots = reinterpret_cast<KRicohRingSlot*>(this->view + sizeof(KRicohRingHeader));
+
+	if (this->header->magic != RING_MAGIC || this->header->version != RING_VERSION)
+	{
+		printf("! The shared memory '%ws' is not a ring of version %u\n", name.c_str(), RING_VERSION);
+		Close();
+		return false;
+	}
+
+	this->ready_semaphore = OpenSemaphoreW(SYNCHRONIZE, FALSE, SemaphoreName(name).c_str());
+	if (this->ready_semaphore == nullptr)
+	{
+		printf("! Failed to open the semaphore of the ring '%ws', error = %lu\n", name.c_str(), ::GetLastError());
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+void KRicohSharedRing::Close()
+{
+	if (this->write_slot != MAXDWORD)
+		AbortWrite();
+
+	if (this->view != nullptr)
+		UnmapViewOfFile(this->view);
+	if (this->mapping != nullptr)
+		CloseHandle(this->mapping);
+	if (this->ready_semaphore != nullptr)
+		CloseHandle(this->ready_semaphore);
+
+	this->view = nullptr;
+	this->mapping = nullptr;
+	this->ready_semaphore = nullptr;
+	this->header = nullptr;
+	this->slots = nullptr;
+	this->producer = false;
+}
+
+BYTE* KRicohSharedRing::BeginWrite(__in DWORD size)
+{
+	if (!this->producer)
+		return nullptr;
+
+	if (this->write_slot != MAXDWORD)
+		AbortWrite();
+
+	if (size > this->header->slot_size)
+	{
+		InterlockedIncrement64(&this->header->too_large);
+		printf("! A picture of %u bytes does not fit a slot of %u bytes\n", size, this->header->slot_size);
+		return nullptr;
+	}
+
+	// Slots are used in sequence order, so the next one is the oldest
+	LONGLONG sequence = this->header->write_sequence;
+	DWORD slot = (DWORD)(sequence % this->header->slot_count);
+	KRicohRingSlot& target = this->slots[slot];
+
+	// A consumer that died holding the slot, while reading it or before it got that far
+	LONG state = InterlockedCompareExchange(&target.state, RING_SLOT_WRITING, RING_SLOT_FREE);
+	DWORD owner = (DWORD)target.owner_pid;
+	if ((state == RING_SLOT_READING || state == RING_SLOT_READY) && owner != 0 && !IsProcessAlive(owner) &&
+		InterlockedCompareExchange(&target.state, RING_SLOT_WRITING, state) == state)
+	{
+		InterlockedIncrement64(&this->header->reclaimed);
+		state = RING_SLOT_FREE;
+	}
+
+	if (state != RING_SLOT_FREE)
+	{
+		InterlockedIncrement64(&this->header->dropped);
+		return nullptr;
+	}
+
+	InterlockedExchange64(&target.sequence, sequence);
+	InterlockedExchange(&target.owner_pid, 0);
+	target.object_handle = 0;
+	target.size = 0;
+	target.captured = 0;
+	target.started = Now();
+	target.published = 0;
+
+	this->write_slot = slot;
+	return SlotData(slot);
+}
+
+void KRicohSharedRing::CommitWrite(__in DWORD object_handle, __in DWORD size, __in LONGLONG captured)
+{
+	if (this->write_slot == MAXDWORD)
+		return;
+
+	KRicohRingSlot& target = this->slots[this->write_slot];
+
+	target.object_handle = object_handle;
+	target.size = min(size, this->header->slot_size);
+	target.captured = captured;
+	target.published = Now();
+
+	// The slot is complete before the sequence that lets consumers at it moves on
+	InterlockedExchange(&target.state, RING_SLOT_READY);
+	LONGLONG written = InterlockedIncrement64(&this->header->write_sequence);
+	InterlockedIncrement64(&this->header->written);
+	this->write_slot = MAXDWORD;
+
+	// Only the producer writes the peak
+	LONGLONG queued = written - Load(&this->header->read_sequence);
+	if (queued > this->header->peak_queued)
+		InterlockedExchange64(&this->header->peak_queued, queued);
+
+	ReleaseSemaphore(this->ready_semaphore, 1, nullptr);
+}
+
+void KRicohSharedRing::AbortWrite()
+{
+	if (this->write_slot == MAXDWORD)
+		return;
+
+	InterlockedExchange(&this->slots[this->write_slot].state, RING_SLOT_FREE);
+	this->write_slot = MAXDWORD;
+}
+
+bool KRicohSharedRing::WriteImage(__in KRicohMTP& camera, __in const std::wstring& obj_id, __in LONGLONG captured)
+{
+	bool reserved = false;
+	DWORD size = 0;
+
+	bool downloaded = camera.DownloadImage(obj_id, [this, &reserved](DWORD image_size) -> BYTE*
+	{
+		BYTE* buffer = BeginWrite(image_size);
+
+		reserved = (buffer != nullptr);
+		return buffer;
+	}, &size);
+
+	if (!downloaded)
+	{
+		if (reserved)
+			AbortWrite();
+		return false;
+	}
+
+	CommitWrite(KRicohMTP::ObjectIDToHandle(obj_id.c_str()), size, captured);
+	return true;
+}
+
+bool KRicohSharedRing::WriteFrame(__in DWORD object_handle, __in const BYTE* data, __in DWORD size, __in LONGLONG captured)
+{
+	BYTE* buffer = BeginWrite(size);
+
+	if (buffer == nullptr)
+		return false;
+
+	memcpy(buffer, data, size);
+	CommitWrite(object_handle, size, captured);
+
+	return true;
+}
+
+bool KRicohSharedRing::Read(__out KRicohRingFrame& frame, __in DWORD timeout_ms)
+{
+	ULONGLONG start = GetTickCount64();
+
+	if (this->header == nullptr)
+		return false;
+
+	for (;;)
+	{
+		if (TryClaim(frame))
+			return true;
+
+		DWORD wait_ms = INFINITE;
+		if (timeout_ms != INFINITE)
+		{
+			ULONGLONG elapsed = GetTickCount64() - start;
+
+			if (elapsed >= timeout_ms)
+				return false;
+			wait_ms = timeout_ms - (DWORD)elapsed;
+		}
+
+		// One count per publish, a publish between TryClaim and here is not missed
+		WaitForSingleObject(this->ready_semaphore, wait_ms);
+	}
+}
+
+void KRicohSharedRing::Release(__in const KRicohRingFrame& frame)
+{
+	if (this->header == nullptr || frame.slot >= this->header->slot_count)
+		return;
+
+	KRicohRingSlot& source = this->slots[frame.slot];
+
+	// Taken back by the producer already, which thought this process had died
+	if (Load(&source.sequence) != frame.sequence)
+		return;
+
+	InterlockedExchange(&source.owner_pid, 0);
+	if (InterlockedCompareExchange(&source.state, RING_SLOT_FREE, RING_SLOT_READING) == RING_SLOT_READING)
+		InterlockedIncrement64(&this->header->consumed);
+}
+
+bool KRicohSharedRing::TryClaim(__out KRicohRingFrame& frame)
+{
+	LONG pid = (LONG)GetCurrentProcessId();
+
+	for (;;)
+	{
+		LONGLONG sequence = Load(&this->header->read_sequence);
+
+		if (sequence >= Load(&this->header->write_sequence))
+			return false;
+
+		DWORD slot = (DWORD)(sequence % this->header->slot_count);
+		KRicohRingSlot& source = this->slots[slot];
+
+		// The claim: whoever sets owner_pid first owns the slot, before read_sequence moves on
+		LONG owner = InterlockedCompareExchange(&source.owner_pid, pid, 0);
+
+		// Its consumer died before marking it READING, the frame is still there to take over
+		if (owner != 0 && owner != pid && source.state == RING_SLOT_READY && !IsProcessAlive((DWORD)owner) &&
+			InterlockedCompareExchange(&source.owner_pid, pid, owner) == owner)
+			owner = 0;
+
+		if (owner != 0)
+		{
+			// Another consumer is about to move the sequence on; if it died first, do it for it
+			// and leave the slot to the producer
+			if (owner != pid && Load(&this->header->read_sequence) == sequence && !IsProcessAlive((DWORD)owner))
+				InterlockedCompareExchange64(&this->header->read_sequence, sequence + 1, sequence);
+			continue;
+		}
+
+		// read_sequence moved on since it was read and the slot holds another frame, or the
+		// producer took the slot back from a dead consumer before anyone claimed this frame
+		LONGLONG held = Load(&source.sequence);
+		if (held != sequence || InterlockedCompareExchange(&source.state, RING_SLOT_READING, RING_SLOT_READY) != RING_SLOT_READY)
+		{
+			InterlockedExchange(&source.owner_pid, 0);
+			if (held > sequence)
+				InterlockedCompareExchange64(&this->header->read_sequence, sequence + 1, sequence);
+			continue;
+		}
+
+		// Fails when another consumer thought this process had died and moved it on already
+		InterlockedCompareExchange64(&this->header->read_sequence, sequence + 1, sequence);
+
+		frame.slot = slot;
+		frame.sequence = sequence;
+		frame.object_handle = source.object_handle;
+		frame.size = source.size;
+		frame.captured = source.captured;
+		frame.started = source.started;
+		frame.published = source.published;
+		frame.data = SlotData(slot);
+
+		return true;
+	}
+}
+
+KRicohRingStats KRicohSharedRing::GetStats()
+{
+	KRicohRingStats stats;
+
+	ZeroMemory(&stats, sizeof(stats));
+	if (this->header == nullptr)
+		return stats;
+
+	stats.written = (ULONGLONG)Load(&this->header->written);
+	stats.dropped = (ULONGLONG)Load(&this->header->dropped);
+	stats.too_large = (ULONGLONG)Load(&this->header->too_large);
+	stats.reclaimed = (ULONGLONG)Load(&this->header->reclaimed);
+	stats.consumed = (ULONGLONG)Load(&this->header->consumed);
+	stats.queued = (ULONGLONG)(Load(&this->header->write_sequence) - Load(&this->header->read_sequence));
+	stats.peak_queued = (ULONGLONG)Load(&this->header->peak_queued);
+
+	return stats;
+}
+
+LONGLONG KRicohSharedRing::GetTickFrequency()
+{
+	return (this->header != nullptr) ? this->header->tick_frequency : 0;
+}
+
+BYTE* KRicohSharedRing::SlotData(__in DWORD slot)
+{
+	return this->view + this->header->data_offset + slot * this->header->slot_stride;
+}
+
+bool KRicohSharedRing::IsProcessAlive(__in DWORD pid)
+{
+	HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, pid);
+
+	// A process this one may not open still exists
+	if (process == nullptr)
+		return ::GetLastError() == ERROR_ACCESS_DENIED;
+
+	bool alive = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+	CloseHandle(process);
+
+	return alive;
+}
+
+std::wstring KRicohSharedRing::SemaphoreName(__in const std::wstring& name)
+{
+	return name + L"_ready";
+}
@@ -0,0 +1,141 @@
+#ifndef _K_RICOH_SHARED_RING_H_
+#define _K_RICOH_SHARED_RING_H_
+
+#include "KRicohMTP.h"
+
+// Layout of the mapping, raised when it changes so old consumers refuse to attach
+#define RING_MAGIC              0x474E4952	// "RING"
+#define RING_VERSION            2
+#define DEFAULT_RING_SLOTS      8
+// A THETA S JPEG is 3 to 8 MB (bytes)
+#define DEFAULT_RING_SLOT_SIZE  (16 * 1024 * 1024)
+// Slot data start on page boundaries
+#define RING_DATA_ALIGNMENT     4096
+
+enum KRicohRingSlotState{
+	RING_SLOT_FREE = 0,
+	RING_SLOT_WRITING = 1,		// the producer streams a picture into it
+	RING_SLOT_READY = 2,		// published, waiting for a consumer; claimed once owner_pid is set
+	RING_SLOT_READING = 3		// claimed by the consumer in owner_pid
+};
+
+// Everything in the mapping has a fixed size, so 32 and 64 bit processes share it.
+// Sequence numbers and statistics sit on cache lines of their own.
+struct KRicohRingHeader{
+	DWORD magic;
+	DWORD version;
+	DWORD slot_count;
+	DWORD slot_size;			// bytes a slot holds
+	ULONGLONG data_offset;		// first slot data from the start of the mapping
+	ULONGLONG slot_stride;		// slot_size rounded up to RING_DATA_ALIGNMENT
+	LONGLONG tick_frequency;	// QueryPerformanceFrequency of the timestamps
+	DWORD producer_pid;
+	BYTE reserved0[20];
+
+	volatile LONGLONG write_sequence;	// frames published, only the producer moves it
+	BYTE reserved1[56];
+	volatile LONGLONG read_sequence;	// frames claimed, moved on by the consumer that claimed the slot
+	BYTE reserved2[56];
+
+	volatile LONGLONG written;
+	volatile LONGLONG dropped;			// no free slot, the picture stays on the camera
+	volatile LONGLONG too_large;		// larger than slot_size
+	volatile LONGLONG reclaimed;		// slots taken back from consumers that died holding them
+	volatile LONGLONG consumed;
+	volatile LONGLONG peak_queued;
+	BYTE reserved3[16];
+};
+
+struct KRicohRingSlot{
+	volatile LONG state;		// KRicohRingSlotState
+	volatile LONG owner_pid;	// consumer process, set with a compare exchange to claim the slot
+	volatile LONGLONG sequence;
+	DWORD object_handle;
+	DWORD size;
+	LONGLONG captured;			// QueryPerformanceCounter ticks, 0 when unknown
+	LONGLONG started;			// the transfer into the slot began
+	LONGLONG published;
+	BYTE reserved[16];
+};
+
+// A frame claimed by Read, data points into the mapping until Release
+struct KRicohRingFrame{
+	DWORD slot;
+	LONGLONG sequence;
+	DWORD object_handle;
+	DWORD size;
+	LONGLONG captured;
+	LONGLONG started;
+	LONGLONG published;
+	const BYTE* data;
+};
+
+struct KRicohRingStats{
+	ULONGLONG written;
+	ULONGLONG dropped;
+	ULONGLONG too_large;
+	ULONGLONG reclaimed;
+	ULONGLONG consumed;
+	ULONGLONG queued;			// published and not claimed yet
+	ULONGLONG peak_queued;
+};
+
+// Pictures handed to other processes through named shared memory. The producer streams
+// each download straight into a slot, consumers in any process read it in place.
+// Slots change hands with interlocked operations on their state; a full ring drops the
+// new picture instead of waiting, so it stays on the camera for a later try.
+// One producer per ring, any number of consumers; each frame goes to one consumer.
+// A consumer claims a slot before it moves read_sequence on, so one that dies at any
+// point leaves its pid behind and the others or the producer clean up after it.
+class K_RICOH_API KRicohSharedRing
+{
+public:
+	KRicohSharedRing();
+	virtual ~KRicohSharedRing();
+
+private:
+	HANDLE mapping;
+	HANDLE ready_semaphore;		// released once per publish, so a burst wakes as many consumers
+	BYTE* view;
+	KRicohRingHeader* header;
+	KRicohRingSlot* slots;
+	bool producer;
+	DWORD write_slot;			// slot between BeginWrite and CommitWrite, MAXDWORD for none
+
+	KRicohSharedRing(const KRicohSharedRing&);
+	KRicohSharedRing& operator=(const KRicohSharedRing&);
+
+	BYTE* SlotData(__in DWORD slot);
+	bool TryClaim(__out KRicohRingFrame& frame);
+	static bool IsProcessAlive(__in DWORD pid);
+	static std::wstring SemaphoreName(__in const std::wstring& name);
+
+public:
+	// producer: creates the ring, or takes over one whose producer went away; the name is
+	// local to the session like L"KRicohFrames"
+	bool Create(__in const std::wstring& name, __in DWORD slot_count = DEFAULT_RING_SLOTS,
+				__in DWORD slot_size = DEFAULT_RING_SLOT_SIZE);
+	// consumer: the ring of a producer, in this or another process
+	bool Attach(__in const std::wstring& name);
+	void Close();
+
+	// Producer. BeginWrite reserves the next slot for size bytes and returns its memory,
+	// nullptr when the picture does not fit or no slot is free (counted, nothing to undo)
+	BYTE* BeginWrite(__in DWORD size);
+	void CommitWrite(__in DWORD object_handle, __in DWORD size, __in LONGLONG captured = 0);
+	void AbortWrite();
+	// DownloadImage straight into the next slot; false when it was dropped or failed
+	bool WriteImage(__in KRicohMTP& camera, __in const std::wstring& obj_id, __in LONGLONG captured = 0);
+	// a picture already in memory, one copy
+	bool WriteFrame(__in DWORD object_handle, __in const BYTE* data, __in DWORD size, __in LONGLONG captured = 0);
+
+	// Consumer. Claims the oldest frame, waiting up to timeout_ms for one
+	bool Read(__out KRicohRingFrame& frame, __in DWORD timeout_ms = INFINITE);
+	void Release(__in const KRicohRingFrame& frame);
+
+	KRicohRingStats GetStats();
+	// ticks per second of the frame timestamps
+	LONGLONG GetTickFrequency();
+};
+
+#endif
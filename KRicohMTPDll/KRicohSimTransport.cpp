@@ -0,0 +1,308 @@
+#include "KRicohSimTransport.h"
+#include <string.h>
+#include <thread>
+#include <algorithm>
+
+// Handles of the THETA start here
+#define SIM_FIRST_HANDLE    0x64000001
+// Response codes the simulator answers besides OK
+#define SIM_RESPONSE_OPERATION_NOT_SUPPORTED 0x2005
+#define SIM_RESPONSE_INVALID_OBJECT_HANDLE  0x2009
+#define SIM_RESPONSE_SESSION_NOT_OPEN       0x2003
+// Sleeping is too coarse below this, shorter delays spin (us)
+#define SIM_SPIN_THRESHOLD  2000
+
+KRicohSimTransport::KRicohSimTransport(const KRicohSimConfig& config)
+	: config(config), next_handle(SIM_FIRST_HANDLE), rng_state(config.seed != 0 ? config.seed : 1),
+	operations(0), session_open(false), last_status(0)
+{
+	for (uint32_t i = 0; i < config.object_count; i++)
+		this->handles.push_back(this->next_handle++);
+
+	// JPEG markers around a fixed pattern, enough for a consumer that checks SOI/EOI
+	this->image.resize((std::max<uint32_t>)(config.image_size, 4));
+	for (size_t i = 0; i < this->image.size(); i++)
+		this->image[i] = (uint8_t)(i * 31 + 7);
+	this->image[0] = 0xFF;
+	this->image[1] = 0xD8;
+	this->image[this->image.size() - 2] = 0xFF;
+	this->image[this->image.size() - 1] = 0xD9;
+}
+
+KRicohSimTransport::~KRicohSimTransport()
+{
+}
+
+bool KRicohSimTransport::Execute(KRicohPtpOperation& op)
+{
+	std::unique_lock<std::mutex> guard(this->lock);
+
+	op.response = 0;
+	op.response_param_count = 0;
+	this->operations++;
+
+	if (this->config.disconnect_after != 0 && this->operations > this->config.disconnect_after)
+	{
+		this->last_status = -1;
+		return false;
+	}
+
+	// OpenSession is never failed so every run gets going
+	uint16_t response = 0;
+	if (op.code != PTP_OC_OPEN_SESSION && InjectFailure(response))
+	{
+		Delay(0);
+		op.data.clear();
+		op.response = response;
+		return true;
+	}
+
+	op.response = Answer(op);
+	Delay(op.data.size());
+
+	this->last_status = 0;
+	return true;
+}
+
+bool KRicohSimTransport::WaitForEvent(KRicohPtpEvent& event, uint32_t timeout_ms)
+{
+	std::unique_lock<std::mutex> guard(this->lock);
+	Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(timeout_ms);
+
+	for (;;)
+	{
+		if (!this->events.empty())
+		{
+			Clock::time_point due = this->events.front().due;
+
+			if (Clock::now() >= due)
+			{
+				event = this->events.front().event;
+				this->events.pop_front();
+				return true;
+			}
+
+			if (due > deadline)
+				return false;
+
+			this->event_ready.wait_until(guard, due);
+			continue;
+		}
+
+		if (this->event_ready.wait_until(guard, deadline) == std::cv_status::timeout && this->events.empty())
+			return false;
+	}
+}
+
+long KRicohSimTransport::GetLastStatus()
+{
+	return this->last_status;
+}
+
+uint32_t KRicohSimTransport::GetObjectCount()
+{
+	std::lock_guard<std::mutex> guard(this->lock);
+
+	return (uint32_t)this->handles.size();
+}
+
+uint64_t KRicohSimTransport::GetOperationCount()
+{
+	std::lock_guard<std::mutex> guard(this->lock);
+
+	return this->operations;
+}
+
+uint16_t KRicohSimTransport::Answer(KRicohPtpOperation& op)
+{
+	uint32_t p0 = op.param_count > 0 ? op.params[0] : 0;
+
+	if (op.data_phase != PTP_DATA_WRITE)
+		op.data.clear();
+
+	if (op.code == PTP_OC_OPEN_SESSION)
+	{
+		if (this->session_open)
+			return PTP_RESPONSE_SESSION_ALREADY_OPEN;
+
+		this->session_open = true;
+		return PTP_RESPONSE_OK;
+	}
+
+	if (!this->session_open)
+		return SIM_RESPONSE_SESSION_NOT_OPEN;
+
+	switch (op.code)
+	{
+	case PTP_OC_CLOSE_SESSION:
+		this->session_open = false;
+		return PTP_RESPONSE_OK;
+
+	case PTP_OC_GET_NUM_OBJECTS:
+		op.response_params[op.response_param_count++] = (uint32_t)this->handles.size();
+		return PTP_RESPONSE_OK;
+
+	case PTP_OC_GET_OBJECT_HANDLES:
+	{
+		uint32_t count = (uint32_t)this->handles.size();
+
+		op.data.resize(4 + count * 4);
+		memcpy(&op.data[0], &count, 4);
+		if (count > 0)
+			memcpy(&op.data[4], &this->handles[0], count * 4);
+		return PTP_RESPONSE_OK;
+	}
+
+	case PTP_OC_GET_OBJECT_INFO:
+	{
+		uint32_t storage = 0x00010001;
+		uint16_t format = PTP_FORMAT_EXIF_JPEG;
+		uint32_t size = (uint32_t)this->image.size();
+
+		if (!HasObject(p0))
+			return SIM_RESPONSE_INVALID_OBJECT_HANDLE;
+
+		// The fixed part of the ObjectInfo dataset and four empty strings, only
+		// StorageID, ObjectFormat and ObjectCompressedSize are filled in
+		op.data.assign(PTP_OBJECT_INFO_FIXED_SIZE + 4, 0);
+		memcpy(&op.data[0], &storage, 4);
+		memcpy(&op.data[4], &format, 2);
+		memcpy(&op.data[PTP_OBJECT_INFO_SIZE_OFFSET], &size, 4);
+		return PTP_RESPONSE_OK;
+	}
+
+	case PTP_OC_GET_OBJECT:
+		if (!HasObject(p0))
+			return SIM_RESPONSE_INVALID_OBJECT_HANDLE;
+
+		// A stream that ends early still answers OK, like a camera that lost the data
+		op.data.assign(this->image.begin(), this->image.end() - (std::min<size_t>)(this->config.short_by, this->image.size()));
+		return PTP_RESPONSE_OK;
+
+	case PTP_OC_GET_THUMB:
+		if (!HasObject(p0))
+			return SIM_RESPONSE_INVALID_OBJECT_HANDLE;
+
+		op.data.assign(this->image.begin(), this->image.begin() + (std::min<size_t>)(this->config.thumb_size, this->image.size()));
+		return PTP_RESPONSE_OK;
+
+	case PTP_OC_GET_PARTIAL_OBJECT:
+	{
+		uint32_t offset = op.param_count > 1 ? op.params[1] : 0;
+		uint32_t max_bytes = op.param_count > 2 ? op.params[2] : 0;
+
+		if (!HasObject(p0))
+			return SIM_RESPONSE_INVALID_OBJECT_HANDLE;
+
+		if (offset < this->image.size())
+		{
+			size_t count = (std::min<size_t>)(max_bytes, this->image.size() - offset);
+			op.data.assign(this->image.begin() + offset, this->image.begin() + offset + count);
+		}
+
+		op.response_params[op.response_param_count++] = (uint32_t)op.data.size();
+		return PTP_RESPONSE_OK;
+	}
+
+	case PTP_OC_DELETE_OBJECT:
+	{
+		std::vector<uint32_t>::iterator it = std::lower_bound(this->handles.begin(), this->handles.end(), p0);
+
+		if (it == this->handles.end() || *it != p0)
+			return SIM_RESPONSE_INVALID_OBJECT_HANDLE;
+
+		this->handles.erase(it);
+		return PTP_RESPONSE_OK;
+	}
+
+	case PTP_OC_INITIATE_CAPTURE:
+	{
+		PendingEvent pending;
+
+		memset(&pending.event, 0, sizeof(pending.event));
+		pending.event.code = PTP_EC_OBJECT_ADDED;
+		pending.event.params[0] = this->next_handle;
+		pending.event.param_count = 1;
+		pending.due = Clock::now() + std::chrono::microseconds(this->config.capture_latency_us);
+
+		this->handles.push_back(this->next_handle++);
+		this->events.push_back(pending);
+		this->event_ready.notify_all();
+		return PTP_RESPONSE_OK;
+	}
+
+	case PTP_OC_GET_DEVICE_PROP_VALUE:
+	{
+		std::map<uint16_t, std::vector<uint8_t> >::const_iterator it = this->properties.find((uint16_t)p0);
+
+		// A property never set reads as a UINT8 100, i.e. a full battery
+		if (it != this->properties.end())
+			op.data = it->second;
+		else
+			op.data.assign(1, 100);
+		return PTP_RESPONSE_OK;
+	}
+
+	case PTP_OC_SET_DEVICE_PROP_VALUE:
+		this->properties[(uint16_t)p0] = op.data;
+		return PTP_RESPONSE_OK;
+
+	default:
+		return SIM_RESPONSE_OPERATION_NOT_SUPPORTED;
+	}
+}
+
+bool KRicohSimTransport::HasObject(uint32_t handle)
+{
+	return std::binary_search(this->handles.begin(), this->handles.end(), handle);
+}
+
+bool KRicohSimTransport::InjectFailure(uint16_t& response)
+{
+	bool fail = false;
+
+	if (this->config.fail_every != 0 && this->operations % this->config.fail_every == 0)
+		fail = true;
+
+	// Draw on every operation so the sequence does not depend on fail_every
+	double draw = NextRandom() / 4294967296.0;
+	if (draw < this->config.fail_rate)
+		fail = true;
+
+	response = fail ? this->config.fail_response : 0;
+	return fail;
+}
+
+uint32_t KRicohSimTransport::NextRandom()
+{
+	// xorshift32, the same sequence on every platform
+	uint32_t x = this->rng_state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	this->rng_state = x;
+
+	return x;
+}
+
+void KRicohSimTransport::Delay(uint64_t bytes)
+{
+	uint64_t delay_us = this->config.op_latency_us;
+
+	if (this->config.bytes_per_ms != 0)
+		delay_us += bytes * 1000 / this->config.bytes_per_ms;
+
+	if (delay_us == 0)
+		return;
+
+	Clock::time_point until = Clock::now() + std::chrono::microseconds(delay_us);
+
+	// The device is busy for the whole operation, like a real camera on one USB pipe
+	if (delay_us > SIM_SPIN_THRESHOLD)
+		std::this_thread::sleep_for(std::chrono::microseconds(delay_us - SIM_SPIN_THRESHOLD));
+
+	while (Clock::now() < until)
+	{
+	}
+}
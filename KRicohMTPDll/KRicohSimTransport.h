@@ -0,0 +1,82 @@
+#ifndef _K_RICOH_SIM_TRANSPORT_H_
+#define _K_RICOH_SIM_TRANSPORT_H_
+
+#include "KRicohPtp.h"
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <map>
+
+// What the simulated camera holds and how slow it is. The same config and seed give
+// the same responses, failures and data on every run.
+struct KRicohSimConfig{
+	uint32_t object_count;			// pictures on the card at start
+	uint32_t image_size;			// bytes per picture
+	uint32_t thumb_size;			// bytes per thumbnail
+	uint32_t op_latency_us;			// fixed cost of every operation
+	uint32_t bytes_per_ms;			// data phase throughput, 0 is unlimited
+	uint32_t capture_latency_us;	// InitiateCapture until ObjectAdded
+	uint32_t fail_every;			// every Nth operation answers fail_response, 0 never
+	double fail_rate;				// share of operations answering fail_response at random
+	uint16_t fail_response;
+	uint32_t disconnect_after;		// operations until the transport drops, 0 never
+	uint32_t short_by;				// bytes GetObject leaves off a picture whose ObjectInfo has them all
+	uint32_t seed;
+
+	KRicohSimConfig()
+		: object_count(0), image_size(4 * 1024 * 1024), thumb_size(16 * 1024), op_latency_us(0), bytes_per_ms(0),
+		capture_latency_us(0), fail_every(0), fail_rate(0.0), fail_response(PTP_RESPONSE_DEVICE_BUSY),
+		disconnect_after(0), short_by(0), seed(1)
+	{
+	}
+};
+
+// A THETA that lives in memory, for benchmarks and for running without hardware.
+// Answers the operations of KRicohPtpClient and posts ObjectAdded after each capture.
+class K_RICOH_API KRicohSimTransport : public KRicohPtpTransport
+{
+public:
+	KRicohSimTransport(const KRicohSimConfig& config);
+	virtual ~KRicohSimTransport();
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct PendingEvent{
+		KRicohPtpEvent event;
+		Clock::time_point due;
+	};
+
+	KRicohSimConfig config;
+	std::vector<uint32_t> handles;		// ascending, like the camera numbers them
+	std::vector<uint8_t> image;			// every picture has the same content
+	uint32_t next_handle;
+	uint32_t rng_state;
+	uint64_t operations;
+	bool session_open;
+	long last_status;
+	std::deque<PendingEvent> events;
+	std::map<uint16_t, std::vector<uint8_t> > properties;	// set by SetDevicePropValue
+	std::mutex lock;
+	std::condition_variable event_ready;
+
+	KRicohSimTransport(const KRicohSimTransport&);
+	KRicohSimTransport& operator=(const KRicohSimTransport&);
+
+	void Delay(uint64_t bytes);
+	bool InjectFailure(uint16_t& response);
+	uint32_t NextRandom();
+	bool HasObject(uint32_t handle);
+	uint16_t Answer(KRicohPtpOperation& op);
+
+public:
+	virtual bool Execute(KRicohPtpOperation& op);
+	virtual bool WaitForEvent(KRicohPtpEvent& event, uint32_t timeout_ms);
+	virtual long GetLastStatus();
+
+	uint32_t GetObjectCount();
+	uint64_t GetOperationCount();
+};
+
+#endif
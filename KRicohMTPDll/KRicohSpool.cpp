@@ -0,0 +1,747 @@
+#include "KRicohSpool.h"
+#include <algorithm>
+
+using namespace std;
+
+static_assert(sizeof(KRicohSpoolRecord) == 32, "KRicohSpoolRecord is the journal format");
+
+KRicohSpool::KRicohSpool(__in KRicohMTP& camera, __in DWORD group_size, __in DWORD group_delay_ms)
+	: camera(camera), group_size(max(group_size, (DWORD)1)), group_delay_ms(group_delay_ms), journal(INVALID_HANDLE_VALUE),
+	oldest_staged_tick(0), commit_thread(nullptr), commit_event(nullptr), stop_requested(0)
+{
+	InitializeCriticalSection(&this->lock);
+	InitializeCriticalSection(&this->commit_lock);
+	ZeroMemory(&this->stats, sizeof(this->stats));
+}
+
+KRicohSpool::~KRicohSpool()
+{
+	Close();
+
+	DeleteCriticalSection(&this->commit_lock);
+	DeleteCriticalSection(&this->lock);
+}
+
+bool KRicohSpool::Open(__in const std::wstring& directory)
+{
+	Close();
+
+	if (directory.empty())
+	{
+		printf("! The spool needs a directory\n");
+		return false;
+	}
+
+	this->directory = directory;
+	if (*this->directory.rbegin() == L'\\' || *this->directory.rbegin() == L'/')
+		this->directory.erase(this->directory.size() - 1);
+
+	std::wstring staging = this->directory + L"\\" + SPOOL_STAGING_NAME;
+	if ((!CreateDirectoryW(this->directory.c_str(), nullptr) && ::GetLastError() != ERROR_ALREADY_EXISTS) ||
+		(!CreateDirectoryW(staging.c_str(), nullptr) && ::GetLastError() != ERROR_ALREADY_EXISTS))
+	{
+		printf("! Failed to create the spool directory '%ws', error = %lu\n", staging.c_str(), ::GetLastError());
+		return false;
+	}
+
+	std::wstring journal_path = this->directory + L"\\" + SPOOL_JOURNAL_NAME;
+	this->journal = CreateFileW(journal_path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+								OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (this->journal == INVALID_HANDLE_VALUE)
+	{
+		printf("! Failed to open the spool journal '%ws', error = %lu\n", journal_path.c_str(), ::GetLastError());
+		return false;
+	}
+
+	EnterCriticalSection(&this->lock);
+	this->states.clear();
+	this->identities.clear();
+	this->undeleted.clear();
+	this->unverified.clear();
+	ZeroMemory(&this->stats, sizeof(this->stats));
+	bool recovered = Recover();
+	LeaveCriticalSection(&this->lock);
+
+	if (!recovered)
+	{
+		Close();
+		return false;
+	}
+
+	if (this->stats.recovered != 0 || this->stats.discarded != 0)
+	{
+		printf("* Spool recovered: %u picture(s) to delete from the camera, %u unfinished download(s) dropped\n",
+				this->stats.recovered, this->stats.discarded);
+	}
+
+	this->stop_requested = 0;
+	this->commit_event = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+	this->commit_thread = (this->commit_event != nullptr) ? CreateThread(nullptr, 0, CommitThread, this, 0, nullptr) : nullptr;
+	if (this->commit_thread == nullptr)
+	{
+		printf("! Failed to create the spool commit thread, error = %lu\n", ::GetLastError());
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+void KRicohSpool::Close()
+{
+	if (this->commit_thread != nullptr)
+	{
+		InterlockedExchange(&this->stop_requested, 1);
+		SetEvent(this->commit_event);
+		WaitForSingleObject(this->commit_thread, INFINITE);
+		CloseHandle(this->commit_thread);
+		this->commit_thread = nullptr;
+	}
+
+	if (this->commit_event != nullptr)
+	{
+		CloseHandle(this->commit_event);
+		this->commit_event = nullptr;
+	}
+
+	if (this->journal != INVALID_HANDLE_VALUE)
+	{
+		// What is staged must not wait for the next run
+		CommitGroup();
+
+		CloseHandle(this->journal);
+		this->journal = INVALID_HANDLE_VALUE;
+	}
+}
+
+bool KRicohSpool::Download(__in const std::wstring& obj_id)
+{
+	bool transferred = false;
+
+	return Fetch(obj_id, &transferred);
+}
+
+bool KRicohSpool::Fetch(__in const std::wstring& obj_id, __out bool* transferred)
+{
+	DWORD handle = KRicohMTP::ObjectIDToHandle(obj_id.c_str());
+	ImageIdentity identity;
+
+	*transferred = false;
+
+	if (this->journal == INVALID_HANDLE_VALUE)
+	{
+		printf("! The spool is not open\n");
+		return false;
+	}
+
+	if (handle == 0)
+	{
+		printf("! '%ws' is not an MTP object id\n", obj_id.c_str());
+		return false;
+	}
+
+	if (!IdentifyImage(obj_id, identity))
+	{
+		printf("! Failed to read the size and file name of '%ws'\n", obj_id.c_str());
+		return false;
+	}
+
+	EnterCriticalSection(&this->lock);
+	std::map<DWORD, KRicohSpoolState>::const_iterator known = this->states.find(handle);
+	KRicohSpoolState state = (known != this->states.end()) ? known->second : SPOOL_NONE;
+	bool spooled = (state != SPOOL_NONE && IsSameImage(handle, identity));
+	if (spooled)
+	{
+		this->stats.skipped++;
+
+		// Open could not check it on the camera, now it may go with the next group
+		if (state == SPOOL_COMMITTED && this->unverified.erase(handle) != 0)
+			this->undeleted.push_back(handle);
+	}
+	LeaveCriticalSection(&this->lock);
+
+	if (spooled)
+		return true;
+
+	if (state == SPOOL_DOWNLOADED)
+	{
+		printf("! Picture 0x%08lX is still staged for another picture of the same handle\n", handle);
+		return false;
+	}
+
+	// The camera deleted the spooled picture and gave its handle to this one
+	if (state != SPOOL_NONE)
+		RetireImage(handle);
+
+	std::wstring path = StagingPath(handle);
+	StagedImage image = { handle, 0, identity.name_hash, INVALID_HANDLE_VALUE, nullptr, nullptr };
+	DWORD mapped_size = 0;
+
+	image.file = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (image.file == INVALID_HANDLE_VALUE)
+	{
+		printf("! Failed to create the staging file '%ws', error = %lu\n", path.c_str(), ::GetLastError());
+		return false;
+	}
+
+	// The transfer writes through a view of the file, so the picture goes to the file
+	// cache without a buffer of its own
+	bool downloaded = this->camera.DownloadImage(obj_id, [&image, &mapped_size](DWORD image_size) -> BYTE*
+	{
+		mapped_size = image_size;
+		image.mapping = CreateFileMappingW(image.file, nullptr, PAGE_READWRITE, 0, image_size, nullptr);
+		if (image.mapping == nullptr)
+		{
+			printf("! Failed to map a staging file of %u bytes, error = %lu\n", image_size, ::GetLastError());
+			return nullptr;
+		}
+
+		image.view = static_cast<BYTE*>(MapViewOfFile(image.mapping, FILE_MAP_WRITE, 0, 0, image_size));
+		return image.view;
+	}, &image.size);
+
+	// A short picture would be committed with zeros in place of its end and then deleted
+	// from the camera, it stays there for the next Download instead
+	if (downloaded && (image.size != mapped_size || image.size != identity.size))
+	{
+		printf("! Picture 0x%08lX came with %u bytes, the camera reported %u\n", handle, image.size, identity.size);
+		downloaded = false;
+	}
+
+	if (!downloaded)
+	{
+		if (image.view != nullptr)
+			UnmapViewOfFile(image.view);
+		if (image.mapping != nullptr)
+			CloseHandle(image.mapping);
+		CloseHandle(image.file);
+		DeleteFileW(path.c_str());
+
+		return false;
+	}
+
+	EnterCriticalSection(&this->lock);
+	if (this->staged.empty())
+		this->oldest_staged_tick = GetTickCount64();
+	this->staged.push_back(image);
+	this->states[handle] = SPOOL_DOWNLOADED;
+	this->identities[handle].size = image.size;
+	this->identities[handle].name_hash = image.name_hash;
+	this->stats.downloaded++;
+	AppendRecord(SPOOL_DOWNLOADED, handle, this->identities[handle]);
+	size_t staged_count = this->staged.size();
+	LeaveCriticalSection(&this->lock);
+
+	*transferred = true;
+
+	// The commit thread is behind by a whole group, wait for it instead of staging more
+	if (staged_count >= 2 * (size_t)this->group_size)
+		return Commit();
+
+	if (staged_count >= this->group_size)
+		SetEvent(this->commit_event);
+
+	return true;
+}
+
+bool KRicohSpool::DownloadAll(__out DWORD* count)
+{
+	std::vector<std::wstring> obj_ids;
+	DWORD downloaded = 0;
+	bool succeeded = true;
+
+	if (count != nullptr)
+		*count = 0;
+
+	if (!this->camera.GetImageList(obj_ids))
+		return false;
+
+	// Known handles too, one of them may be a new picture under a reused handle
+	for (size_t i = 0; i < obj_ids.size(); i++)
+	{
+		bool transferred = false;
+
+		// One failed picture stays on the camera, the others are still worth taking
+		if (!Fetch(obj_ids[i], &transferred))
+			succeeded = false;
+		else if (transferred)
+			downloaded++;
+	}
+
+	if (count != nullptr)
+		*count = downloaded;
+
+	return succeeded;
+}
+
+bool KRicohSpool::Commit()
+{
+	if (this->journal == INVALID_HANDLE_VALUE)
+	{
+		printf("! The spool is not open\n");
+		return false;
+	}
+
+	return CommitGroup();
+}
+
+KRicohSpoolState KRicohSpool::GetState(__in DWORD object_handle)
+{
+	KRicohSpoolState state = SPOOL_NONE;
+
+	EnterCriticalSection(&this->lock);
+	std::map<DWORD, KRicohSpoolState>::const_iterator it = this->states.find(object_handle);
+	if (it != this->states.end())
+		state = it->second;
+	LeaveCriticalSection(&this->lock);
+
+	return state;
+}
+
+std::wstring KRicohSpool::GetImagePath(__in DWORD object_handle)
+{
+	KRicohSpoolState state = GetState(object_handle);
+
+	return (state == SPOOL_COMMITTED || state == SPOOL_DELETED) ? ImagePath(object_handle) : std::wstring();
+}
+
+KRicohSpoolStats KRicohSpool::GetStats()
+{
+	KRicohSpoolStats snapshot;
+
+	EnterCriticalSection(&this->lock);
+	snapshot = this->stats;
+	snapshot.pending = (DWORD)this->staged.size();
+	LeaveCriticalSection(&this->lock);
+
+	return snapshot;
+}
+
+DWORD WINAPI KRicohSpool::CommitThread(__in LPVOID param)
+{
+	CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+	static_cast<KRicohSpool*>(param)->RunCommits();
+	CoUninitialize();
+
+	return 0;
+}
+
+void KRicohSpool::RunCommits()
+{
+	DWORD wait_ms = (this->group_delay_ms != 0) ? this->group_delay_ms : INFINITE;
+
+	while (this->stop_requested == 0)
+	{
+		WaitForSingleObject(this->commit_event, wait_ms);
+		if (this->stop_requested != 0)
+			break;
+
+		EnterCriticalSection(&this->lock);
+		bool due = this->staged.size() >= this->group_size ||
+			(!this->staged.empty() && wait_ms != INFINITE && GetTickCount64() - this->oldest_staged_tick >= wait_ms);
+		LeaveCriticalSection(&this->lock);
+
+		if (due)
+			CommitGroup();
+	}
+}
+
+bool KRicohSpool::CommitGroup()
+{
+	std::vector<StagedImage> group;
+	std::vector<StagedImage> durable;
+	std::vector<DWORD> to_delete;
+	bool succeeded = true;
+
+	EnterCriticalSection(&this->commit_lock);
+
+	EnterCriticalSection(&this->lock);
+	group.swap(this->staged);
+	to_delete.swap(this->undeleted);
+	LeaveCriticalSection(&this->lock);
+
+	if (group.empty() && to_delete.empty())
+	{
+		LeaveCriticalSection(&this->commit_lock);
+		return true;
+	}
+
+	// 1) The data of every picture to disk, then into the directory. A picture that does not
+	// make it is forgotten, so it stays on the camera and the next Download takes it again.
+	for (size_t i = 0; i < group.size(); i++)
+	{
+		const StagedImage& image = group[i];
+		std::wstring staging = StagingPath(image.object_handle);
+		LARGE_INTEGER file_size;
+
+		bool flushed = FlushViewOfFile(image.view, 0) != FALSE;
+		UnmapViewOfFile(image.view);
+		CloseHandle(image.mapping);
+
+		// Fetch only stages whole pictures; a file of another size is never cut to fit
+		if (!GetFileSizeEx(image.file, &file_size) || file_size.QuadPart != image.size)
+		{
+			printf("! The staging file of picture 0x%08lX does not have its %u bytes\n", image.object_handle, image.size);
+			flushed = false;
+		}
+		flushed = flushed && (FlushFileBuffers(image.file) != FALSE);
+		CloseHandle(image.file);
+
+		if (flushed && MoveFileExW(staging.c_str(), ImagePath(image.object_handle).c_str(), MOVEFILE_REPLACE_EXISTING))
+		{
+			durable.push_back(image);
+			continue;
+		}
+
+		printf("! Failed to commit picture 0x%08lX, error = %lu\n", image.object_handle, ::GetLastError());
+		DeleteFileW(staging.c_str());
+
+		EnterCriticalSection(&this->lock);
+		this->states.erase(image.object_handle);
+		this->identities.erase(image.object_handle);
+		LeaveCriticalSection(&this->lock);
+		succeeded = false;
+	}
+
+	// 2) One journal flush for the whole group; only then may the camera let go of them
+	EnterCriticalSection(&this->lock);
+	bool journaled = true;
+	for (size_t i = 0; i < durable.size() && journaled; i++)
+		journaled = AppendRecord(SPOOL_COMMITTED, durable[i].object_handle, this->identities[durable[i].object_handle]);
+
+	if (!durable.empty() && journaled && !FlushFileBuffers(this->journal))
+	{
+		printf("! Failed to flush the spool journal, error = %lu\n", ::GetLastError());
+		journaled = false;
+	}
+
+	for (size_t i = 0; i < durable.size(); i++)
+	{
+		if (journaled)
+		{
+			this->states[durable[i].object_handle] = SPOOL_COMMITTED;
+			to_delete.push_back(durable[i].object_handle);
+		}
+		else
+		{
+			this->states.erase(durable[i].object_handle);
+			this->identities.erase(durable[i].object_handle);
+		}
+	}
+
+	if (journaled)
+		this->stats.committed += (DWORD)durable.size();
+	else
+		succeeded = false;
+	this->stats.groups++;
+	LeaveCriticalSection(&this->lock);
+
+	// 3) One delete call for the group and whatever an earlier group left on the camera
+	if (!to_delete.empty())
+	{
+		std::vector<std::wstring> obj_ids;
+		std::vector<std::wstring> failed_ids;
+		std::set<DWORD> failed;
+
+		for (size_t i = 0; i < to_delete.size(); i++)
+			obj_ids.push_back(KRicohMTP::HandleToObjectID(to_delete[i]));
+
+		if (!this->camera.DeleteImages(obj_ids, failed_ids) && failed_ids.empty())
+			failed_ids = obj_ids;
+
+		// Deleted already, by a run that did not get to journal it or by someone else
+		std::vector<std::wstring> remaining;
+		if (!failed_ids.empty() && this->camera.GetImageList(remaining))
+		{
+			std::set<std::wstring> on_camera(remaining.begin(), remaining.end());
+			std::vector<std::wstring> still_failed;
+
+			for (size_t i = 0; i < failed_ids.size(); i++)
+			{
+				if (on_camera.count(failed_ids[i]) != 0)
+					still_failed.push_back(failed_ids[i]);
+			}
+			failed_ids.swap(still_failed);
+		}
+
+		for (size_t i = 0; i < failed_ids.size(); i++)
+			failed.insert(KRicohMTP::ObjectIDToHandle(failed_ids[i].c_str()));
+
+		// Not flushed: a lost DELETED record only means one more delete after a restart
+		EnterCriticalSection(&this->lock);
+		for (size_t i = 0; i < to_delete.size(); i++)
+		{
+			if (failed.count(to_delete[i]) != 0)
+			{
+				this->undeleted.push_back(to_delete[i]);
+				this->stats.delete_failures++;
+			}
+			else
+			{
+				this->states[to_delete[i]] = SPOOL_DELETED;
+				AppendRecord(SPOOL_DELETED, to_delete[i], this->identities[to_delete[i]]);
+				this->stats.deleted++;
+			}
+		}
+		LeaveCriticalSection(&this->lock);
+
+		if (!failed.empty())
+			succeeded = false;
+	}
+
+	LeaveCriticalSection(&this->commit_lock);
+	return succeeded;
+}
+
+bool KRicohSpool::Recover()
+{
+	std::map<DWORD, KRicohSpoolRecord> last_records;
+
+	if (!ReadJournal(last_records))
+		return false;
+
+	for (std::map<DWORD, KRicohSpoolRecord>::const_iterator it = last_records.begin(); it != last_records.end(); it++)
+	{
+		DWORD handle = it->first;
+		ImageIdentity on_camera;
+
+		switch (it->second.state)
+		{
+		case SPOOL_COMMITTED:
+			// The data was flushed before the record, only the rename may not have reached the disk
+			if (GetFileAttributesW(ImagePath(handle).c_str()) == INVALID_FILE_ATTRIBUTES &&
+				!MoveFileExW(StagingPath(handle).c_str(), ImagePath(handle).c_str(), MOVEFILE_REPLACE_EXISTING))
+			{
+				// Moved away since; if the camera still has it, it is taken again rather than lost
+				printf("* The file of committed picture 0x%08lX is gone, it is not deleted from the camera\n", handle);
+				break;
+			}
+
+			this->states[handle] = SPOOL_COMMITTED;
+			this->identities[handle].size = it->second.size;
+			this->identities[handle].name_hash = it->second.name_hash;
+
+			// Deleted only while the camera object is still this picture, the handle may belong
+			// to a newer one by now
+			if (!IdentifyImage(KRicohMTP::HandleToObjectID(handle), on_camera))
+			{
+				this->unverified.insert(handle);
+			}
+			else if (IsSameImage(handle, on_camera))
+			{
+				this->undeleted.push_back(handle);
+				this->stats.recovered++;
+			}
+			else
+			{
+				printf("* Handle 0x%08lX is another picture on the camera now, it is not deleted\n", handle);
+			}
+			break;
+
+		case SPOOL_DELETED:
+			this->states[handle] = SPOOL_DELETED;
+			this->identities[handle].size = it->second.size;
+			this->identities[handle].name_hash = it->second.name_hash;
+			break;
+
+		default:
+			// Downloaded but never committed: the camera still has it, the staging file goes
+			break;
+		}
+	}
+
+	DiscardStaging();
+	return true;
+}
+
+bool KRicohSpool::ReadJournal(__out std::map<DWORD, KRicohSpoolRecord>& last_records)
+{
+	LARGE_INTEGER file_size;
+	LARGE_INTEGER position;
+	std::vector<BYTE> data;
+	DWORD read = 0;
+
+	last_records.clear();
+
+	if (!GetFileSizeEx(this->journal, &file_size))
+	{
+		printf("! Failed to get the size of the spool journal, error = %lu\n", ::GetLastError());
+		return false;
+	}
+
+	if (file_size.QuadPart > MAXDWORD)
+	{
+		printf("! The spool journal is too large, %lld bytes\n", file_size.QuadPart);
+		return false;
+	}
+
+	data.resize((size_t)file_size.QuadPart);
+	if (!data.empty() && (!ReadFile(this->journal, &data[0], (DWORD)data.size(), &read, nullptr) || read != data.size()))
+	{
+		printf("! Failed to read the spool journal, error = %lu\n", ::GetLastError());
+		return false;
+	}
+
+	// Later records of a handle replace earlier ones
+	size_t valid = 0;
+	while (valid + sizeof(KRicohSpoolRecord) <= data.size())
+	{
+		KRicohSpoolRecord record;
+
+		memcpy(&record, &data[valid], sizeof(record));
+		if (record.magic != SPOOL_RECORD_MAGIC || record.checksum != Checksum(record))
+			break;
+
+		last_records[record.object_handle] = record;
+		valid += sizeof(record);
+	}
+
+	// Whatever follows the last good record was being written when the process ended
+	if (valid != data.size())
+	{
+		printf("* The spool journal ends in a torn record, %u byte(s) dropped\n", (DWORD)(data.size() - valid));
+
+		position.QuadPart = (LONGLONG)valid;
+		if (!SetFilePointerEx(this->journal, position, nullptr, FILE_BEGIN) || !SetEndOfFile(this->journal))
+		{
+			printf("! Failed to truncate the spool journal, error = %lu\n", ::GetLastError());
+			return false;
+		}
+	}
+
+	position.QuadPart = 0;
+	return SetFilePointerEx(this->journal, position, nullptr, FILE_END) != FALSE;
+}
+
+bool KRicohSpool::IdentifyImage(__in const std::wstring& obj_id, __out ImageIdentity& identity)
+{
+	std::wstring file_name;
+
+	if (!this->camera.GetImageInfo(obj_id, &identity.size, file_name))
+		return false;
+
+	identity.name_hash = NameHash(file_name);
+	return true;
+}
+
+bool KRicohSpool::IsSameImage(__in DWORD object_handle, __in const ImageIdentity& identity)
+{
+	std::map<DWORD, ImageIdentity>::const_iterator spooled = this->identities.find(object_handle);
+
+	return spooled != this->identities.end() && spooled->second.size == identity.size &&
+		spooled->second.name_hash == identity.name_hash;
+}
+
+void KRicohSpool::RetireImage(__in DWORD object_handle)
+{
+	// Not while a commit may still delete the handle
+	EnterCriticalSection(&this->commit_lock);
+	EnterCriticalSection(&this->lock);
+
+	std::wstring path = ImagePath(object_handle);
+	std::wstring retired = RetiredPath(object_handle, this->identities[object_handle].name_hash);
+
+	if (MoveFileExW(path.c_str(), retired.c_str(), MOVEFILE_REPLACE_EXISTING))
+		printf("* Handle 0x%08lX was given to a new picture, the earlier one is kept as '%ws'\n", object_handle, retired.c_str());
+
+	this->undeleted.erase(std::remove(this->undeleted.begin(), this->undeleted.end(), object_handle), this->undeleted.end());
+	this->unverified.erase(object_handle);
+	this->states.erase(object_handle);
+	this->identities.erase(object_handle);
+	this->stats.reused++;
+
+	LeaveCriticalSection(&this->lock);
+	LeaveCriticalSection(&this->commit_lock);
+}
+
+bool KRicohSpool::AppendRecord(__in KRicohSpoolState state, __in DWORD object_handle, __in const ImageIdentity& identity)
+{
+	KRicohSpoolRecord record;
+	FILETIME now;
+	DWORD written = 0;
+
+	GetSystemTimeAsFileTime(&now);
+
+	ZeroMemory(&record, sizeof(record));
+	record.magic = SPOOL_RECORD_MAGIC;
+	record.state = state;
+	record.object_handle = object_handle;
+	record.size = identity.size;
+	record.time = ((ULONGLONG)now.dwHighDateTime << 32) | now.dwLowDateTime;
+	record.name_hash = identity.name_hash;
+	record.checksum = Checksum(record);
+
+	if (!WriteFile(this->journal, &record, sizeof(record), &written, nullptr) || written != sizeof(record))
+	{
+		printf("! Failed to append to the spool journal, error = %lu\n", ::GetLastError());
+		return false;
+	}
+
+	return true;
+}
+
+void KRicohSpool::DiscardStaging()
+{
+	WIN32_FIND_DATAW found;
+	std::wstring staging = this->directory + L"\\" + SPOOL_STAGING_NAME + L"\\";
+
+	HANDLE find = FindFirstFileW((staging + L"*.part").c_str(), &found);
+	if (find == INVALID_HANDLE_VALUE)
+		return;
+
+	do
+	{
+		if (DeleteFileW((staging + found.cFileName).c_str()))
+			this->stats.discarded++;
+	} while (FindNextFileW(find, &found));
+
+	FindClose(find);
+}
+
+std::wstring KRicohSpool::StagingPath(__in DWORD object_handle)
+{
+	WCHAR name[32] = { 0 };
+
+	StringCchPrintfW(name, ARRAYSIZE(name), L"\\%08lX.part", object_handle);
+
+	return this->directory + L"\\" + SPOOL_STAGING_NAME + name;
+}
+
+std::wstring KRicohSpool::ImagePath(__in DWORD object_handle)
+{
+	WCHAR name[32] = { 0 };
+
+	StringCchPrintfW(name, ARRAYSIZE(name), L"\\%08lX.JPG", object_handle);
+
+	return this->directory + name;
+}
+
+std::wstring KRicohSpool::RetiredPath(__in DWORD object_handle, __in DWORD name_hash)
+{
+	WCHAR name[32] = { 0 };
+
+	StringCchPrintfW(name, ARRAYSIZE(name), L"\\%08lX_%08lX.JPG", object_handle, name_hash);
+
+	return this->directory + name;
+}
+
+DWORD KRicohSpool::Checksum(__in const KRicohSpoolRecord& record)
+{
+	const BYTE* bytes = reinterpret_cast<const BYTE*>(&record);
+	DWORD hash = 2166136261;
+
+	for (size_t i = 0; i < offsetof(KRicohSpoolRecord, checksum); i++)
+		hash = (hash ^ bytes[i]) * 16777619;
+
+	return hash;
+}
+
+DWORD KRicohSpool::NameHash(__in const std::wstring& file_name)
+{
+	DWORD hash = 2166136261;
+
+	for (size_t i = 0; i < file_name.size(); i++)
+		hash = (hash ^ (DWORD)file_name[i]) * 16777619;
+
+	return hash;
+}
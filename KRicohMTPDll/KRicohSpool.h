@@ -0,0 +1,146 @@
+#ifndef _K_RICOH_SPOOL_H_
+#define _K_RICOH_SPOOL_H_
+
+#include "KRicohMTP.h"
+
+// Pictures made durable and deleted from the camera together
+#define DEFAULT_SPOOL_GROUP_SIZE    8
+// A smaller group is committed once its oldest picture waited this long (ms)
+#define DEFAULT_SPOOL_GROUP_DELAY   2000
+
+#define SPOOL_RECORD_MAGIC          0x4C4F5053	// "SPOL"
+#define SPOOL_JOURNAL_NAME          L"spool.journal"
+#define SPOOL_STAGING_NAME          L"staging"
+
+enum KRicohSpoolState{
+	SPOOL_NONE = 0,
+	SPOOL_DOWNLOADED = 1,		// bytes in the staging directory, not durable yet
+	SPOOL_COMMITTED = 2,		// the picture file is on disk for good, the camera may delete it
+	SPOOL_DELETED = 3			// gone from the camera
+};
+
+// One journal entry, appended and never rewritten; a record whose checksum does not
+// match is the torn end of a crash and ends the journal
+struct KRicohSpoolRecord{
+	DWORD magic;
+	DWORD state;				// KRicohSpoolState
+	DWORD object_handle;
+	DWORD size;
+	ULONGLONG time;				// FILETIME, UTC
+	DWORD name_hash;			// FNV-1a of the file name on the camera; with size it tells a reused handle
+	DWORD checksum;				// FNV-1a of the fields above
+};
+
+struct KRicohSpoolStats{
+	DWORD downloaded;
+	DWORD skipped;				// already committed, not downloaded again
+	DWORD committed;
+	DWORD deleted;
+	DWORD delete_failures;		// left on the camera, tried again with the next group
+	DWORD groups;				// commits, each one journal flush and one delete call
+	DWORD recovered;			// committed pictures Open found still on the camera
+	DWORD reused;				// handles the camera gave to another picture, the earlier file kept aside
+	DWORD discarded;			// staging files of an interrupted run thrown away by Open
+	DWORD pending;				// downloaded and not committed yet
+};
+
+// Downloads pictures to a directory so that no picture is deleted from the camera before
+// its file is on disk. Download streams the picture into a file in the staging directory;
+// a commit thread then makes a group of them durable, moves them into the directory,
+// records that in the journal with one flush and deletes the whole group from the camera.
+// Open reads the journal back: committed pictures are not downloaded again and are deleted
+// if that had not happened yet, unfinished downloads are thrown away. Pictures are named
+// by their object handle, like 0000002A.JPG. The camera may give a handle to a new picture
+// once the old one is deleted, so a spooled picture is only skipped or deleted while the
+// camera object has its size and file name; otherwise the earlier file is kept as
+// 0000002A_<name hash>.JPG and the new picture is downloaded.
+// Download is called by one thread at a time; the commit thread deletes on the same
+// KRicohMTP meanwhile, which takes the two in turns.
+class K_RICOH_API KRicohSpool
+{
+public:
+	KRicohSpool(__in KRicohMTP& camera, __in DWORD group_size = DEFAULT_SPOOL_GROUP_SIZE,
+				__in DWORD group_delay_ms = DEFAULT_SPOOL_GROUP_DELAY);
+	virtual ~KRicohSpool();
+
+private:
+	// What the journal keeps to recognize a picture on the camera
+	struct ImageIdentity{
+		DWORD size;
+		DWORD name_hash;
+	};
+
+	struct StagedImage{
+		DWORD object_handle;
+		DWORD size;
+		DWORD name_hash;
+		// The download was written through the view; all three stay open until the
+		// commit flushes them, so the download loop never waits for the disk
+		HANDLE file;
+		HANDLE mapping;
+		BYTE* view;
+	};
+
+	KRicohMTP& camera;
+	DWORD group_size;
+	DWORD group_delay_ms;
+	std::wstring directory;
+	HANDLE journal;
+
+	// Guards everything below and the journal file
+	CRITICAL_SECTION lock;
+	std::map<DWORD, KRicohSpoolState> states;
+	std::map<DWORD, ImageIdentity> identities;
+	std::vector<StagedImage> staged;
+	std::vector<DWORD> undeleted;		// committed, the camera still has them
+	std::set<DWORD> unverified;			// committed in an earlier run, deleted once Download finds them unchanged
+	ULONGLONG oldest_staged_tick;
+	KRicohSpoolStats stats;
+
+	// One commit at a time, by the commit thread or by Commit
+	CRITICAL_SECTION commit_lock;
+	HANDLE commit_thread;
+	HANDLE commit_event;
+	volatile LONG stop_requested;
+
+	KRicohSpool(const KRicohSpool&);
+	KRicohSpool& operator=(const KRicohSpool&);
+
+	static DWORD WINAPI CommitThread(__in LPVOID param);
+	void RunCommits();
+	bool CommitGroup();
+	bool Recover();
+	bool Fetch(__in const std::wstring& obj_id, __out bool* transferred);
+	bool IdentifyImage(__in const std::wstring& obj_id, __out ImageIdentity& identity);
+	bool IsSameImage(__in DWORD object_handle, __in const ImageIdentity& identity);
+	void RetireImage(__in DWORD object_handle);
+	bool ReadJournal(__out std::map<DWORD, KRicohSpoolRecord>& last_records);
+	bool AppendRecord(__in KRicohSpoolState state, __in DWORD object_handle, __in const ImageIdentity& identity);
+	void DiscardStaging();
+	std::wstring StagingPath(__in DWORD object_handle);
+	std::wstring ImagePath(__in DWORD object_handle);
+	std::wstring RetiredPath(__in DWORD object_handle, __in DWORD name_hash);
+	static DWORD Checksum(__in const KRicohSpoolRecord& record);
+	static DWORD NameHash(__in const std::wstring& file_name);
+
+public:
+	// creates the directory when needed and recovers what the last run left in it
+	bool Open(__in const std::wstring& directory);
+	// stops the commit thread and commits what is still staged
+	void Close();
+
+	// Downloads obj_id into the staging directory; true without a transfer when this picture
+	// was spooled before. The camera keeps it until its group is committed.
+	bool Download(__in const std::wstring& obj_id);
+	// every picture on the camera that is not spooled yet, count is the number downloaded
+	bool DownloadAll(__out DWORD* count = nullptr);
+	// commits the staged pictures now and waits for it, e.g. when the capture loop goes idle
+	bool Commit();
+
+	KRicohSpoolState GetState(__in DWORD object_handle);
+	// where a committed picture is
+	std::wstring GetImagePath(__in DWORD object_handle);
+	KRicohSpoolStats GetStats();
+};
+
+#endif
@@ -0,0 +1,551 @@
+#include "KRicohWpdTransport.h"
+#include <new>
+#include <stdio.h>
+
+using Microsoft::WRL::ComPtr;
+
+KRicohWpdTransport::KRicohWpdTransport(__in IPortableDevice* device)
+	: device(device), last_status(S_OK), allocations(0)
+{
+	InitializeCriticalSection(&this->cache_lock);
+}
+
+KRicohWpdTransport::~KRicohWpdTransport()
+{
+	DeleteCriticalSection(&this->cache_lock);
+}
+
+IPortableDevice* KRicohWpdTransport::GetDevice()
+{
+	return this->device.Get();
+}
+
+LONG KRicohWpdTransport::GetAllocationCount()
+{
+	return this->allocations;
+}
+
+bool KRicohWpdTransport::Execute(KRicohPtpOperation& op)
+{
+	op.response = 0;
+	op.response_param_count = 0;
+
+	if (this->device == nullptr)
+	{
+		this->last_status = E_POINTER;
+		return false;
+	}
+
+	// Another operation holding the cache gets no wait, this one builds fresh objects
+	CommandObjects local;
+	bool cached = TryEnterCriticalSection(&this->cache_lock) != FALSE;
+	CommandObjects& objects = cached ? this->cache : local;
+	HRESULT hr = S_OK;
+
+	switch (op.data_phase)
+	{
+	case PTP_DATA_NONE:
+		hr = ExecuteWithoutData(op, objects);
+		break;
+	case PTP_DATA_READ:
+		hr = ExecuteReadData(op, objects);
+		break;
+	case PTP_DATA_WRITE:
+		hr = ExecuteWriteData(op, objects);
+		break;
+	default:
+		hr = E_INVALIDARG;
+		break;
+	}
+
+	if (cached)
+		LeaveCriticalSection(&this->cache_lock);
+
+	this->last_status = hr;
+	return SUCCEEDED(hr);
+}
+
+bool KRicohWpdTransport::WaitForEvent(KRicohPtpEvent& event, uint32_t timeout_ms)
+{
+	UNREFERENCED_PARAMETER(event);
+	UNREFERENCED_PARAMETER(timeout_ms);
+
+	this->last_status = E_NOTIMPL;
+	return false;
+}
+
+long KRicohWpdTransport::GetLastStatus()
+{
+	return this->last_status;
+}
+
+HRESULT KRicohWpdTransport::CreateValues(__out IPortableDeviceValues** ppValues)
+{
+	InterlockedIncrement(&this->allocations);
+
+	return CoCreateInstance(CLSID_PortableDeviceValues,
+		NULL,
+		CLSCTX_INPROC_SERVER,
+		IID_IPortableDeviceValues,
+		(VOID**)ppValues);
+}
+
+HRESULT KRicohWpdTransport::CreateCommandParameters(__in REFPROPERTYKEY wpd_command, __in const KRicohPtpOperation& op,
+													__inout CommandObjects& objects, __out IPortableDeviceValues** ppParameters)
+{
+	HRESULT hr = S_OK;
+	ComPtr<IPortableDeviceValues>& spParameters = objects.execute[op.data_phase];
+
+	*ppParameters = nullptr;
+
+	// Build basic WPD parameters for the command the first time it is used.
+	// Use one of the WPD_COMMAND_MTP_EXT_EXECUTE_COMMAND_* commands, depending on
+	// whether the operation has a data phase
+	if (spParameters == nullptr)
+	{
+		hr = CreateValues(&spParameters);
+
+		if (hr == S_OK)
+		{
+			hr = spParameters->SetGuidValue(WPD_PROPERTY_COMMON_COMMAND_CATEGORY, wpd_command.fmtid);
+		}
+
+		if (hr == S_OK)
+		{
+			hr = spParameters->SetUnsignedIntegerValue(WPD_PROPERTY_COMMON_COMMAND_ID, wpd_command.pid);
+		}
+
+		// A half built object is not kept
+		if (hr != S_OK)
+		{
+			spParameters = nullptr;
+			return hr;
+		}
+	}
+
+	// Specify the actual MTP opcode that we want to execute here
+	hr = spParameters->SetUnsignedIntegerValue(WPD_PROPERTY_MTP_EXT_OPERATION_CODE, (ULONG)op.code);
+
+	// Parameters need to be first put into a PropVariantCollection
+	if (hr == S_OK)
+	{
+		if (objects.op_params == nullptr)
+		{
+			InterlockedIncrement(&this->allocations);
+			hr = CoCreateInstance(CLSID_PortableDevicePropVariantCollection,
+				NULL,
+				CLSCTX_INPROC_SERVER,
+				IID_IPortableDevicePropVariantCollection,
+				(VOID**)&objects.op_params);
+		}
+		else
+		{
+			hr = objects.op_params->Clear();
+		}
+	}
+
+	PROPVARIANT pvParam = { 0 };
+	pvParam.vt = VT_UI4;
+
+	for (int i = 0; i < op.param_count && hr == S_OK; i++)
+	{
+		pvParam.ulVal = op.params[i];
+		hr = objects.op_params->Add(&pvParam);
+	}
+
+	// Add MTP parameters collection to our main parameter list
+	if (hr == S_OK)
+	{
+		hr = spParameters->SetIPortableDevicePropVariantCollectionValue(
+			WPD_PROPERTY_MTP_EXT_OPERATION_PARAMS, objects.op_params.Get());
+	}
+
+	if (hr == S_OK)
+	{
+		*ppParameters = spParameters.Get();
+		(*ppParameters)->AddRef();
+	}
+
+	return hr;
+}
+
+HRESULT KRicohWpdTransport::CreateTransferParameters(__in REFPROPERTYKEY wpd_command, __in PCWSTR context,
+													__inout CommandObjects& objects, __out IPortableDeviceValues** ppParameters)
+{
+	HRESULT hr = S_OK;
+
+	*ppParameters = nullptr;
+
+	// The data phase commands share one object, emptied between them
+	if (objects.transfer == nullptr)
+	{
+		hr = CreateValues(&objects.transfer);
+	}
+	else
+	{
+		hr = objects.transfer->Clear();
+	}
+
+	if (hr == S_OK)
+	{
+		hr = objects.transfer->SetGuidValue(WPD_PROPERTY_COMMON_COMMAND_CATEGORY, wpd_command.fmtid);
+	}
+
+	if (hr == S_OK)
+	{
+		hr = objects.transfer->SetUnsignedIntegerValue(WPD_PROPERTY_COMMON_COMMAND_ID, wpd_command.pid);
+	}
+
+	if (hr == S_OK)
+	{
+		hr = objects.transfer->SetStringValue(WPD_PROPERTY_MTP_EXT_TRANSFER_CONTEXT, context);
+	}
+
+	if (hr == S_OK)
+	{
+		*ppParameters = objects.transfer.Get();
+		(*ppParameters)->AddRef();
+	}
+
+	return hr;
+}
+
+HRESULT KRicohWpdTransport::SendWpdCommand(__in IPortableDeviceValues* pParameters, __out IPortableDeviceValues** ppResults)
+{
+	HRESULT hr = this->device->SendCommand(0, pParameters, ppResults);
+
+	// Check if the driver was able to send the command by interrogating WPD_PROPERTY_COMMON_HRESULT
+	HRESULT hrCmd = S_OK;
+	if (hr == S_OK)
+	{
+		hr = (*ppResults)->GetErrorValue(WPD_PROPERTY_COMMON_HRESULT, &hrCmd);
+	}
+
+	if (hr == S_OK)
+	{
+		//printf("Driver return code: 0x%08X\n", hrCmd);
+		hr = hrCmd;
+	}
+
+	return hr;
+}
+
+HRESULT KRicohWpdTransport::ReadResponse(__in IPortableDeviceValues* pResults, __out KRicohPtpOperation& op)
+{
+	ULONG response = 0;
+
+	// Be aware that there is a distinction between the command being successfully sent
+	// to the device and the command being handled successfully by the device.
+	HRESULT hr = pResults->GetUnsignedIntegerValue(WPD_PROPERTY_MTP_EXT_RESPONSE_CODE, &response);
+	if (hr == S_OK)
+	{
+		//printf("MTP Response code: 0x%X\n", response);
+		op.response = (uint16_t)response;
+	}
+
+	// The MTP response parameters are returned in the WPD_PROPERTY_MTP_EXT_RESPONSE_PARAMS
+	// property, which is a PropVariantCollection. Not every operation has them.
+	ComPtr<IPortableDevicePropVariantCollection> spRespParams;
+	DWORD count = 0;
+	if (hr == S_OK &&
+		SUCCEEDED(pResults->GetIPortableDevicePropVariantCollectionValue(WPD_PROPERTY_MTP_EXT_RESPONSE_PARAMS, &spRespParams)) &&
+		SUCCEEDED(spRespParams->GetCount(&count)))
+	{
+		for (DWORD i = 0; i < count && i < PTP_MAX_PARAMS; i++)
+		{
+			PROPVARIANT pvParam = { 0 };
+
+			if (SUCCEEDED(spRespParams->GetAt(i, &pvParam)))
+				op.response_params[op.response_param_count++] = pvParam.ulVal;
+
+			PropVariantClear(&pvParam);
+		}
+	}
+
+	return hr;
+}
+
+HRESULT KRicohWpdTransport::ExecuteWithoutData(__inout KRicohPtpOperation& op, __inout CommandObjects& objects)
+{
+	HRESULT hr = S_OK;
+
+	// Use the WPD_COMMAND_MTP_EXT_EXECUTE_COMMAND_WITHOUT_DATA_PHASE command
+	ComPtr<IPortableDeviceValues> spParameters;
+	hr = CreateCommandParameters(WPD_COMMAND_MTP_EXT_EXECUTE_COMMAND_WITHOUT_DATA_PHASE, op, objects, &spParameters);
+
+	// Send the command to the MTP device
+	ComPtr<IPortableDeviceValues> spResults;
+	if (hr == S_OK)
+	{
+		hr = SendWpdCommand(spParameters.Get(), &spResults);
+	}
+
+	if (hr == S_OK)
+	{
+		hr = ReadResponse(spResults.Get(), op);
+	}
+
+	return hr;
+}
+
+HRESULT KRicohWpdTransport::ExecuteReadData(__inout KRicohPtpOperation& op, __inout CommandObjects& objects)
+{
+	HRESULT		hr = S_OK;
+	PWSTR		pwszContext = NULL;
+	ULONGLONG	cbTotalDataSize = 0;
+	DWORD		cbOptimalTransferSize = 0;
+	DWORD		cbTotalBytesRead = 0;
+
+	op.data.clear();
+
+	// 1) Start the operation with WPD_COMMAND_MTP_EXT_EXECUTE_COMMAND_WITH_DATA_TO_READ
+	ComPtr<IPortableDeviceValues> spParameters;
+	hr = CreateCommandParameters(WPD_COMMAND_MTP_EXT_EXECUTE_COMMAND_WITH_DATA_TO_READ, op, objects, &spParameters);
+
+	ComPtr<IPortableDeviceValues> spResults;
+	if (hr == S_OK)
+	{
+		hr = SendWpdCommand(spParameters.Get(), &spResults);
+	}
+
+	// The driver hands back a context for the transfer along with its size
+	if (hr == S_OK)
+	{
+		hr = spResults->GetStringValue(WPD_PROPERTY_MTP_EXT_TRANSFER_CONTEXT, &pwszContext);
+	}
+
+	if (hr == S_OK)
+	{
+		hr = spResults->GetUnsignedLargeIntegerValue(WPD_PROPERTY_MTP_EXT_TRANSFER_TOTAL_DATA_SIZE, &cbTotalDataSize);
+	}
+
+	if (hr == S_OK)
+	{
+		if (FAILED(spResults->GetUnsignedIntegerValue(WPD_PROPERTY_MTP_EXT_OPTIMAL_TRANSFER_BUFFER_SIZE, &cbOptimalTransferSize)) ||
+			cbOptimalTransferSize == 0)
+		{
+			cbOptimalTransferSize = 0x40000;
+		}
+
+		if (cbTotalDataSize > MAXDWORD)
+		{
+			printf("! The data phase of operation 0x%X is too large (%llu bytes)\n", op.code, cbTotalDataSize);
+			hr = E_OUTOFMEMORY;
+		}
+	}
+
+	if (hr == S_OK)
+	{
+		try
+		{
+			op.data.resize((size_t)cbTotalDataSize);
+		}
+		catch (const std::bad_alloc&)
+		{
+			hr = E_OUTOFMEMORY;
+		}
+	}
+
+	// 2) Read the data phase with WPD_COMMAND_MTP_EXT_READ_DATA in optimal sized chunks,
+	// only the size and the buffer change from one chunk to the next
+	ComPtr<IPortableDeviceValues> spTransfer;
+	if (hr == S_OK && !op.data.empty())
+	{
+		hr = CreateTransferParameters(WPD_COMMAND_MTP_EXT_READ_DATA, pwszContext, objects, &spTransfer);
+	}
+
+	while (hr == S_OK && cbTotalBytesRead < op.data.size())
+	{
+		DWORD cbToRead = min(cbOptimalTransferSize, (DWORD)op.data.size() - cbTotalBytesRead);
+		DWORD cbBytesRead = 0;
+
+		spResults = nullptr;
+
+		hr = spTransfer->SetUnsignedIntegerValue(WPD_PROPERTY_MTP_EXT_TRANSFER_NUM_BYTES_TO_READ, cbToRead);
+
+		if (hr == S_OK)
+		{
+			hr = spTransfer->SetBufferValue(WPD_PROPERTY_MTP_EXT_TRANSFER_DATA, &op.data[cbTotalBytesRead], cbToRead);
+		}
+
+		if (hr == S_OK)
+		{
+			hr = SendWpdCommand(spTransfer.Get(), &spResults);
+		}
+
+		if (hr == S_OK)
+		{
+			hr = spResults->GetUnsignedIntegerValue(WPD_PROPERTY_MTP_EXT_TRANSFER_NUM_BYTES_READ, &cbBytesRead);
+		}
+
+		// The driver returns the bytes in its own buffer, copy them into place
+		if (hr == S_OK)
+		{
+			BYTE*	pbData = NULL;
+			DWORD	cbData = 0;
+
+			hr = spResults->GetBufferValue(WPD_PROPERTY_MTP_EXT_TRANSFER_DATA, &pbData, &cbData);
+			if (hr == S_OK)
+			{
+				cbBytesRead = min(cbBytesRead, min(cbData, cbToRead));
+				CopyMemory(&op.data[cbTotalBytesRead], pbData, cbBytesRead);
+			}
+
+			CoTaskMemFree(pbData);
+		}
+
+		if (hr == S_OK)
+		{
+			if (cbBytesRead == 0)
+				break;
+
+			cbTotalBytesRead += cbBytesRead;
+		}
+		else
+		{
+			printf("! Failed to read the data phase of operation 0x%X, hr = 0x%lx\n", op.code, hr);
+		}
+	}
+
+	if (hr == S_OK)
+	{
+		op.data.resize(cbTotalBytesRead);
+	}
+
+	// 3) Always close the transfer once it was started, the response code arrives here
+	if (pwszContext != NULL)
+	{
+		HRESULT hrEnd = EndDataTransfer(pwszContext, objects, op);
+		if (hr == S_OK)
+			hr = hrEnd;
+
+		CoTaskMemFree(pwszContext);
+	}
+
+	return hr;
+}
+
+HRESULT KRicohWpdTransport::ExecuteWriteData(__inout KRicohPtpOperation& op, __inout CommandObjects& objects)
+{
+	HRESULT		hr = S_OK;
+	PWSTR		pwszContext = NULL;
+	DWORD		cbOptimalTransferSize = 0;
+	DWORD		cbTotalBytesWritten = 0;
+
+	if (op.data.size() > MAXDWORD)
+	{
+		printf("! The data phase of operation 0x%X is too large (%llu bytes)\n", op.code, (ULONGLONG)op.data.size());
+		return E_INVALIDARG;
+	}
+
+	// 1) Start the operation with WPD_COMMAND_MTP_EXT_EXECUTE_COMMAND_WITH_DATA_TO_WRITE,
+	// the driver needs the size of the whole data phase up front
+	ComPtr<IPortableDeviceValues> spParameters;
+	hr = CreateCommandParameters(WPD_COMMAND_MTP_EXT_EXECUTE_COMMAND_WITH_DATA_TO_WRITE, op, objects, &spParameters);
+
+	if (hr == S_OK)
+	{
+		hr = spParameters->SetUnsignedLargeIntegerValue(WPD_PROPERTY_MTP_EXT_TRANSFER_TOTAL_DATA_SIZE, op.data.size());
+	}
+
+	ComPtr<IPortableDeviceValues> spResults;
+	if (hr == S_OK)
+	{
+		hr = SendWpdCommand(spParameters.Get(), &spResults);
+	}
+
+	if (hr == S_OK)
+	{
+		hr = spResults->GetStringValue(WPD_PROPERTY_MTP_EXT_TRANSFER_CONTEXT, &pwszContext);
+	}
+
+	if (hr == S_OK)
+	{
+		if (FAILED(spResults->GetUnsignedIntegerValue(WPD_PROPERTY_MTP_EXT_OPTIMAL_TRANSFER_BUFFER_SIZE, &cbOptimalTransferSize)) ||
+			cbOptimalTransferSize == 0)
+		{
+			cbOptimalTransferSize = 0x40000;
+		}
+	}
+
+	// 2) Send the data phase with WPD_COMMAND_MTP_EXT_WRITE_DATA in optimal sized chunks
+	ComPtr<IPortableDeviceValues> spTransfer;
+	if (hr == S_OK && !op.data.empty())
+	{
+		hr = CreateTransferParameters(WPD_COMMAND_MTP_EXT_WRITE_DATA, pwszContext, objects, &spTransfer);
+	}
+
+	while (hr == S_OK && cbTotalBytesWritten < op.data.size())
+	{
+		DWORD cbToWrite = min(cbOptimalTransferSize, (DWORD)op.data.size() - cbTotalBytesWritten);
+		DWORD cbBytesWritten = 0;
+
+		spResults = nullptr;
+
+		hr = spTransfer->SetUnsignedIntegerValue(WPD_PROPERTY_MTP_EXT_TRANSFER_NUM_BYTES_TO_WRITE, cbToWrite);
+
+		if (hr == S_OK)
+		{
+			hr = spTransfer->SetBufferValue(WPD_PROPERTY_MTP_EXT_TRANSFER_DATA, &op.data[cbTotalBytesWritten], cbToWrite);
+		}
+
+		if (hr == S_OK)
+		{
+			hr = SendWpdCommand(spTransfer.Get(), &spResults);
+		}
+
+		if (hr == S_OK)
+		{
+			hr = spResults->GetUnsignedIntegerValue(WPD_PROPERTY_MTP_EXT_TRANSFER_NUM_BYTES_WRITTEN, &cbBytesWritten);
+		}
+
+		if (hr == S_OK)
+		{
+			if (cbBytesWritten == 0)
+			{
+				printf("! The driver accepted no data for operation 0x%X\n", op.code);
+				hr = E_FAIL;
+			}
+
+			cbTotalBytesWritten += min(cbBytesWritten, cbToWrite);
+		}
+		else
+		{
+			printf("! Failed to write the data phase of operation 0x%X, hr = 0x%lx\n", op.code, hr);
+		}
+	}
+
+	// 3) Always close the transfer once it was started, the response code arrives here
+	if (pwszContext != NULL)
+	{
+		HRESULT hrEnd = EndDataTransfer(pwszContext, objects, op);
+		if (hr == S_OK)
+			hr = hrEnd;
+
+		CoTaskMemFree(pwszContext);
+	}
+
+	return hr;
+}
+
+HRESULT KRicohWpdTransport::EndDataTransfer(__in PCWSTR context, __inout CommandObjects& objects, __out KRicohPtpOperation& op)
+{
+	HRESULT hr = S_OK;
+
+	ComPtr<IPortableDeviceValues> spParameters;
+	hr = CreateTransferParameters(WPD_COMMAND_MTP_EXT_END_DATA_TRANSFER, context, objects, &spParameters);
+
+	ComPtr<IPortableDeviceValues> spResults;
+	if (hr == S_OK)
+	{
+		hr = SendWpdCommand(spParameters.Get(), &spResults);
+	}
+
+	// The MTP response of the whole operation is reported when the transfer ends
+	if (hr == S_OK)
+	{
+		hr = ReadResponse(spResults.Get(), op);
+	}
+
+	return hr;
+}
@@ -0,0 +1,63 @@
+#ifndef _K_RICOH_WPD_TRANSPORT_H_
+#define _K_RICOH_WPD_TRANSPORT_H_
+
+#include <Windows.h>
+#include <PortableDevice.h>
+#include <PortableDeviceApi.h>
+#include <wpdmtpextensions.h>
+#include <wrl/client.h>
+#include "KRicohPtp.h"
+
+// PTP operations over the WPD MTP extension commands of an opened IPortableDevice.
+// The WPD parameter objects are created once and reused by later operations, so keep
+// one transport per device instead of one per call.
+class K_RICOH_API KRicohWpdTransport : public KRicohPtpTransport
+{
+public:
+	KRicohWpdTransport(__in IPortableDevice* device);
+	virtual ~KRicohWpdTransport();
+
+private:
+	// The parameter objects of one operation. The execute commands keep their category and
+	// command id, only the opcode and the operation parameters change between operations.
+	struct CommandObjects{
+		Microsoft::WRL::ComPtr<IPortableDeviceValues> execute[PTP_DATA_WRITE + 1];	// by data phase
+		Microsoft::WRL::ComPtr<IPortableDevicePropVariantCollection> op_params;
+		Microsoft::WRL::ComPtr<IPortableDeviceValues> transfer;	// READ_DATA, WRITE_DATA and END_DATA_TRANSFER
+	};
+
+	Microsoft::WRL::ComPtr<IPortableDevice> device;
+	HRESULT last_status;
+	// Used by one operation at a time, a concurrent operation builds its own objects
+	// instead of waiting for these
+	CommandObjects cache;
+	CRITICAL_SECTION cache_lock;
+	volatile LONG allocations;
+
+	KRicohWpdTransport(const KRicohWpdTransport&);
+	KRicohWpdTransport& operator=(const KRicohWpdTransport&);
+
+	HRESULT CreateValues(__out IPortableDeviceValues** ppValues);
+	HRESULT CreateCommandParameters(__in REFPROPERTYKEY wpd_command, __in const KRicohPtpOperation& op,
+									__inout CommandObjects& objects, __out IPortableDeviceValues** ppParameters);
+	HRESULT CreateTransferParameters(__in REFPROPERTYKEY wpd_command, __in PCWSTR context,
+									__inout CommandObjects& objects, __out IPortableDeviceValues** ppParameters);
+	HRESULT SendWpdCommand(__in IPortableDeviceValues* pParameters, __out IPortableDeviceValues** ppResults);
+	HRESULT ReadResponse(__in IPortableDeviceValues* pResults, __out KRicohPtpOperation& op);
+	HRESULT ExecuteWithoutData(__inout KRicohPtpOperation& op, __inout CommandObjects& objects);
+	HRESULT ExecuteReadData(__inout KRicohPtpOperation& op, __inout CommandObjects& objects);
+	HRESULT ExecuteWriteData(__inout KRicohPtpOperation& op, __inout CommandObjects& objects);
+	HRESULT EndDataTransfer(__in PCWSTR context, __inout CommandObjects& objects, __out KRicohPtpOperation& op);
+
+public:
+	IPortableDevice* GetDevice();
+	// COM objects created for operations so far, stays flat once the cache is warm
+	LONG GetAllocationCount();
+
+	virtual bool Execute(KRicohPtpOperation& op);
+	// WPD reports events through IPortableDevice::Advise, not here
+	virtual bool WaitForEvent(KRicohPtpEvent& event, uint32_t timeout_ms);
+	virtual long GetLastStatus();
+};
+
+#endif